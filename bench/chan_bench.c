@@ -0,0 +1,151 @@
+/*
+ * Channel throughput microbenchmark.
+ *
+ * Moves int64 messages through one lz_chan between plain threads in three
+ * layouts: 1:1, N:1 and N:M producers to consumers. Each layout runs once
+ * with single sends and receives and once with send_many/recv_many batches,
+ * and reports messages per second. Every consumer checks that the sum of
+ * what it received adds up, so a lost or duplicated message fails the run.
+ *
+ * Usage: chan_bench [messages] [capacity] [threads]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/runtime/runtime.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_BATCH 64
+
+typedef struct {
+    lz_chan *chan;
+    int64_t first;
+    size_t count;
+    bool batched;
+    int64_t sum;
+} BenchWorker;
+
+static double bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static void *bench_produce(void *arg) {
+    BenchWorker *worker = arg;
+    int64_t batch[BENCH_BATCH];
+    size_t sent = 0;
+    while (sent < worker->count) {
+        size_t count = worker->batched ? worker->count - sent : 1;
+        if (count > BENCH_BATCH) {
+            count = BENCH_BATCH;
+        }
+        for (size_t i = 0; i < count; i++) {
+            batch[i] = worker->first + (int64_t)(sent + i);
+        }
+        if (worker->batched) {
+            lz_chan_send_many(worker->chan, batch, count);
+        } else {
+            lz_chan_send(worker->chan, batch);
+        }
+        sent += count;
+    }
+    return NULL;
+}
+
+static void *bench_consume(void *arg) {
+    BenchWorker *worker = arg;
+    int64_t batch[BENCH_BATCH];
+    size_t received = 0;
+    int64_t sum = 0;
+    while (received < worker->count) {
+        size_t want = worker->batched ? worker->count - received : 1;
+        if (want > BENCH_BATCH) {
+            want = BENCH_BATCH;
+        }
+        size_t count = worker->batched ? lz_chan_recv_many(worker->chan, batch, want)
+                                       : (lz_chan_recv(worker->chan, batch), 1);
+        for (size_t i = 0; i < count; i++) {
+            sum += batch[i];
+        }
+        received += count;
+    }
+    worker->sum = sum;
+    return NULL;
+}
+
+static void bench_layout(const char *name,
+                         size_t producers,
+                         size_t consumers,
+                         size_t messages,
+                         size_t capacity,
+                         bool batched) {
+    /* Every thread moves the same share, so the totals are exact. */
+    size_t per_producer = messages / producers / consumers * consumers;
+    size_t total = per_producer * producers;
+    size_t per_consumer = total / consumers;
+
+    lz_chan *chan = lz_chan_new(capacity, sizeof(int64_t), NULL, NULL);
+    BenchWorker *workers = calloc(producers + consumers, sizeof(BenchWorker));
+    pthread_t *threads = calloc(producers + consumers, sizeof(pthread_t));
+    if (!workers || !threads) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = bench_now();
+    for (size_t i = 0; i < producers + consumers; i++) {
+        bool producer = i < producers;
+        workers[i] = (BenchWorker){
+            .chan = chan,
+            .first = producer ? (int64_t)(i * per_producer) : 0,
+            .count = producer ? per_producer : per_consumer,
+            .batched = batched,
+        };
+        if (pthread_create(&threads[i], NULL, producer ? bench_produce : bench_consume, &workers[i]) != 0) {
+            fprintf(stderr, "failed to start a thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int64_t sum = 0;
+    for (size_t i = 0; i < producers + consumers; i++) {
+        pthread_join(threads[i], NULL);
+        sum += workers[i].sum;
+    }
+    double elapsed = bench_now() - start;
+
+    int64_t expected = (int64_t)total * ((int64_t)total - 1) / 2;
+    if (sum != expected) {
+        fprintf(stderr, "%s: received sum %lld, expected %lld\n", name, (long long)sum, (long long)expected);
+        exit(EXIT_FAILURE);
+    }
+    printf("%-4s %-7s %8.2f Mmsg/s  %7.1f ns/msg\n",
+           name,
+           batched ? "batched" : "single",
+           (double)total / elapsed / 1e6,
+           elapsed * 1e9 / (double)total);
+
+    lz_chan_release(chan);
+    free(workers);
+    free(threads);
+}
+
+int main(int argc, char **argv) {
+    size_t messages = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+    size_t capacity = argc > 2 ? strtoul(argv[2], NULL, 10) : 1024;
+    size_t threads = argc > 3 ? strtoul(argv[3], NULL, 10) : 4;
+    if (messages == 0 || capacity == 0 || threads == 0) {
+        fprintf(stderr, "usage: %s [messages] [capacity] [threads]\n", argv[0]);
+        return 1;
+    }
+    printf("messages: %zu, capacity: %zu, N = M = %zu\n", messages, capacity, threads);
+    for (int batched = 0; batched <= 1; batched++) {
+        bench_layout("1:1", 1, 1, messages, capacity, batched);
+        bench_layout("N:1", threads, 1, messages, capacity, batched);
+        bench_layout("N:M", threads, threads, messages, capacity, batched);
+    }
+    return 0;
+}
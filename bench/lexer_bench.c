@@ -0,0 +1,202 @@
+/*
+ * Lexer microbenchmark.
+ *
+ * Builds a synthetic lazylang source in memory (functions with nested
+ * blocks, keyword-heavy statements, literals and operators), then reports:
+ *   - keyword classification: the old linear strlen/strncmp chain against
+ *     lexer_keyword_type, over every identifier-like token in the source;
+ *   - end-to-end lexer throughput in tokens/s and MB/s, against the
+ *     1 GB/s goal set for block scanning.
+ *
+ * Usage: lexer_bench [functions] [iterations]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/lexer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Throughput the block scanner was meant to reach; printed next to the result. */
+#define BENCH_LEXER_TARGET_MB_S 1000.0
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} BenchBuffer;
+
+typedef struct {
+    const char *text;
+    size_t length;
+} BenchWord;
+
+static void bench_append(BenchBuffer *buffer, const char *text) {
+    size_t length = strlen(text);
+    if (buffer->length + length + 1 > buffer->capacity) {
+        buffer->capacity = (buffer->capacity + length + 1) * 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+        if (!buffer->data) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(buffer->data + buffer->length, text, length + 1);
+    buffer->length += length;
+}
+
+static char *bench_build_source(size_t functions, size_t *length) {
+    BenchBuffer buffer = { NULL, 0, 0 };
+    char line[256];
+    for (size_t i = 0; i < functions; i++) {
+        snprintf(line, sizeof(line), "compute_value_%zu: (int, string) -> int = (count, label)\n", i);
+        bench_append(&buffer, line);
+        bench_append(&buffer, "    mut total: int = count * 3 + 17\n");
+        bench_append(&buffer, "    if total >= 100\n");
+        bench_append(&buffer, "        log(label)\n");
+        bench_append(&buffer, "        return total - 1\n");
+        bench_append(&buffer, "    else\n");
+        bench_append(&buffer, "        total = total + 42\n");
+        bench_append(&buffer, "    ready: bool = true\n");
+        bench_append(&buffer, "    missing: maybe[int] = null\n");
+        snprintf(line, sizeof(line), "    log(\"iteration %zu finished\")\n", i);
+        bench_append(&buffer, line);
+        bench_append(&buffer, "    total\n\n");
+    }
+    *length = buffer.length;
+    return buffer.data;
+}
+
+static double bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/* The classifier lexer.c used before the length/first-character switch. */
+static TokenType bench_keyword_linear(const char *text, size_t len) {
+#define KW(name, tok) \
+    if (len == strlen(name) && strncmp(text, name, len) == 0) \
+        return tok;
+
+    KW("if", TOKEN_IF)
+    KW("else", TOKEN_ELSE)
+    KW("for", TOKEN_FOR)
+    KW("in", TOKEN_IN)
+    KW("struct", TOKEN_STRUCT)
+    KW("mut", TOKEN_MUT)
+    KW("pub", TOKEN_PUB)
+    KW("import", TOKEN_IMPORT)
+    KW("task", TOKEN_TASK)
+    KW("return", TOKEN_RETURN)
+    KW("true", TOKEN_TRUE)
+    KW("false", TOKEN_FALSE)
+    KW("null", TOKEN_NULL)
+
+#undef KW
+    return TOKEN_IDENT;
+}
+
+static bool bench_is_word(TokenType type) {
+    return type == TOKEN_IDENT || (type >= TOKEN_IF && type <= TOKEN_NULL);
+}
+
+/* Keeps the optimizer from discarding benchmark results. */
+static volatile size_t bench_sink;
+
+int main(int argc, char **argv) {
+    size_t functions = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+    if (functions == 0 || iterations <= 0) {
+        fprintf(stderr, "usage: %s [functions] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    size_t length = 0;
+    char *source = bench_build_source(functions, &length);
+
+    /* Collect identifier-like words once so both classifiers see the same input. */
+    BenchWord *words = NULL;
+    size_t word_count = 0;
+    size_t word_capacity = 0;
+    size_t token_count = 0;
+    Lexer *lexer = lexer_create(source, length);
+    for (;;) {
+        Token token = lexer_next_token(lexer);
+        token_count++;
+        if (token.type == TOKEN_EOF) break;
+        if (!bench_is_word(token.type)) continue;
+        if (word_count == word_capacity) {
+            word_capacity = word_capacity ? word_capacity * 2 : 1024;
+            words = realloc(words, word_capacity * sizeof(BenchWord));
+            if (!words) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        }
+        words[word_count++] = (BenchWord){ token.lexeme, token.length };
+    }
+    lexer_destroy(lexer);
+
+    for (size_t i = 0; i < word_count; i++) {
+        if (bench_keyword_linear(words[i].text, words[i].length) !=
+            lexer_keyword_type(words[i].text, words[i].length)) {
+            fprintf(stderr, "classifier mismatch on '%.*s'\n", (int)words[i].length, words[i].text);
+            return 1;
+        }
+    }
+
+    double best_linear = 1e30;
+    double best_switch = 1e30;
+    double best_lex = 1e30;
+    for (int iter = 0; iter < iterations; iter++) {
+        size_t keywords = 0;
+        double start = bench_now();
+        for (size_t i = 0; i < word_count; i++) {
+            keywords += bench_keyword_linear(words[i].text, words[i].length) != TOKEN_IDENT;
+        }
+        double elapsed = bench_now() - start;
+        if (elapsed < best_linear) best_linear = elapsed;
+
+        start = bench_now();
+        for (size_t i = 0; i < word_count; i++) {
+            keywords += lexer_keyword_type(words[i].text, words[i].length) != TOKEN_IDENT;
+        }
+        elapsed = bench_now() - start;
+        if (elapsed < best_switch) best_switch = elapsed;
+
+        start = bench_now();
+        lexer = lexer_create(source, length);
+        while (lexer_next_token(lexer).type != TOKEN_EOF) {
+            keywords++;
+        }
+        lexer_destroy(lexer);
+        elapsed = bench_now() - start;
+        if (elapsed < best_lex) best_lex = elapsed;
+        bench_sink += keywords;
+    }
+
+    printf("source: %zu bytes, %zu tokens, %zu identifier/keyword words\n",
+           length,
+           token_count,
+           word_count);
+    printf("keyword classify (linear strncmp): %8.2f ns/word\n", best_linear * 1e9 / (double)word_count);
+    printf("keyword classify (length switch):  %8.2f ns/word  (%.1fx)\n",
+           best_switch * 1e9 / (double)word_count,
+           best_linear / best_switch);
+    printf("lexer end-to-end: %8.2f ns/token, %.1f Mtokens/s, %.1f MB/s\n",
+           best_lex * 1e9 / (double)token_count,
+           (double)token_count / best_lex / 1e6,
+           (double)length / best_lex / 1e6);
+    double lex_mb_s = (double)length / best_lex / 1e6;
+    printf("lexer target:     %.0f MB/s, %s (%.0f%% of target)\n",
+           BENCH_LEXER_TARGET_MB_S,
+           lex_mb_s >= BENCH_LEXER_TARGET_MB_S ? "met" : "NOT met",
+           lex_mb_s * 100.0 / BENCH_LEXER_TARGET_MB_S);
+
+    free(words);
+    free(source);
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AST_ARENA_CHUNK_SIZE (64 * 1024)
+#define AST_ARENA_ALIGN alignof(max_align_t)
+
+struct ASTArenaChunk {
+    ASTArenaChunk *next;
+    size_t capacity;
+    size_t used;
+    alignas(max_align_t) unsigned char data[];
+};
+
+static size_t ast_arena_align(size_t size) {
+    return (size + AST_ARENA_ALIGN - 1) & ~(AST_ARENA_ALIGN - 1);
+}
+
+static ASTArenaChunk *ast_arena_add_chunk(ASTArena *arena, size_t min_size) {
+    size_t capacity = min_size > AST_ARENA_CHUNK_SIZE ? min_size : AST_ARENA_CHUNK_SIZE;
+    ASTArenaChunk *chunk = malloc(sizeof(ASTArenaChunk) + capacity);
+    if (!chunk) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    chunk->next = arena->head;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    arena->head = chunk;
+    arena->bytes_reserved += capacity;
+    return chunk;
+}
+
+void ast_arena_init(ASTArena *arena) {
+    arena->head = NULL;
+    arena->bytes_used = 0;
+    arena->bytes_reserved = 0;
+}
+
+void *ast_arena_alloc(ASTArena *arena, size_t size) {
+    size_t aligned = ast_arena_align(size ? size : 1);
+    ASTArenaChunk *chunk = arena->head;
+    if (!chunk || chunk->capacity - chunk->used < aligned) {
+        chunk = ast_arena_add_chunk(arena, aligned);
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += aligned;
+    arena->bytes_used += aligned;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void *ast_arena_grow(ASTArena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr) {
+        return ast_arena_alloc(arena, new_size);
+    }
+    ASTArenaChunk *chunk = arena->head;
+    size_t old_aligned = ast_arena_align(old_size ? old_size : 1);
+    size_t new_aligned = ast_arena_align(new_size);
+    if (chunk &&
+        (unsigned char *)ptr + old_aligned == chunk->data + chunk->used &&
+        chunk->capacity - chunk->used >= new_aligned - old_aligned) {
+        chunk->used += new_aligned - old_aligned;
+        arena->bytes_used += new_aligned - old_aligned;
+        memset((unsigned char *)ptr + old_size, 0, new_size - old_size);
+        return ptr;
+    }
+    void *copy = ast_arena_alloc(arena, new_size);
+    memcpy(copy, ptr, old_size);
+    return copy;
+}
+
+char *ast_arena_copy_text(ASTArena *arena, const char *source, size_t length) {
+    char *buffer = ast_arena_alloc(arena, length + 1);
+    memcpy(buffer, source, length);
+    buffer[length] = '\0';
+    return buffer;
+}
+
+void ast_arena_destroy(ASTArena *arena) {
+    ASTArenaChunk *chunk = arena->head;
+    while (chunk) {
+        ASTArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->bytes_used = 0;
+    arena->bytes_reserved = 0;
+}
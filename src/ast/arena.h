@@ -0,0 +1,26 @@
+#ifndef LZ_AST_ARENA_H
+#define LZ_AST_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump-pointer arena backing an entire AST: nodes, ASTArray storage and copied
+ * strings all live here and are released together by ast_arena_destroy.
+ * Allocations are zeroed and never freed individually.
+ */
+typedef struct ASTArenaChunk ASTArenaChunk;
+
+typedef struct {
+    ASTArenaChunk *head;
+    size_t bytes_used;
+    size_t bytes_reserved;
+} ASTArena;
+
+void ast_arena_init(ASTArena *arena);
+void *ast_arena_alloc(ASTArena *arena, size_t size);
+/* Grows the most recent allocation in place when possible, else copies. */
+void *ast_arena_grow(ASTArena *arena, void *ptr, size_t old_size, size_t new_size);
+char *ast_arena_copy_text(ASTArena *arena, const char *source, size_t length);
+void ast_arena_destroy(ASTArena *arena);
+
+#endif
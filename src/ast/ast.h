@@ -5,6 +5,8 @@
 #include <stddef.h>
 
 #include "../lexer.h"
+#include "arena.h"
+#include "intern.h"
 
 typedef enum {
     AST_NODE_PROGRAM,
@@ -21,7 +23,8 @@ typedef enum {
     AST_NODE_EXPR_LITERAL,
     AST_NODE_EXPR_IDENTIFIER,
     AST_NODE_EXPR_CALL,
-    AST_NODE_EXPR_BINARY
+    AST_NODE_EXPR_BINARY,
+    AST_NODE_EXPR_TASK
 } ASTNodeKind;
 
 typedef enum {
@@ -56,6 +59,7 @@ typedef struct ASTLiteralExpr ASTLiteralExpr;
 typedef struct ASTIdentifierExpr ASTIdentifierExpr;
 typedef struct ASTCallExpr ASTCallExpr;
 typedef struct ASTBinaryExpr ASTBinaryExpr;
+typedef struct ASTTaskExpr ASTTaskExpr;
 
 struct ASTNode {
     ASTNodeKind kind;
@@ -64,40 +68,45 @@ struct ASTNode {
 
 struct ASTProgram {
     ASTNode base;
+    ASTArena arena;        /* owns every node, array and string below */
     ASTArray imports;      /* ASTImport* */
     ASTArray declarations; /* ASTNode* */
+    /* Interned dotted import path; NULL for the file lazylangc was given. */
+    const char *module_name;
+    /* ASTProgram* of the modules `imports` resolved to (std.* has none). */
+    ASTArray dependencies;
 };
 
 struct ASTImport {
     ASTNode base;
-    ASTArray segments; /* char* */
+    ASTArray segments; /* interned const char* */
 };
 
 struct ASTFunctionParam {
-    char *name;
-    char *type_name;
+    const char *name;
+    const char *type_name;
     Token token;
 };
 
 struct ASTFunctionDecl {
     ASTNode base;
     bool is_public;
-    char *name;
+    const char *name;
     ASTArray params; /* ASTFunctionParam* */
-    char *return_type;
+    const char *return_type;
     ASTBlock *body;
 };
 
 struct ASTStructField {
-    char *name;
-    char *type_name;
+    const char *name;
+    const char *type_name;
     Token token;
 };
 
 struct ASTStructDecl {
     ASTNode base;
     bool is_public;
-    char *name;
+    const char *name;
     ASTArray fields; /* ASTStructField* */
 };
 
@@ -109,14 +118,14 @@ struct ASTBlock {
 struct ASTVarDecl {
     ASTNode base;
     bool is_mutable;
-    char *name;
-    char *type_name;
+    const char *name;
+    const char *type_name;
     ASTNode *initializer;
 };
 
 struct ASTAssignStmt {
     ASTNode base;
-    char *target;
+    const char *target;
     ASTNode *value;
 };
 
@@ -129,7 +138,7 @@ struct ASTIfStmt {
 
 struct ASTForStmt {
     ASTNode base;
-    char *iterator;
+    const char *iterator;
     ASTNode *iterable;
     ASTBlock *body;
 };
@@ -147,13 +156,15 @@ struct ASTExprStmt {
 struct ASTLiteralExpr {
     ASTNode base;
     ASTLiteralKind literal_kind;
-    char *text;
+    /* Slice of the source buffer, not NUL-terminated; the source outlives the AST. */
+    const char *text;
+    size_t text_length;
     bool bool_value;
 };
 
 struct ASTIdentifierExpr {
     ASTNode base;
-    char *name;
+    const char *name;
 };
 
 struct ASTCallExpr {
@@ -169,88 +180,89 @@ struct ASTBinaryExpr {
     ASTNode *right;
 };
 
+/* `task ()` followed by a block; evaluates to a future of the block's tail value. */
+struct ASTTaskExpr {
+    ASTNode base;
+    ASTBlock *body;
+    /* T of the future[T] the task initializes; set by sema. */
+    const char *result_type;
+};
+
+/*
+ * Every node, ASTArray backing store and copied string is carved out of the
+ * arena owned by ASTProgram; ast_program_destroy releases them all at once.
+ * Identifiers and type names are interned (see intern.h) rather than copied,
+ * so they can be compared by pointer.
+ */
 void ast_array_init(ASTArray *array);
-void ast_array_append(ASTArray *array, void *item);
-void ast_array_free(ASTArray *array);
+void ast_array_append(ASTArena *arena, ASTArray *array, void *item);
 
-char *ast_copy_text(const char *source, size_t length);
-char *ast_copy_token_text(const Token *token);
+char *ast_copy_text(ASTArena *arena, const char *source, size_t length);
+char *ast_copy_token_text(ASTArena *arena, const Token *token);
 
 ASTProgram *ast_program_create(void);
 void ast_program_add_import(ASTProgram *program, ASTImport *import_stmt);
 void ast_program_add_declaration(ASTProgram *program, ASTNode *declaration);
+void ast_program_add_dependency(ASTProgram *program, ASTProgram *dependency);
 void ast_program_destroy(ASTProgram *program);
 
-ASTImport *ast_import_create(const Token *import_token);
-void ast_import_add_segment(ASTImport *import_stmt, const Token *segment_token);
-void ast_import_destroy(ASTImport *import_stmt);
+ASTImport *ast_import_create(ASTArena *arena, const Token *import_token);
+void ast_import_add_segment(ASTArena *arena, ASTImport *import_stmt, const Token *segment_token);
 
-ASTFunctionDecl *ast_function_decl_create(bool is_public, const Token *name_token);
-void ast_function_decl_add_param(ASTFunctionDecl *fn,
+ASTFunctionDecl *ast_function_decl_create(ASTArena *arena, bool is_public, const Token *name_token);
+void ast_function_decl_add_param(ASTArena *arena,
+                                 ASTFunctionDecl *fn,
                                  const char *type_name,
-                                 size_t type_length,
                                  const Token *name_token);
-void ast_function_decl_set_return_type(ASTFunctionDecl *fn,
-                                       const char *type_name,
-                                       size_t type_length);
+void ast_function_decl_set_return_type(ASTFunctionDecl *fn, const char *type_name);
 void ast_function_decl_set_body(ASTFunctionDecl *fn, ASTBlock *body);
-void ast_function_decl_destroy(ASTFunctionDecl *fn);
 
-ASTStructDecl *ast_struct_decl_create(bool is_public, const Token *name_token);
-void ast_struct_decl_add_field(ASTStructDecl *decl,
+ASTStructDecl *ast_struct_decl_create(ASTArena *arena, bool is_public, const Token *name_token);
+void ast_struct_decl_add_field(ASTArena *arena,
+                               ASTStructDecl *decl,
                                const Token *name_token,
-                               const char *type_name,
-                               size_t type_length);
-void ast_struct_decl_destroy(ASTStructDecl *decl);
+                               const char *type_name);
 
-ASTBlock *ast_block_create(const Token *start_token);
-void ast_block_add_statement(ASTBlock *block, ASTNode *statement);
-void ast_block_destroy(ASTBlock *block);
+ASTBlock *ast_block_create(ASTArena *arena, const Token *start_token);
+void ast_block_add_statement(ASTArena *arena, ASTBlock *block, ASTNode *statement);
 
-ASTVarDecl *ast_var_decl_create(const Token *name_token, bool is_mutable);
-void ast_var_decl_set_type(ASTVarDecl *decl, const char *type_name, size_t type_length);
+ASTVarDecl *ast_var_decl_create(ASTArena *arena, const Token *name_token, bool is_mutable);
+void ast_var_decl_set_type(ASTVarDecl *decl, const char *type_name);
 void ast_var_decl_set_initializer(ASTVarDecl *decl, ASTNode *expr);
-void ast_var_decl_destroy(ASTVarDecl *decl);
 
-ASTAssignStmt *ast_assign_create(const Token *name_token, ASTNode *value);
-void ast_assign_destroy(ASTAssignStmt *assign_stmt);
+ASTAssignStmt *ast_assign_create(ASTArena *arena, const Token *name_token, ASTNode *value);
 
-ASTIfStmt *ast_if_create(const Token *if_token,
+ASTIfStmt *ast_if_create(ASTArena *arena,
+                         const Token *if_token,
                          ASTNode *condition,
                          ASTBlock *then_block,
                          ASTBlock *else_block);
-void ast_if_destroy(ASTIfStmt *stmt);
 
-ASTForStmt *ast_for_create(const Token *for_token,
+ASTForStmt *ast_for_create(ASTArena *arena,
+                           const Token *for_token,
                            const Token *iterator_token,
                            ASTNode *iterable,
                            ASTBlock *body);
-void ast_for_destroy(ASTForStmt *stmt);
 
-ASTReturnStmt *ast_return_create(const Token *return_token, ASTNode *value);
-void ast_return_destroy(ASTReturnStmt *stmt);
+ASTReturnStmt *ast_return_create(ASTArena *arena, const Token *return_token, ASTNode *value);
 
-ASTExprStmt *ast_expr_stmt_create(ASTNode *expr);
-void ast_expr_stmt_destroy(ASTExprStmt *stmt);
+ASTExprStmt *ast_expr_stmt_create(ASTArena *arena, ASTNode *expr);
 
-ASTLiteralExpr *ast_literal_create(const Token *token, ASTLiteralKind kind);
+ASTLiteralExpr *ast_literal_create(ASTArena *arena, const Token *token, ASTLiteralKind kind);
 void ast_literal_set_text(ASTLiteralExpr *literal, const char *text, size_t length);
 void ast_literal_set_bool(ASTLiteralExpr *literal, bool value);
-void ast_literal_destroy(ASTLiteralExpr *literal);
 
-ASTIdentifierExpr *ast_identifier_create(const Token *name_token);
-void ast_identifier_destroy(ASTIdentifierExpr *ident);
+ASTIdentifierExpr *ast_identifier_create(ASTArena *arena, const Token *name_token);
 
-ASTCallExpr *ast_call_create(ASTNode *callee, const Token *call_token);
-void ast_call_add_argument(ASTCallExpr *call_expr, ASTNode *argument);
-void ast_call_destroy(ASTCallExpr *call_expr);
+ASTCallExpr *ast_call_create(ASTArena *arena, ASTNode *callee, const Token *call_token);
+void ast_call_add_argument(ASTArena *arena, ASTCallExpr *call_expr, ASTNode *argument);
 
-ASTBinaryExpr *ast_binary_create(ASTNode *left,
+ASTBinaryExpr *ast_binary_create(ASTArena *arena,
+                                 ASTNode *left,
                                  TokenType op,
                                  ASTNode *right,
                                  const Token *op_token);
-void ast_binary_destroy(ASTBinaryExpr *binary_expr);
 
-void ast_node_destroy(ASTNode *node);
+ASTTaskExpr *ast_task_create(ASTArena *arena, const Token *task_token, ASTBlock *body);
 
 #endif
@@ -0,0 +1,123 @@
+#include "intern.h"
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    const char *text;
+    uint32_t hash;
+    uint32_t length;
+} InternEntry;
+
+typedef struct {
+    InternEntry *entries;
+    size_t count;
+    size_t capacity; /* power of two */
+    ASTArena storage;
+    ASTSymbols symbols;
+} InternTable;
+
+static InternTable intern_table;
+/* Modules are parsed and checked on worker threads; they all intern here. */
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t intern_symbols_once = PTHREAD_ONCE_INIT;
+
+static uint32_t intern_hash(const char *text, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void intern_grow(InternTable *table) {
+    size_t new_capacity = table->capacity ? table->capacity * 2 : 1024;
+    InternEntry *entries = calloc(new_capacity, sizeof(InternEntry));
+    if (!entries) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        InternEntry *entry = &table->entries[i];
+        if (!entry->text) continue;
+        size_t slot = entry->hash & (new_capacity - 1);
+        while (entries[slot].text) {
+            slot = (slot + 1) & (new_capacity - 1);
+        }
+        entries[slot] = *entry;
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = new_capacity;
+}
+
+const char *ast_intern(const char *text, size_t length) {
+    InternTable *table = &intern_table;
+    pthread_mutex_lock(&intern_lock);
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        intern_grow(table);
+    }
+
+    uint32_t hash = intern_hash(text, length);
+    size_t slot = hash & (table->capacity - 1);
+    while (table->entries[slot].text) {
+        InternEntry *entry = &table->entries[slot];
+        if (entry->hash == hash &&
+            entry->length == length &&
+            memcmp(entry->text, text, length) == 0) {
+            pthread_mutex_unlock(&intern_lock);
+            return entry->text;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+
+    const char *copy = ast_arena_copy_text(&table->storage, text, length);
+    table->entries[slot] = (InternEntry){
+        .text = copy,
+        .hash = hash,
+        .length = (uint32_t)length,
+    };
+    table->count++;
+    pthread_mutex_unlock(&intern_lock);
+    return copy;
+}
+
+const char *ast_intern_cstr(const char *text) {
+    return ast_intern(text, strlen(text));
+}
+
+size_t ast_intern_count(void) {
+    pthread_mutex_lock(&intern_lock);
+    size_t count = intern_table.count;
+    pthread_mutex_unlock(&intern_lock);
+    return count;
+}
+
+static void intern_init_symbols(void) {
+    intern_table.symbols = (ASTSymbols){
+        .main = ast_intern_cstr("main"),
+        .log = ast_intern_cstr("log"),
+        .int_type = ast_intern_cstr("int"),
+        .float_type = ast_intern_cstr("float"),
+        .bool_type = ast_intern_cstr("bool"),
+        .string_type = ast_intern_cstr("string"),
+        .null_type = ast_intern_cstr("null"),
+        .task = ast_intern_cstr("task"),
+        .future = ast_intern_cstr("future"),
+        .chan = ast_intern_cstr("chan"),
+        .await = ast_intern_cstr("await"),
+        .send = ast_intern_cstr("send"),
+        .recv = ast_intern_cstr("recv"),
+    };
+}
+
+const ASTSymbols *ast_symbols(void) {
+    pthread_once(&intern_symbols_once, intern_init_symbols);
+    return &intern_table.symbols;
+}
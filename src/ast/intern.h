@@ -0,0 +1,36 @@
+#ifndef LZ_AST_INTERN_H
+#define LZ_AST_INTERN_H
+
+#include <stddef.h>
+
+/*
+ * Process-wide string interner for identifiers and type names. Every distinct
+ * spelling maps to one canonical, NUL-terminated pointer that lives until
+ * exit, so parser, sema and codegen compare symbols with `==` instead of
+ * strcmp. Only pass interned pointers where a symbol is expected. Safe to
+ * call from several threads; lookups serialize on one lock.
+ */
+const char *ast_intern(const char *text, size_t length);
+const char *ast_intern_cstr(const char *text);
+size_t ast_intern_count(void);
+
+/* Canonical symbols the compiler itself refers to by name. */
+typedef struct {
+    const char *main;
+    const char *log;
+    const char *int_type;
+    const char *float_type;
+    const char *bool_type;
+    const char *string_type;
+    const char *null_type;
+    const char *task;
+    const char *future;
+    const char *chan;
+    const char *await;
+    const char *send;
+    const char *recv;
+} ASTSymbols;
+
+const ASTSymbols *ast_symbols(void);
+
+#endif
@@ -0,0 +1,177 @@
+#include "symtab.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *symtab_xrealloc(void *ptr, size_t size) {
+    void *result = realloc(ptr, size);
+    if (!result) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+/* Fibonacci hashing of the (interned) key address. */
+static size_t symtab_hash(const char *key, size_t capacity) {
+    uint64_t bits = (uint64_t)(uintptr_t)key;
+    bits ^= bits >> 17;
+    return (size_t)((bits * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+}
+
+void ast_symbol_map_init(ASTSymbolMap *map) {
+    map->keys = NULL;
+    map->values = NULL;
+    map->count = 0;
+    map->capacity = 0;
+}
+
+void ast_symbol_map_destroy(ASTSymbolMap *map) {
+    free(map->keys);
+    free(map->values);
+    ast_symbol_map_init(map);
+}
+
+static void ast_symbol_map_grow(ASTSymbolMap *map) {
+    size_t new_capacity = map->capacity ? map->capacity * 2 : 16;
+    const char **keys = calloc(new_capacity, sizeof(const char *));
+    size_t *values = calloc(new_capacity, sizeof(size_t));
+    if (!keys || !values) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (!map->keys[i]) continue;
+        size_t slot = symtab_hash(map->keys[i], new_capacity);
+        while (keys[slot]) {
+            slot = (slot + 1) & (new_capacity - 1);
+        }
+        keys[slot] = map->keys[i];
+        values[slot] = map->values[i];
+    }
+    free(map->keys);
+    free(map->values);
+    map->keys = keys;
+    map->values = values;
+    map->capacity = new_capacity;
+}
+
+size_t ast_symbol_map_get(const ASTSymbolMap *map, const char *key) {
+    if (!key || map->capacity == 0) {
+        return 0;
+    }
+    size_t slot = symtab_hash(key, map->capacity);
+    while (map->keys[slot]) {
+        if (map->keys[slot] == key) {
+            return map->values[slot];
+        }
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    return 0;
+}
+
+/* Keys are never deleted; storing 0 marks a symbol absent and keeps its slot. */
+void ast_symbol_map_set(ASTSymbolMap *map, const char *key, size_t value) {
+    if ((map->count + 1) * 4 > map->capacity * 3) {
+        ast_symbol_map_grow(map);
+    }
+    size_t slot = symtab_hash(key, map->capacity);
+    while (map->keys[slot]) {
+        if (map->keys[slot] == key) {
+            map->values[slot] = value;
+            return;
+        }
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    map->keys[slot] = key;
+    map->values[slot] = value;
+    map->count++;
+}
+
+void ast_scope_stack_init(ASTScopeStack *stack, size_t item_size) {
+    stack->items = NULL;
+    stack->names = NULL;
+    stack->shadowed = NULL;
+    stack->item_size = item_size;
+    stack->count = 0;
+    stack->capacity = 0;
+    stack->scope_starts = NULL;
+    stack->depth = 0;
+    stack->depth_capacity = 0;
+    ast_symbol_map_init(&stack->index);
+}
+
+void ast_scope_stack_destroy(ASTScopeStack *stack) {
+    free(stack->items);
+    free(stack->names);
+    free(stack->shadowed);
+    free(stack->scope_starts);
+    ast_symbol_map_destroy(&stack->index);
+    ast_scope_stack_init(stack, stack->item_size);
+}
+
+void ast_scope_stack_push(ASTScopeStack *stack) {
+    if (stack->depth == stack->depth_capacity) {
+        stack->depth_capacity = stack->depth_capacity ? stack->depth_capacity * 2 : 8;
+        stack->scope_starts = symtab_xrealloc(stack->scope_starts,
+                                              stack->depth_capacity * sizeof(size_t));
+    }
+    stack->scope_starts[stack->depth++] = stack->count;
+}
+
+void ast_scope_stack_pop(ASTScopeStack *stack) {
+    if (stack->depth == 0) return;
+    size_t start = stack->scope_starts[--stack->depth];
+    while (stack->count > start) {
+        stack->count--;
+        ast_symbol_map_set(&stack->index,
+                           stack->names[stack->count],
+                           stack->shadowed[stack->count]);
+    }
+}
+
+void *ast_scope_stack_add(ASTScopeStack *stack, const char *name) {
+    if (stack->depth == 0) {
+        ast_scope_stack_push(stack);
+    }
+    if (stack->count == stack->capacity) {
+        stack->capacity = stack->capacity ? stack->capacity * 2 : 16;
+        stack->items = symtab_xrealloc(stack->items, stack->capacity * stack->item_size);
+        stack->names = symtab_xrealloc(stack->names, stack->capacity * sizeof(const char *));
+        stack->shadowed = symtab_xrealloc(stack->shadowed, stack->capacity * sizeof(size_t));
+    }
+    size_t position = stack->count++;
+    stack->names[position] = name;
+    stack->shadowed[position] = ast_symbol_map_get(&stack->index, name);
+    ast_symbol_map_set(&stack->index, name, position + 1);
+    void *item = stack->items + position * stack->item_size;
+    memset(item, 0, stack->item_size);
+    return item;
+}
+
+void *ast_scope_stack_lookup(const ASTScopeStack *stack, const char *name) {
+    size_t entry = ast_symbol_map_get(&stack->index, name);
+    return entry ? ast_scope_stack_at(stack, entry - 1) : NULL;
+}
+
+void *ast_scope_stack_lookup_current(const ASTScopeStack *stack, const char *name) {
+    size_t entry = ast_symbol_map_get(&stack->index, name);
+    if (!entry || stack->depth == 0 || entry - 1 < stack->scope_starts[stack->depth - 1]) {
+        return NULL;
+    }
+    return ast_scope_stack_at(stack, entry - 1);
+}
+
+void *ast_scope_stack_at(const ASTScopeStack *stack, size_t position) {
+    return stack->items + position * stack->item_size;
+}
+
+size_t ast_scope_stack_position(const ASTScopeStack *stack, const void *item) {
+    return (size_t)((const unsigned char *)item - stack->items) / stack->item_size;
+}
+
+size_t ast_scope_stack_start(const ASTScopeStack *stack, size_t level) {
+    return level < stack->depth ? stack->scope_starts[level] : stack->count;
+}
@@ -0,0 +1,61 @@
+#ifndef LZ_AST_SYMTAB_H
+#define LZ_AST_SYMTAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Symbol tables keyed by interned names (see intern.h). Keys are compared by
+ * pointer and hashed by address, so lookups never touch the string bytes.
+ */
+
+/* Open-addressing map from symbol to a caller-defined index; 0 means absent. */
+typedef struct {
+    const char **keys;
+    size_t *values;
+    size_t count;
+    size_t capacity; /* power of two */
+} ASTSymbolMap;
+
+void ast_symbol_map_init(ASTSymbolMap *map);
+void ast_symbol_map_destroy(ASTSymbolMap *map);
+size_t ast_symbol_map_get(const ASTSymbolMap *map, const char *key);
+void ast_symbol_map_set(ASTSymbolMap *map, const char *key, size_t value);
+
+/*
+ * Lexically scoped bindings. Bindings live in one flat array; each scope is a
+ * suffix of it. The map always points at the innermost binding for a name and
+ * every binding remembers the one it shadows, so push is O(1) and pop only
+ * restores the bindings the closing scope introduced -- nothing is rehashed.
+ */
+typedef struct {
+    unsigned char *items;
+    const char **names;
+    size_t *shadowed; /* previous binding for the same name (index + 1) */
+    size_t item_size;
+    size_t count;
+    size_t capacity;
+
+    size_t *scope_starts;
+    size_t depth;
+    size_t depth_capacity;
+
+    ASTSymbolMap index;
+} ASTScopeStack;
+
+void ast_scope_stack_init(ASTScopeStack *stack, size_t item_size);
+void ast_scope_stack_destroy(ASTScopeStack *stack);
+void ast_scope_stack_push(ASTScopeStack *stack);
+void ast_scope_stack_pop(ASTScopeStack *stack);
+/* Returns zeroed payload storage; valid until the next add. */
+void *ast_scope_stack_add(ASTScopeStack *stack, const char *name);
+void *ast_scope_stack_lookup(const ASTScopeStack *stack, const char *name);
+/* Like lookup, but only matches bindings of the innermost scope. */
+void *ast_scope_stack_lookup_current(const ASTScopeStack *stack, const char *name);
+void *ast_scope_stack_at(const ASTScopeStack *stack, size_t position);
+/* Inverse of ast_scope_stack_at for a binding returned by the stack. */
+size_t ast_scope_stack_position(const ASTScopeStack *stack, const void *item);
+/* First binding position of the scope at `level` (0 = outermost). */
+size_t ast_scope_stack_start(const ASTScopeStack *stack, size_t level);
+
+#endif
@@ -1,44 +1,135 @@
+#define _GNU_SOURCE
+
 #include "codegen.h"
 
+#include "../ast/symtab.h"
+#include "../profile.h"
+
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #define DEFAULT_C_OUTPUT "lazylang_out.c"
 #define DEFAULT_BINARY_OUTPUT "lazylang_out"
 #define INDENT_WIDTH 4
-
+#define WRITER_INITIAL_CAPACITY (64 * 1024)
+#define RUNTIME_LIBRARY "liblzrt.a"
+#define RUNTIME_INCLUDE_DIR "include"
+#define RUNTIME_HEADER RUNTIME_INCLUDE_DIR "/runtime.h"
+#define CG_PATH_CAPACITY 4096
+
+/*
+ * Generated C is assembled in memory and written out with write(2) once
+ * emission finishes, so codegen never goes through stdio per fragment.
+ */
 typedef struct {
-    FILE *file;
+    char *data;
+    size_t length;
+    size_t capacity;
     int indent;
 } CodeWriter;
 
+/* Generated C of one translation unit, kept in memory until it is compiled. */
+struct CodegenOutput {
+    CodeWriter writer;
+};
+
+/* argv of a compiler run; each item is owned, and the array is NULL-terminated when run. */
+typedef struct {
+    char **items;
+    size_t count;
+    size_t capacity;
+} CGCommand;
+
+/* Indentation is copied out of this prefix instead of built per line. */
+static const char WRITER_INDENT_SPACES[] =
+    "                                                                ";
+
+/* Names are interned by the parser; lookups compare pointers. */
 typedef struct {
     const ASTStructDecl *decl;
-    char *name;
+    const char *name;
+    char *c_type;
     char *assign_helper;
+    char *move_helper;
 } CGStructInfo;
 
 typedef struct {
     const ASTFunctionDecl *decl;
-    char *name;
+    const char *name;
     char *c_name;
+    bool imported; /* defined in another module's translation unit */
 } CGFunctionInfo;
 
+typedef struct {
+    const char *text;
+    size_t length;
+} CGStringLiteral;
+
 typedef struct {
     const char *name;
+    const char *c_name; /* how C spells it: the name, or a field of a task frame */
     const char *type_name;
     bool is_mutable;
+    bool owns_ref;
+    bool moved;
 } CGVarBinding;
 
+/*
+ * Owned (+1) call result hoisted out of an expression so it can be released;
+ * in a task body also a received value, which may be a plain one.
+ */
 typedef struct {
-    CGVarBinding *items;
-    size_t count;
-    size_t capacity;
-} CGScope;
+    const ASTNode *node;
+    const char *type_name;
+    size_t id;
+    bool in_frame; /* spilled into the task frame because an await separates it from its release */
+} CGOwnedTemp;
+
+typedef struct {
+    const char *c_type;
+    const char *name;
+} CGFrameField;
+
+/*
+ * Task body being lowered. Besides its captures, the frame holds whatever
+ * must survive a suspension: locals that are used (or released) after an
+ * await and temporaries hoisted in statements that await.
+ */
+typedef struct {
+    CGFrameField *fields;
+    size_t field_count;
+    size_t field_capacity;
+    const ASTVarDecl **spilled; /* locals that live across an await */
+    size_t spilled_count;
+    size_t spilled_capacity;
+    size_t resume_count;
+    bool spill_temps; /* the statement being emitted awaits */
+} CGTaskState;
+
+/*
+ * Outer variables a task body refers to, in first-use order, plus the names
+ * the body declares itself (truncated as blocks close) so those are not
+ * mistaken for captures.
+ */
+typedef struct {
+    CGVarBinding *captures;
+    size_t capture_count;
+    size_t capture_capacity;
+    const char **locals;
+    size_t local_count;
+    size_t local_capacity;
+} CGCaptureSet;
 
 typedef struct {
     CodeWriter writer;
@@ -46,48 +137,111 @@ typedef struct {
     CGStructInfo *structs;
     size_t struct_count;
     size_t struct_capacity;
+    ASTSymbolMap struct_index; /* name -> struct position + 1 */
     CGFunctionInfo *functions;
     size_t function_count;
     size_t function_capacity;
-    CGScope *scopes;
-    size_t scope_count;
-    size_t scope_capacity;
+    ASTSymbolMap function_index; /* name -> function position + 1 */
+    CGStringLiteral *strings;
+    size_t string_count;
+    size_t string_capacity;
+    ASTSymbolMap string_index; /* interned text -> constant index + 1 */
+    ASTScopeStack scopes; /* of CGVarBinding */
+    CGOwnedTemp *temps;
+    size_t temp_count;
+    size_t temp_capacity;
+    size_t next_temp_id;
     const ASTFunctionDecl *current_function;
+    CGTaskState *task; /* NULL outside task bodies */
+    /*
+     * Frame structs and run/drop/spawn functions of lowered tasks. They are
+     * emitted while the enclosing function is, and spliced in ahead of the
+     * function definitions at `task_defs_offset` once those are done.
+     */
+    CodeWriter task_defs;
+    size_t task_defs_offset;
+    size_t next_task_id;
+    /*
+     * Incremental shards hold a single definition: `shard_function`, or the
+     * C main() when `shard_entry` is set. Every function then needs external
+     * linkage, since its callers live in other shards.
+     */
+    bool sharded;
+    const ASTFunctionDecl *shard_function;
+    bool shard_entry;
     bool had_error;
 } CodegenContext;
 
+static void writer_init(CodeWriter *writer);
+static void writer_destroy(CodeWriter *writer);
+static void writer_reserve(CodeWriter *writer, size_t extra);
+static void writer_append(CodeWriter *writer, const char *text, size_t length);
+static void writer_puts(CodeWriter *writer, const char *text);
+static void writer_putc(CodeWriter *writer, char ch);
+static void writer_vprintf(CodeWriter *writer, const char *fmt, va_list args);
+static bool writer_flush_to_path(const CodeWriter *writer, const char *path);
 static void writer_write_indent(CodeWriter *writer);
 static void writer_line(CodeWriter *writer, const char *fmt, ...);
+static void writer_put_line(CodeWriter *writer, const char *text);
 static void writer_printf(CodeWriter *writer, const char *fmt, ...);
 static void writer_begin_line(CodeWriter *writer);
 static void writer_end_line(CodeWriter *writer);
 static void writer_push(CodeWriter *writer);
 static void writer_pop(CodeWriter *writer);
 static void writer_blank_line(CodeWriter *writer);
+static void writer_insert(CodeWriter *writer, size_t offset, const CodeWriter *text);
 
-static char *cg_strdup(const char *text);
-static void cg_context_init(CodegenContext *ctx,
-                            FILE *out,
-                            const ASTProgram *program);
+static void cg_context_init(CodegenContext *ctx, const ASTProgram *program);
 static void cg_context_destroy(CodegenContext *ctx);
 static void cg_collect_metadata(CodegenContext *ctx);
 static void cg_register_struct(CodegenContext *ctx, const ASTStructDecl *decl);
-static void cg_register_function(CodegenContext *ctx, const ASTFunctionDecl *decl);
+static void cg_register_function(CodegenContext *ctx,
+                                 const ASTFunctionDecl *decl,
+                                 const char *module_name,
+                                 bool imported);
 static const CGFunctionInfo *cg_find_function(const CodegenContext *ctx, const char *name);
 static const CGStructInfo *cg_find_struct(const CodegenContext *ctx, const char *name);
+static size_t cg_intern_string(CodegenContext *ctx, const char *text, size_t length);
+static void cg_collect_strings_in_block(CodegenContext *ctx, const ASTBlock *block);
+static void cg_collect_strings_in_node(CodegenContext *ctx, const ASTNode *node);
 static void cg_scope_push(CodegenContext *ctx);
 static void cg_scope_pop(CodegenContext *ctx);
-static void cg_scope_add(CodegenContext *ctx,
-                         const char *name,
-                         const char *type_name,
-                         bool is_mutable);
+static CGVarBinding *cg_scope_add(CodegenContext *ctx,
+                                  const char *name,
+                                  const char *type_name,
+                                  bool is_mutable,
+                                  bool owns_ref);
 static const CGVarBinding *cg_scope_lookup(const CodegenContext *ctx, const char *name);
+static bool cg_type_is_refcounted(const CodegenContext *ctx, const char *type_name);
+static bool cg_type_is_future(const char *type_name);
+static bool cg_type_is_chan(const char *type_name);
+static const char *cg_chan_element_type(const char *type_name);
+static const char *cg_future_result_type(const char *type_name);
+static const char *cg_retain_fn_for(const CodegenContext *ctx, const char *type_name);
+static const char *cg_release_fn_for(const CodegenContext *ctx, const char *type_name);
+static const char *cg_share_fn_for(const CodegenContext *ctx, const char *type_name);
+static const char *cg_expr_type_name(const CodegenContext *ctx, const ASTNode *node);
+static bool cg_expr_is_owned(const CodegenContext *ctx, const ASTNode *node);
+static void cg_hoist_owned_temps(CodegenContext *ctx, const ASTNode *node, bool consumed);
+static void cg_hoist_statement_temps(CodegenContext *ctx, const ASTNode *node);
+static const CGOwnedTemp *cg_find_temp(const CodegenContext *ctx, const ASTNode *node);
+static void cg_release_temps(CodegenContext *ctx, size_t mark);
+static bool cg_bindings_need_release(const CodegenContext *ctx,
+                                     size_t from,
+                                     const CGVarBinding *skip);
+static void cg_emit_binding_releases(CodegenContext *ctx,
+                                     size_t from,
+                                     const CGVarBinding *skip);
+static void cg_emit_scope_releases(CodegenContext *ctx);
+static bool cg_has_pending_releases(const CodegenContext *ctx, const CGVarBinding *skip);
+static void cg_emit_pending_releases(CodegenContext *ctx, const CGVarBinding *skip);
 static bool cg_emit_program(CodegenContext *ctx);
 static void cg_emit_file_header(CodegenContext *ctx);
 static void cg_emit_includes(CodegenContext *ctx);
+static void cg_emit_string_constants(CodegenContext *ctx);
 static void cg_emit_struct_forward_decls(CodegenContext *ctx);
 static void cg_emit_structs(CodegenContext *ctx);
-static void cg_emit_struct_assign_helpers(CodegenContext *ctx);
+static void cg_emit_struct_helpers(CodegenContext *ctx);
 static void cg_emit_function_signature(CodegenContext *ctx,
                                        const CGFunctionInfo *info,
                                        bool prototype);
@@ -98,32 +252,43 @@ static void cg_emit_entrypoint(CodegenContext *ctx);
 static void cg_emit_block(CodegenContext *ctx,
                           ASTBlock *block,
                           const char *tail_var,
-                          const char *tail_helper);
+                          const char *tail_type);
 static void cg_emit_statement(CodegenContext *ctx,
                               ASTNode *node,
                               const char *tail_var,
-                              const char *tail_helper);
+                              const char *tail_type);
 static void cg_emit_var_decl(CodegenContext *ctx, ASTVarDecl *decl);
 static void cg_emit_assignment(CodegenContext *ctx, ASTAssignStmt *assign);
 static void cg_emit_if(CodegenContext *ctx,
                        ASTIfStmt *stmt,
                        const char *tail_var,
-                       const char *tail_helper);
+                       const char *tail_type);
 static void cg_emit_return(CodegenContext *ctx, ASTReturnStmt *stmt);
 static void cg_emit_expr_stmt(CodegenContext *ctx,
                               ASTExprStmt *stmt,
                               const char *tail_var,
-                              const char *tail_helper);
+                              const char *tail_type);
 static void cg_emit_expression(CodegenContext *ctx, ASTNode *node);
 static void cg_emit_literal(CodegenContext *ctx, ASTLiteralExpr *literal);
 static void cg_emit_identifier(CodegenContext *ctx, ASTIdentifierExpr *ident);
 static void cg_emit_call(CodegenContext *ctx, ASTCallExpr *call);
+static void cg_emit_task(CodegenContext *ctx, ASTTaskExpr *task);
+static bool cg_is_builtin_call(const ASTNode *node, const char *name);
+static bool cg_is_await_call(const ASTNode *node);
+static bool cg_is_suspend_call(const ASTNode *node);
+static const char *cg_task_add_field(CodegenContext *ctx, const char *c_type, const char *name);
+static bool cg_task_spills(const CGTaskState *task, const ASTVarDecl *decl);
+static bool cg_statement_awaits(const ASTNode *node);
+static void cg_lower_statement_awaits(CodegenContext *ctx, const ASTNode *node);
 static void cg_emit_binary(CodegenContext *ctx, ASTBinaryExpr *binary);
 static const char *cg_binary_op(TokenType type);
-static void cg_emit_string_literal(CodegenContext *ctx, const char *text);
+static void cg_emit_string_literal(CodegenContext *ctx, const char *text, size_t length);
+static void cg_write_c_string(CodegenContext *ctx, const char *text, size_t length);
 static const char *cg_c_type_for(const CodegenContext *ctx, const char *type_name);
 static const char *cg_c_return_type_for(const CodegenContext *ctx, const char *type_name);
-static const char *cg_assign_helper_for(const CodegenContext *ctx, const char *type_name);
+static const char *cg_assign_helper_for(const CodegenContext *ctx,
+                                        const char *type_name,
+                                        bool owned);
 static bool cg_type_is_result(const char *type_name);
 static bool cg_type_is_maybe(const char *type_name);
 static bool cg_type_is_struct(const CodegenContext *ctx, const char *type_name);
@@ -132,11 +297,63 @@ static void cg_emit_assignment_call(CodegenContext *ctx,
                                     const char *target_name,
                                     const char *type_name,
                                     ASTNode *value);
-static bool cg_command_exists(const char *cmd);
-static bool cg_invoke_compiler(const char *compiler,
-                               const char *c_path,
-                               const char *binary_path);
-static bool cg_run_clang(const char *c_path, const char *binary_path);
+static bool cg_begin_compiler_command(CGCommand *command,
+                                      const char *compiler,
+                                      const CodegenBuildFlags *flags,
+                                      char *runtime_dir,
+                                      size_t runtime_dir_size);
+static bool cg_run_command(CGCommand *command, const char *output_path, const CodeWriter *input);
+static bool cg_build_binary(const CodeWriter *source,
+                            const char *binary_path,
+                            const CodegenBuildFlags *flags);
+
+/* The writer moves into the output; the rest of the context is dropped. */
+static CodegenOutput *cg_generate(const ASTProgram *program,
+                                  bool sharded,
+                                  const ASTFunctionDecl *fn,
+                                  bool entry) {
+    CodegenContext ctx;
+    cg_context_init(&ctx, program);
+    ctx.sharded = sharded;
+    ctx.shard_function = fn;
+    ctx.shard_entry = entry;
+    CodegenOutput *output = NULL;
+    if (cg_emit_program(&ctx)) {
+        output = malloc(sizeof(CodegenOutput));
+        if (!output) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        output->writer = ctx.writer;
+        ctx.writer = (CodeWriter){0};
+    }
+    cg_context_destroy(&ctx);
+    return output;
+}
+
+CodegenOutput *codegen_generate(const ASTProgram *program) {
+    return cg_generate(program, false, NULL, false);
+}
+
+CodegenOutput *codegen_generate_function_shard(const ASTProgram *program, const ASTFunctionDecl *fn) {
+    return cg_generate(program, true, fn, false);
+}
+
+CodegenOutput *codegen_generate_entry_shard(const ASTProgram *program) {
+    return cg_generate(program, true, NULL, true);
+}
+
+bool codegen_output_write(const CodegenOutput *output, const char *c_path) {
+    return writer_flush_to_path(&output->writer, c_path);
+}
+
+void codegen_output_free(CodegenOutput *output) {
+    if (!output) {
+        return;
+    }
+    writer_destroy(&output->writer);
+    free(output);
+}
 
 bool codegen_emit(const ASTProgram *program, const CodegenOptions *options) {
     if (!program) {
@@ -150,32 +367,135 @@ bool codegen_emit(const ASTProgram *program, const CodegenOptions *options) {
         ? options->binary_output_path
         : DEFAULT_BINARY_OUTPUT;
     bool emit_binary = true;
+    bool emit_c = true;
+    CodegenBuildFlags flags = {0};
     if (options) {
         emit_binary = options->emit_binary;
+        emit_c = options->emit_c || !emit_binary;
+        flags = options->build;
     }
 
-    FILE *out = fopen(c_path, "w");
-    if (!out) {
-        fprintf(stderr, "failed to open '%s' for writing: %s\n", c_path, strerror(errno));
-        return false;
+    profile_begin(PROFILE_PHASE_EMIT);
+    CodegenOutput *output = codegen_generate(program);
+    bool ok = output != NULL;
+    if (ok && emit_c) {
+        ok = codegen_output_write(output, c_path);
     }
+    profile_end(PROFILE_PHASE_EMIT);
 
-    CodegenContext ctx;
-    cg_context_init(&ctx, out, program);
-    bool ok = cg_emit_program(&ctx);
-    cg_context_destroy(&ctx);
-    fclose(out);
-
+    /* The compiler reads the C from memory; the file, if any, is only for the user. */
     if (ok && emit_binary) {
-        ok = cg_run_clang(c_path, binary_path);
+        profile_begin(PROFILE_PHASE_CC);
+        ok = cg_build_binary(&output->writer, binary_path, &flags);
+        profile_end(PROFILE_PHASE_CC);
     }
 
+    codegen_output_free(output);
     return ok;
 }
 
+static void writer_init(CodeWriter *writer) {
+    writer->data = malloc(WRITER_INITIAL_CAPACITY);
+    if (!writer->data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    writer->length = 0;
+    writer->capacity = WRITER_INITIAL_CAPACITY;
+    writer->indent = 0;
+}
+
+static void writer_destroy(CodeWriter *writer) {
+    free(writer->data);
+    writer->data = NULL;
+    writer->length = 0;
+    writer->capacity = 0;
+}
+
+static void writer_reserve(CodeWriter *writer, size_t extra) {
+    if (writer->capacity - writer->length >= extra) {
+        return;
+    }
+    size_t new_capacity = writer->capacity;
+    while (new_capacity - writer->length < extra) {
+        new_capacity *= 2;
+    }
+    char *new_data = realloc(writer->data, new_capacity);
+    if (!new_data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    writer->data = new_data;
+    writer->capacity = new_capacity;
+}
+
+static void writer_append(CodeWriter *writer, const char *text, size_t length) {
+    writer_reserve(writer, length);
+    memcpy(writer->data + writer->length, text, length);
+    writer->length += length;
+}
+
+static void writer_puts(CodeWriter *writer, const char *text) {
+    writer_append(writer, text, strlen(text));
+}
+
+static void writer_putc(CodeWriter *writer, char ch) {
+    writer_reserve(writer, 1);
+    writer->data[writer->length++] = ch;
+}
+
+/* Formats straight into the buffer; retries once if the tail was too small. */
+static void writer_vprintf(CodeWriter *writer, const char *fmt, va_list args) {
+    va_list retry;
+    va_copy(retry, args);
+    size_t available = writer->capacity - writer->length;
+    int needed = vsnprintf(writer->data + writer->length, available, fmt, args);
+    if (needed < 0) {
+        va_end(retry);
+        return;
+    }
+    if ((size_t)needed >= available) {
+        writer_reserve(writer, (size_t)needed + 1);
+        vsnprintf(writer->data + writer->length, (size_t)needed + 1, fmt, retry);
+    }
+    va_end(retry);
+    writer->length += (size_t)needed;
+}
+
+static bool writer_flush_to_path(const CodeWriter *writer, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open '%s' for writing: %s\n", path, strerror(errno));
+        return false;
+    }
+    size_t written = 0;
+    while (written < writer->length) {
+        ssize_t n = write(fd, writer->data + written, writer->length - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "failed to write '%s': %s\n", path, strerror(errno));
+            close(fd);
+            return false;
+        }
+        written += (size_t)n;
+    }
+    if (close(fd) != 0) {
+        fprintf(stderr, "failed to write '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
 static void writer_write_indent(CodeWriter *writer) {
-    for (int i = 0; i < writer->indent; i++) {
-        fputs("    ", writer->file);
+    size_t remaining = (size_t)writer->indent * INDENT_WIDTH;
+    while (remaining > 0) {
+        size_t chunk = remaining < sizeof(WRITER_INDENT_SPACES) - 1
+            ? remaining
+            : sizeof(WRITER_INDENT_SPACES) - 1;
+        writer_append(writer, WRITER_INDENT_SPACES, chunk);
+        remaining -= chunk;
     }
 }
 
@@ -183,15 +503,21 @@ static void writer_line(CodeWriter *writer, const char *fmt, ...) {
     writer_write_indent(writer);
     va_list args;
     va_start(args, fmt);
-    vfprintf(writer->file, fmt, args);
+    writer_vprintf(writer, fmt, args);
     va_end(args);
-    fputc('\n', writer->file);
+    writer_putc(writer, '\n');
+}
+
+static void writer_put_line(CodeWriter *writer, const char *text) {
+    writer_write_indent(writer);
+    writer_puts(writer, text);
+    writer_putc(writer, '\n');
 }
 
 static void writer_printf(CodeWriter *writer, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    vfprintf(writer->file, fmt, args);
+    writer_vprintf(writer, fmt, args);
     va_end(args);
 }
 
@@ -200,7 +526,7 @@ static void writer_begin_line(CodeWriter *writer) {
 }
 
 static void writer_end_line(CodeWriter *writer) {
-    fputc('\n', writer->file);
+    writer_putc(writer, '\n');
 }
 
 static void writer_push(CodeWriter *writer) {
@@ -214,68 +540,104 @@ static void writer_pop(CodeWriter *writer) {
 }
 
 static void writer_blank_line(CodeWriter *writer) {
-    fputc('\n', writer->file);
+    writer_putc(writer, '\n');
 }
 
-static char *cg_strdup(const char *text) {
-    if (!text) {
-        return NULL;
-    }
-    size_t len = strlen(text);
-    char *copy = malloc(len + 1);
-    if (!copy) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
-    memcpy(copy, text, len + 1);
-    return copy;
+static void writer_insert(CodeWriter *writer, size_t offset, const CodeWriter *text) {
+    writer_reserve(writer, text->length);
+    memmove(writer->data + offset + text->length, writer->data + offset, writer->length - offset);
+    memcpy(writer->data + offset, text->data, text->length);
+    writer->length += text->length;
 }
 
-static void cg_context_init(CodegenContext *ctx,
-                            FILE *out,
-                            const ASTProgram *program) {
-    ctx->writer.file = out;
-    ctx->writer.indent = 0;
+static void cg_context_init(CodegenContext *ctx, const ASTProgram *program) {
+    writer_init(&ctx->writer);
     ctx->program = program;
     ctx->structs = NULL;
     ctx->struct_count = 0;
     ctx->struct_capacity = 0;
+    ast_symbol_map_init(&ctx->struct_index);
     ctx->functions = NULL;
     ctx->function_count = 0;
     ctx->function_capacity = 0;
-    ctx->scopes = NULL;
-    ctx->scope_count = 0;
-    ctx->scope_capacity = 0;
+    ast_symbol_map_init(&ctx->function_index);
+    ctx->strings = NULL;
+    ctx->string_count = 0;
+    ctx->string_capacity = 0;
+    ast_symbol_map_init(&ctx->string_index);
+    ast_scope_stack_init(&ctx->scopes, sizeof(CGVarBinding));
+    ctx->temps = NULL;
+    ctx->temp_count = 0;
+    ctx->temp_capacity = 0;
+    ctx->next_temp_id = 0;
     ctx->current_function = NULL;
+    ctx->task = NULL;
+    ctx->task_defs = (CodeWriter){0};
+    ctx->task_defs_offset = 0;
+    ctx->next_task_id = 0;
+    ctx->sharded = false;
+    ctx->shard_function = NULL;
+    ctx->shard_entry = false;
     ctx->had_error = false;
 }
 
 static void cg_context_destroy(CodegenContext *ctx) {
     for (size_t i = 0; i < ctx->struct_count; i++) {
-        free(ctx->structs[i].name);
+        free(ctx->structs[i].c_type);
         free(ctx->structs[i].assign_helper);
+        free(ctx->structs[i].move_helper);
     }
     free(ctx->structs);
+    ast_symbol_map_destroy(&ctx->struct_index);
 
     for (size_t i = 0; i < ctx->function_count; i++) {
-        free(ctx->functions[i].name);
         free(ctx->functions[i].c_name);
     }
     free(ctx->functions);
-
-    for (size_t i = 0; i < ctx->scope_count; i++) {
-        free(ctx->scopes[i].items);
-    }
-    free(ctx->scopes);
+    ast_symbol_map_destroy(&ctx->function_index);
+    free(ctx->strings);
+    ast_symbol_map_destroy(&ctx->string_index);
+    ast_scope_stack_destroy(&ctx->scopes);
+    free(ctx->temps);
+    writer_destroy(&ctx->task_defs);
+    writer_destroy(&ctx->writer);
 }
 
+/*
+ * Each module is its own translation unit. `pub` structs of imported modules
+ * are redefined here (they are only types), and their `pub` functions get
+ * extern prototypes so calls resolve at link time.
+ */
 static void cg_collect_metadata(CodegenContext *ctx) {
-    for (size_t i = 0; i < ctx->program->declarations.count; i++) {
-        ASTNode *node = ctx->program->declarations.items[i];
+    const ASTProgram *program = ctx->program;
+    for (size_t i = 0; i < program->declarations.count; i++) {
+        ASTNode *node = program->declarations.items[i];
         if (node->kind == AST_NODE_STRUCT) {
             cg_register_struct(ctx, (const ASTStructDecl *)node);
         } else if (node->kind == AST_NODE_FUNCTION) {
-            cg_register_function(ctx, (const ASTFunctionDecl *)node);
+            const ASTFunctionDecl *fn = (const ASTFunctionDecl *)node;
+            cg_register_function(ctx, fn, program->module_name, false);
+            if (!ctx->sharded || fn == ctx->shard_function) {
+                cg_collect_strings_in_block(ctx, fn->body);
+            }
+        }
+    }
+
+    for (size_t d = 0; d < program->dependencies.count; d++) {
+        const ASTProgram *dependency = program->dependencies.items[d];
+        for (size_t i = 0; i < dependency->declarations.count; i++) {
+            ASTNode *node = dependency->declarations.items[i];
+            if (node->kind == AST_NODE_STRUCT) {
+                const ASTStructDecl *decl = (const ASTStructDecl *)node;
+                if (decl->is_public && !cg_find_struct(ctx, decl->name)) {
+                    cg_register_struct(ctx, decl);
+                }
+            } else if (node->kind == AST_NODE_FUNCTION) {
+                const ASTFunctionDecl *decl = (const ASTFunctionDecl *)node;
+                if (decl->is_public && !cg_find_function(ctx, decl->name)) {
+                    cg_register_function(ctx, decl, dependency->module_name, true);
+                }
+            }
         }
     }
 }
@@ -293,17 +655,28 @@ static void cg_register_struct(CodegenContext *ctx, const ASTStructDecl *decl) {
     }
     CGStructInfo *info = &ctx->structs[ctx->struct_count++];
     info->decl = decl;
-    info->name = cg_strdup(decl->name);
-    size_t helper_len = strlen(decl->name) + strlen("lz_assign_struct_") + 1;
+    info->name = decl->name;
+    /* Struct values live in frozen boxes, so the C type is a pointer to one. */
+    size_t c_type_len = strlen(decl->name) + strlen(" *") + 1;
+    size_t helper_len = strlen(decl->name) + strlen("lz_assign_struct__move") + 1;
+    info->c_type = malloc(c_type_len);
     info->assign_helper = malloc(helper_len);
-    if (!info->assign_helper) {
+    info->move_helper = malloc(helper_len);
+    if (!info->c_type || !info->assign_helper || !info->move_helper) {
         fprintf(stderr, "Out of memory\n");
         exit(EXIT_FAILURE);
     }
+    snprintf(info->c_type, c_type_len, "%s *", decl->name);
     snprintf(info->assign_helper, helper_len, "lz_assign_struct_%s", decl->name);
+    snprintf(info->move_helper, helper_len, "lz_assign_struct_%s_move", decl->name);
+    ast_symbol_map_set(&ctx->struct_index, info->name, ctx->struct_count);
 }
 
-static void cg_register_function(CodegenContext *ctx, const ASTFunctionDecl *decl) {
+/* lz_fn_<name> in the entry module, lz_fn_<a>_<b>__<name> in module a.b. */
+static void cg_register_function(CodegenContext *ctx,
+                                 const ASTFunctionDecl *decl,
+                                 const char *module_name,
+                                 bool imported) {
     if (ctx->function_count == ctx->function_capacity) {
         size_t new_capacity = ctx->function_capacity ? ctx->function_capacity * 2 : 4;
         CGFunctionInfo *new_items = realloc(ctx->functions, new_capacity * sizeof(CGFunctionInfo));
@@ -316,246 +689,686 @@ static void cg_register_function(CodegenContext *ctx, const ASTFunctionDecl *dec
     }
     CGFunctionInfo *info = &ctx->functions[ctx->function_count++];
     info->decl = decl;
-    info->name = cg_strdup(decl->name);
+    info->name = decl->name;
+    info->imported = imported;
     size_t prefix_len = strlen("lz_fn_");
-    size_t c_name_len = prefix_len + strlen(decl->name) + 1;
+    size_t module_len = module_name ? strlen(module_name) + 2 : 0;
+    size_t c_name_len = prefix_len + module_len + strlen(decl->name) + 1;
     info->c_name = malloc(c_name_len);
     if (!info->c_name) {
         fprintf(stderr, "Out of memory\n");
         exit(EXIT_FAILURE);
     }
-    snprintf(info->c_name, c_name_len, "lz_fn_%s", decl->name);
+    if (module_name) {
+        snprintf(info->c_name, c_name_len, "lz_fn_%s__%s", module_name, decl->name);
+        for (char *p = info->c_name + prefix_len; p < info->c_name + prefix_len + module_len; p++) {
+            if (*p == '.') *p = '_';
+        }
+    } else {
+        snprintf(info->c_name, c_name_len, "lz_fn_%s", decl->name);
+    }
+    ast_symbol_map_set(&ctx->function_index, info->name, ctx->function_count);
 }
 
 static const CGFunctionInfo *cg_find_function(const CodegenContext *ctx, const char *name) {
-    if (!name) return NULL;
-    for (size_t i = 0; i < ctx->function_count; i++) {
-        if (strcmp(ctx->functions[i].name, name) == 0) {
-            return &ctx->functions[i];
-        }
-    }
-    return NULL;
+    size_t entry = ast_symbol_map_get(&ctx->function_index, name);
+    return entry ? &ctx->functions[entry - 1] : NULL;
 }
 
 static const CGStructInfo *cg_find_struct(const CodegenContext *ctx, const char *name) {
-    if (!name) return NULL;
-    for (size_t i = 0; i < ctx->struct_count; i++) {
-        if (strcmp(ctx->structs[i].name, name) == 0) {
-            return &ctx->structs[i];
-        }
-    }
-    return NULL;
+    size_t entry = ast_symbol_map_get(&ctx->struct_index, name);
+    return entry ? &ctx->structs[entry - 1] : NULL;
 }
 
-static void cg_scope_push(CodegenContext *ctx) {
-    if (ctx->scope_count == ctx->scope_capacity) {
-        size_t new_capacity = ctx->scope_capacity ? ctx->scope_capacity * 2 : 4;
-        CGScope *new_scopes = realloc(ctx->scopes, new_capacity * sizeof(CGScope));
-        if (!new_scopes) {
+/*
+ * String literals are hoisted into file-scope constants, one per distinct
+ * spelling, so evaluating a literal never allocates. The returned index names
+ * the constant (lz_str_<index>). Literal text is a slice of the source;
+ * interning it lets the dedupe probe by pointer.
+ */
+static size_t cg_intern_string(CodegenContext *ctx, const char *text, size_t length) {
+    text = ast_intern(text, length);
+    size_t entry = ast_symbol_map_get(&ctx->string_index, text);
+    if (entry) {
+        return entry - 1;
+    }
+    if (ctx->string_count == ctx->string_capacity) {
+        size_t new_capacity = ctx->string_capacity ? ctx->string_capacity * 2 : 8;
+        CGStringLiteral *new_items = realloc(ctx->strings, new_capacity * sizeof(CGStringLiteral));
+        if (!new_items) {
             fprintf(stderr, "Out of memory\n");
             exit(EXIT_FAILURE);
         }
-        ctx->scopes = new_scopes;
-        ctx->scope_capacity = new_capacity;
+        ctx->strings = new_items;
+        ctx->string_capacity = new_capacity;
     }
-    CGScope *scope = &ctx->scopes[ctx->scope_count++];
-    scope->items = NULL;
-    scope->count = 0;
-    scope->capacity = 0;
+    ctx->strings[ctx->string_count] = (CGStringLiteral){
+        .text = text,
+        .length = length,
+    };
+    ast_symbol_map_set(&ctx->string_index, text, ctx->string_count + 1);
+    return ctx->string_count++;
 }
 
-static void cg_scope_pop(CodegenContext *ctx) {
-    if (ctx->scope_count == 0) {
-        return;
+static void cg_collect_strings_in_block(CodegenContext *ctx, const ASTBlock *block) {
+    if (!block) return;
+    for (size_t i = 0; i < block->statements.count; i++) {
+        cg_collect_strings_in_node(ctx, block->statements.items[i]);
     }
-    CGScope *scope = &ctx->scopes[ctx->scope_count - 1];
-    free(scope->items);
-    scope->items = NULL;
-    scope->count = 0;
-    scope->capacity = 0;
-    ctx->scope_count--;
-}
-
-static void cg_scope_add(CodegenContext *ctx,
-                         const char *name,
-                         const char *type_name,
-                         bool is_mutable) {
-    if (ctx->scope_count == 0) {
-        cg_scope_push(ctx);
-    }
-    CGScope *scope = &ctx->scopes[ctx->scope_count - 1];
-    if (scope->count == scope->capacity) {
-        size_t new_capacity = scope->capacity ? scope->capacity * 2 : 4;
-        CGVarBinding *new_items = realloc(scope->items, new_capacity * sizeof(CGVarBinding));
-        if (!new_items) {
-            fprintf(stderr, "Out of memory\n");
-            exit(EXIT_FAILURE);
+}
+
+static void cg_collect_strings_in_node(CodegenContext *ctx, const ASTNode *node) {
+    if (!node) return;
+    switch (node->kind) {
+        case AST_NODE_VAR_DECL:
+            cg_collect_strings_in_node(ctx, ((const ASTVarDecl *)node)->initializer);
+            break;
+        case AST_NODE_ASSIGN:
+            cg_collect_strings_in_node(ctx, ((const ASTAssignStmt *)node)->value);
+            break;
+        case AST_NODE_IF: {
+            const ASTIfStmt *stmt = (const ASTIfStmt *)node;
+            cg_collect_strings_in_node(ctx, stmt->condition);
+            cg_collect_strings_in_block(ctx, stmt->then_block);
+            cg_collect_strings_in_block(ctx, stmt->else_block);
+            break;
+        }
+        case AST_NODE_FOR: {
+            const ASTForStmt *stmt = (const ASTForStmt *)node;
+            cg_collect_strings_in_node(ctx, stmt->iterable);
+            cg_collect_strings_in_block(ctx, stmt->body);
+            break;
+        }
+        case AST_NODE_RETURN:
+            cg_collect_strings_in_node(ctx, ((const ASTReturnStmt *)node)->value);
+            break;
+        case AST_NODE_BLOCK:
+            cg_collect_strings_in_block(ctx, (const ASTBlock *)node);
+            break;
+        case AST_NODE_EXPR_STMT:
+            cg_collect_strings_in_node(ctx, ((const ASTExprStmt *)node)->expr);
+            break;
+        case AST_NODE_EXPR_LITERAL: {
+            const ASTLiteralExpr *literal = (const ASTLiteralExpr *)node;
+            if (literal->literal_kind == AST_LITERAL_STRING) {
+                cg_intern_string(ctx, literal->text ? literal->text : "", literal->text_length);
+            }
+            break;
+        }
+        case AST_NODE_EXPR_CALL: {
+            const ASTCallExpr *call = (const ASTCallExpr *)node;
+            cg_collect_strings_in_node(ctx, call->callee);
+            for (size_t i = 0; i < call->arguments.count; i++) {
+                cg_collect_strings_in_node(ctx, call->arguments.items[i]);
+            }
+            break;
+        }
+        case AST_NODE_EXPR_BINARY: {
+            const ASTBinaryExpr *binary = (const ASTBinaryExpr *)node;
+            cg_collect_strings_in_node(ctx, binary->left);
+            cg_collect_strings_in_node(ctx, binary->right);
+            break;
         }
-        scope->items = new_items;
-        scope->capacity = new_capacity;
+        case AST_NODE_EXPR_TASK:
+            cg_collect_strings_in_block(ctx, ((const ASTTaskExpr *)node)->body);
+            break;
+        default:
+            break;
     }
-    scope->items[scope->count++] = (CGVarBinding){
+}
+
+static void cg_scope_push(CodegenContext *ctx) {
+    ast_scope_stack_push(&ctx->scopes);
+}
+
+static void cg_scope_pop(CodegenContext *ctx) {
+    ast_scope_stack_pop(&ctx->scopes);
+}
+
+static CGVarBinding *cg_scope_add(CodegenContext *ctx,
+                                  const char *name,
+                                  const char *type_name,
+                                  bool is_mutable,
+                                  bool owns_ref) {
+    CGVarBinding *binding = ast_scope_stack_add(&ctx->scopes, name);
+    *binding = (CGVarBinding){
         .name = name,
+        .c_name = name,
         .type_name = type_name,
         .is_mutable = is_mutable,
+        .owns_ref = owns_ref,
+        .moved = false,
     };
+    return binding;
 }
 
 static const CGVarBinding *cg_scope_lookup(const CodegenContext *ctx, const char *name) {
-    if (!name) {
-        return NULL;
-    }
-    for (size_t s = ctx->scope_count; s > 0; s--) {
-        CGScope *scope = &ctx->scopes[s - 1];
-        for (size_t i = 0; i < scope->count; i++) {
-            if (strcmp(scope->items[i].name, name) == 0) {
-                return &scope->items[i];
-            }
-        }
-    }
-    return NULL;
+    return ast_scope_stack_lookup(&ctx->scopes, name);
 }
 
-static bool cg_emit_program(CodegenContext *ctx) {
-    cg_collect_metadata(ctx);
-    cg_emit_file_header(ctx);
-    cg_emit_includes(ctx);
-    writer_blank_line(&ctx->writer);
-    cg_emit_struct_forward_decls(ctx);
-    writer_blank_line(&ctx->writer);
-    cg_emit_structs(ctx);
-    writer_blank_line(&ctx->writer);
-    cg_emit_struct_assign_helpers(ctx);
-    writer_blank_line(&ctx->writer);
-    cg_emit_function_prototypes(ctx);
-    writer_blank_line(&ctx->writer);
-    cg_emit_function_definitions(ctx);
-    writer_blank_line(&ctx->writer);
-    cg_emit_entrypoint(ctx);
-    return !ctx->had_error;
+/*
+ * ARC lowering
+ * ------------
+ * Locals of refcounted type own one reference and are released when their
+ * scope closes; parameters are borrowed. Calls returning a refcounted type
+ * yield an owned (+1) value: when that value feeds a declaration, assignment,
+ * return or tail slot the reference is moved in (no retain/release pair), and
+ * anywhere else it is hoisted into a __lz_tmp temporary that is released once
+ * the statement completes. Strings, futures, channels and structs (frozen
+ * boxes) are the refcounted types; a `task` expression yields an owned
+ * future, `chan(n)` an owned channel, `Name(...)` an owned struct and `recv`
+ * an owned element.
+ */
+static bool cg_type_is_refcounted(const CodegenContext *ctx, const char *type_name) {
+    return type_name && (type_name == ast_symbols()->string_type ||
+                         cg_type_is_future(type_name) ||
+                         cg_type_is_chan(type_name) ||
+                         cg_type_is_struct(ctx, type_name));
 }
 
-static void cg_emit_file_header(CodegenContext *ctx) {
-    writer_line(&ctx->writer, "/* Auto-generated C output from lazylang */");
+static bool cg_type_is_future(const char *type_name) {
+    if (!type_name) return false;
+    return strncmp(type_name, "future[", strlen("future[")) == 0;
 }
 
-static void cg_emit_includes(CodegenContext *ctx) {
-    writer_line(&ctx->writer, "#include <stdint.h>");
-    writer_line(&ctx->writer, "#include <stdbool.h>");
-    writer_line(&ctx->writer, "#include <stddef.h>");
-    writer_line(&ctx->writer, "#include <stdio.h>");
-    writer_line(&ctx->writer, "#include <stdlib.h>");
-    writer_line(&ctx->writer, "#include <string.h>");
-    writer_line(&ctx->writer, "#if defined(__GNUC__) || defined(__clang__)");
-    writer_line(&ctx->writer, "#define LZ_UNUSED __attribute__((unused))");
-    writer_line(&ctx->writer, "#else");
-    writer_line(&ctx->writer, "#define LZ_UNUSED");
-    writer_line(&ctx->writer, "#endif");
-    writer_line(&ctx->writer, "#define LZ_RUNTIME_DEFINE_STRUCTS");
-    writer_line(&ctx->writer, "#include \"src/runtime/runtime.h\"");
+/* Interned T of "future[T]"; sema has already rejected any other spelling. */
+static const char *cg_future_result_type(const char *type_name) {
+    size_t prefix = strlen("future[");
+    return ast_intern(type_name + prefix, strlen(type_name) - prefix - 1);
 }
 
+static bool cg_type_is_chan(const char *type_name) {
+    if (!type_name) return false;
+    return strncmp(type_name, "chan[", strlen("chan[")) == 0;
+}
 
-static void cg_emit_struct_forward_decls(CodegenContext *ctx) {
-    for (size_t i = 0; i < ctx->struct_count; i++) {
-        writer_line(&ctx->writer, "typedef struct %s %s;", ctx->structs[i].name, ctx->structs[i].name);
-    }
+/* Interned T of "chan[T]". */
+static const char *cg_chan_element_type(const char *type_name) {
+    size_t prefix = strlen("chan[");
+    return ast_intern(type_name + prefix, strlen(type_name) - prefix - 1);
 }
 
-static void cg_emit_structs(CodegenContext *ctx) {
-    for (size_t i = 0; i < ctx->struct_count; i++) {
-        const ASTStructDecl *decl = ctx->structs[i].decl;
-        writer_line(&ctx->writer, "struct %s {", decl->name);
-        writer_push(&ctx->writer);
-        for (size_t f = 0; f < decl->fields.count; f++) {
-            ASTStructField *field = decl->fields.items[f];
-            const char *c_type = cg_c_type_for(ctx, field->type_name);
-            writer_line(&ctx->writer, "%s %s;", c_type, field->name);
-        }
-        writer_pop(&ctx->writer);
-        writer_line(&ctx->writer, "};");
-        writer_blank_line(&ctx->writer);
-    }
+static const char *cg_retain_fn_for(const CodegenContext *ctx, const char *type_name) {
+    if (cg_type_is_chan(type_name)) return "lz_chan_retain";
+    if (cg_type_is_struct(ctx, type_name)) return "lz_frozen_retain";
+    return cg_type_is_future(type_name) ? "lz_future_retain" : "lz_string_retain";
 }
 
-static void cg_emit_struct_assign_helpers(CodegenContext *ctx) {
-    for (size_t i = 0; i < ctx->struct_count; i++) {
-        const CGStructInfo *info = &ctx->structs[i];
-        writer_line(&ctx->writer,
-                    "static void LZ_UNUSED %s(%s *dst, %s value) {",
-                    info->assign_helper,
-                    info->name,
-                    info->name);
-        writer_push(&ctx->writer);
-        writer_line(&ctx->writer, "*dst = value;");
-        writer_pop(&ctx->writer);
-        writer_line(&ctx->writer, "}");
-        writer_blank_line(&ctx->writer);
-    }
+static const char *cg_release_fn_for(const CodegenContext *ctx, const char *type_name) {
+    if (cg_type_is_chan(type_name)) return "lz_chan_release";
+    if (cg_type_is_struct(ctx, type_name)) return "lz_frozen_release";
+    return cg_type_is_future(type_name) ? "lz_future_release" : "lz_string_release";
 }
 
-static void cg_emit_function_signature(CodegenContext *ctx,
-                                       const CGFunctionInfo *info,
-                                       bool prototype) {
-    const ASTFunctionDecl *fn = info->decl;
-    const char *ret_type = cg_c_return_type_for(ctx, fn->return_type);
-    writer_begin_line(&ctx->writer);
-    writer_printf(&ctx->writer, "static %s %s(", ret_type, info->c_name);
-    if (fn->params.count == 0) {
-        writer_printf(&ctx->writer, "void");
-    } else {
-        for (size_t i = 0; i < fn->params.count; i++) {
-            ASTFunctionParam *param = fn->params.items[i];
-            const char *param_type = cg_c_type_for(ctx, param->type_name);
-            writer_printf(&ctx->writer,
-                          "%s %s",
-                          param_type,
-                          param->name);
-            if (i + 1 < fn->params.count) {
-                writer_printf(&ctx->writer, ", ");
-            }
-        }
+/* Switches a value to atomic counting before another task sees it; NULL when nothing needs it. */
+static const char *cg_share_fn_for(const CodegenContext *ctx, const char *type_name) {
+    if (type_name && type_name == ast_symbols()->string_type) return "lz_string_share";
+    return cg_type_is_struct(ctx, type_name) ? "lz_frozen_share" : NULL;
+}
+
+/* Checked type of the expressions ARC and await lowering need to know about; NULL otherwise. */
+static const char *cg_expr_type_name(const CodegenContext *ctx, const ASTNode *node) {
+    if (!node) {
+        return NULL;
     }
-    writer_printf(&ctx->writer, ")");
-    if (prototype) {
-        writer_printf(&ctx->writer, ";");
+    if (node->kind == AST_NODE_EXPR_IDENTIFIER) {
+        const CGVarBinding *binding = cg_scope_lookup(ctx, ((const ASTIdentifierExpr *)node)->name);
+        return binding ? binding->type_name : NULL;
     }
-    writer_end_line(&ctx->writer);
+    if (node->kind != AST_NODE_EXPR_CALL) {
+        return NULL;
+    }
+    const ASTCallExpr *call = (const ASTCallExpr *)node;
+    if (call->callee->kind != AST_NODE_EXPR_IDENTIFIER) {
+        return NULL;
+    }
+    const char *callee = ((const ASTIdentifierExpr *)call->callee)->name;
+    if (callee == ast_symbols()->await && call->arguments.count == 1) {
+        const char *future_type = cg_expr_type_name(ctx, call->arguments.items[0]);
+        return cg_type_is_future(future_type) ? cg_future_result_type(future_type) : NULL;
+    }
+    if (callee == ast_symbols()->recv && call->arguments.count == 1) {
+        const char *chan_type = cg_expr_type_name(ctx, call->arguments.items[0]);
+        return cg_type_is_chan(chan_type) ? cg_chan_element_type(chan_type) : NULL;
+    }
+    const CGFunctionInfo *fn = cg_find_function(ctx, callee);
+    if (!fn) {
+        const CGStructInfo *info = cg_find_struct(ctx, callee);
+        return info ? info->name : NULL;
+    }
+    return fn->decl->return_type;
 }
 
-static void cg_emit_function_prototypes(CodegenContext *ctx) {
-    for (size_t i = 0; i < ctx->function_count; i++) {
-        cg_emit_function_signature(ctx, &ctx->functions[i], true);
+static bool cg_expr_is_owned(const CodegenContext *ctx, const ASTNode *node) {
+    if (node && node->kind == AST_NODE_EXPR_TASK) {
+        return true;
+    }
+    /* A value already hoisted into a temporary is borrowed from it. */
+    if (!node || node->kind != AST_NODE_EXPR_CALL || cg_find_temp(ctx, node)) {
+        return false;
+    }
+    const ASTCallExpr *call = (const ASTCallExpr *)node;
+    if (call->callee->kind != AST_NODE_EXPR_IDENTIFIER) {
+        return false;
+    }
+    const ASTIdentifierExpr *ident = (const ASTIdentifierExpr *)call->callee;
+    if (ident->name == ast_symbols()->chan) {
+        return true;
     }
+    if (ident->name == ast_symbols()->recv) {
+        return cg_type_is_refcounted(ctx, cg_expr_type_name(ctx, node));
+    }
+    const CGFunctionInfo *fn = cg_find_function(ctx, ident->name);
+    if (!fn) {
+        return cg_find_struct(ctx, ident->name) != NULL;
+    }
+    return cg_type_is_refcounted(ctx, fn->decl->return_type);
 }
 
-static void cg_emit_function_body(CodegenContext *ctx, const ASTFunctionDecl *fn) {
-    if (!fn->body) {
-        writer_line(&ctx->writer, "{");
-        writer_line(&ctx->writer, "}");
+/* Spilled temporaries are fields of the task frame rather than C locals. */
+static const char *cg_temp_prefix(const CGOwnedTemp *temp) {
+    return temp->in_frame ? "__lz_frame->" : "";
+}
+
+static void cg_hoist_owned_temps(CodegenContext *ctx, const ASTNode *node, bool consumed) {
+    /* Await lowering hoists an awaited call (and its arguments) ahead of the statement. */
+    if (!node || cg_find_temp(ctx, node)) return;
+    if (node->kind == AST_NODE_EXPR_BINARY) {
+        const ASTBinaryExpr *binary = (const ASTBinaryExpr *)node;
+        cg_hoist_owned_temps(ctx, binary->left, false);
+        cg_hoist_owned_temps(ctx, binary->right, false);
         return;
     }
-
-    writer_line(&ctx->writer, "{");
-    writer_push(&ctx->writer);
-    cg_scope_push(ctx);
-    for (size_t i = 0; i < fn->params.count; i++) {
-        ASTFunctionParam *param = fn->params.items[i];
-        cg_scope_add(ctx, param->name, param->type_name, false);
+    if (node->kind != AST_NODE_EXPR_CALL) {
+        return;
     }
-
-    const char *ret_type = cg_c_return_type_for(ctx, fn->return_type);
-    bool returns_value = strcmp(ret_type, "void") != 0;
+    const ASTCallExpr *call = (const ASTCallExpr *)node;
+    for (size_t i = 0; i < call->arguments.count; i++) {
+        cg_hoist_owned_temps(ctx, call->arguments.items[i], false);
+    }
+    if (consumed || !cg_expr_is_owned(ctx, node)) {
+        return;
+    }
+
+    size_t id = ctx->next_temp_id++;
+    const char *type_name = cg_expr_type_name(ctx, node);
+    bool in_frame = ctx->task && ctx->task->spill_temps;
+    writer_begin_line(&ctx->writer);
+    if (in_frame) {
+        char field[32];
+        snprintf(field, sizeof(field), "__lz_tmp%zu", id);
+        cg_task_add_field(ctx, cg_c_type_for(ctx, type_name), field);
+        writer_printf(&ctx->writer, "__lz_frame->%s = ", field);
+    } else {
+        writer_printf(&ctx->writer, "%s __lz_tmp%zu = ", cg_c_type_for(ctx, type_name), id);
+    }
+    cg_emit_expression(ctx, (ASTNode *)node);
+    writer_puts(&ctx->writer, ";");
+    writer_end_line(&ctx->writer);
+
+    if (ctx->temp_count == ctx->temp_capacity) {
+        size_t new_capacity = ctx->temp_capacity ? ctx->temp_capacity * 2 : 4;
+        CGOwnedTemp *new_items = realloc(ctx->temps, new_capacity * sizeof(CGOwnedTemp));
+        if (!new_items) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        ctx->temps = new_items;
+        ctx->temp_capacity = new_capacity;
+    }
+    ctx->temps[ctx->temp_count++] = (CGOwnedTemp){
+        .node = node,
+        .type_name = type_name,
+        .id = id,
+        .in_frame = in_frame,
+    };
+}
+
+static void cg_hoist_statement_temps(CodegenContext *ctx, const ASTNode *node) {
+    switch (node->kind) {
+        case AST_NODE_VAR_DECL:
+            cg_hoist_owned_temps(ctx, ((const ASTVarDecl *)node)->initializer, true);
+            break;
+        case AST_NODE_ASSIGN:
+            cg_hoist_owned_temps(ctx, ((const ASTAssignStmt *)node)->value, true);
+            break;
+        case AST_NODE_IF:
+            cg_hoist_owned_temps(ctx, ((const ASTIfStmt *)node)->condition, false);
+            break;
+        case AST_NODE_RETURN:
+            cg_hoist_owned_temps(ctx, ((const ASTReturnStmt *)node)->value, true);
+            break;
+        case AST_NODE_EXPR_STMT:
+            cg_hoist_owned_temps(ctx, ((const ASTExprStmt *)node)->expr, true);
+            break;
+        default:
+            break;
+    }
+}
+
+static const CGOwnedTemp *cg_find_temp(const CodegenContext *ctx, const ASTNode *node) {
+    for (size_t i = ctx->temp_count; i > 0; i--) {
+        if (ctx->temps[i - 1].node == node) {
+            return &ctx->temps[i - 1];
+        }
+    }
+    return NULL;
+}
+
+static void cg_release_temps(CodegenContext *ctx, size_t mark) {
+    while (ctx->temp_count > mark) {
+        const CGOwnedTemp *temp = &ctx->temps[--ctx->temp_count];
+        if (!cg_type_is_refcounted(ctx, temp->type_name)) {
+            continue;
+        }
+        writer_line(&ctx->writer,
+                    "%s(%s__lz_tmp%zu);",
+                    cg_release_fn_for(ctx, temp->type_name),
+                    cg_temp_prefix(temp),
+                    temp->id);
+    }
+}
+
+/* Bindings are stored flat across scopes; `from` selects a suffix of them. */
+static bool cg_bindings_need_release(const CodegenContext *ctx,
+                                     size_t from,
+                                     const CGVarBinding *skip) {
+    for (size_t i = from; i < ctx->scopes.count; i++) {
+        const CGVarBinding *binding = ast_scope_stack_at(&ctx->scopes, i);
+        if (binding->owns_ref && !binding->moved && binding != skip) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void cg_emit_binding_releases(CodegenContext *ctx,
+                                     size_t from,
+                                     const CGVarBinding *skip) {
+    for (size_t i = ctx->scopes.count; i > from; i--) {
+        const CGVarBinding *binding = ast_scope_stack_at(&ctx->scopes, i - 1);
+        if (binding->owns_ref && !binding->moved && binding != skip) {
+            writer_line(&ctx->writer, "%s(%s);", cg_release_fn_for(ctx, binding->type_name), binding->c_name);
+        }
+    }
+}
+
+static void cg_emit_scope_releases(CodegenContext *ctx) {
+    if (ctx->scopes.depth == 0) {
+        return;
+    }
+    cg_emit_binding_releases(ctx,
+                             ast_scope_stack_start(&ctx->scopes, ctx->scopes.depth - 1),
+                             NULL);
+}
+
+static bool cg_has_pending_releases(const CodegenContext *ctx, const CGVarBinding *skip) {
+    for (size_t i = 0; i < ctx->temp_count; i++) {
+        if (cg_type_is_refcounted(ctx, ctx->temps[i].type_name)) {
+            return true;
+        }
+    }
+    return cg_bindings_need_release(ctx, 0, skip);
+}
+
+/* Releases everything an early return leaves behind, innermost first. */
+static void cg_emit_pending_releases(CodegenContext *ctx, const CGVarBinding *skip) {
+    for (size_t i = ctx->temp_count; i > 0; i--) {
+        const CGOwnedTemp *temp = &ctx->temps[i - 1];
+        if (!cg_type_is_refcounted(ctx, temp->type_name)) {
+            continue;
+        }
+        writer_line(&ctx->writer,
+                    "%s(%s__lz_tmp%zu);",
+                    cg_release_fn_for(ctx, temp->type_name),
+                    cg_temp_prefix(temp),
+                    temp->id);
+    }
+    cg_emit_binding_releases(ctx, 0, skip);
+}
+
+static bool cg_emit_program(CodegenContext *ctx) {
+    cg_collect_metadata(ctx);
+    cg_emit_file_header(ctx);
+    cg_emit_includes(ctx);
+    writer_blank_line(&ctx->writer);
+    cg_emit_string_constants(ctx);
+    writer_blank_line(&ctx->writer);
+    cg_emit_struct_forward_decls(ctx);
+    writer_blank_line(&ctx->writer);
+    cg_emit_structs(ctx);
+    writer_blank_line(&ctx->writer);
+    cg_emit_struct_helpers(ctx);
+    writer_blank_line(&ctx->writer);
+    cg_emit_function_prototypes(ctx);
+    writer_blank_line(&ctx->writer);
+    ctx->task_defs_offset = ctx->writer.length;
+    cg_emit_function_definitions(ctx);
+    if (ctx->sharded ? ctx->shard_entry : !ctx->program->module_name) {
+        writer_blank_line(&ctx->writer);
+        cg_emit_entrypoint(ctx);
+    }
+    if (ctx->task_defs.length > 0) {
+        writer_insert(&ctx->writer, ctx->task_defs_offset, &ctx->task_defs);
+    }
+    return !ctx->had_error;
+}
+
+static void cg_emit_file_header(CodegenContext *ctx) {
+    writer_put_line(&ctx->writer, "/* Auto-generated C output from lazylang */");
+}
+
+static void cg_emit_includes(CodegenContext *ctx) {
+    writer_put_line(&ctx->writer, "#include <stdint.h>");
+    writer_put_line(&ctx->writer, "#include <stdbool.h>");
+    writer_put_line(&ctx->writer, "#include <stddef.h>");
+    writer_put_line(&ctx->writer, "#include <stdio.h>");
+    writer_put_line(&ctx->writer, "#include <stdlib.h>");
+    writer_put_line(&ctx->writer, "#include <string.h>");
+    writer_put_line(&ctx->writer, "#if defined(__GNUC__) || defined(__clang__)");
+    writer_put_line(&ctx->writer, "#define LZ_UNUSED __attribute__((unused))");
+    writer_put_line(&ctx->writer, "#else");
+    writer_put_line(&ctx->writer, "#define LZ_UNUSED");
+    writer_put_line(&ctx->writer, "#endif");
+    writer_put_line(&ctx->writer, "#define LZ_RUNTIME_DEFINE_STRUCTS");
+    writer_put_line(&ctx->writer, "#include \"runtime.h\"");
+}
+
+static void cg_emit_string_constants(CodegenContext *ctx) {
+    for (size_t i = 0; i < ctx->string_count; i++) {
+        const CGStringLiteral *literal = &ctx->strings[i];
+        writer_begin_line(&ctx->writer);
+        writer_printf(&ctx->writer,
+                      "static const struct lz_string lz_str_%zu = { .length = %zu, .data = ",
+                      i,
+                      literal->length);
+        cg_write_c_string(ctx, literal->text, literal->length);
+        writer_puts(&ctx->writer, ", .flags = LZ_STRING_STATIC };");
+        writer_end_line(&ctx->writer);
+    }
+}
+
+static void cg_emit_struct_forward_decls(CodegenContext *ctx) {
+    for (size_t i = 0; i < ctx->struct_count; i++) {
+        writer_line(&ctx->writer, "typedef struct %s %s;", ctx->structs[i].name, ctx->structs[i].name);
+    }
+}
+
+static void cg_emit_structs(CodegenContext *ctx) {
+    for (size_t i = 0; i < ctx->struct_count; i++) {
+        const ASTStructDecl *decl = ctx->structs[i].decl;
+        writer_line(&ctx->writer, "struct %s {", decl->name);
+        writer_push(&ctx->writer);
+        for (size_t f = 0; f < decl->fields.count; f++) {
+            ASTStructField *field = decl->fields.items[f];
+            const char *c_type = cg_c_type_for(ctx, field->type_name);
+            writer_line(&ctx->writer, "%s %s;", c_type, field->name);
+        }
+        writer_pop(&ctx->writer);
+        writer_put_line(&ctx->writer, "};");
+        writer_blank_line(&ctx->writer);
+    }
+}
+
+/*
+ * Sema only admits frozen structs, so every struct value is built once into
+ * an lz_frozen box by lz_new_struct_<Name> and shared by pointer from then
+ * on. Structs with string fields also get share and drop hooks for the box;
+ * the assign helpers follow lz_assign_string/lz_assign_string_move.
+ */
+static void cg_emit_struct_helpers(CodegenContext *ctx) {
+    CodeWriter *out = &ctx->writer;
+    for (size_t i = 0; i < ctx->struct_count; i++) {
+        const CGStructInfo *info = &ctx->structs[i];
+        const ASTStructDecl *decl = info->decl;
+        bool has_strings = false;
+        for (size_t f = 0; f < decl->fields.count; f++) {
+            const ASTStructField *field = decl->fields.items[f];
+            has_strings = has_strings || field->type_name == ast_symbols()->string_type;
+        }
+
+        if (has_strings) {
+            const char *hooks[] = {"share", "drop"};
+            for (size_t h = 0; h < 2; h++) {
+                writer_line(out, "static void lz_%s_struct_%s(void *payload) {", hooks[h], info->name);
+                writer_push(out);
+                writer_line(out, "%s *value = payload;", info->name);
+                for (size_t f = 0; f < decl->fields.count; f++) {
+                    const ASTStructField *field = decl->fields.items[f];
+                    if (field->type_name == ast_symbols()->string_type) {
+                        writer_line(out,
+                                    "%s(value->%s);",
+                                    h == 0 ? "lz_string_share" : "lz_string_release",
+                                    field->name);
+                    }
+                }
+                writer_pop(out);
+                writer_put_line(out, "}");
+                writer_blank_line(out);
+            }
+        }
+
+        writer_begin_line(out);
+        writer_printf(out, "static %sLZ_UNUSED lz_new_struct_%s(", info->c_type, info->name);
+        if (decl->fields.count == 0) {
+            writer_puts(out, "void");
+        }
+        for (size_t f = 0; f < decl->fields.count; f++) {
+            const ASTStructField *field = decl->fields.items[f];
+            writer_printf(out, "%s%s %s", f > 0 ? ", " : "", cg_c_type_for(ctx, field->type_name), field->name);
+        }
+        writer_puts(out, ") {");
+        writer_end_line(out);
+        writer_push(out);
+        if (has_strings) {
+            writer_line(out,
+                        "%s__lz_value = lz_frozen_new(sizeof(%s), lz_share_struct_%s, lz_drop_struct_%s);",
+                        info->c_type,
+                        info->name,
+                        info->name,
+                        info->name);
+        } else {
+            writer_line(out, "%s__lz_value = lz_frozen_new(sizeof(%s), NULL, NULL);", info->c_type, info->name);
+        }
+        for (size_t f = 0; f < decl->fields.count; f++) {
+            const ASTStructField *field = decl->fields.items[f];
+            if (field->type_name == ast_symbols()->string_type) {
+                writer_line(out, "__lz_value->%s = lz_string_retain(%s);", field->name, field->name);
+            } else {
+                writer_line(out, "__lz_value->%s = %s;", field->name, field->name);
+            }
+        }
+        writer_put_line(out, "return __lz_value;");
+        writer_pop(out);
+        writer_put_line(out, "}");
+        writer_blank_line(out);
+
+        for (size_t move = 0; move < 2; move++) {
+            writer_line(out,
+                        "static void LZ_UNUSED %s(%s*dst, %svalue) {",
+                        move ? info->move_helper : info->assign_helper,
+                        info->c_type,
+                        info->c_type);
+            writer_push(out);
+            writer_line(out, "%sprevious = *dst;", info->c_type);
+            writer_put_line(out, move ? "*dst = value;" : "*dst = lz_frozen_retain(value);");
+            writer_put_line(out, "lz_frozen_release(previous);");
+            writer_pop(out);
+            writer_put_line(out, "}");
+            writer_blank_line(out);
+        }
+    }
+}
+
+static void cg_emit_function_signature(CodegenContext *ctx,
+                                       const CGFunctionInfo *info,
+                                       bool prototype) {
+    const ASTFunctionDecl *fn = info->decl;
+    const char *ret_type = cg_c_return_type_for(ctx, fn->return_type);
+    writer_begin_line(&ctx->writer);
+    /* `pub` functions keep external linkage so other modules can link to them. */
+    writer_printf(&ctx->writer,
+                  "%s%s %s(",
+                  fn->is_public || ctx->sharded ? "" : "static ",
+                  ret_type,
+                  info->c_name);
+    if (fn->params.count == 0) {
+        writer_puts(&ctx->writer, "void");
+    } else {
+        for (size_t i = 0; i < fn->params.count; i++) {
+            ASTFunctionParam *param = fn->params.items[i];
+            const char *param_type = cg_c_type_for(ctx, param->type_name);
+            writer_printf(&ctx->writer,
+                          "%s %s",
+                          param_type,
+                          param->name);
+            if (i + 1 < fn->params.count) {
+                writer_puts(&ctx->writer, ", ");
+            }
+        }
+    }
+    writer_puts(&ctx->writer, ")");
+    if (prototype) {
+        writer_puts(&ctx->writer, ";");
+    }
+    writer_end_line(&ctx->writer);
+}
+
+static void cg_emit_function_prototypes(CodegenContext *ctx) {
+    for (size_t i = 0; i < ctx->function_count; i++) {
+        cg_emit_function_signature(ctx, &ctx->functions[i], true);
+    }
+}
+
+static void cg_emit_function_body(CodegenContext *ctx, const ASTFunctionDecl *fn) {
+    if (!fn->body) {
+        writer_put_line(&ctx->writer, "{");
+        writer_put_line(&ctx->writer, "}");
+        return;
+    }
+
+    writer_put_line(&ctx->writer, "{");
+    writer_push(&ctx->writer);
+    cg_scope_push(ctx);
+    ctx->next_temp_id = 0;
+    for (size_t i = 0; i < fn->params.count; i++) {
+        ASTFunctionParam *param = fn->params.items[i];
+        cg_scope_add(ctx, param->name, param->type_name, false, false);
+    }
+
+    const char *ret_type = cg_c_return_type_for(ctx, fn->return_type);
+    bool returns_value = strcmp(ret_type, "void") != 0;
     size_t stmt_count = fn->body->statements.count;
     ASTNode *last_stmt = stmt_count > 0 ? fn->body->statements.items[stmt_count - 1] : NULL;
-    bool needs_tail_return = returns_value && (stmt_count == 0 || !last_stmt || last_stmt->kind != AST_NODE_RETURN);
+    bool ends_with_return = last_stmt && last_stmt->kind == AST_NODE_RETURN;
+    bool needs_tail_return = returns_value && !ends_with_return;
     const char *tail_var = NULL;
-    const char *tail_helper = NULL;
+    const char *tail_type = NULL;
 
     if (needs_tail_return) {
         const char *ret_storage_type = cg_c_type_for(ctx, fn->return_type);
         tail_var = "__lz_ret";
-        tail_helper = cg_assign_helper_for(ctx, fn->return_type);
+        tail_type = fn->return_type;
         writer_line(&ctx->writer, "%s %s = {0};", ret_storage_type, tail_var);
     }
 
@@ -563,22 +1376,28 @@ static void cg_emit_function_body(CodegenContext *ctx, const ASTFunctionDecl *fn
         ASTNode *stmt = fn->body->statements.items[i];
         bool is_last = (i + 1 == stmt_count);
         const char *stmt_tail_var = (needs_tail_return && is_last) ? tail_var : NULL;
-        const char *stmt_tail_helper = (needs_tail_return && is_last) ? tail_helper : NULL;
-        cg_emit_statement(ctx, stmt, stmt_tail_var, stmt_tail_helper);
+        const char *stmt_tail_type = (needs_tail_return && is_last) ? tail_type : NULL;
+        cg_emit_statement(ctx, stmt, stmt_tail_var, stmt_tail_type);
     }
 
+    if (!ends_with_return) {
+        cg_emit_scope_releases(ctx);
+    }
     if (needs_tail_return) {
         writer_line(&ctx->writer, "return %s;", tail_var);
     }
 
     cg_scope_pop(ctx);
     writer_pop(&ctx->writer);
-    writer_line(&ctx->writer, "}");
+    writer_put_line(&ctx->writer, "}");
 }
 
 static void cg_emit_function_definitions(CodegenContext *ctx) {
     for (size_t i = 0; i < ctx->function_count; i++) {
         const CGFunctionInfo *info = &ctx->functions[i];
+        if (info->imported || (ctx->sharded && info->decl != ctx->shard_function)) {
+            continue;
+        }
         cg_emit_function_signature(ctx, info, false);
         ctx->current_function = info->decl;
         cg_emit_function_body(ctx, info->decl);
@@ -588,215 +1407,1137 @@ static void cg_emit_function_definitions(CodegenContext *ctx) {
 }
 
 static void cg_emit_entrypoint(CodegenContext *ctx) {
-    const CGFunctionInfo *main_fn = cg_find_function(ctx, "main");
-    writer_line(&ctx->writer, "int main(void) {");
+    const CGFunctionInfo *main_fn = cg_find_function(ctx, ast_symbols()->main);
+    if (main_fn && main_fn->imported) {
+        main_fn = NULL;
+    }
+    writer_put_line(&ctx->writer, "int main(void) {");
     writer_push(&ctx->writer);
     if (main_fn) {
-        if (main_fn->decl->params.count == 0) {
-            writer_line(&ctx->writer, "%s();", main_fn->c_name);
-        } else {
+        if (main_fn->decl->params.count != 0) {
+            writer_put_line(&ctx->writer,
+                            "/* TODO: pass CLI arguments to main */");
+        }
+        if (cg_type_is_refcounted(ctx, main_fn->decl->return_type)) {
             writer_line(&ctx->writer,
-                        "/* TODO: pass CLI arguments to main */");
+                        "%s(%s());",
+                        cg_release_fn_for(ctx, main_fn->decl->return_type),
+                        main_fn->c_name);
+        } else {
             writer_line(&ctx->writer, "%s();", main_fn->c_name);
         }
-        writer_line(&ctx->writer, "return 0;");
-    } else {
-        writer_line(&ctx->writer,
-                    "fprintf(stderr, \"no entry point defined\\n\");");
-        writer_line(&ctx->writer, "return 1;");
+        writer_put_line(&ctx->writer, "return 0;");
+    } else {
+        writer_put_line(&ctx->writer,
+                        "fprintf(stderr, \"no entry point defined\\n\");");
+        writer_put_line(&ctx->writer, "return 1;");
+    }
+    writer_pop(&ctx->writer);
+    writer_put_line(&ctx->writer, "}");
+}
+
+
+static void cg_emit_block(CodegenContext *ctx,
+                          ASTBlock *block,
+                          const char *tail_var,
+                          const char *tail_type) {
+    writer_put_line(&ctx->writer, "{");
+    writer_push(&ctx->writer);
+    cg_scope_push(ctx);
+    bool ends_with_return = false;
+    if (block) {
+        for (size_t i = 0; i < block->statements.count; i++) {
+            bool is_last = (i + 1 == block->statements.count);
+            const char *stmt_tail_var = (tail_var && is_last) ? tail_var : NULL;
+            const char *stmt_tail_type = (tail_type && is_last) ? tail_type : NULL;
+            ASTNode *stmt = block->statements.items[i];
+            cg_emit_statement(ctx, stmt, stmt_tail_var, stmt_tail_type);
+            ends_with_return = stmt && stmt->kind == AST_NODE_RETURN;
+        }
+    }
+    if (!ends_with_return) {
+        cg_emit_scope_releases(ctx);
+    }
+    cg_scope_pop(ctx);
+    writer_pop(&ctx->writer);
+    writer_put_line(&ctx->writer, "}");
+}
+
+static void cg_emit_statement(CodegenContext *ctx,
+                              ASTNode *node,
+                              const char *tail_var,
+                              const char *tail_type) {
+    if (ctx->had_error || !node) {
+        return;
+    }
+    size_t temp_mark = ctx->temp_count;
+    bool outer_spill_temps = false;
+    if (ctx->task) {
+        outer_spill_temps = ctx->task->spill_temps;
+        ctx->task->spill_temps = cg_statement_awaits(node);
+        cg_lower_statement_awaits(ctx, node);
+    }
+    cg_hoist_statement_temps(ctx, node);
+    switch (node->kind) {
+        case AST_NODE_VAR_DECL:
+            cg_emit_var_decl(ctx, (ASTVarDecl *)node);
+            break;
+        case AST_NODE_ASSIGN:
+            cg_emit_assignment(ctx, (ASTAssignStmt *)node);
+            break;
+        case AST_NODE_IF:
+            cg_emit_if(ctx, (ASTIfStmt *)node, tail_var, tail_type);
+            break;
+        case AST_NODE_RETURN:
+            cg_emit_return(ctx, (ASTReturnStmt *)node);
+            /* The return path already released every pending temporary. */
+            ctx->temp_count = temp_mark;
+            if (ctx->task) {
+                ctx->task->spill_temps = outer_spill_temps;
+            }
+            return;
+        case AST_NODE_EXPR_STMT:
+            cg_emit_expr_stmt(ctx, (ASTExprStmt *)node, tail_var, tail_type);
+            break;
+        case AST_NODE_FOR:
+            cg_fail(ctx, &node->token, "for-in loops are not supported yet");
+            break;
+        case AST_NODE_BLOCK:
+            /* Left behind by constant folding in place of an if. */
+            cg_emit_block(ctx, (ASTBlock *)node, tail_var, tail_type);
+            break;
+        default:
+            cg_fail(ctx, &node->token, "unsupported statement kind in codegen");
+            break;
+    }
+    cg_release_temps(ctx, temp_mark);
+    if (ctx->task) {
+        ctx->task->spill_temps = outer_spill_temps;
+    }
+}
+
+static void cg_emit_var_decl(CodegenContext *ctx, ASTVarDecl *decl) {
+    const char *c_type = cg_c_type_for(ctx, decl->type_name);
+    const char *c_name = decl->name;
+    if (ctx->task && cg_task_spills(ctx->task, decl)) {
+        /* Frames start zeroed, which is all the {0} below would do. */
+        const char *field = cg_task_add_field(ctx, c_type, decl->name);
+        size_t length = strlen("__lz_frame->") + strlen(field) + 1;
+        char *spelled = malloc(length);
+        if (!spelled) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(spelled, length, "__lz_frame->%s", field);
+        c_name = ast_intern_cstr(spelled);
+        free(spelled);
+    } else {
+        writer_line(&ctx->writer, "%s %s = {0};", c_type, decl->name);
+    }
+    CGVarBinding *binding = cg_scope_add(ctx,
+                                         decl->name,
+                                         decl->type_name,
+                                         decl->is_mutable,
+                                         cg_type_is_refcounted(ctx, decl->type_name));
+    binding->c_name = c_name;
+    cg_emit_assignment_call(ctx, c_name, decl->type_name, decl->initializer);
+}
+
+static void cg_emit_assignment(CodegenContext *ctx, ASTAssignStmt *assign) {
+    const CGVarBinding *binding = cg_scope_lookup(ctx, assign->target);
+    if (!binding) {
+        cg_fail(ctx, &assign->base.token, "assignment to unknown symbol");
+        return;
+    }
+    cg_emit_assignment_call(ctx, binding->c_name, binding->type_name, assign->value);
+}
+
+static void cg_emit_if(CodegenContext *ctx,
+                       ASTIfStmt *stmt,
+                       const char *tail_var,
+                       const char *tail_type) {
+    writer_begin_line(&ctx->writer);
+    writer_puts(&ctx->writer, "if (");
+    cg_emit_expression(ctx, stmt->condition);
+    writer_puts(&ctx->writer, ") ");
+    writer_end_line(&ctx->writer);
+    cg_emit_block(ctx, stmt->then_block, tail_var, tail_type);
+    if (stmt->else_block) {
+        writer_put_line(&ctx->writer, "else");
+        cg_emit_block(ctx, stmt->else_block, tail_var, tail_type);
+    }
+}
+
+static void cg_emit_return(CodegenContext *ctx, ASTReturnStmt *stmt) {
+    const char *ret_type_name = ctx->current_function ? ctx->current_function->return_type : NULL;
+    const char *ret_type = cg_c_return_type_for(ctx, ret_type_name);
+    bool returns_ref = cg_type_is_refcounted(ctx, ret_type_name);
+
+    /*
+     * Returning an owned local hands its reference to the caller, which
+     * elides both the retain on the way out and the release at scope exit.
+     */
+    const CGVarBinding *transferred = NULL;
+    bool needs_retain = false;
+    if (returns_ref && stmt->value && !cg_expr_is_owned(ctx, stmt->value)) {
+        if (stmt->value->kind == AST_NODE_EXPR_IDENTIFIER) {
+            const CGVarBinding *binding =
+                cg_scope_lookup(ctx, ((ASTIdentifierExpr *)stmt->value)->name);
+            if (binding && binding->owns_ref && !binding->moved) {
+                transferred = binding;
+            }
+        }
+        needs_retain = transferred == NULL;
+    }
+
+    if (!cg_has_pending_releases(ctx, transferred)) {
+        writer_begin_line(&ctx->writer);
+        writer_puts(&ctx->writer, "return");
+        if (stmt->value) {
+            writer_printf(&ctx->writer, needs_retain ? " %s(" : " ", cg_retain_fn_for(ctx, ret_type_name));
+            cg_emit_expression(ctx, stmt->value);
+            if (needs_retain) {
+                writer_puts(&ctx->writer, ")");
+            }
+        }
+        writer_puts(&ctx->writer, ";");
+        writer_end_line(&ctx->writer);
+        return;
+    }
+
+    bool returns_value = strcmp(ret_type, "void") != 0;
+    writer_put_line(&ctx->writer, "{");
+    writer_push(&ctx->writer);
+    if (stmt->value) {
+        writer_begin_line(&ctx->writer);
+        if (returns_value) {
+            writer_printf(&ctx->writer, "%s __lz_rv = ", cg_c_type_for(ctx, ret_type_name));
+        }
+        if (needs_retain) {
+            writer_printf(&ctx->writer, "%s(", cg_retain_fn_for(ctx, ret_type_name));
+        }
+        cg_emit_expression(ctx, stmt->value);
+        writer_puts(&ctx->writer, needs_retain ? ");" : ";");
+        writer_end_line(&ctx->writer);
+    }
+    cg_emit_pending_releases(ctx, transferred);
+    writer_put_line(&ctx->writer, (returns_value && stmt->value) ? "return __lz_rv;" : "return;");
+    writer_pop(&ctx->writer);
+    writer_put_line(&ctx->writer, "}");
+}
+
+static void cg_emit_expr_stmt(CodegenContext *ctx,
+                              ASTExprStmt *stmt,
+                              const char *tail_var,
+                              const char *tail_type) {
+    /* send has no value; in a task body it already ran as a suspension point. */
+    if (cg_is_builtin_call(stmt->expr, ast_symbols()->send)) {
+        if (!ctx->task) {
+            writer_begin_line(&ctx->writer);
+            cg_emit_expression(ctx, stmt->expr);
+            writer_puts(&ctx->writer, ";");
+            writer_end_line(&ctx->writer);
+        }
+        return;
+    }
+    writer_begin_line(&ctx->writer);
+    if (tail_var && tail_type && stmt->expr) {
+        bool owned = cg_expr_is_owned(ctx, stmt->expr);
+        /* A local that dies with this scope can move into the return slot. */
+        if (!owned && stmt->expr->kind == AST_NODE_EXPR_IDENTIFIER) {
+            CGVarBinding *binding = ast_scope_stack_lookup_current(
+                &ctx->scopes, ((ASTIdentifierExpr *)stmt->expr)->name);
+            if (binding && binding->owns_ref && !binding->moved) {
+                binding->moved = true;
+                owned = true;
+            }
+        }
+        writer_printf(&ctx->writer, "%s(&%s, ", cg_assign_helper_for(ctx, tail_type, owned), tail_var);
+        cg_emit_expression(ctx, stmt->expr);
+        writer_puts(&ctx->writer, ");");
+    } else if (stmt->expr && cg_expr_is_owned(ctx, stmt->expr)) {
+        writer_printf(&ctx->writer, "%s(", cg_release_fn_for(ctx, cg_expr_type_name(ctx, stmt->expr)));
+        cg_emit_expression(ctx, stmt->expr);
+        writer_puts(&ctx->writer, ");");
+    } else {
+        if (stmt->expr) {
+            /* A bare await only waits; its result is not used. */
+            if (cg_is_await_call(stmt->expr)) {
+                writer_puts(&ctx->writer, "(void)");
+            }
+            cg_emit_expression(ctx, stmt->expr);
+        }
+        writer_puts(&ctx->writer, ";");
+    }
+    writer_end_line(&ctx->writer);
+}
+
+static void cg_emit_expression(CodegenContext *ctx, ASTNode *node) {
+    if (!node) {
+        writer_puts(&ctx->writer, "NULL");
+        return;
+    }
+    const CGOwnedTemp *temp = cg_find_temp(ctx, node);
+    if (temp) {
+        writer_printf(&ctx->writer, "%s__lz_tmp%zu", cg_temp_prefix(temp), temp->id);
+        return;
+    }
+    switch (node->kind) {
+        case AST_NODE_EXPR_LITERAL:
+            cg_emit_literal(ctx, (ASTLiteralExpr *)node);
+            break;
+        case AST_NODE_EXPR_IDENTIFIER:
+            cg_emit_identifier(ctx, (ASTIdentifierExpr *)node);
+            break;
+        case AST_NODE_EXPR_CALL:
+            cg_emit_call(ctx, (ASTCallExpr *)node);
+            break;
+        case AST_NODE_EXPR_BINARY:
+            cg_emit_binary(ctx, (ASTBinaryExpr *)node);
+            break;
+        case AST_NODE_EXPR_TASK:
+            cg_emit_task(ctx, (ASTTaskExpr *)node);
+            break;
+        default:
+            cg_fail(ctx, &node->token, "unsupported expression kind");
+            writer_puts(&ctx->writer, "/* unsupported expr */");
+            break;
+    }
+}
+
+static void cg_emit_literal(CodegenContext *ctx, ASTLiteralExpr *literal) {
+    switch (literal->literal_kind) {
+        case AST_LITERAL_INT:
+        case AST_LITERAL_FLOAT:
+            if (literal->text) {
+                writer_append(&ctx->writer, literal->text, literal->text_length);
+            } else {
+                writer_puts(&ctx->writer, "0");
+            }
+            break;
+        case AST_LITERAL_BOOL:
+            writer_puts(&ctx->writer, literal->bool_value ? "true" : "false");
+            break;
+        case AST_LITERAL_STRING:
+            cg_emit_string_literal(ctx, literal->text ? literal->text : "", literal->text_length);
+            break;
+        case AST_LITERAL_NULL:
+            writer_puts(&ctx->writer, "NULL");
+            break;
+    }
+}
+
+static void cg_emit_identifier(CodegenContext *ctx, ASTIdentifierExpr *ident) {
+    if (ident->name == ast_symbols()->log) {
+        writer_puts(&ctx->writer, "lz_runtime_log");
+        return;
+    }
+    const CGVarBinding *binding = cg_scope_lookup(ctx, ident->name);
+    if (binding) {
+        writer_puts(&ctx->writer, binding->c_name);
+        return;
+    }
+    const CGFunctionInfo *fn = cg_find_function(ctx, ident->name);
+    if (fn) {
+        writer_puts(&ctx->writer, fn->c_name);
+        return;
+    }
+    writer_puts(&ctx->writer, ident->name);
+}
+
+static bool cg_is_builtin_call(const ASTNode *node, const char *name) {
+    if (!node || node->kind != AST_NODE_EXPR_CALL) {
+        return false;
+    }
+    const ASTNode *callee = ((const ASTCallExpr *)node)->callee;
+    return callee->kind == AST_NODE_EXPR_IDENTIFIER &&
+           ((const ASTIdentifierExpr *)callee)->name == name;
+}
+
+static bool cg_is_await_call(const ASTNode *node) {
+    return cg_is_builtin_call(node, ast_symbols()->await);
+}
+
+/* Calls a task body may suspend in. */
+static bool cg_is_suspend_call(const ASTNode *node) {
+    const ASTSymbols *symbols = ast_symbols();
+    return cg_is_await_call(node) ||
+           cg_is_builtin_call(node, symbols->send) ||
+           cg_is_builtin_call(node, symbols->recv);
+}
+
+/* await(f) reads the result slot of the finished task in place. */
+static void cg_emit_await(CodegenContext *ctx, ASTCallExpr *call) {
+    ASTNode *future = call->arguments.items[0];
+    const char *future_type = cg_expr_type_name(ctx, future);
+    if (!cg_type_is_future(future_type)) {
+        cg_fail(ctx, &call->base.token, "await expects a future");
+        return;
+    }
+    writer_printf(&ctx->writer,
+                  "(*(%s *)lz_future_await(",
+                  cg_c_type_for(ctx, cg_future_result_type(future_type)));
+    cg_emit_expression(ctx, future);
+    writer_puts(&ctx->writer, "))");
+}
+
+/*
+ * Outside task bodies send and recv block. The element travels through a
+ * compound literal; recv hands back its address so the value is read in
+ * place, as await does with a result slot.
+ */
+static void cg_emit_chan_op(CodegenContext *ctx, ASTCallExpr *call, bool send) {
+    const char *chan_type = cg_expr_type_name(ctx, call->arguments.items[0]);
+    if (!cg_type_is_chan(chan_type)) {
+        cg_fail(ctx, &call->base.token, send ? "send expects a channel" : "recv expects a channel");
+        return;
+    }
+    const char *element_type = cg_c_type_for(ctx, cg_chan_element_type(chan_type));
+    writer_puts(&ctx->writer, send ? "lz_chan_send(" : "(*(");
+    if (!send) {
+        writer_printf(&ctx->writer, "%s *)lz_chan_recv(", element_type);
+    }
+    cg_emit_expression(ctx, call->arguments.items[0]);
+    writer_printf(&ctx->writer, ", &(%s){", element_type);
+    if (send) {
+        cg_emit_expression(ctx, call->arguments.items[1]);
+    } else {
+        writer_puts(&ctx->writer, "0");
+    }
+    writer_puts(&ctx->writer, send ? "})" : "}))");
+}
+
+/* `chan(n)` only initializes a variable, whose type says what the channel holds. */
+static void cg_emit_chan_new(CodegenContext *ctx, ASTCallExpr *call, const char *chan_type) {
+    const char *element_type = cg_chan_element_type(chan_type);
+    const char *retain = "NULL";
+    const char *release = "NULL";
+    if (element_type == ast_symbols()->string_type) {
+        retain = "lz_chan_retain_string";
+        release = "lz_chan_release_string";
+    } else if (cg_type_is_struct(ctx, element_type)) {
+        retain = "lz_chan_retain_frozen";
+        release = "lz_chan_release_frozen";
+    }
+    writer_puts(&ctx->writer, "lz_chan_new(");
+    cg_emit_expression(ctx, call->arguments.items[0]);
+    writer_printf(&ctx->writer,
+                  ", sizeof(%s), %s, %s)",
+                  cg_c_type_for(ctx, element_type),
+                  retain,
+                  release);
+}
+
+static void cg_emit_call(CodegenContext *ctx, ASTCallExpr *call) {
+    if (cg_is_await_call((ASTNode *)call)) {
+        cg_emit_await(ctx, call);
+        return;
+    }
+    if (cg_is_builtin_call((ASTNode *)call, ast_symbols()->send) ||
+        cg_is_builtin_call((ASTNode *)call, ast_symbols()->recv)) {
+        cg_emit_chan_op(ctx, call, cg_is_builtin_call((ASTNode *)call, ast_symbols()->send));
+        return;
+    }
+    const char *callee = call->callee->kind == AST_NODE_EXPR_IDENTIFIER
+                             ? ((const ASTIdentifierExpr *)call->callee)->name
+                             : NULL;
+    if (callee && !cg_find_function(ctx, callee) && cg_find_struct(ctx, callee)) {
+        writer_printf(&ctx->writer, "lz_new_struct_%s", callee);
+    } else {
+        cg_emit_expression(ctx, call->callee);
+    }
+    writer_puts(&ctx->writer, "(");
+    for (size_t i = 0; i < call->arguments.count; i++) {
+        if (i > 0) {
+            writer_puts(&ctx->writer, ", ");
+        }
+        cg_emit_expression(ctx, call->arguments.items[i]);
+    }
+    writer_puts(&ctx->writer, ")");
+}
+
+static void cg_capture_block(const CodegenContext *ctx, CGCaptureSet *set, const ASTBlock *block);
+
+static void cg_capture_local(CGCaptureSet *set, const char *name) {
+    if (set->local_count == set->local_capacity) {
+        size_t new_capacity = set->local_capacity ? set->local_capacity * 2 : 8;
+        const char **new_items = realloc(set->locals, new_capacity * sizeof(const char *));
+        if (!new_items) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        set->locals = new_items;
+        set->local_capacity = new_capacity;
+    }
+    set->locals[set->local_count++] = name;
+}
+
+static void cg_capture_name(const CodegenContext *ctx, CGCaptureSet *set, const char *name) {
+    for (size_t i = set->local_count; i > 0; i--) {
+        if (set->locals[i - 1] == name) {
+            return;
+        }
+    }
+    for (size_t i = 0; i < set->capture_count; i++) {
+        if (set->captures[i].name == name) {
+            return;
+        }
+    }
+    const CGVarBinding *binding = cg_scope_lookup(ctx, name);
+    if (!binding) {
+        return;
+    }
+    if (set->capture_count == set->capture_capacity) {
+        size_t new_capacity = set->capture_capacity ? set->capture_capacity * 2 : 4;
+        CGVarBinding *new_items = realloc(set->captures, new_capacity * sizeof(CGVarBinding));
+        if (!new_items) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        set->captures = new_items;
+        set->capture_capacity = new_capacity;
+    }
+    set->captures[set->capture_count++] = *binding;
+}
+
+/* Nested tasks are walked too: whatever they capture from outside must pass through this one. */
+static void cg_capture_node(const CodegenContext *ctx, CGCaptureSet *set, const ASTNode *node) {
+    if (!node) return;
+    switch (node->kind) {
+        case AST_NODE_VAR_DECL: {
+            const ASTVarDecl *decl = (const ASTVarDecl *)node;
+            cg_capture_node(ctx, set, decl->initializer);
+            cg_capture_local(set, decl->name);
+            break;
+        }
+        case AST_NODE_ASSIGN:
+            cg_capture_node(ctx, set, ((const ASTAssignStmt *)node)->value);
+            break;
+        case AST_NODE_IF: {
+            const ASTIfStmt *stmt = (const ASTIfStmt *)node;
+            cg_capture_node(ctx, set, stmt->condition);
+            cg_capture_block(ctx, set, stmt->then_block);
+            cg_capture_block(ctx, set, stmt->else_block);
+            break;
+        }
+        case AST_NODE_FOR: {
+            const ASTForStmt *stmt = (const ASTForStmt *)node;
+            cg_capture_node(ctx, set, stmt->iterable);
+            cg_capture_block(ctx, set, stmt->body);
+            break;
+        }
+        case AST_NODE_RETURN:
+            cg_capture_node(ctx, set, ((const ASTReturnStmt *)node)->value);
+            break;
+        case AST_NODE_BLOCK:
+            cg_capture_block(ctx, set, (const ASTBlock *)node);
+            break;
+        case AST_NODE_EXPR_STMT:
+            cg_capture_node(ctx, set, ((const ASTExprStmt *)node)->expr);
+            break;
+        case AST_NODE_EXPR_IDENTIFIER:
+            cg_capture_name(ctx, set, ((const ASTIdentifierExpr *)node)->name);
+            break;
+        case AST_NODE_EXPR_CALL: {
+            const ASTCallExpr *call = (const ASTCallExpr *)node;
+            cg_capture_node(ctx, set, call->callee);
+            for (size_t i = 0; i < call->arguments.count; i++) {
+                cg_capture_node(ctx, set, call->arguments.items[i]);
+            }
+            break;
+        }
+        case AST_NODE_EXPR_BINARY: {
+            const ASTBinaryExpr *binary = (const ASTBinaryExpr *)node;
+            cg_capture_node(ctx, set, binary->left);
+            cg_capture_node(ctx, set, binary->right);
+            break;
+        }
+        case AST_NODE_EXPR_TASK:
+            cg_capture_block(ctx, set, ((const ASTTaskExpr *)node)->body);
+            break;
+        default:
+            break;
+    }
+}
+
+static void cg_capture_block(const CodegenContext *ctx, CGCaptureSet *set, const ASTBlock *block) {
+    if (!block) return;
+    size_t mark = set->local_count;
+    for (size_t i = 0; i < block->statements.count; i++) {
+        cg_capture_node(ctx, set, block->statements.items[i]);
+    }
+    set->local_count = mark;
+}
+
+/*
+ * Spill analysis. A local must live in the frame if the task may suspend
+ * between its declaration and a later use, or its release at scope exit.
+ * Every await of a statement is lowered before the rest of it runs, so
+ * the walk counts a statement's awaits before visiting its expressions,
+ * and a local declared after `n` awaits spills once a use sees more.
+ */
+typedef struct {
+    const ASTVarDecl *decl;
+    size_t awaits;
+} CGSpillLocal;
+
+typedef struct {
+    const CodegenContext *ctx;
+    CGTaskState *task;
+    CGSpillLocal *locals;
+    size_t local_count;
+    size_t local_capacity;
+    size_t awaits;
+} CGSpillWalk;
+
+static void cg_spill_block(CGSpillWalk *walk, const ASTBlock *block);
+
+/* Awaits, sends and receives evaluated by the expression itself; a nested task's body runs elsewhere. */
+static size_t cg_count_awaits(const ASTNode *node) {
+    if (!node) return 0;
+    if (node->kind == AST_NODE_EXPR_BINARY) {
+        const ASTBinaryExpr *binary = (const ASTBinaryExpr *)node;
+        return cg_count_awaits(binary->left) + cg_count_awaits(binary->right);
+    }
+    if (node->kind != AST_NODE_EXPR_CALL) {
+        return 0;
+    }
+    const ASTCallExpr *call = (const ASTCallExpr *)node;
+    size_t count = cg_is_suspend_call(node) ? 1 : 0;
+    for (size_t i = 0; i < call->arguments.count; i++) {
+        count += cg_count_awaits(call->arguments.items[i]);
+    }
+    return count;
+}
+
+static void cg_spill_mark(CGSpillWalk *walk, const ASTVarDecl *decl) {
+    CGTaskState *task = walk->task;
+    if (cg_task_spills(task, decl)) {
+        return;
+    }
+    if (task->spilled_count == task->spilled_capacity) {
+        size_t new_capacity = task->spilled_capacity ? task->spilled_capacity * 2 : 4;
+        const ASTVarDecl **new_items = realloc(task->spilled, new_capacity * sizeof(const ASTVarDecl *));
+        if (!new_items) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        task->spilled = new_items;
+        task->spilled_capacity = new_capacity;
     }
-    writer_pop(&ctx->writer);
-    writer_line(&ctx->writer, "}");
+    task->spilled[task->spilled_count++] = decl;
 }
 
-
-static void cg_emit_block(CodegenContext *ctx,
-                          ASTBlock *block,
-                          const char *tail_var,
-                          const char *tail_helper) {
-    writer_line(&ctx->writer, "{");
-    writer_push(&ctx->writer);
-    cg_scope_push(ctx);
-    if (block) {
-        for (size_t i = 0; i < block->statements.count; i++) {
-            bool is_last = (i + 1 == block->statements.count);
-            const char *stmt_tail_var = (tail_var && is_last) ? tail_var : NULL;
-            const char *stmt_tail_helper = (tail_helper && is_last) ? tail_helper : NULL;
-            cg_emit_statement(ctx,
-                              block->statements.items[i],
-                              stmt_tail_var,
-                              stmt_tail_helper);
+static void cg_spill_use(CGSpillWalk *walk, const char *name) {
+    for (size_t i = walk->local_count; i > 0; i--) {
+        const CGSpillLocal *local = &walk->locals[i - 1];
+        if (local->decl->name == name) {
+            if (walk->awaits > local->awaits) {
+                cg_spill_mark(walk, local->decl);
+            }
+            return;
         }
     }
-    cg_scope_pop(ctx);
-    writer_pop(&ctx->writer);
-    writer_line(&ctx->writer, "}");
 }
 
-static void cg_emit_statement(CodegenContext *ctx,
-                              ASTNode *node,
-                              const char *tail_var,
-                              const char *tail_helper) {
-    if (ctx->had_error || !node) {
-        return;
+static void cg_spill_expression(CGSpillWalk *walk, const ASTNode *node) {
+    if (!node) return;
+    switch (node->kind) {
+        case AST_NODE_EXPR_IDENTIFIER:
+            cg_spill_use(walk, ((const ASTIdentifierExpr *)node)->name);
+            break;
+        case AST_NODE_EXPR_CALL: {
+            const ASTCallExpr *call = (const ASTCallExpr *)node;
+            for (size_t i = 0; i < call->arguments.count; i++) {
+                cg_spill_expression(walk, call->arguments.items[i]);
+            }
+            break;
+        }
+        case AST_NODE_EXPR_BINARY: {
+            const ASTBinaryExpr *binary = (const ASTBinaryExpr *)node;
+            cg_spill_expression(walk, binary->left);
+            cg_spill_expression(walk, binary->right);
+            break;
+        }
+        case AST_NODE_EXPR_TASK: {
+            /* Captures are read when the nested task is spawned, here; its own awaits do not count. */
+            size_t awaits = walk->awaits;
+            cg_spill_block(walk, ((const ASTTaskExpr *)node)->body);
+            walk->awaits = awaits;
+            break;
+        }
+        default:
+            break;
     }
+}
+
+static void cg_spill_statement(CGSpillWalk *walk, const ASTNode *node) {
+    if (!node) return;
     switch (node->kind) {
-        case AST_NODE_VAR_DECL:
-            cg_emit_var_decl(ctx, (ASTVarDecl *)node);
+        case AST_NODE_VAR_DECL: {
+            const ASTVarDecl *decl = (const ASTVarDecl *)node;
+            walk->awaits += cg_count_awaits(decl->initializer);
+            cg_spill_expression(walk, decl->initializer);
+            if (walk->local_count == walk->local_capacity) {
+                size_t new_capacity = walk->local_capacity ? walk->local_capacity * 2 : 8;
+                CGSpillLocal *new_items = realloc(walk->locals, new_capacity * sizeof(CGSpillLocal));
+                if (!new_items) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                walk->locals = new_items;
+                walk->local_capacity = new_capacity;
+            }
+            walk->locals[walk->local_count++] = (CGSpillLocal){ .decl = decl, .awaits = walk->awaits };
             break;
-        case AST_NODE_ASSIGN:
-            cg_emit_assignment(ctx, (ASTAssignStmt *)node);
+        }
+        case AST_NODE_ASSIGN: {
+            const ASTAssignStmt *assign = (const ASTAssignStmt *)node;
+            walk->awaits += cg_count_awaits(assign->value);
+            cg_spill_expression(walk, assign->value);
+            cg_spill_use(walk, assign->target);
             break;
-        case AST_NODE_IF:
-            cg_emit_if(ctx, (ASTIfStmt *)node, tail_var, tail_helper);
+        }
+        case AST_NODE_IF: {
+            const ASTIfStmt *stmt = (const ASTIfStmt *)node;
+            walk->awaits += cg_count_awaits(stmt->condition);
+            cg_spill_expression(walk, stmt->condition);
+            cg_spill_block(walk, stmt->then_block);
+            cg_spill_block(walk, stmt->else_block);
             break;
-        case AST_NODE_RETURN:
-            cg_emit_return(ctx, (ASTReturnStmt *)node);
+        }
+        case AST_NODE_FOR: {
+            const ASTForStmt *stmt = (const ASTForStmt *)node;
+            walk->awaits += cg_count_awaits(stmt->iterable);
+            cg_spill_expression(walk, stmt->iterable);
+            cg_spill_block(walk, stmt->body);
             break;
-        case AST_NODE_EXPR_STMT:
-            cg_emit_expr_stmt(ctx, (ASTExprStmt *)node, tail_var, tail_helper);
+        }
+        case AST_NODE_RETURN: {
+            const ASTReturnStmt *stmt = (const ASTReturnStmt *)node;
+            walk->awaits += cg_count_awaits(stmt->value);
+            cg_spill_expression(walk, stmt->value);
             break;
-        case AST_NODE_FOR:
-            cg_fail(ctx, &node->token, "for-in loops are not supported yet");
+        }
+        case AST_NODE_EXPR_STMT: {
+            const ASTExprStmt *stmt = (const ASTExprStmt *)node;
+            walk->awaits += cg_count_awaits(stmt->expr);
+            cg_spill_expression(walk, stmt->expr);
+            break;
+        }
+        case AST_NODE_BLOCK:
+            cg_spill_block(walk, (const ASTBlock *)node);
             break;
         default:
-            cg_fail(ctx, &node->token, "unsupported statement kind in codegen");
             break;
     }
 }
 
-static void cg_emit_var_decl(CodegenContext *ctx, ASTVarDecl *decl) {
-    const char *c_type = cg_c_type_for(ctx, decl->type_name);
-    writer_line(&ctx->writer, "%s %s = {0};", c_type, decl->name);
-    cg_scope_add(ctx, decl->name, decl->type_name, decl->is_mutable);
-    cg_emit_assignment_call(ctx, decl->name, decl->type_name, decl->initializer);
+/* Refcounted locals are also used by their release when the block closes. */
+static void cg_spill_block(CGSpillWalk *walk, const ASTBlock *block) {
+    if (!block) return;
+    size_t mark = walk->local_count;
+    for (size_t i = 0; i < block->statements.count; i++) {
+        cg_spill_statement(walk, block->statements.items[i]);
+    }
+    for (size_t i = mark; i < walk->local_count; i++) {
+        const CGSpillLocal *local = &walk->locals[i];
+        if (cg_type_is_refcounted(walk->ctx, local->decl->type_name) && walk->awaits > local->awaits) {
+            cg_spill_mark(walk, local->decl);
+        }
+    }
+    walk->local_count = mark;
 }
 
-static void cg_emit_assignment(CodegenContext *ctx, ASTAssignStmt *assign) {
-    const CGVarBinding *binding = cg_scope_lookup(ctx, assign->target);
-    if (!binding) {
-        cg_fail(ctx, &assign->base.token, "assignment to unknown symbol");
-        return;
+static bool cg_task_spills(const CGTaskState *task, const ASTVarDecl *decl) {
+    for (size_t i = 0; i < task->spilled_count; i++) {
+        if (task->spilled[i] == decl) {
+            return true;
+        }
     }
-    cg_emit_assignment_call(ctx, assign->target, binding->type_name, assign->value);
+    return false;
 }
 
-static void cg_emit_if(CodegenContext *ctx,
-                       ASTIfStmt *stmt,
-                       const char *tail_var,
-                       const char *tail_helper) {
-    writer_begin_line(&ctx->writer);
-    writer_printf(&ctx->writer, "if (");
-    cg_emit_expression(ctx, stmt->condition);
-    writer_printf(&ctx->writer, ") ");
-    writer_end_line(&ctx->writer);
-    cg_emit_block(ctx, stmt->then_block, tail_var, tail_helper);
-    if (stmt->else_block) {
-        writer_line(&ctx->writer, "else");
-        cg_emit_block(ctx, stmt->else_block, tail_var, tail_helper);
+/* Returns the field's name: `name`, or `name_<n>` when a shadowed local already took it. */
+static const char *cg_task_add_field(CodegenContext *ctx, const char *c_type, const char *name) {
+    CGTaskState *task = ctx->task;
+    const char *field = ast_intern_cstr(name);
+    for (size_t i = 0; i < task->field_count; i++) {
+        if (task->fields[i].name == field) {
+            size_t length = strlen(name) + 24;
+            char *unique = malloc(length);
+            if (!unique) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            snprintf(unique, length, "%s_%zu", name, task->field_count);
+            field = ast_intern_cstr(unique);
+            free(unique);
+            break;
+        }
+    }
+    if (task->field_count == task->field_capacity) {
+        size_t new_capacity = task->field_capacity ? task->field_capacity * 2 : 8;
+        CGFrameField *new_items = realloc(task->fields, new_capacity * sizeof(CGFrameField));
+        if (!new_items) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        task->fields = new_items;
+        task->field_capacity = new_capacity;
     }
+    task->fields[task->field_count++] = (CGFrameField){ .c_type = c_type, .name = field };
+    return field;
 }
 
-static void cg_emit_return(CodegenContext *ctx, ASTReturnStmt *stmt) {
-    writer_begin_line(&ctx->writer);
-    writer_printf(&ctx->writer, "return");
-    if (stmt->value) {
-        writer_printf(&ctx->writer, " ");
-        cg_emit_expression(ctx, stmt->value);
+/* Whether emitting this statement can suspend, nested blocks included. */
+static bool cg_statement_awaits(const ASTNode *node) {
+    if (!node) return false;
+    switch (node->kind) {
+        case AST_NODE_VAR_DECL:
+            return cg_count_awaits(((const ASTVarDecl *)node)->initializer) > 0;
+        case AST_NODE_ASSIGN:
+            return cg_count_awaits(((const ASTAssignStmt *)node)->value) > 0;
+        case AST_NODE_EXPR_STMT:
+            return cg_count_awaits(((const ASTExprStmt *)node)->expr) > 0;
+        case AST_NODE_IF: {
+            const ASTIfStmt *stmt = (const ASTIfStmt *)node;
+            if (cg_count_awaits(stmt->condition) > 0) {
+                return true;
+            }
+            const ASTBlock *blocks[2] = { stmt->then_block, stmt->else_block };
+            for (size_t b = 0; b < 2; b++) {
+                for (size_t i = 0; blocks[b] && i < blocks[b]->statements.count; i++) {
+                    if (cg_statement_awaits(blocks[b]->statements.items[i])) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+        case AST_NODE_BLOCK: {
+            const ASTBlock *block = (const ASTBlock *)node;
+            for (size_t i = 0; i < block->statements.count; i++) {
+                if (cg_statement_awaits(block->statements.items[i])) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        default:
+            return false;
     }
-    writer_printf(&ctx->writer, ";");
+}
+
+/*
+ * Each await becomes a resume point: the awaited future is made to outlive
+ * the suspension (an owned call result is hoisted into a spilled
+ * temporary), and if it has not completed the task records where it was
+ * and returns. Inner awaits are lowered first, so the awaited expression
+ * only reads finished futures.
+ */
+static void cg_lower_await(CodegenContext *ctx, ASTNode *future) {
+    cg_hoist_owned_temps(ctx, future, false);
+    size_t point = ++ctx->task->resume_count;
+    writer_line(&ctx->writer, "__lz_frame->__lz_header.resume_point = %zu;", point);
+    writer_begin_line(&ctx->writer);
+    writer_puts(&ctx->writer, "if (lz_task_suspend(__lz_future, ");
+    cg_emit_expression(ctx, future);
+    writer_puts(&ctx->writer, ")) return false;");
     writer_end_line(&ctx->writer);
+    writer_line(&ctx->writer, "__lz_resume%zu:;", point);
 }
 
-static void cg_emit_expr_stmt(CodegenContext *ctx,
-                              ASTExprStmt *stmt,
-                              const char *tail_var,
-                              const char *tail_helper) {
+/*
+ * A channel operation that cannot proceed parks the task on the channel,
+ * which resubmits it to retry from the same point. A received value lands
+ * in a frame temporary that stands in for the recv call.
+ */
+static void cg_lower_chan_op(CodegenContext *ctx, ASTCallExpr *call, bool send) {
+    const char *chan_type = cg_expr_type_name(ctx, call->arguments.items[0]);
+    if (!cg_type_is_chan(chan_type)) {
+        cg_fail(ctx, &call->base.token, send ? "send expects a channel" : "recv expects a channel");
+        return;
+    }
+    const char *element_type = cg_chan_element_type(chan_type);
+    for (size_t i = 0; i < call->arguments.count; i++) {
+        cg_hoist_owned_temps(ctx, call->arguments.items[i], false);
+    }
+    size_t id = 0;
+    if (!send) {
+        char field[32];
+        id = ctx->next_temp_id++;
+        snprintf(field, sizeof(field), "__lz_tmp%zu", id);
+        cg_task_add_field(ctx, cg_c_type_for(ctx, element_type), field);
+    }
+    size_t point = ++ctx->task->resume_count;
+    writer_line(&ctx->writer, "__lz_frame->__lz_header.resume_point = %zu;", point);
+    writer_line(&ctx->writer, "__lz_resume%zu:;", point);
     writer_begin_line(&ctx->writer);
-    if (tail_var && tail_helper && stmt->expr) {
-        writer_printf(&ctx->writer, "%s(&%s, ", tail_helper, tail_var);
-        cg_emit_expression(ctx, stmt->expr);
-        writer_printf(&ctx->writer, ");");
+    writer_printf(&ctx->writer, "if (!lz_chan_task_%s(", send ? "send" : "recv");
+    cg_emit_expression(ctx, call->arguments.items[0]);
+    if (send) {
+        writer_printf(&ctx->writer, ", &(%s){", cg_c_type_for(ctx, element_type));
+        cg_emit_expression(ctx, call->arguments.items[1]);
+        writer_puts(&ctx->writer, "}");
     } else {
-        if (stmt->expr) {
-            cg_emit_expression(ctx, stmt->expr);
-        }
-        writer_printf(&ctx->writer, ";");
+        writer_printf(&ctx->writer, ", &__lz_frame->__lz_tmp%zu", id);
     }
+    writer_puts(&ctx->writer, ", __lz_future)) return false;");
     writer_end_line(&ctx->writer);
+    if (send) {
+        return;
+    }
+
+    if (ctx->temp_count == ctx->temp_capacity) {
+        size_t new_capacity = ctx->temp_capacity ? ctx->temp_capacity * 2 : 4;
+        CGOwnedTemp *new_items = realloc(ctx->temps, new_capacity * sizeof(CGOwnedTemp));
+        if (!new_items) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        ctx->temps = new_items;
+        ctx->temp_capacity = new_capacity;
+    }
+    ctx->temps[ctx->temp_count++] = (CGOwnedTemp){
+        .node = (const ASTNode *)call,
+        .type_name = element_type,
+        .id = id,
+        .in_frame = true,
+    };
 }
 
-static void cg_emit_expression(CodegenContext *ctx, ASTNode *node) {
-    if (!node) {
-        writer_printf(&ctx->writer, "NULL");
+/* Inner suspension points go first, so each one only reads values that are ready. */
+static void cg_lower_awaits(CodegenContext *ctx, const ASTNode *node) {
+    if (!node) return;
+    if (node->kind == AST_NODE_EXPR_BINARY) {
+        const ASTBinaryExpr *binary = (const ASTBinaryExpr *)node;
+        cg_lower_awaits(ctx, binary->left);
+        cg_lower_awaits(ctx, binary->right);
         return;
     }
+    if (node->kind != AST_NODE_EXPR_CALL) {
+        return;
+    }
+    ASTCallExpr *call = (ASTCallExpr *)node;
+    for (size_t i = 0; i < call->arguments.count; i++) {
+        cg_lower_awaits(ctx, call->arguments.items[i]);
+    }
+    if (cg_is_await_call(node) && call->arguments.count == 1) {
+        cg_lower_await(ctx, call->arguments.items[0]);
+    } else if (cg_is_builtin_call(node, ast_symbols()->send) && call->arguments.count == 2) {
+        cg_lower_chan_op(ctx, call, true);
+    } else if (cg_is_builtin_call(node, ast_symbols()->recv) && call->arguments.count == 1) {
+        cg_lower_chan_op(ctx, call, false);
+    }
+}
+
+static void cg_lower_statement_awaits(CodegenContext *ctx, const ASTNode *node) {
     switch (node->kind) {
-        case AST_NODE_EXPR_LITERAL:
-            cg_emit_literal(ctx, (ASTLiteralExpr *)node);
+        case AST_NODE_VAR_DECL:
+            cg_lower_awaits(ctx, ((const ASTVarDecl *)node)->initializer);
             break;
-        case AST_NODE_EXPR_IDENTIFIER:
-            cg_emit_identifier(ctx, (ASTIdentifierExpr *)node);
+        case AST_NODE_ASSIGN:
+            cg_lower_awaits(ctx, ((const ASTAssignStmt *)node)->value);
             break;
-        case AST_NODE_EXPR_CALL:
-            cg_emit_call(ctx, (ASTCallExpr *)node);
+        case AST_NODE_IF:
+            cg_lower_awaits(ctx, ((const ASTIfStmt *)node)->condition);
             break;
-        case AST_NODE_EXPR_BINARY:
-            cg_emit_binary(ctx, (ASTBinaryExpr *)node);
+        case AST_NODE_EXPR_STMT:
+            cg_lower_awaits(ctx, ((const ASTExprStmt *)node)->expr);
             break;
         default:
-            cg_fail(ctx, &node->token, "unsupported expression kind");
-            writer_printf(&ctx->writer, "/* unsupported expr */");
             break;
     }
 }
 
-static void cg_emit_literal(CodegenContext *ctx, ASTLiteralExpr *literal) {
-    switch (literal->literal_kind) {
-        case AST_LITERAL_INT:
-        case AST_LITERAL_FLOAT:
-            writer_printf(&ctx->writer, "%s", literal->text ? literal->text : "0");
-            break;
-        case AST_LITERAL_BOOL:
-            writer_printf(&ctx->writer, literal->bool_value ? "true" : "false");
-            break;
-        case AST_LITERAL_STRING:
-            cg_emit_string_literal(ctx, literal->text ? literal->text : "");
-            break;
-        case AST_LITERAL_NULL:
-            writer_printf(&ctx->writer, "NULL");
-            break;
-    }
-}
+/*
+ * Task lowering
+ * -------------
+ * `task ()` becomes a frame struct that starts with the runtime's lz_future
+ * header, and three functions around it:
+ *   lz_task<N>_spawn  copies the captured variables into a pooled frame and
+ *                     hands it to the scheduler; its result is the future;
+ *   lz_task<N>_run    the body as a stackless coroutine: captures are
+ *                     reloaded as borrowed locals on every entry, a switch
+ *                     jumps to the await the task last suspended in, and the
+ *                     frame's result slot is the body's tail variable;
+ *   lz_task<N>_drop   releases refcounted captures and the result.
+ * The frame holds only the captures, the result and what spill analysis
+ * found live across an await, so a suspended task costs its frame and no
+ * stack. Captured strings and structs are switched to atomic counting
+ * before the frame takes its reference, so a struct crosses into the task as
+ * one pointer, and a string or struct result is shared before other threads
+ * read it.
+ */
+static void cg_emit_task(CodegenContext *ctx, ASTTaskExpr *task) {
+    CGCaptureSet set = {0};
+    cg_capture_block(ctx, &set, task->body);
+
+    CGTaskState state = {0};
+    CGSpillWalk walk = { .ctx = ctx, .task = &state };
+    cg_spill_block(&walk, task->body);
+    free(walk.locals);
+
+    size_t id = ctx->next_task_id++;
+    const char *result_type = task->result_type;
+
+    CodeWriter outer_writer = ctx->writer;
+    ASTScopeStack outer_scopes = ctx->scopes;
+    size_t outer_next_temp_id = ctx->next_temp_id;
+    const ASTFunctionDecl *outer_function = ctx->current_function;
+    CGTaskState *outer_task = ctx->task;
+    writer_init(&ctx->writer);
+    ast_scope_stack_init(&ctx->scopes, sizeof(CGVarBinding));
+    ctx->next_temp_id = 0;
+    ctx->current_function = NULL;
+    ctx->task = &state;
 
-static void cg_emit_identifier(CodegenContext *ctx, ASTIdentifierExpr *ident) {
-    if (strcmp(ident->name, "log") == 0) {
-        writer_printf(&ctx->writer, "lz_runtime_log");
-        return;
+    /* The body goes first: it decides which locals and temporaries the frame needs. */
+    for (size_t i = 0; i < set.capture_count; i++) {
+        cg_task_add_field(ctx, cg_c_type_for(ctx, set.captures[i].type_name), set.captures[i].name);
     }
-    const CGVarBinding *binding = cg_scope_lookup(ctx, ident->name);
-    if (binding) {
-        writer_printf(&ctx->writer, "%s", ident->name);
-        return;
+    writer_push(&ctx->writer);
+    cg_scope_push(ctx);
+    for (size_t i = 0; i < set.capture_count; i++) {
+        const CGVarBinding *capture = &set.captures[i];
+        cg_scope_add(ctx, capture->name, capture->type_name, false, false);
     }
-    const CGFunctionInfo *fn = cg_find_function(ctx, ident->name);
-    if (fn) {
-        writer_printf(&ctx->writer, "%s", fn->c_name);
-        return;
+    cg_emit_block(ctx, task->body, "__lz_frame->__lz_result", result_type);
+    if (cg_share_fn_for(ctx, result_type)) {
+        writer_line(&ctx->writer, "%s(__lz_frame->__lz_result);", cg_share_fn_for(ctx, result_type));
     }
-    writer_printf(&ctx->writer, "%s", ident->name);
-}
-
-static void cg_emit_call(CodegenContext *ctx, ASTCallExpr *call) {
-    cg_emit_expression(ctx, call->callee);
-    writer_printf(&ctx->writer, "(");
-    for (size_t i = 0; i < call->arguments.count; i++) {
-        if (i > 0) {
-            writer_printf(&ctx->writer, ", ");
+    writer_put_line(&ctx->writer, "return true;");
+    cg_scope_pop(ctx);
+    CodeWriter body = ctx->writer;
+    writer_init(&ctx->writer);
+    CodeWriter *out = &ctx->writer;
+
+    writer_line(out, "struct lz_task%zu {", id);
+    writer_push(out);
+    writer_put_line(out, "lz_future __lz_header;");
+    for (size_t i = 0; i < state.field_count; i++) {
+        writer_line(out, "%s %s;", state.fields[i].c_type, state.fields[i].name);
+    }
+    writer_line(out, "%s __lz_result;", cg_c_type_for(ctx, result_type));
+    writer_pop(out);
+    writer_put_line(out, "};");
+    writer_blank_line(out);
+
+    writer_line(out, "static bool lz_task%zu_run(lz_future *__lz_future) {", id);
+    writer_push(out);
+    writer_line(out, "struct lz_task%zu *__lz_frame = (struct lz_task%zu *)__lz_future;", id, id);
+    for (size_t i = 0; i < set.capture_count; i++) {
+        const CGVarBinding *capture = &set.captures[i];
+        writer_line(out,
+                    "%s %s = __lz_frame->%s;",
+                    cg_c_type_for(ctx, capture->type_name),
+                    capture->name,
+                    capture->name);
+    }
+    if (state.resume_count > 0) {
+        writer_put_line(out, "switch (__lz_frame->__lz_header.resume_point) {");
+        writer_push(out);
+        for (size_t point = 1; point <= state.resume_count; point++) {
+            writer_line(out, "case %zu: goto __lz_resume%zu;", point, point);
+        }
+        writer_put_line(out, "default: break;");
+        writer_pop(out);
+        writer_put_line(out, "}");
+    }
+    writer_pop(out);
+    writer_append(out, body.data, body.length);
+    writer_destroy(&body);
+    writer_put_line(out, "}");
+    writer_blank_line(out);
+
+    bool needs_drop = cg_type_is_refcounted(ctx, result_type);
+    for (size_t i = 0; i < set.capture_count; i++) {
+        needs_drop = needs_drop || cg_type_is_refcounted(ctx, set.captures[i].type_name);
+    }
+    if (needs_drop) {
+        writer_line(out, "static void lz_task%zu_drop(lz_future *__lz_future) {", id);
+        writer_push(out);
+        writer_line(out, "struct lz_task%zu *__lz_frame = (struct lz_task%zu *)__lz_future;", id, id);
+        for (size_t i = 0; i < set.capture_count; i++) {
+            const CGVarBinding *capture = &set.captures[i];
+            if (cg_type_is_refcounted(ctx, capture->type_name)) {
+                writer_line(out, "%s(__lz_frame->%s);", cg_release_fn_for(ctx, capture->type_name), capture->name);
+            }
+        }
+        if (cg_type_is_refcounted(ctx, result_type)) {
+            writer_line(out, "%s(__lz_frame->__lz_result);", cg_release_fn_for(ctx, result_type));
+        }
+        writer_pop(out);
+        writer_put_line(out, "}");
+        writer_blank_line(out);
+    }
+
+    writer_begin_line(out);
+    writer_printf(out, "static lz_future *lz_task%zu_spawn(", id);
+    if (set.capture_count == 0) {
+        writer_puts(out, "void");
+    }
+    for (size_t i = 0; i < set.capture_count; i++) {
+        const CGVarBinding *capture = &set.captures[i];
+        writer_printf(out, "%s%s %s", i > 0 ? ", " : "", cg_c_type_for(ctx, capture->type_name), capture->name);
+    }
+    writer_puts(out, ") {");
+    writer_end_line(out);
+    writer_push(out);
+    writer_line(out, "struct lz_task%zu *__lz_frame = (struct lz_task%zu *)lz_task_alloc(", id, id);
+    writer_push(out);
+    writer_line(out, "sizeof(struct lz_task%zu),", id);
+    writer_line(out, "offsetof(struct lz_task%zu, __lz_result),", id);
+    writer_line(out, "lz_task%zu_run,", id);
+    if (needs_drop) {
+        writer_line(out, "lz_task%zu_drop);", id);
+    } else {
+        writer_put_line(out, "NULL);");
+    }
+    writer_pop(out);
+    for (size_t i = 0; i < set.capture_count; i++) {
+        const CGVarBinding *capture = &set.captures[i];
+        if (cg_share_fn_for(ctx, capture->type_name)) {
+            writer_line(out, "%s(%s);", cg_share_fn_for(ctx, capture->type_name), capture->name);
+        }
+        if (cg_type_is_refcounted(ctx, capture->type_name)) {
+            writer_line(out,
+                        "__lz_frame->%s = %s(%s);",
+                        capture->name,
+                        cg_retain_fn_for(ctx, capture->type_name),
+                        capture->name);
+        } else {
+            writer_line(out, "__lz_frame->%s = %s;", capture->name, capture->name);
         }
-        cg_emit_expression(ctx, call->arguments.items[i]);
     }
-    writer_printf(&ctx->writer, ")");
+    writer_put_line(out, "return lz_task_spawn(&__lz_frame->__lz_header);");
+    writer_pop(out);
+    writer_put_line(out, "}");
+    writer_blank_line(out);
+
+    /* Tasks nested in this body appended their definitions first, which is the order C needs. */
+    if (!ctx->task_defs.data) {
+        writer_init(&ctx->task_defs);
+    }
+    writer_append(&ctx->task_defs, out->data, out->length);
+    writer_destroy(&ctx->writer);
+    ast_scope_stack_destroy(&ctx->scopes);
+    ctx->writer = outer_writer;
+    ctx->scopes = outer_scopes;
+    ctx->next_temp_id = outer_next_temp_id;
+    ctx->current_function = outer_function;
+    ctx->task = outer_task;
+
+    writer_printf(&ctx->writer, "lz_task%zu_spawn(", id);
+    for (size_t i = 0; i < set.capture_count; i++) {
+        writer_printf(&ctx->writer, "%s%s", i > 0 ? ", " : "", set.captures[i].c_name);
+    }
+    writer_puts(&ctx->writer, ")");
+    free(set.captures);
+    free(set.locals);
+    free(state.fields);
+    free(state.spilled);
 }
 
 static const char *cg_binary_op(TokenType type) {
@@ -816,54 +2557,67 @@ static const char *cg_binary_op(TokenType type) {
 }
 
 static void cg_emit_binary(CodegenContext *ctx, ASTBinaryExpr *binary) {
-    writer_printf(&ctx->writer, "(");
+    writer_puts(&ctx->writer, "(");
     cg_emit_expression(ctx, binary->left);
     writer_printf(&ctx->writer, " %s ", cg_binary_op(binary->op));
     cg_emit_expression(ctx, binary->right);
-    writer_printf(&ctx->writer, ")");
+    writer_puts(&ctx->writer, ")");
+}
+
+static void cg_emit_string_literal(CodegenContext *ctx, const char *text, size_t length) {
+    /* The runtime never writes through lz_string, so dropping const is safe. */
+    writer_printf(&ctx->writer, "((lz_string *)&lz_str_%zu)", cg_intern_string(ctx, text, length));
 }
 
-static void cg_emit_string_literal(CodegenContext *ctx, const char *text) {
-    writer_printf(&ctx->writer, "lz_string_from_literal(\"");
+static void cg_write_c_string(CodegenContext *ctx, const char *text, size_t length) {
+    writer_puts(&ctx->writer, "\"");
     if (text) {
-        for (const char *c = text; *c; c++) {
-            unsigned char ch = (unsigned char)*c;
+        for (size_t i = 0; i < length; i++) {
+            unsigned char ch = (unsigned char)text[i];
             switch (ch) {
-                case '\\': writer_printf(&ctx->writer, "\\\\"); break;
-                case '"': writer_printf(&ctx->writer, "\\\""); break;
-                case '\n': writer_printf(&ctx->writer, "\\n"); break;
-                case '\r': writer_printf(&ctx->writer, "\\r"); break;
-                case '\t': writer_printf(&ctx->writer, "\\t"); break;
+                case '\\': writer_puts(&ctx->writer, "\\\\"); break;
+                case '"': writer_puts(&ctx->writer, "\\\""); break;
+                case '\n': writer_puts(&ctx->writer, "\\n"); break;
+                case '\r': writer_puts(&ctx->writer, "\\r"); break;
+                case '\t': writer_puts(&ctx->writer, "\\t"); break;
                 default:
                     if (isprint(ch)) {
-                        fputc(ch, ctx->writer.file);
+                        writer_putc(&ctx->writer, (char)ch);
                     } else {
-                        writer_printf(&ctx->writer, "\\x%02X", ch);
+                        /* Octal escapes stop after three digits, unlike \x. */
+                        writer_printf(&ctx->writer, "\\%03o", ch);
                     }
                     break;
             }
         }
     }
-    writer_printf(&ctx->writer, "\")");
+    writer_puts(&ctx->writer, "\"");
 }
 
 static const char *cg_c_type_for(const CodegenContext *ctx, const char *type_name) {
     if (!type_name) {
         return "void *";
     }
-    if (strcmp(type_name, "int") == 0) {
+    const ASTSymbols *symbols = ast_symbols();
+    if (type_name == symbols->int_type) {
         return "int64_t";
     }
-    if (strcmp(type_name, "float") == 0) {
+    if (type_name == symbols->float_type) {
         return "double";
     }
-    if (strcmp(type_name, "bool") == 0) {
+    if (type_name == symbols->bool_type) {
         return "bool";
     }
-    if (strcmp(type_name, "string") == 0) {
+    if (type_name == symbols->string_type) {
         return "struct lz_string *";
     }
-    if (strcmp(type_name, "null") == 0) {
+    if (cg_type_is_future(type_name)) {
+        return "lz_future *";
+    }
+    if (cg_type_is_chan(type_name)) {
+        return "lz_chan *";
+    }
+    if (type_name == symbols->null_type) {
         return "void *";
     }
     if (cg_type_is_result(type_name)) {
@@ -872,34 +2626,44 @@ static const char *cg_c_type_for(const CodegenContext *ctx, const char *type_nam
     if (cg_type_is_maybe(type_name)) {
         return "lz_maybe";
     }
-    if (cg_type_is_struct(ctx, type_name)) {
-        return type_name;
+    const CGStructInfo *info = cg_find_struct(ctx, type_name);
+    if (info) {
+        return info->c_type;
     }
     return type_name;
 }
 
 static const char *cg_c_return_type_for(const CodegenContext *ctx, const char *type_name) {
-    if (!type_name || strcmp(type_name, "null") == 0) {
+    if (!type_name || type_name == ast_symbols()->null_type) {
         return "void";
     }
     return cg_c_type_for(ctx, type_name);
 }
 
-static const char *cg_assign_helper_for(const CodegenContext *ctx, const char *type_name) {
+static const char *cg_assign_helper_for(const CodegenContext *ctx,
+                                        const char *type_name,
+                                        bool owned) {
     if (!type_name) {
         return "lz_assign_ptr";
     }
-    if (strcmp(type_name, "int") == 0) {
+    const ASTSymbols *symbols = ast_symbols();
+    if (type_name == symbols->int_type) {
         return "lz_assign_int64";
     }
-    if (strcmp(type_name, "float") == 0) {
+    if (type_name == symbols->float_type) {
         return "lz_assign_double";
     }
-    if (strcmp(type_name, "bool") == 0) {
+    if (type_name == symbols->bool_type) {
         return "lz_assign_bool";
     }
-    if (strcmp(type_name, "string") == 0) {
-        return "lz_assign_string";
+    if (type_name == symbols->string_type) {
+        return owned ? "lz_assign_string_move" : "lz_assign_string";
+    }
+    if (cg_type_is_future(type_name)) {
+        return owned ? "lz_assign_future_move" : "lz_assign_future";
+    }
+    if (cg_type_is_chan(type_name)) {
+        return owned ? "lz_assign_chan_move" : "lz_assign_chan";
     }
     if (cg_type_is_result(type_name)) {
         return "lz_assign_result";
@@ -909,7 +2673,7 @@ static const char *cg_assign_helper_for(const CodegenContext *ctx, const char *t
     }
     const CGStructInfo *info = cg_find_struct(ctx, type_name);
     if (info) {
-        return info->assign_helper;
+        return owned ? info->move_helper : info->assign_helper;
     }
     return "lz_assign_ptr";
 }
@@ -950,47 +2714,306 @@ static void cg_emit_assignment_call(CodegenContext *ctx,
                                     const char *type_name,
                                     ASTNode *value) {
     writer_begin_line(&ctx->writer);
-    writer_printf(&ctx->writer, "%s(&%s, ", cg_assign_helper_for(ctx, type_name), target_name);
-    cg_emit_expression(ctx, value);
-    writer_printf(&ctx->writer, ");");
+    writer_printf(&ctx->writer,
+                  "%s(&%s, ",
+                  cg_assign_helper_for(ctx, type_name, cg_expr_is_owned(ctx, value)),
+                  target_name);
+    if (cg_is_builtin_call(value, ast_symbols()->chan) && cg_type_is_chan(type_name)) {
+        cg_emit_chan_new(ctx, (ASTCallExpr *)value, type_name);
+    } else {
+        cg_emit_expression(ctx, value);
+    }
+    writer_puts(&ctx->writer, ");");
     writer_end_line(&ctx->writer);
 }
 
-static bool cg_command_exists(const char *cmd) {
-    char command[256];
-    snprintf(command, sizeof(command), "command -v %s >/dev/null 2>&1", cmd);
-    int result = system(command);
-    return result == 0;
-}
-
-static bool cg_invoke_compiler(const char *compiler,
-                               const char *c_path,
-                               const char *binary_path) {
-    char command[1024];
-    const char *runtime_path = "src/runtime/runtime.c";
-    snprintf(command,
-             sizeof(command),
-             "%s -std=c11 -Wall -Wextra \"%s\" \"%s\" -o \"%s\"",
-             compiler,
-             c_path,
-             runtime_path,
-             binary_path);
-    int result = system(command);
-    if (result != 0) {
-        fprintf(stderr, "%s failed while building '%s'\n", compiler, binary_path);
+static void cg_command_push(CGCommand *command, const char *fmt, ...) {
+    if (command->count + 1 >= command->capacity) {
+        size_t new_capacity = command->capacity ? command->capacity * 2 : 16;
+        char **grown = realloc(command->items, new_capacity * sizeof(char *));
+        if (!grown) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        command->items = grown;
+        command->capacity = new_capacity;
+    }
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    char *item = malloc((size_t)length + 1);
+    if (!item) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    va_start(args, fmt);
+    vsnprintf(item, (size_t)length + 1, fmt, args);
+    va_end(args);
+    command->items[command->count++] = item;
+    command->items[command->count] = NULL;
+}
+
+static void cg_command_destroy(CGCommand *command) {
+    for (size_t i = 0; i < command->count; i++) {
+        free(command->items[i]);
+    }
+    free(command->items);
+    command->items = NULL;
+    command->count = 0;
+    command->capacity = 0;
+}
+
+/*
+ * The runtime is prebuilt by make as liblzrt.a next to lazylangc, with its
+ * header in include/ beside it, so both are found relative to the compiler
+ * executable rather than the working directory or a source checkout.
+ */
+bool codegen_locate_runtime(char *dir, size_t size) {
+    ssize_t length = readlink("/proc/self/exe", dir, size - 1);
+    if (length <= 0) {
+        fprintf(stderr, "failed to locate the lazylangc executable: %s\n", strerror(errno));
+        return false;
+    }
+    dir[length] = '\0';
+    char *slash = strrchr(dir, '/');
+    if (slash == dir) {
+        slash[1] = '\0';
+    } else if (slash) {
+        *slash = '\0';
+    }
+
+    char library[CG_PATH_CAPACITY];
+    snprintf(library, sizeof(library), "%s/%s", dir, RUNTIME_LIBRARY);
+    if (access(library, R_OK) != 0) {
+        fprintf(stderr, "runtime library '%s' not found; run make\n", library);
+        return false;
+    }
+    snprintf(library, sizeof(library), "%s/%s", dir, RUNTIME_HEADER);
+    if (access(library, R_OK) != 0) {
+        fprintf(stderr, "runtime header '%s' not found; run make\n", library);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Starts "<compiler> -std=c11 -Wall -Wextra -O<n> -pthread <flags> -I<runtime>"
+ * as an argv vector; arguments are never re-parsed by a shell, so paths need
+ * no quoting.
+ */
+static bool cg_begin_compiler_command(CGCommand *command,
+                                      const char *compiler,
+                                      const CodegenBuildFlags *flags,
+                                      char *runtime_dir,
+                                      size_t runtime_dir_size) {
+    if (!codegen_locate_runtime(runtime_dir, runtime_dir_size)) {
         return false;
     }
+    int level = flags->opt_level;
+    if (level < 0) level = 0;
+    if (level > 3) level = 3;
+    *command = (CGCommand){0};
+    cg_command_push(command, "%s", compiler);
+    cg_command_push(command, "-std=c11");
+    cg_command_push(command, "-Wall");
+    cg_command_push(command, "-Wextra");
+    cg_command_push(command, "-O%d", level);
+    /* The runtime's task scheduler runs on pthreads. */
+    cg_command_push(command, "-pthread");
+    if (flags->march_native) cg_command_push(command, "-march=native");
+    if (flags->lto) cg_command_push(command, "-flto");
+    if (flags->no_plt) cg_command_push(command, "-fno-plt");
+    cg_command_push(command, "-I%s/" RUNTIME_INCLUDE_DIR, runtime_dir);
     return true;
 }
 
-static bool cg_run_clang(const char *c_path, const char *binary_path) {
-    if (cg_command_exists("clang")) {
-        return cg_invoke_compiler("clang", c_path, binary_path);
+/*
+ * Streams `input` into the compiler's stdin. SIGPIPE is held off in this
+ * thread only, so a compiler that dies early shows up as a failed build
+ * rather than killing lazylangc (or another module's build thread).
+ */
+static void cg_feed_pipe(int fd, const CodeWriter *input) {
+    sigset_t pipe_signal;
+    sigset_t previous;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, &previous);
+
+    bool broken = false;
+    size_t written = 0;
+    while (written < input->length) {
+        ssize_t n = write(fd, input->data + written, input->length - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            broken = errno == EPIPE;
+            break;
+        }
+        written += (size_t)n;
+    }
+    close(fd);
+
+    if (broken) {
+        struct timespec no_wait = {0, 0};
+        sigtimedwait(&pipe_signal, NULL, &no_wait);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+/* Runs and releases `command`; with `input`, it is piped to the compiler's stdin. */
+static bool cg_run_command(CGCommand *command, const char *output_path, const CodeWriter *input) {
+    int pipe_fds[2] = { -1, -1 };
+    if (input && pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        fprintf(stderr, "failed to create a pipe: %s\n", strerror(errno));
+        cg_command_destroy(command);
+        return false;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (input) {
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[0], STDIN_FILENO);
+    }
+    /* Children start with default signal handling whatever the driver (or its server) changed. */
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTERM);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+    extern char **environ;
+    pid_t pid;
+    int spawn_error = posix_spawn(&pid, command->items[0], &actions, &attributes, command->items, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if (input) {
+        close(pipe_fds[0]);
+    }
+
+    bool ok = spawn_error == 0;
+    if (!ok) {
+        fprintf(stderr, "failed to run '%s': %s\n", command->items[0], strerror(spawn_error));
+        if (input) close(pipe_fds[1]);
+    } else {
+        if (input) {
+            cg_feed_pipe(pipe_fds[1], input);
+        }
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        if (!ok) {
+            fprintf(stderr, "%s failed while building '%s'\n", command->items[0], output_path);
+        }
+    }
+    cg_command_destroy(command);
+    return ok;
+}
+
+static bool cg_build_binary(const CodeWriter *source,
+                            const char *binary_path,
+                            const CodegenBuildFlags *flags) {
+    const char *compiler = codegen_find_compiler();
+    char runtime_dir[CG_PATH_CAPACITY];
+    CGCommand command;
+    if (!compiler || !cg_begin_compiler_command(&command, compiler, flags, runtime_dir, sizeof(runtime_dir))) {
+        return false;
+    }
+    /* "-x none" ends "-x c", so the runtime archive is not read as C. */
+    cg_command_push(&command, "-x");
+    cg_command_push(&command, "c");
+    cg_command_push(&command, "-");
+    cg_command_push(&command, "-x");
+    cg_command_push(&command, "none");
+    cg_command_push(&command, "%s/" RUNTIME_LIBRARY, runtime_dir);
+    cg_command_push(&command, "-o");
+    cg_command_push(&command, "%s", binary_path);
+    return cg_run_command(&command, binary_path, source);
+}
+
+bool codegen_compile_output(const char *compiler,
+                            const CodegenOutput *output,
+                            const char *object_path,
+                            const CodegenBuildFlags *flags) {
+    char runtime_dir[CG_PATH_CAPACITY];
+    CGCommand command;
+    if (!cg_begin_compiler_command(&command, compiler, flags, runtime_dir, sizeof(runtime_dir))) {
+        return false;
+    }
+    cg_command_push(&command, "-c");
+    cg_command_push(&command, "-x");
+    cg_command_push(&command, "c");
+    cg_command_push(&command, "-");
+    cg_command_push(&command, "-o");
+    cg_command_push(&command, "%s", object_path);
+    return cg_run_command(&command, object_path, &output->writer);
+}
+
+bool codegen_link(const char *compiler,
+                  const char *const *object_paths,
+                  size_t object_count,
+                  const char *binary_path,
+                  const CodegenBuildFlags *flags) {
+    char runtime_dir[CG_PATH_CAPACITY];
+    CGCommand command;
+    if (!cg_begin_compiler_command(&command, compiler, flags, runtime_dir, sizeof(runtime_dir))) {
+        return false;
+    }
+    for (size_t i = 0; i < object_count; i++) {
+        cg_command_push(&command, "%s", object_paths[i]);
+    }
+    cg_command_push(&command, "%s/" RUNTIME_LIBRARY, runtime_dir);
+    cg_command_push(&command, "-o");
+    cg_command_push(&command, "%s", binary_path);
+    return cg_run_command(&command, binary_path, NULL);
+}
+
+/* First executable `name` on PATH, as execvp would pick it, without asking a shell. */
+static bool cg_search_path(const char *name, char *result, size_t size) {
+    const char *path = getenv("PATH");
+    if (!path) {
+        path = "/usr/bin:/bin";
+    }
+    const char *start = path;
+    for (;;) {
+        const char *end = strchr(start, ':');
+        size_t length = end ? (size_t)(end - start) : strlen(start);
+        int written = snprintf(result,
+                               size,
+                               "%.*s/%s",
+                               (int)(length ? length : 1),
+                               length ? start : ".",
+                               name);
+        if (written > 0 && (size_t)written < size && access(result, X_OK) == 0) {
+            return true;
+        }
+        if (!end) break;
+        start = end + 1;
+    }
+    return false;
+}
+
+/* Looked up once per process; the compile server resolves it before forking builds. */
+const char *codegen_find_compiler(void) {
+    static char compiler[CG_PATH_CAPACITY];
+    static bool found = false;
+    if (found) {
+        return compiler;
+    }
+    if (cg_search_path("clang", compiler, sizeof(compiler))) {
+        found = true;
+        return compiler;
     }
     fprintf(stderr, "clang not found; attempting to use cc instead\n");
-    if (cg_command_exists("cc")) {
-        return cg_invoke_compiler("cc", c_path, binary_path);
+    if (cg_search_path("cc", compiler, sizeof(compiler))) {
+        found = true;
+        return compiler;
     }
     fprintf(stderr, "no suitable C compiler found (missing clang and cc)\n");
-    return false;
+    return NULL;
 }
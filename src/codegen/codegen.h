@@ -4,13 +4,60 @@
 #include "../ast/ast.h"
 
 #include <stdbool.h>
+#include <stddef.h>
+
+/* Flags forwarded to the C compiler that builds the final binary. */
+typedef struct {
+    int opt_level;     /* 0-3, mapped onto -O<n> */
+    bool march_native; /* -march=native */
+    bool lto;          /* -flto */
+    bool no_plt;       /* -fno-plt */
+} CodegenBuildFlags;
 
 typedef struct {
     const char *c_output_path;
     const char *binary_output_path;
     bool emit_binary;
+    bool emit_c; /* also write the C to c_output_path (always, without emit_binary) */
+    CodegenBuildFlags build;
 } CodegenOptions;
 
+/* Generates the program's C in memory and builds the binary from it in one compiler run. */
 bool codegen_emit(const ASTProgram *program, const CodegenOptions *options);
 
+/*
+ * Separate compilation for multi-module builds. Each module becomes one C
+ * translation unit; only the entry module (module_name == NULL) defines
+ * main(). These do no profiling and only share the (locked) interner, so the
+ * driver may run them for different modules concurrently. Generated C stays
+ * in memory and is piped to the compiler; writing it out is optional.
+ */
+typedef struct CodegenOutput CodegenOutput;
+
+/* NULL after a diagnostic if the program cannot be lowered. */
+CodegenOutput *codegen_generate(const ASTProgram *program);
+/*
+ * Incremental builds split a module further, into one translation unit per
+ * function plus one holding main(). Shards carry the module's types and
+ * prototypes, so each compiles on its own and only edited ones need to.
+ */
+CodegenOutput *codegen_generate_function_shard(const ASTProgram *program, const ASTFunctionDecl *fn);
+CodegenOutput *codegen_generate_entry_shard(const ASTProgram *program);
+bool codegen_output_write(const CodegenOutput *output, const char *c_path);
+void codegen_output_free(CodegenOutput *output);
+/* Path of the first clang on PATH, else of cc; NULL (after a diagnostic) if neither is. Cached. */
+const char *codegen_find_compiler(void);
+bool codegen_compile_output(const char *compiler,
+                            const CodegenOutput *output,
+                            const char *object_path,
+                            const CodegenBuildFlags *flags);
+bool codegen_link(const char *compiler,
+                  const char *const *object_paths,
+                  size_t object_count,
+                  const char *binary_path,
+                  const CodegenBuildFlags *flags);
+
+/* Directory holding liblzrt.a and include/runtime.h, i.e. the one lazylangc lives in. */
+bool codegen_locate_runtime(char *dir, size_t size);
+
 #endif
@@ -0,0 +1,40 @@
+#include "diag.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static _Thread_local DiagScope *diag_current;
+
+void diag_enter(DiagScope *scope, const char *path) {
+    scope->path = path;
+    scope->silent = false;
+    scope->previous = diag_current;
+    diag_current = scope;
+}
+
+void diag_leave(DiagScope *scope) {
+    diag_current = scope->previous;
+}
+
+_Noreturn void diag_error(const char *format, ...) {
+    char message[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    /* One call per diagnostic, so modules failing at once do not interleave. */
+    DiagScope *scope = diag_current;
+    if (scope && scope->silent) {
+        /* reported by whoever repeats the work */
+    } else if (scope && scope->path) {
+        fprintf(stderr, "%s: %s", scope->path, message);
+    } else {
+        fputs(message, stderr);
+    }
+    if (scope) {
+        longjmp(scope->jump, 1);
+    }
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,41 @@
+#ifndef LZ_DIAG_H
+#define LZ_DIAG_H
+
+#include <setjmp.h>
+#include <stdbool.h>
+
+/*
+ * User-facing compile errors (lexer, parser, sema, imports). Outside a
+ * scope, diag_error prints the message and exits, as errors always have.
+ * The module driver opens a scope around each module's work: inside it,
+ * messages are prefixed with the module's path and diag_error unwinds to
+ * the scope's jmp_buf instead of exiting, so modules handled on pool
+ * threads never call exit() concurrently. The driver marks the module as
+ * failed and exits from the main thread once the pool is idle.
+ *
+ *     DiagScope scope;
+ *     diag_enter(&scope, path);
+ *     if (setjmp(scope.jump) == 0) {
+ *         ...work that may call diag_error...
+ *     } else {
+ *         ...the error has been printed...
+ *     }
+ *     diag_leave(&scope);
+ *
+ * Scopes are per thread and nest. A silent scope unwinds without printing,
+ * for work whose errors someone else reports later.
+ */
+typedef struct DiagScope {
+    jmp_buf jump;
+    const char *path;
+    bool silent;
+    struct DiagScope *previous;
+} DiagScope;
+
+void diag_enter(DiagScope *scope, const char *path);
+void diag_leave(DiagScope *scope);
+
+/* Prints "<path>: " and the printf-style message as one write, then fails. */
+_Noreturn void diag_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+#endif
@@ -0,0 +1,450 @@
+#define _DEFAULT_SOURCE
+
+#include "builddb.h"
+
+#include "cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BUILDDB_FORMAT_VERSION 1
+#define BUILDDB_MANIFEST "manifest"
+#define BUILDDB_MANIFEST_TMP "manifest.tmp"
+
+/* Hashing state for one module: the functions its code can name and the structs it can see. */
+typedef struct {
+    CacheHasher hasher;
+    ASTSymbolMap functions; /* name -> position in `owners` + 1 */
+    const ASTFunctionDecl **decls;
+    const char **owners; /* module name per entry of `decls` */
+    size_t count;
+} BuildDbScope;
+
+static void *builddb_xmalloc(size_t size) {
+    void *result = malloc(size ? size : 1);
+    if (!result) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+static void builddb_hash_name(CacheHasher *hasher, const char *name) {
+    cache_hash_u64(hasher, name != NULL);
+    if (name) {
+        cache_hash_str(hasher, name);
+    }
+}
+
+bool builddb_open(BuildDb *db, const char *c_output_path, const CodegenBuildFlags *flags) {
+    memset(db, 0, sizeof(*db));
+    ast_symbol_map_init(&db->previous_index);
+    cache_environment_key(flags, db->environment);
+
+    size_t stem = strlen(c_output_path);
+    if (stem >= 2 && strcmp(c_output_path + stem - 2, ".c") == 0) {
+        stem -= 2;
+    }
+    db->dir = builddb_xmalloc(stem + sizeof(".lzdb"));
+    memcpy(db->dir, c_output_path, stem);
+    memcpy(db->dir + stem, ".lzdb", sizeof(".lzdb"));
+    if (mkdir(db->dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create build database '%s'\n", db->dir);
+        return false;
+    }
+
+    char *manifest_path = builddb_shard_path(db, BUILDDB_MANIFEST, NULL);
+    FILE *manifest = fopen(manifest_path, "r");
+    free(manifest_path);
+    if (!manifest) {
+        return true;
+    }
+
+    /* An unreadable or foreign manifest is the same as none: everything rebuilds. */
+    char line[4096];
+    int version = 0;
+    char environment[33] = "";
+    if (fgets(line, sizeof(line), manifest) &&
+        sscanf(line, "lazylang-builddb %d %32s", &version, environment) == 2 &&
+        version == BUILDDB_FORMAT_VERSION &&
+        strcmp(environment, db->environment) == 0) {
+        size_t capacity = 0;
+        while (fgets(line, sizeof(line), manifest)) {
+            char key[33];
+            char shard[4000];
+            if (sscanf(line, "%32s %3999s", key, shard) != 2 || strlen(key) != 32) {
+                continue;
+            }
+            if (db->previous_count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                BuildDbEntry *grown = realloc(db->previous, capacity * sizeof(BuildDbEntry));
+                if (!grown) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                db->previous = grown;
+            }
+            BuildDbEntry *entry = &db->previous[db->previous_count++];
+            entry->shard = ast_intern_cstr(shard);
+            memcpy(entry->key, key, sizeof(entry->key));
+            ast_symbol_map_set(&db->previous_index, entry->shard, db->previous_count);
+        }
+    }
+    fclose(manifest);
+    return true;
+}
+
+void builddb_close(BuildDb *db) {
+    free(db->dir);
+    free(db->previous);
+    free(db->current);
+    ast_symbol_map_destroy(&db->previous_index);
+}
+
+const char *builddb_function_shard(const char *module_name, const ASTFunctionDecl *fn) {
+    if (!module_name) {
+        return fn->name;
+    }
+    size_t module_length = strlen(module_name);
+    size_t name_length = strlen(fn->name);
+    char *shard = builddb_xmalloc(module_length + name_length + 2);
+    memcpy(shard, module_name, module_length);
+    shard[module_length] = '.';
+    memcpy(shard + module_length + 1, fn->name, name_length + 1);
+    const char *interned = ast_intern_cstr(shard);
+    free(shard);
+    return interned;
+}
+
+/* What callers depend on: where the function lives and how it is called. */
+static void builddb_hash_signature(CacheHasher *hasher, const char *owner, const ASTFunctionDecl *fn) {
+    builddb_hash_name(hasher, owner);
+    builddb_hash_name(hasher, fn->name);
+    cache_hash_u64(hasher, fn->is_public);
+    cache_hash_u64(hasher, fn->params.count);
+    for (size_t i = 0; i < fn->params.count; i++) {
+        const ASTFunctionParam *param = fn->params.items[i];
+        builddb_hash_name(hasher, param->type_name);
+    }
+    builddb_hash_name(hasher, fn->return_type);
+}
+
+static void builddb_hash_struct(CacheHasher *hasher, const char *owner, const ASTStructDecl *decl) {
+    builddb_hash_name(hasher, owner);
+    builddb_hash_name(hasher, decl->name);
+    cache_hash_u64(hasher, decl->is_public);
+    cache_hash_u64(hasher, decl->fields.count);
+    for (size_t i = 0; i < decl->fields.count; i++) {
+        const ASTStructField *field = decl->fields.items[i];
+        builddb_hash_name(hasher, field->name);
+        builddb_hash_name(hasher, field->type_name);
+    }
+}
+
+static void builddb_scope_add(BuildDbScope *scope, const char *owner, const ASTFunctionDecl *fn) {
+    if (ast_symbol_map_get(&scope->functions, fn->name)) {
+        return;
+    }
+    scope->decls[scope->count] = fn;
+    scope->owners[scope->count] = owner;
+    scope->count++;
+    ast_symbol_map_set(&scope->functions, fn->name, scope->count);
+}
+
+/*
+ * Mirrors what sema and codegen let a module see: its own declarations and
+ * the pub ones of the modules it imports. The resulting hasher state is the
+ * common prefix of every function key in the module.
+ */
+static void builddb_scope_init(BuildDbScope *scope, const BuildDb *db, const ASTProgram *program) {
+    size_t capacity = program->declarations.count;
+    for (size_t d = 0; d < program->dependencies.count; d++) {
+        const ASTProgram *dependency = program->dependencies.items[d];
+        capacity += dependency->declarations.count;
+    }
+    ast_symbol_map_init(&scope->functions);
+    scope->decls = builddb_xmalloc(capacity * sizeof(*scope->decls));
+    scope->owners = builddb_xmalloc(capacity * sizeof(*scope->owners));
+    scope->count = 0;
+
+    CacheHasher *hasher = &scope->hasher;
+    cache_hasher_init(hasher);
+    cache_hash_u64(hasher, BUILDDB_FORMAT_VERSION);
+    cache_hash_str(hasher, db->environment);
+    builddb_hash_name(hasher, program->module_name);
+
+    for (size_t i = 0; i < program->declarations.count; i++) {
+        const ASTNode *node = program->declarations.items[i];
+        if (node->kind == AST_NODE_FUNCTION) {
+            builddb_scope_add(scope, program->module_name, (const ASTFunctionDecl *)node);
+        } else if (node->kind == AST_NODE_STRUCT) {
+            builddb_hash_struct(hasher, program->module_name, (const ASTStructDecl *)node);
+        }
+    }
+    for (size_t d = 0; d < program->dependencies.count; d++) {
+        const ASTProgram *dependency = program->dependencies.items[d];
+        for (size_t i = 0; i < dependency->declarations.count; i++) {
+            const ASTNode *node = dependency->declarations.items[i];
+            if (node->kind == AST_NODE_FUNCTION && ((const ASTFunctionDecl *)node)->is_public) {
+                builddb_scope_add(scope, dependency->module_name, (const ASTFunctionDecl *)node);
+            } else if (node->kind == AST_NODE_STRUCT && ((const ASTStructDecl *)node)->is_public) {
+                builddb_hash_struct(hasher, dependency->module_name, (const ASTStructDecl *)node);
+            }
+        }
+    }
+}
+
+static void builddb_scope_destroy(BuildDbScope *scope) {
+    ast_symbol_map_destroy(&scope->functions);
+    free(scope->decls);
+    free(scope->owners);
+}
+
+static void builddb_hash_node(const BuildDbScope *scope, CacheHasher *hasher, const ASTNode *node);
+
+static void builddb_hash_block(const BuildDbScope *scope, CacheHasher *hasher, const ASTBlock *block) {
+    if (!block) {
+        cache_hash_u64(hasher, UINT64_MAX);
+        return;
+    }
+    cache_hash_u64(hasher, block->statements.count);
+    for (size_t i = 0; i < block->statements.count; i++) {
+        builddb_hash_node(scope, hasher, block->statements.items[i]);
+    }
+}
+
+/* Structure and spelling only; token positions are left out so moving code does not rebuild it. */
+static void builddb_hash_node(const BuildDbScope *scope, CacheHasher *hasher, const ASTNode *node) {
+    if (!node) {
+        cache_hash_u64(hasher, UINT64_MAX);
+        return;
+    }
+    cache_hash_u64(hasher, node->kind);
+    switch (node->kind) {
+        case AST_NODE_BLOCK:
+            builddb_hash_block(scope, hasher, (const ASTBlock *)node);
+            break;
+        case AST_NODE_VAR_DECL: {
+            const ASTVarDecl *decl = (const ASTVarDecl *)node;
+            cache_hash_u64(hasher, decl->is_mutable);
+            builddb_hash_name(hasher, decl->name);
+            builddb_hash_name(hasher, decl->type_name);
+            builddb_hash_node(scope, hasher, decl->initializer);
+            break;
+        }
+        case AST_NODE_ASSIGN: {
+            const ASTAssignStmt *assign = (const ASTAssignStmt *)node;
+            builddb_hash_name(hasher, assign->target);
+            builddb_hash_node(scope, hasher, assign->value);
+            break;
+        }
+        case AST_NODE_IF: {
+            const ASTIfStmt *stmt = (const ASTIfStmt *)node;
+            builddb_hash_node(scope, hasher, stmt->condition);
+            builddb_hash_block(scope, hasher, stmt->then_block);
+            builddb_hash_block(scope, hasher, stmt->else_block);
+            break;
+        }
+        case AST_NODE_FOR: {
+            const ASTForStmt *stmt = (const ASTForStmt *)node;
+            builddb_hash_name(hasher, stmt->iterator);
+            builddb_hash_node(scope, hasher, stmt->iterable);
+            builddb_hash_block(scope, hasher, stmt->body);
+            break;
+        }
+        case AST_NODE_RETURN:
+            builddb_hash_node(scope, hasher, ((const ASTReturnStmt *)node)->value);
+            break;
+        case AST_NODE_EXPR_STMT:
+            builddb_hash_node(scope, hasher, ((const ASTExprStmt *)node)->expr);
+            break;
+        case AST_NODE_EXPR_LITERAL: {
+            const ASTLiteralExpr *literal = (const ASTLiteralExpr *)node;
+            cache_hash_u64(hasher, literal->literal_kind);
+            cache_hash_u64(hasher, literal->text_length);
+            if (literal->text) {
+                cache_hash_bytes(hasher, literal->text, literal->text_length);
+            }
+            cache_hash_u64(hasher, literal->bool_value);
+            break;
+        }
+        case AST_NODE_EXPR_IDENTIFIER: {
+            /* A name may resolve to a function; its signature is part of this function's key. */
+            const char *name = ((const ASTIdentifierExpr *)node)->name;
+            builddb_hash_name(hasher, name);
+            size_t entry = ast_symbol_map_get(&scope->functions, name);
+            cache_hash_u64(hasher, entry != 0);
+            if (entry) {
+                builddb_hash_signature(hasher, scope->owners[entry - 1], scope->decls[entry - 1]);
+            }
+            break;
+        }
+        case AST_NODE_EXPR_CALL: {
+            const ASTCallExpr *call = (const ASTCallExpr *)node;
+            builddb_hash_node(scope, hasher, call->callee);
+            cache_hash_u64(hasher, call->arguments.count);
+            for (size_t i = 0; i < call->arguments.count; i++) {
+                builddb_hash_node(scope, hasher, call->arguments.items[i]);
+            }
+            break;
+        }
+        case AST_NODE_EXPR_BINARY: {
+            const ASTBinaryExpr *binary = (const ASTBinaryExpr *)node;
+            cache_hash_u64(hasher, binary->op);
+            builddb_hash_node(scope, hasher, binary->left);
+            builddb_hash_node(scope, hasher, binary->right);
+            break;
+        }
+        case AST_NODE_EXPR_TASK:
+            builddb_hash_block(scope, hasher, ((const ASTTaskExpr *)node)->body);
+            break;
+        default:
+            break;
+    }
+}
+
+void builddb_program_keys(const BuildDb *db, const ASTProgram *program, char (*keys)[33]) {
+    BuildDbScope scope;
+    builddb_scope_init(&scope, db, program);
+    for (size_t i = 0; i < program->declarations.count; i++) {
+        const ASTNode *node = program->declarations.items[i];
+        if (node->kind != AST_NODE_FUNCTION) {
+            continue;
+        }
+        const ASTFunctionDecl *fn = (const ASTFunctionDecl *)node;
+        CacheHasher hasher = scope.hasher;
+        builddb_hash_signature(&hasher, program->module_name, fn);
+        cache_hash_u64(&hasher, fn->params.count);
+        for (size_t p = 0; p < fn->params.count; p++) {
+            const ASTFunctionParam *param = fn->params.items[p];
+            builddb_hash_name(&hasher, param->name);
+        }
+        builddb_hash_block(&scope, &hasher, fn->body);
+        cache_hasher_format(&hasher, keys[i]);
+    }
+    builddb_scope_destroy(&scope);
+}
+
+void builddb_entry_key(const BuildDb *db, const ASTProgram *program, char key[33]) {
+    CacheHasher hasher;
+    cache_hasher_init(&hasher);
+    cache_hash_u64(&hasher, BUILDDB_FORMAT_VERSION);
+    cache_hash_str(&hasher, db->environment);
+    cache_hash_str(&hasher, BUILDDB_ENTRY_SHARD);
+
+    /* main() only calls the entry module's own main, if there is one. */
+    const ASTFunctionDecl *main_fn = NULL;
+    for (size_t i = 0; i < program->declarations.count && !main_fn; i++) {
+        const ASTNode *node = program->declarations.items[i];
+        if (node->kind == AST_NODE_FUNCTION &&
+            ((const ASTFunctionDecl *)node)->name == ast_symbols()->main) {
+            main_fn = (const ASTFunctionDecl *)node;
+        }
+    }
+    cache_hash_u64(&hasher, main_fn != NULL);
+    if (main_fn) {
+        builddb_hash_signature(&hasher, program->module_name, main_fn);
+    }
+    cache_hasher_format(&hasher, key);
+}
+
+char *builddb_shard_path(const BuildDb *db, const char *shard, const char *extension) {
+    size_t length = strlen(db->dir) + strlen(shard) + (extension ? strlen(extension) + 1 : 0) + 2;
+    char *path = builddb_xmalloc(length);
+    snprintf(path,
+             length,
+             "%s/%s%s%s",
+             db->dir,
+             shard,
+             extension ? "." : "",
+             extension ? extension : "");
+    return path;
+}
+
+bool builddb_is_fresh(const BuildDb *db, const char *shard, const char key[33]) {
+    size_t entry = ast_symbol_map_get(&db->previous_index, shard);
+    if (!entry || memcmp(db->previous[entry - 1].key, key, 32) != 0) {
+        return false;
+    }
+    char *object_path = builddb_shard_path(db, shard, "o");
+    bool exists = access(object_path, R_OK) == 0;
+    free(object_path);
+    return exists;
+}
+
+void builddb_record(BuildDb *db, const char *shard, const char key[33]) {
+    if (db->current_count == db->current_capacity) {
+        size_t new_capacity = db->current_capacity ? db->current_capacity * 2 : 64;
+        BuildDbEntry *grown = realloc(db->current, new_capacity * sizeof(BuildDbEntry));
+        if (!grown) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        db->current = grown;
+        db->current_capacity = new_capacity;
+    }
+    BuildDbEntry *entry = &db->current[db->current_count++];
+    entry->shard = shard;
+    memcpy(entry->key, key, sizeof(entry->key));
+}
+
+/* Deletes <shard>.c and <shard>.o files of shards this build did not record. */
+static void builddb_remove_orphans(const BuildDb *db) {
+    ASTSymbolMap recorded;
+    ast_symbol_map_init(&recorded);
+    for (size_t i = 0; i < db->current_count; i++) {
+        ast_symbol_map_set(&recorded, db->current[i].shard, i + 1);
+    }
+
+    DIR *dir = opendir(db->dir);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t length = strlen(entry->d_name);
+            if (length < 3 || entry->d_name[length - 2] != '.' ||
+                (entry->d_name[length - 1] != 'c' && entry->d_name[length - 1] != 'o')) {
+                continue;
+            }
+            const char *shard = ast_intern(entry->d_name, length - 2);
+            if (ast_symbol_map_get(&recorded, shard)) {
+                continue;
+            }
+            char *path = builddb_shard_path(db, entry->d_name, NULL);
+            unlink(path);
+            free(path);
+        }
+        closedir(dir);
+    }
+    ast_symbol_map_destroy(&recorded);
+}
+
+bool builddb_save(BuildDb *db) {
+    char *tmp_path = builddb_shard_path(db, BUILDDB_MANIFEST_TMP, NULL);
+    char *manifest_path = builddb_shard_path(db, BUILDDB_MANIFEST, NULL);
+    FILE *out = fopen(tmp_path, "w");
+    bool ok = out != NULL;
+    if (ok) {
+        fprintf(out, "lazylang-builddb %d %s\n", BUILDDB_FORMAT_VERSION, db->environment);
+        for (size_t i = 0; i < db->current_count; i++) {
+            fprintf(out, "%s %s\n", db->current[i].key, db->current[i].shard);
+        }
+        ok = fclose(out) == 0;
+    }
+    ok = ok && rename(tmp_path, manifest_path) == 0;
+    if (!ok) {
+        fprintf(stderr, "failed to write build database manifest '%s'\n", manifest_path);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(manifest_path);
+    if (ok) {
+        builddb_remove_orphans(db);
+    }
+    return ok;
+}
@@ -0,0 +1,70 @@
+#ifndef LZ_DRIVER_BUILDDB_H
+#define LZ_DRIVER_BUILDDB_H
+
+#include "../ast/ast.h"
+#include "../ast/symtab.h"
+#include "../codegen/codegen.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BUILDDB_ENTRY_SHARD "entry-point"
+
+/*
+ * Persistent state of --incremental builds, kept next to the C output in
+ * <stem>.lzdb/. Every function is its own shard (<shard>.o, plus <shard>.c
+ * with --emit-c) named after the function, prefixed with its module for imported modules
+ * ("a.b.f"); main() lives in BUILDDB_ENTRY_SHARD. The manifest maps each
+ * shard to the key of the inputs its object was built from:
+ *
+ *   lazylang-builddb 1 <environment key>
+ *   <key> <shard>
+ *   ...
+ *
+ * A function's key covers its own AST (not its position in the file), the
+ * signatures of the functions it names, and every struct its module can
+ * see. Shards whose key is unchanged and whose object exists are reused as
+ * they are. A different compiler, runtime, toolchain or set of build flags
+ * discards the whole manifest.
+ */
+typedef struct {
+    const char *shard; /* interned */
+    char key[33];
+} BuildDbEntry;
+
+typedef struct {
+    char *dir;
+    char environment[33];
+    BuildDbEntry *previous; /* as loaded from the manifest */
+    size_t previous_count;
+    ASTSymbolMap previous_index; /* shard -> previous position + 1 */
+    BuildDbEntry *current; /* recorded by this build */
+    size_t current_count;
+    size_t current_capacity;
+} BuildDb;
+
+/* Creates the database directory if needed; false if it cannot be used. */
+bool builddb_open(BuildDb *db, const char *c_output_path, const CodegenBuildFlags *flags);
+void builddb_close(BuildDb *db);
+
+/* Interned shard name of `fn` in the module named `module_name` (NULL for the entry file). */
+const char *builddb_function_shard(const char *module_name, const ASTFunctionDecl *fn);
+/* keys[i] receives the key of declarations.items[i]; entries of non-functions are left alone. */
+void builddb_program_keys(const BuildDb *db, const ASTProgram *program, char (*keys)[33]);
+void builddb_entry_key(const BuildDb *db, const ASTProgram *program, char key[33]);
+
+/* True when the last build left an object for `shard` built from `key`. */
+bool builddb_is_fresh(const BuildDb *db, const char *shard, const char key[33]);
+/* Marks `shard` as built from `key`; only recorded shards survive builddb_save. */
+void builddb_record(BuildDb *db, const char *shard, const char key[33]);
+/*
+ * Replaces the manifest with the recorded shards and removes the files of
+ * every other shard. Called once before compiling, with the reusable shards
+ * only, so an interrupted build never leaves a key next to a newer object.
+ */
+bool builddb_save(BuildDb *db);
+
+/* Malloc'd path of <dir>/<shard>.<extension>. */
+char *builddb_shard_path(const BuildDb *db, const char *shard, const char *extension);
+
+#endif
@@ -0,0 +1,393 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_FORMAT_VERSION 1
+#define CACHE_DEFAULT_MAX_MB 256
+#define CACHE_STALE_TMP_SECONDS 3600
+#define CACHE_C_FILE "program.c"
+#define CACHE_BINARY_FILE "program"
+
+typedef struct {
+    char name[64];
+    time_t mtime;
+    uint64_t bytes;
+} CacheEntry;
+
+void cache_hasher_init(CacheHasher *hasher) {
+    hasher->a = 14695981039346656037ull;
+    hasher->b = 0x84222325cbf29ce4ull;
+}
+
+void cache_hash_bytes(CacheHasher *hasher, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hasher->a = (hasher->a ^ bytes[i]) * 1099511628211ull;
+        hasher->b = (hasher->b ^ bytes[i] ^ (hasher->a >> 29)) * 0x100000001b3ull;
+    }
+}
+
+void cache_hash_str(CacheHasher *hasher, const char *text) {
+    cache_hash_bytes(hasher, text, strlen(text) + 1);
+}
+
+void cache_hash_u64(CacheHasher *hasher, uint64_t value) {
+    cache_hash_bytes(hasher, &value, sizeof(value));
+}
+
+/* A file is identified by path, size and modification time; missing files hash too. */
+static void cache_hash_file_identity(CacheHasher *hasher, const char *path) {
+    struct stat info;
+    cache_hash_str(hasher, path);
+    if (stat(path, &info) != 0) {
+        cache_hash_u64(hasher, UINT64_MAX);
+        return;
+    }
+    cache_hash_u64(hasher, (uint64_t)info.st_size);
+    cache_hash_u64(hasher, (uint64_t)info.st_ino);
+    cache_hash_u64(hasher, (uint64_t)info.st_mtim.tv_sec);
+    cache_hash_u64(hasher, (uint64_t)info.st_mtim.tv_nsec);
+}
+
+/* The compiler codegen will actually run, so the key can never name a different one. */
+static void cache_hash_toolchain(CacheHasher *hasher) {
+    const char *compiler = codegen_find_compiler();
+    if (!compiler) {
+        cache_hash_u64(hasher, 0);
+        return;
+    }
+    cache_hash_file_identity(hasher, compiler);
+}
+
+static bool cache_make_dirs(char *path) {
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        int status = mkdir(path, 0755);
+        *p = '/';
+        if (status != 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+static bool cache_resolve_root(char *root, size_t size) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int written;
+    if (xdg && xdg[0] == '/') {
+        written = snprintf(root, size, "%s/lazylang", xdg);
+    } else if (home && home[0] == '/') {
+        written = snprintf(root, size, "%s/.cache/lazylang", home);
+    } else {
+        return false;
+    }
+    return written > 0 && (size_t)written < size;
+}
+
+/* Everything but the program itself: compiler, runtime, toolchain and flags. */
+static void cache_hash_environment(CacheHasher *hasher, const CodegenBuildFlags *flags) {
+    cache_hash_u64(hasher, CACHE_FORMAT_VERSION);
+    cache_hash_str(hasher, LAZYLANG_VERSION);
+    cache_hash_file_identity(hasher, "/proc/self/exe");
+
+    char runtime_dir[CACHE_PATH_CAPACITY];
+    char runtime_file[CACHE_PATH_CAPACITY + 32];
+    if (codegen_locate_runtime(runtime_dir, sizeof(runtime_dir))) {
+        snprintf(runtime_file, sizeof(runtime_file), "%s/liblzrt.a", runtime_dir);
+        cache_hash_file_identity(hasher, runtime_file);
+        snprintf(runtime_file, sizeof(runtime_file), "%s/include/runtime.h", runtime_dir);
+        cache_hash_file_identity(hasher, runtime_file);
+    }
+    cache_hash_toolchain(hasher);
+
+    cache_hash_u64(hasher, (uint64_t)flags->opt_level);
+    cache_hash_u64(hasher, flags->march_native);
+    cache_hash_u64(hasher, flags->lto);
+    cache_hash_u64(hasher, flags->no_plt);
+}
+
+void cache_hasher_format(const CacheHasher *hasher, char key[33]) {
+    snprintf(key, 33, "%016llx%016llx", (unsigned long long)hasher->a, (unsigned long long)hasher->b);
+}
+
+void cache_environment_key(const CodegenBuildFlags *flags, char key[33]) {
+    CacheHasher hasher;
+    cache_hasher_init(&hasher);
+    cache_hash_environment(&hasher, flags);
+    cache_hasher_format(&hasher, key);
+}
+
+void cache_open(CompileCache *cache,
+                const CacheSource *sources,
+                size_t source_count,
+                const CodegenBuildFlags *flags) {
+    cache->enabled = false;
+    cache->key[0] = '\0';
+    if (!cache_resolve_root(cache->root, sizeof(cache->root)) ||
+        !cache_make_dirs(cache->root)) {
+        return;
+    }
+
+    CacheHasher hasher;
+    cache_hasher_init(&hasher);
+    cache_hash_environment(&hasher, flags);
+
+    cache_hash_u64(&hasher, (uint64_t)source_count);
+    for (size_t i = 0; i < source_count; i++) {
+        cache_hash_str(&hasher, sources[i].name ? sources[i].name : "");
+        cache_hash_u64(&hasher, (uint64_t)sources[i].length);
+        cache_hash_bytes(&hasher, sources[i].data, sources[i].length);
+    }
+
+    cache_hasher_format(&hasher, cache->key);
+    cache->enabled = true;
+}
+
+/* Replaces `to` instead of writing through it, so running binaries and links are safe. */
+static bool cache_copy_file(const char *from, const char *to, mode_t mode) {
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+    unlink(to);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    bool ok = true;
+    char buffer[64 * 1024];
+    for (;;) {
+        ssize_t n = read(in, buffer, sizeof(buffer));
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ok = false;
+            break;
+        }
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = write(out, buffer + done, (size_t)(n - done));
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                ok = false;
+                break;
+            }
+            done += w;
+        }
+        if (!ok) break;
+    }
+    close(in);
+    if (close(out) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+static void cache_entry_path(const CompileCache *cache,
+                             const char *entry,
+                             const char *file,
+                             char *path,
+                             size_t size) {
+    snprintf(path, size, "%s/%s/%s", cache->root, entry, file);
+}
+
+bool cache_restore(const CompileCache *cache,
+                   const char *c_output_path,
+                   const char *binary_output_path) {
+    if (!cache->enabled) {
+        return false;
+    }
+    char c_file[CACHE_PATH_CAPACITY + 64];
+    char binary_file[CACHE_PATH_CAPACITY + 64];
+    cache_entry_path(cache, cache->key, CACHE_C_FILE, c_file, sizeof(c_file));
+    cache_entry_path(cache, cache->key, CACHE_BINARY_FILE, binary_file, sizeof(binary_file));
+    if (access(binary_file, R_OK) != 0) {
+        return false;
+    }
+    if ((c_output_path && !cache_copy_file(c_file, c_output_path, 0644)) ||
+        !cache_copy_file(binary_file, binary_output_path, 0755)) {
+        return false;
+    }
+
+    /* Entry directory mtime doubles as the LRU timestamp. */
+    char entry_dir[CACHE_PATH_CAPACITY + 64];
+    snprintf(entry_dir, sizeof(entry_dir), "%s/%s", cache->root, cache->key);
+    utimensat(AT_FDCWD, entry_dir, NULL, 0);
+    return true;
+}
+
+static uint64_t cache_remove_dir(const char *path) {
+    uint64_t bytes = 0;
+    DIR *dir = opendir(path);
+    if (dir) {
+        struct dirent *item;
+        while ((item = readdir(dir)) != NULL) {
+            if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+                continue;
+            }
+            char file[CACHE_PATH_CAPACITY + 512];
+            struct stat info;
+            snprintf(file, sizeof(file), "%s/%s", path, item->d_name);
+            if (stat(file, &info) == 0) {
+                bytes += (uint64_t)info.st_size;
+            }
+            unlink(file);
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+    return bytes;
+}
+
+static uint64_t cache_dir_size(const char *path) {
+    uint64_t bytes = 0;
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL) {
+        char file[CACHE_PATH_CAPACITY + 512];
+        struct stat info;
+        snprintf(file, sizeof(file), "%s/%s", path, item->d_name);
+        if (item->d_name[0] != '.' && stat(file, &info) == 0) {
+            bytes += (uint64_t)info.st_size;
+        }
+    }
+    closedir(dir);
+    return bytes;
+}
+
+static int cache_entry_compare(const void *lhs, const void *rhs) {
+    const CacheEntry *a = lhs;
+    const CacheEntry *b = rhs;
+    return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+static uint64_t cache_size_limit(void) {
+    const char *value = getenv("LAZYLANG_CACHE_MAX_MB");
+    if (value && *value) {
+        char *end = NULL;
+        unsigned long long mb = strtoull(value, &end, 10);
+        if (end && *end == '\0') {
+            return (uint64_t)mb * 1024 * 1024;
+        }
+    }
+    return (uint64_t)CACHE_DEFAULT_MAX_MB * 1024 * 1024;
+}
+
+/* Drops least recently used entries until the cache fits its size limit. */
+static void cache_evict(const CompileCache *cache) {
+    DIR *dir = opendir(cache->root);
+    if (!dir) {
+        return;
+    }
+
+    CacheEntry *entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    uint64_t total = 0;
+    time_t now = time(NULL);
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL) {
+        char path[CACHE_PATH_CAPACITY + 512];
+        struct stat info;
+        snprintf(path, sizeof(path), "%s/%s", cache->root, item->d_name);
+        if (item->d_name[0] == '.') {
+            /* Staging directories left behind by interrupted stores. */
+            if (strncmp(item->d_name, ".tmp-", 5) == 0 && stat(path, &info) == 0 &&
+                now - info.st_mtim.tv_sec > CACHE_STALE_TMP_SECONDS) {
+                cache_remove_dir(path);
+            }
+            continue;
+        }
+        size_t name_length = strlen(item->d_name);
+        if (name_length >= sizeof(entries[0].name) ||
+            stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+            continue;
+        }
+        if (count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 64;
+            CacheEntry *new_entries = realloc(entries, new_capacity * sizeof(CacheEntry));
+            if (!new_entries) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            entries = new_entries;
+            capacity = new_capacity;
+        }
+        CacheEntry *entry = &entries[count++];
+        memcpy(entry->name, item->d_name, name_length + 1);
+        entry->mtime = info.st_mtim.tv_sec;
+        entry->bytes = cache_dir_size(path);
+        total += entry->bytes;
+    }
+    closedir(dir);
+
+    uint64_t limit = cache_size_limit();
+    if (total > limit) {
+        qsort(entries, count, sizeof(CacheEntry), cache_entry_compare);
+        for (size_t i = 0; i < count && total > limit; i++) {
+            if (strcmp(entries[i].name, cache->key) == 0) {
+                continue;
+            }
+            char path[CACHE_PATH_CAPACITY + 64];
+            snprintf(path, sizeof(path), "%s/%s", cache->root, entries[i].name);
+            cache_remove_dir(path);
+            total -= entries[i].bytes;
+        }
+    }
+    free(entries);
+}
+
+void cache_store(const CompileCache *cache,
+                 const char *c_output_path,
+                 const char *binary_output_path) {
+    if (!cache->enabled) {
+        return;
+    }
+
+    /* Stage the entry privately, then publish it with one rename. */
+    char staging[CACHE_PATH_CAPACITY + 64];
+    char entry_dir[CACHE_PATH_CAPACITY + 64];
+    snprintf(staging, sizeof(staging), "%s/.tmp-%ld-%s", cache->root, (long)getpid(), cache->key);
+    snprintf(entry_dir, sizeof(entry_dir), "%s/%s", cache->root, cache->key);
+    if (mkdir(staging, 0755) != 0) {
+        return;
+    }
+
+    char c_file[CACHE_PATH_CAPACITY + 128];
+    char binary_file[CACHE_PATH_CAPACITY + 128];
+    snprintf(c_file, sizeof(c_file), "%s/%s", staging, CACHE_C_FILE);
+    snprintf(binary_file, sizeof(binary_file), "%s/%s", staging, CACHE_BINARY_FILE);
+    if ((c_output_path && !cache_copy_file(c_output_path, c_file, 0644)) ||
+        !cache_copy_file(binary_output_path, binary_file, 0755)) {
+        cache_remove_dir(staging);
+        return;
+    }
+    bool published = rename(staging, entry_dir) == 0;
+    if (!published && c_output_path) {
+        /* An entry stored without C (no --emit-c) gives way to this fuller one. */
+        cache_remove_dir(entry_dir);
+        published = rename(staging, entry_dir) == 0;
+    }
+    if (!published) {
+        cache_remove_dir(staging);
+        return;
+    }
+    cache_evict(cache);
+}
@@ -0,0 +1,71 @@
+#ifndef LZ_DRIVER_CACHE_H
+#define LZ_DRIVER_CACHE_H
+
+#include "../codegen/codegen.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LAZYLANG_VERSION "0.1.0-prealpha"
+#define CACHE_PATH_CAPACITY 4096
+
+/*
+ * Content-addressed cache of finished builds. The key covers everything that
+ * can change the output: the text and name of every module, the compiler
+ * version and binary,
+ * the build flags, the prebuilt runtime and the C compiler codegen runs
+ * (codegen_find_compiler).
+ * Entries hold the linked binary, plus the generated C when the build
+ * wrote it (--emit-c), and live under
+ * $XDG_CACHE_HOME/lazylang (or ~/.cache/lazylang). Least recently used
+ * entries are evicted once the cache grows past its size limit
+ * (LAZYLANG_CACHE_MAX_MB, 256 MiB by default).
+ */
+/* Two independent FNV-1a lanes give a 128-bit key. */
+typedef struct {
+    uint64_t a;
+    uint64_t b;
+} CacheHasher;
+
+void cache_hasher_init(CacheHasher *hasher);
+void cache_hash_bytes(CacheHasher *hasher, const void *data, size_t length);
+/* Hashes the terminator too, so consecutive strings cannot run together. */
+void cache_hash_str(CacheHasher *hasher, const char *text);
+void cache_hash_u64(CacheHasher *hasher, uint64_t value);
+/* 32 lowercase hex digits and a terminator. */
+void cache_hasher_format(const CacheHasher *hasher, char key[33]);
+
+/* One module of the program; `name` is NULL for the entry file. */
+typedef struct {
+    const char *name;
+    const char *data;
+    size_t length;
+} CacheSource;
+
+typedef struct {
+    bool enabled;
+    char root[CACHE_PATH_CAPACITY];
+    char key[33];
+} CompileCache;
+
+/* Computes the key; leaves the cache disabled if no cache directory is usable. */
+void cache_open(CompileCache *cache,
+                const CacheSource *sources,
+                size_t source_count,
+                const CodegenBuildFlags *flags);
+/* Key of the build environment alone (no sources), for the incremental build database. */
+void cache_environment_key(const CodegenBuildFlags *flags, char key[33]);
+/*
+ * Copies a cached build to the requested outputs; false on a miss. A NULL
+ * c_output_path skips the C; otherwise an entry without C is a miss.
+ */
+bool cache_restore(const CompileCache *cache,
+                   const char *c_output_path,
+                   const char *binary_output_path);
+/* Records a successful build and trims the cache; c_output_path may be NULL. Failures are not fatal. */
+void cache_store(const CompileCache *cache,
+                 const char *c_output_path,
+                 const char *binary_output_path);
+
+#endif
@@ -0,0 +1,793 @@
+#define _DEFAULT_SOURCE
+
+#include "module.h"
+
+#include "../diag.h"
+#include "../lexer.h"
+#include "../opt/fold.h"
+#include "../parser/parser.h"
+#include "../profile.h"
+#include "../sema/sema.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    ModuleGraph *graph;
+    Module *module;
+    BuildUnit *unit;
+    const char *compiler;
+    const CodegenBuildFlags *flags;
+    void (*fn)(void *);
+    ProfilePhase phase; /* the submitter's, so pool allocations land in the same bucket */
+} ModuleTask;
+
+static void *module_xmalloc(size_t size) {
+    void *result = malloc(size);
+    if (!result) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+static char *module_strdup(const char *text) {
+    size_t length = strlen(text) + 1;
+    char *copy = module_xmalloc(length);
+    memcpy(copy, text, length);
+    return copy;
+}
+
+/* A file as the compile server parsed it; see module_cache_warm. */
+typedef struct {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+    SourceFile source;
+    ASTProgram *program; /* NULL when this version of the file failed to load */
+} ModuleCacheEntry;
+
+static struct {
+    ModuleCacheEntry *entries;
+    size_t count;
+    size_t capacity;
+    ASTSymbolMap by_path; /* interned canonical path -> entry position + 1 */
+} module_cache;
+
+static void module_import_error(const ASTImport *import_stmt, const char *name, const char *path) {
+    diag_error("[line %d:%d] Import error: module '%s' not found (expected '%s')\n",
+               import_stmt->base.token.line,
+               import_stmt->base.token.column,
+               name,
+               path);
+}
+
+/* Adds a module for `path` unless one exists; the caller holds the lock. */
+static Module *module_graph_intern(ModuleGraph *graph, const char *path, const char *name, bool *created) {
+    const char *key = ast_intern_cstr(path);
+    size_t entry = ast_symbol_map_get(&graph->by_path, key);
+    if (entry) {
+        *created = false;
+        return graph->modules[entry - 1];
+    }
+    if (graph->count == graph->capacity) {
+        size_t new_capacity = graph->capacity ? graph->capacity * 2 : 8;
+        Module **grown = realloc(graph->modules, new_capacity * sizeof(Module *));
+        if (!grown) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        graph->modules = grown;
+        graph->capacity = new_capacity;
+    }
+    Module *module = calloc(1, sizeof(Module));
+    if (!module) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    module->name = name;
+    module->path = module_strdup(path);
+    graph->modules[graph->count++] = module;
+    ast_symbol_map_set(&graph->by_path, key, graph->count);
+    *created = true;
+    return module;
+}
+
+static void module_load_task(void *arg);
+
+static void module_add_import(Module *module, Module *dependency) {
+    for (size_t i = 0; i < module->import_count; i++) {
+        if (module->imports[i] == dependency) {
+            return;
+        }
+    }
+    Module **grown = realloc(module->imports, (module->import_count + 1) * sizeof(Module *));
+    if (!grown) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    module->imports = grown;
+    module->imports[module->import_count++] = dependency;
+}
+
+/* a.b -> "a.b" and <root>/a/b.lz; false when either does not fit in PATH_MAX bytes. */
+static bool module_import_path(const char *root, const ASTArray *segments, char *name, char *path) {
+    size_t name_length = 0;
+    size_t path_length = strlen(root);
+    if (path_length >= PATH_MAX) {
+        return false;
+    }
+    memcpy(path, root, path_length);
+    for (size_t s = 0; s < segments->count; s++) {
+        const char *segment = segments->items[s];
+        size_t segment_length = strlen(segment);
+        if (name_length + segment_length + 1 >= PATH_MAX ||
+            path_length + segment_length + sizeof("/.lz") >= PATH_MAX) {
+            return false;
+        }
+        if (s > 0) name[name_length++] = '.';
+        memcpy(name + name_length, segment, segment_length);
+        name_length += segment_length;
+        path[path_length++] = '/';
+        memcpy(path + path_length, segment, segment_length);
+        path_length += segment_length;
+    }
+    name[name_length] = '\0';
+    memcpy(path + path_length, ".lz", sizeof(".lz"));
+    return true;
+}
+
+/* Resolves each import to a file and queues the modules not seen before. */
+static void module_resolve_imports(ModuleGraph *graph, Module *module) {
+    const ASTArray *imports = &module->program->imports;
+    for (size_t i = 0; i < imports->count; i++) {
+        const ASTImport *import_stmt = imports->items[i];
+        const ASTArray *segments = &import_stmt->segments;
+        if (segments->count == 0 || strcmp(segments->items[0], "std") == 0) {
+            continue;
+        }
+
+        char name[PATH_MAX];
+        char path[PATH_MAX];
+        if (!module_import_path(graph->root, segments, name, path)) {
+            diag_error("[line %d:%d] Import error: module path too long\n",
+                       import_stmt->base.token.line,
+                       import_stmt->base.token.column);
+        }
+
+        char canonical[PATH_MAX];
+        if (!realpath(path, canonical)) {
+            module_import_error(import_stmt, name, path);
+        }
+
+        bool created = false;
+        pthread_mutex_lock(&graph->lock);
+        Module *dependency = module_graph_intern(graph, canonical, ast_intern_cstr(name), &created);
+        pthread_mutex_unlock(&graph->lock);
+        module_add_import(module, dependency);
+
+        if (created) {
+            ModuleTask *task = module_xmalloc(sizeof(ModuleTask));
+            *task = (ModuleTask){ .graph = graph, .module = dependency };
+            if (!graph->pool) {
+                graph->pool = task_pool_create(graph->threads);
+            }
+            task_pool_submit(graph->pool, module_load_task, task);
+        }
+    }
+}
+
+/* How diagnostics name a module: its path under the entry file's directory. */
+static const char *module_display_path(const ModuleGraph *graph, const Module *module) {
+    size_t root_length = strlen(graph->root);
+    if (strncmp(module->path, graph->root, root_length) == 0 && module->path[root_length] == '/') {
+        return module->path + root_length + 1;
+    }
+    return module->path;
+}
+
+/* True when any module reported an error; the pool must be idle. */
+static bool module_graph_failed(const ModuleGraph *graph) {
+    for (size_t i = 0; i < graph->count; i++) {
+        if (graph->modules[i]->failed) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static ASTProgram *module_lex_and_parse(const SourceFile *source, bool profiled) {
+    if (profiled) profile_begin(PROFILE_PHASE_PARSE);
+    else profile_set_thread_phase(PROFILE_PHASE_PARSE);
+    Lexer *lexer = lexer_create(source->data, source->length);
+    ASTProgram *program = parse_program(lexer, profiled);
+    lexer_destroy(lexer);
+    if (profiled) profile_end(PROFILE_PHASE_PARSE);
+    return program;
+}
+
+static bool module_cache_matches(const ModuleCacheEntry *entry, const struct stat *info) {
+    return entry->device == info->st_dev && entry->inode == info->st_ino && entry->size == info->st_size &&
+           entry->modified.tv_sec == info->st_mtim.tv_sec && entry->modified.tv_nsec == info->st_mtim.tv_nsec;
+}
+
+/* The cached parse of `path` if the file is unchanged since; only read once the cache is warm. */
+static const ModuleCacheEntry *module_cache_lookup(const char *path) {
+    if (module_cache.count == 0) {
+        return NULL;
+    }
+    size_t position = ast_symbol_map_get(&module_cache.by_path, ast_intern_cstr(path));
+    struct stat info;
+    if (!position || stat(path, &info) != 0) {
+        return NULL;
+    }
+    const ModuleCacheEntry *entry = &module_cache.entries[position - 1];
+    return entry->program && module_cache_matches(entry, &info) ? entry : NULL;
+}
+
+/* Parses `path` into the cache unless the entry for it is still current. */
+static ModuleCacheEntry *module_cache_refresh(const char *path) {
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        return NULL;
+    }
+    const char *key = ast_intern_cstr(path);
+    size_t position = ast_symbol_map_get(&module_cache.by_path, key);
+    bool known = position != 0;
+    if (!known) {
+        if (module_cache.count == module_cache.capacity) {
+            size_t new_capacity = module_cache.capacity ? module_cache.capacity * 2 : 8;
+            ModuleCacheEntry *grown = realloc(module_cache.entries, new_capacity * sizeof(ModuleCacheEntry));
+            if (!grown) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            module_cache.entries = grown;
+            module_cache.capacity = new_capacity;
+        }
+        module_cache.entries[module_cache.count++] = (ModuleCacheEntry){0};
+        ast_symbol_map_set(&module_cache.by_path, key, module_cache.count);
+        position = module_cache.count;
+    }
+    ModuleCacheEntry *entry = &module_cache.entries[position - 1];
+    if (known) {
+        if (module_cache_matches(entry, &info)) {
+            return entry->program ? entry : NULL;
+        }
+        ast_program_destroy(entry->program);
+        source_file_close(&entry->source);
+    }
+    /* Stat before reading: a file that changes in between is parsed again next time, never reused stale. */
+    *entry = (ModuleCacheEntry){
+        .device = info.st_dev,
+        .inode = info.st_ino,
+        .size = info.st_size,
+        .modified = info.st_mtim,
+    };
+
+    /*
+     * Errors are left for the build to report. A failed parse leaks its
+     * partial AST, but only once per version of the file: the entry
+     * remembers the failure until the file changes.
+     */
+    DiagScope scope;
+    diag_enter(&scope, NULL);
+    scope.silent = true;
+    if (setjmp(scope.jump) != 0) {
+        diag_leave(&scope);
+        source_file_close(&entry->source);
+        return NULL;
+    }
+    source_file_open(&entry->source, path);
+    entry->program = module_lex_and_parse(&entry->source, false);
+    diag_leave(&scope);
+    return entry;
+}
+
+/* Refreshes `path` and, depth first, every module it imports that `visited` has not seen. */
+static void module_cache_visit(const char *root, const char *path, ASTSymbolMap *visited) {
+    ast_symbol_map_set(visited, ast_intern_cstr(path), 1);
+    const ModuleCacheEntry *entry = module_cache_refresh(path);
+    if (!entry) {
+        return;
+    }
+    const ASTArray *imports = &entry->program->imports;
+    for (size_t i = 0; i < imports->count; i++) {
+        const ASTImport *import_stmt = imports->items[i];
+        const ASTArray *segments = &import_stmt->segments;
+        char name[PATH_MAX];
+        char import_path[PATH_MAX];
+        char canonical[PATH_MAX];
+        if (segments->count == 0 || strcmp(segments->items[0], "std") == 0 ||
+            !module_import_path(root, segments, name, import_path) || !realpath(import_path, canonical)) {
+            continue;
+        }
+        if (!ast_symbol_map_get(visited, ast_intern_cstr(canonical))) {
+            module_cache_visit(root, canonical, visited);
+        }
+    }
+}
+
+void module_cache_warm(const char *entry_path) {
+    char canonical[PATH_MAX];
+    if (!realpath(entry_path, canonical)) {
+        return;
+    }
+    char root[PATH_MAX];
+    memcpy(root, canonical, strlen(canonical) + 1);
+    *strrchr(root, '/') = '\0';
+
+    ASTSymbolMap visited;
+    ast_symbol_map_init(&visited);
+    module_cache_visit(root, canonical, &visited);
+    ast_symbol_map_destroy(&visited);
+}
+
+/* Only the entry module is parsed on the main thread, so only it is profiled. */
+static void module_parse(ModuleGraph *graph, Module *module, bool profiled) {
+    DiagScope scope;
+    diag_enter(&scope, module_display_path(graph, module));
+    if (setjmp(scope.jump) != 0) {
+        module->failed = true;
+        diag_leave(&scope);
+        return;
+    }
+    const ModuleCacheEntry *cached = module_cache_lookup(module->path);
+    if (cached) {
+        module->source = cached->source;
+        module->program = cached->program;
+        module->cached = true;
+    } else {
+        source_file_open(&module->source, module->path);
+        module->program = module_lex_and_parse(&module->source, profiled);
+    }
+
+    if (profiled) profile_begin(PROFILE_PHASE_PARSE);
+    else profile_set_thread_phase(PROFILE_PHASE_PARSE);
+    module->program->module_name = module->name;
+    module_resolve_imports(graph, module);
+    if (profiled) profile_end(PROFILE_PHASE_PARSE);
+    diag_leave(&scope);
+}
+
+static void module_load_task(void *arg) {
+    ModuleTask *task = arg;
+    module_parse(task->graph, task->module, false);
+    free(task);
+}
+
+static int module_compare_names(const void *lhs, const void *rhs) {
+    const Module *a = *(Module *const *)lhs;
+    const Module *b = *(Module *const *)rhs;
+    return strcmp(a->name, b->name);
+}
+
+void module_graph_load(ModuleGraph *graph, const char *entry_path, size_t threads) {
+    memset(graph, 0, sizeof(*graph));
+    pthread_mutex_init(&graph->lock, NULL);
+    ast_symbol_map_init(&graph->by_path);
+    graph->threads = threads;
+
+    char canonical[PATH_MAX];
+    if (!realpath(entry_path, canonical)) {
+        fprintf(stderr, "failed to open '%s'\n", entry_path);
+        exit(EXIT_FAILURE);
+    }
+    graph->root = module_strdup(canonical);
+    *strrchr(graph->root, '/') = '\0';
+
+    bool created = false;
+    Module *entry = module_graph_intern(graph, canonical, NULL, &created);
+    module_parse(graph, entry, true);
+
+    if (graph->pool) {
+        profile_begin(PROFILE_PHASE_PARSE);
+        task_pool_wait(graph->pool);
+        profile_end(PROFILE_PHASE_PARSE);
+    }
+    if (module_graph_failed(graph)) {
+        exit(EXIT_FAILURE);
+    }
+
+    /* Discovery order depends on thread timing; the build must not. */
+    qsort(graph->modules + 1, graph->count - 1, sizeof(Module *), module_compare_names);
+    for (size_t i = 0; i < graph->count; i++) {
+        Module *module = graph->modules[i];
+        for (size_t d = 0; d < module->import_count; d++) {
+            ast_program_add_dependency(module->program, module->imports[d]->program);
+        }
+    }
+}
+
+static void module_check_task(void *arg) {
+    ModuleTask *task = arg;
+    Module *module = task->module;
+    DiagScope scope;
+    diag_enter(&scope, module_display_path(task->graph, module));
+    if (setjmp(scope.jump) == 0) {
+        sema_check_program_partial(module->program, module->selected);
+    } else {
+        module->failed = true;
+    }
+    diag_leave(&scope);
+    free(task);
+}
+
+/* Runs a queued task under the phase that was open when it was submitted. */
+static void module_run_task(void *arg) {
+    ModuleTask *task = arg;
+    profile_set_thread_phase(task->phase);
+    task->fn(task);
+}
+
+/* Runs `fn` once per module on the pool, or inline when there is no pool. */
+static void module_graph_run(ModuleGraph *graph,
+                             void (*fn)(void *),
+                             const char *compiler,
+                             const CodegenBuildFlags *flags) {
+    for (size_t i = 0; i < graph->count; i++) {
+        ModuleTask *task = module_xmalloc(sizeof(ModuleTask));
+        *task = (ModuleTask){
+            .graph = graph,
+            .module = graph->modules[i],
+            .compiler = compiler,
+            .flags = flags,
+            .fn = fn,
+            .phase = profile_thread_phase(),
+        };
+        if (graph->pool) {
+            task_pool_submit(graph->pool, module_run_task, task);
+        } else {
+            fn(task);
+        }
+    }
+    if (graph->pool) {
+        task_pool_wait(graph->pool);
+    }
+}
+
+void module_graph_check(ModuleGraph *graph) {
+    profile_begin(PROFILE_PHASE_SEMA);
+    module_graph_run(graph, module_check_task, NULL, NULL);
+    profile_end(PROFILE_PHASE_SEMA);
+    if (module_graph_failed(graph)) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void module_fold_task(void *arg) {
+    ModuleTask *task = arg;
+    task->module->folded = fold_program(task->module->program, task->module->selected);
+    free(task);
+}
+
+size_t module_graph_fold(ModuleGraph *graph) {
+    profile_begin(PROFILE_PHASE_OPT);
+    module_graph_run(graph, module_fold_task, NULL, NULL);
+    profile_end(PROFILE_PHASE_OPT);
+    size_t folded = 0;
+    for (size_t i = 0; i < graph->count; i++) {
+        folded += graph->modules[i]->folded;
+    }
+    return folded;
+}
+
+static void module_emit_task(void *arg) {
+    ModuleTask *task = arg;
+    Module *module = task->module;
+    module->output = codegen_generate(module->program);
+    module->ok = module->output && (!module->c_path || codegen_output_write(module->output, module->c_path));
+    free(task);
+}
+
+static void module_compile_task(void *arg) {
+    ModuleTask *task = arg;
+    Module *module = task->module;
+    module->ok = codegen_compile_output(task->compiler, module->output, module->object_path, task->flags);
+    codegen_output_free(module->output);
+    module->output = NULL;
+    free(task);
+}
+
+static bool module_graph_all_ok(const ModuleGraph *graph) {
+    for (size_t i = 0; i < graph->count; i++) {
+        if (!graph->modules[i]->ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Replaces a trailing ".c" of `c_output_path` with `<module>.<extension>`. */
+static char *module_output_path(const char *c_output_path, const char *name, const char *extension) {
+    size_t stem = strlen(c_output_path);
+    if (stem >= 2 && strcmp(c_output_path + stem - 2, ".c") == 0) {
+        stem -= 2;
+    }
+    size_t length = stem + (name ? strlen(name) + 1 : 0) + strlen(extension) + 2;
+    char *path = module_xmalloc(length);
+    snprintf(path,
+             length,
+             "%.*s%s%s.%s",
+             (int)stem,
+             c_output_path,
+             name ? "." : "",
+             name ? name : "",
+             extension);
+    return path;
+}
+
+bool module_graph_build(ModuleGraph *graph,
+                        const char *c_output_path,
+                        const char *binary_output_path,
+                        const CodegenBuildFlags *flags,
+                        bool emit_c) {
+    if (graph->count == 1) {
+        CodegenOptions options = {
+            .c_output_path = c_output_path,
+            .binary_output_path = binary_output_path,
+            .emit_binary = true,
+            .emit_c = emit_c,
+            .build = *flags,
+        };
+        return codegen_emit(graph->modules[0]->program, &options);
+    }
+    graph->emit_c = emit_c;
+
+    for (size_t i = 0; i < graph->count; i++) {
+        Module *module = graph->modules[i];
+        if (emit_c) {
+            module->c_path = module->name
+                ? module_output_path(c_output_path, module->name, "c")
+                : module_strdup(c_output_path);
+        }
+    }
+
+    profile_begin(PROFILE_PHASE_EMIT);
+    module_graph_run(graph, module_emit_task, NULL, NULL);
+    profile_end(PROFILE_PHASE_EMIT);
+    if (!module_graph_all_ok(graph)) {
+        return false;
+    }
+
+    /* Objects are kept next to the C with --emit-c; otherwise only the binary is left behind. */
+    char scratch[PATH_MAX];
+    char stem[PATH_MAX + sizeof("/out.c")];
+    if (!emit_c) {
+        const char *tmp_dir = getenv("TMPDIR");
+        snprintf(scratch, sizeof(scratch), "%s/lazylangc-XXXXXX", tmp_dir && tmp_dir[0] ? tmp_dir : "/tmp");
+        if (!mkdtemp(scratch)) {
+            fprintf(stderr, "failed to create a directory for objects in '%s': %s\n", scratch, strerror(errno));
+            return false;
+        }
+        snprintf(stem, sizeof(stem), "%s/out.c", scratch);
+    }
+    for (size_t i = 0; i < graph->count; i++) {
+        Module *module = graph->modules[i];
+        module->object_path = module_output_path(emit_c ? c_output_path : stem, module->name, "o");
+    }
+
+    profile_begin(PROFILE_PHASE_CC);
+    const char *compiler = codegen_find_compiler();
+    bool ok = compiler != NULL;
+    if (ok) {
+        module_graph_run(graph, module_compile_task, compiler, flags);
+        ok = module_graph_all_ok(graph);
+    }
+    if (ok) {
+        const char **objects = module_xmalloc(graph->count * sizeof(char *));
+        for (size_t i = 0; i < graph->count; i++) {
+            objects[i] = graph->modules[i]->object_path;
+        }
+        ok = codegen_link(compiler, objects, graph->count, binary_output_path, flags);
+        free(objects);
+    }
+    if (!emit_c) {
+        for (size_t i = 0; i < graph->count; i++) {
+            unlink(graph->modules[i]->object_path);
+        }
+        rmdir(scratch);
+    }
+    profile_end(PROFILE_PHASE_CC);
+    return ok;
+}
+
+static void module_unit_init(const ModuleGraph *graph,
+                             BuildUnit *unit,
+                             Module *module,
+                             const ASTFunctionDecl *fn,
+                             const BuildDb *db) {
+    unit->module = module;
+    unit->fn = fn;
+    unit->shard = fn ? builddb_function_shard(module->name, fn) : ast_intern_cstr(BUILDDB_ENTRY_SHARD);
+    unit->c_path = builddb_shard_path(db, unit->shard, "c");
+    unit->object_path = builddb_shard_path(db, unit->shard, "o");
+    unit->output = NULL;
+    /* With --emit-c, a shard whose C was not kept last time is regenerated too. */
+    unit->stale = !builddb_is_fresh(db, unit->shard, unit->key) ||
+                  (graph->emit_c && access(unit->c_path, R_OK) != 0);
+    unit->ok = false;
+}
+
+void module_graph_plan(ModuleGraph *graph, const BuildDb *db, bool emit_c) {
+    profile_begin(PROFILE_PHASE_CACHE);
+    graph->emit_c = emit_c;
+    size_t capacity = 1;
+    for (size_t i = 0; i < graph->count; i++) {
+        capacity += graph->modules[i]->program->declarations.count;
+    }
+    graph->units = module_xmalloc(capacity * sizeof(BuildUnit));
+    graph->unit_count = 0;
+    graph->stale_count = 0;
+
+    for (size_t i = 0; i < graph->count; i++) {
+        Module *module = graph->modules[i];
+        const ASTArray *declarations = &module->program->declarations;
+        char (*keys)[33] = module_xmalloc((declarations->count + 1) * sizeof(*keys));
+        builddb_program_keys(db, module->program, keys);
+        module->selected = module_xmalloc((declarations->count + 1) * sizeof(bool));
+
+        for (size_t d = 0; d < declarations->count; d++) {
+            const ASTNode *node = declarations->items[d];
+            module->selected[d] = true;
+            if (node->kind != AST_NODE_FUNCTION) {
+                continue;
+            }
+            BuildUnit *unit = &graph->units[graph->unit_count++];
+            memcpy(unit->key, keys[d], sizeof(unit->key));
+            module_unit_init(graph, unit, module, (const ASTFunctionDecl *)node, db);
+            module->selected[d] = unit->stale;
+            graph->stale_count += unit->stale;
+        }
+        free(keys);
+    }
+
+    BuildUnit *entry = &graph->units[graph->unit_count++];
+    builddb_entry_key(db, graph->modules[0]->program, entry->key);
+    module_unit_init(graph, entry, graph->modules[0], NULL, db);
+    graph->stale_count += entry->stale;
+    profile_end(PROFILE_PHASE_CACHE);
+}
+
+static void module_unit_emit_task(void *arg) {
+    ModuleTask *task = arg;
+    BuildUnit *unit = task->unit;
+    unit->output = unit->fn
+        ? codegen_generate_function_shard(unit->module->program, unit->fn)
+        : codegen_generate_entry_shard(unit->module->program);
+    unit->ok = unit->output != NULL;
+    if (unit->ok && task->graph->emit_c) {
+        unit->ok = codegen_output_write(unit->output, unit->c_path);
+    } else if (unit->ok) {
+        unlink(unit->c_path); /* an older --emit-c copy would no longer match the object */
+    }
+    free(task);
+}
+
+static void module_unit_compile_task(void *arg) {
+    ModuleTask *task = arg;
+    BuildUnit *unit = task->unit;
+    unit->ok = codegen_compile_output(task->compiler, unit->output, unit->object_path, task->flags);
+    codegen_output_free(unit->output);
+    unit->output = NULL;
+    free(task);
+}
+
+/* Like module_graph_run, over the stale units; a single module still gets a pool here. */
+static bool module_graph_run_units(ModuleGraph *graph,
+                                   void (*fn)(void *),
+                                   const char *compiler,
+                                   const CodegenBuildFlags *flags) {
+    if (!graph->pool && graph->threads > 1 && graph->stale_count > 1) {
+        graph->pool = task_pool_create(graph->threads);
+    }
+    for (size_t i = 0; i < graph->unit_count; i++) {
+        BuildUnit *unit = &graph->units[i];
+        if (!unit->stale) {
+            continue;
+        }
+        ModuleTask *task = module_xmalloc(sizeof(ModuleTask));
+        *task = (ModuleTask){
+            .graph = graph,
+            .module = unit->module,
+            .unit = unit,
+            .compiler = compiler,
+            .flags = flags,
+            .fn = fn,
+            .phase = profile_thread_phase(),
+        };
+        if (graph->pool) {
+            task_pool_submit(graph->pool, module_run_task, task);
+        } else {
+            fn(task);
+        }
+    }
+    if (graph->pool) {
+        task_pool_wait(graph->pool);
+    }
+    for (size_t i = 0; i < graph->unit_count; i++) {
+        if (graph->units[i].stale && !graph->units[i].ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool module_graph_build_incremental(ModuleGraph *graph,
+                                    BuildDb *db,
+                                    const char *binary_output_path,
+                                    const CodegenBuildFlags *flags) {
+    /* Forget stale shards before touching their files; see builddb_save. */
+    for (size_t i = 0; i < graph->unit_count; i++) {
+        if (!graph->units[i].stale) {
+            builddb_record(db, graph->units[i].shard, graph->units[i].key);
+        }
+    }
+    if (!builddb_save(db)) {
+        return false;
+    }
+
+    profile_begin(PROFILE_PHASE_EMIT);
+    bool ok = module_graph_run_units(graph, module_unit_emit_task, NULL, NULL);
+    profile_end(PROFILE_PHASE_EMIT);
+    if (!ok) {
+        return false;
+    }
+
+    profile_begin(PROFILE_PHASE_CC);
+    const char *compiler = codegen_find_compiler();
+    ok = compiler != NULL;
+    if (ok) {
+        ok = module_graph_run_units(graph, module_unit_compile_task, compiler, flags);
+        for (size_t i = 0; i < graph->unit_count; i++) {
+            if (graph->units[i].stale && graph->units[i].ok) {
+                builddb_record(db, graph->units[i].shard, graph->units[i].key);
+            }
+        }
+        builddb_save(db);
+    }
+    if (ok) {
+        const char **objects = module_xmalloc(graph->unit_count * sizeof(char *));
+        for (size_t i = 0; i < graph->unit_count; i++) {
+            objects[i] = graph->units[i].object_path;
+        }
+        ok = codegen_link(compiler, objects, graph->unit_count, binary_output_path, flags);
+        free(objects);
+    }
+    profile_end(PROFILE_PHASE_CC);
+    return ok;
+}
+
+void module_graph_destroy(ModuleGraph *graph) {
+    task_pool_destroy(graph->pool);
+    for (size_t i = 0; i < graph->unit_count; i++) {
+        codegen_output_free(graph->units[i].output);
+        free(graph->units[i].c_path);
+        free(graph->units[i].object_path);
+    }
+    free(graph->units);
+    for (size_t i = 0; i < graph->count; i++) {
+        Module *module = graph->modules[i];
+        if (!module->cached) {
+            ast_program_destroy(module->program);
+            source_file_close(&module->source);
+        }
+        free(module->imports);
+        free(module->path);
+        codegen_output_free(module->output);
+        free(module->c_path);
+        free(module->object_path);
+        free(module->selected);
+        free(module);
+    }
+    free(graph->modules);
+    free(graph->root);
+    ast_symbol_map_destroy(&graph->by_path);
+    pthread_mutex_destroy(&graph->lock);
+}
@@ -0,0 +1,116 @@
+#ifndef LZ_DRIVER_MODULE_H
+#define LZ_DRIVER_MODULE_H
+
+#include "../ast/ast.h"
+#include "../ast/symtab.h"
+#include "../codegen/codegen.h"
+#include "builddb.h"
+#include "pool.h"
+#include "source.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * The set of modules reachable from the entry file. `import a.b` names the
+ * file a/b.lz under the entry file's directory; std.* imports are provided
+ * by the runtime and never loaded from disk. Modules are lexed and parsed as
+ * they are discovered, then checked, emitted and compiled one translation
+ * unit each, all on a shared pool of worker threads.
+ */
+typedef struct Module Module;
+
+struct Module {
+    const char *name; /* interned dotted path; NULL for the entry file */
+    char *path;       /* canonical path of the source file */
+    SourceFile source;
+    ASTProgram *program;
+    Module **imports; /* resolved non-std imports, without duplicates */
+    size_t import_count;
+    char *c_path;       /* NULL unless the C is written out */
+    CodegenOutput *output; /* generated C between emission and compilation */
+    char *object_path;
+    bool *selected; /* declarations sema checks; NULL checks them all */
+    size_t folded;  /* nodes constant folding removed */
+    bool ok; /* last build step succeeded */
+    bool failed; /* reported an error while loading or checking */
+    bool cached; /* source and program belong to the module cache */
+};
+
+/* One shard of an incremental build: a function, or main() when `fn` is NULL. */
+typedef struct {
+    Module *module;
+    const ASTFunctionDecl *fn;
+    const char *shard;
+    char key[33];
+    char *c_path;
+    CodegenOutput *output;
+    char *object_path;
+    bool stale; /* must be emitted and compiled again */
+    bool ok;
+} BuildUnit;
+
+typedef struct {
+    Module **modules; /* entry first, then the rest sorted by name */
+    size_t count;
+    size_t capacity;
+    char *root;          /* directory imports are resolved against */
+    ASTSymbolMap by_path; /* interned canonical path -> module position + 1 */
+    size_t threads;
+    TaskPool *pool;      /* started on the first import, NULL until then */
+    pthread_mutex_t lock;
+    BuildUnit *units; /* incremental builds only */
+    size_t unit_count;
+    size_t stale_count;
+    bool emit_c; /* write each translation unit's C as well */
+} ModuleGraph;
+
+/*
+ * Loads the entry file and everything it imports. Each module stops at its
+ * first error, prefixed with its path; once every module is done, the main
+ * thread exits if any failed.
+ */
+void module_graph_load(ModuleGraph *graph, const char *entry_path, size_t threads);
+/* Runs sema over every module; errors are reported and handled as in module_graph_load. */
+void module_graph_check(ModuleGraph *graph);
+/* Constant-folds every checked function (see fold.h); returns the nodes folded. */
+size_t module_graph_fold(ModuleGraph *graph);
+/*
+ * Generates one C translation unit per module, compiles them to objects in
+ * parallel and links the binary. The objects go to a temporary directory
+ * that is removed after linking. With emit_c the C is also written, the
+ * entry's at c_output_path and module a.b's as <stem>.a.b.c, and the
+ * objects are kept beside it as <stem>.o and <stem>.a.b.o.
+ */
+bool module_graph_build(ModuleGraph *graph,
+                        const char *c_output_path,
+                        const char *binary_output_path,
+                        const CodegenBuildFlags *flags,
+                        bool emit_c);
+/*
+ * Splits every module into per-function shards and compares their keys with
+ * the build database (with emit_c, shard C files are kept in it too).
+ * Afterwards module_graph_check only checks the bodies
+ * of stale functions, and module_graph_build_incremental only emits and
+ * compiles their shards before relinking all of them.
+ */
+void module_graph_plan(ModuleGraph *graph, const BuildDb *db, bool emit_c);
+bool module_graph_build_incremental(ModuleGraph *graph,
+                                    BuildDb *db,
+                                    const char *binary_output_path,
+                                    const CodegenBuildFlags *flags);
+void module_graph_destroy(ModuleGraph *graph);
+
+/*
+ * Parsed-module cache for the compile server. Loads the entry file and what
+ * it imports in the calling process, keeping each module's source and AST
+ * keyed by canonical path and checked against the file's device, inode, size
+ * and mtime. module_graph_load in a process forked afterwards takes the AST
+ * of every unchanged file from here instead of lexing and parsing it again.
+ * Nothing is reported: a file that fails to load is left for the build to
+ * report, and is not retried until it changes.
+ */
+void module_cache_warm(const char *entry_path);
+
+#endif
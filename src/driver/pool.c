@@ -0,0 +1,134 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct PoolTask {
+    TaskFn fn;
+    void *arg;
+    struct PoolTask *next;
+} PoolTask;
+
+struct TaskPool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready; /* a task was queued, or shutdown began */
+    pthread_cond_t idle;       /* queue empty and nothing running */
+    PoolTask *head;
+    PoolTask *tail;
+    size_t running;
+    bool shutting_down;
+    pthread_t *threads;
+    size_t thread_count;
+};
+
+static void *pool_worker(void *arg) {
+    TaskPool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->shutting_down) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (!pool->head) {
+            break;
+        }
+        PoolTask *task = pool->head;
+        pool->head = task->next;
+        if (!pool->head) {
+            pool->tail = NULL;
+        }
+        pool->running++;
+        pthread_mutex_unlock(&pool->lock);
+
+        task->fn(task->arg);
+        free(task);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        if (!pool->head && pool->running == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+size_t task_pool_default_threads(void) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (size_t)online : 1;
+}
+
+TaskPool *task_pool_create(size_t threads) {
+    if (threads == 0) {
+        threads = 1;
+    }
+    TaskPool *pool = calloc(1, sizeof(TaskPool));
+    pthread_t *handles = calloc(threads, sizeof(pthread_t));
+    if (!pool || !handles) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->threads = handles;
+    for (size_t i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+            fprintf(stderr, "failed to start worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+        pool->thread_count++;
+    }
+    return pool;
+}
+
+void task_pool_submit(TaskPool *pool, TaskFn fn, void *arg) {
+    PoolTask *task = malloc(sizeof(PoolTask));
+    if (!task) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) {
+        pool->tail->next = task;
+    } else {
+        pool->head = task;
+    }
+    pool->tail = task;
+    pthread_cond_signal(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void task_pool_wait(TaskPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head || pool->running > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void task_pool_destroy(TaskPool *pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->shutting_down = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,24 @@
+#ifndef LZ_DRIVER_POOL_H
+#define LZ_DRIVER_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Fixed-size pool of worker threads draining a FIFO of tasks. Tasks may
+ * submit further tasks (module discovery does), and task_pool_wait returns
+ * only once the queue is empty and no task is running. Errors inside a task
+ * are reported and exit the process, as everywhere else in the compiler.
+ */
+typedef void (*TaskFn)(void *arg);
+
+typedef struct TaskPool TaskPool;
+
+/* Online CPUs, at least 1. */
+size_t task_pool_default_threads(void);
+
+TaskPool *task_pool_create(size_t threads);
+void task_pool_submit(TaskPool *pool, TaskFn fn, void *arg);
+void task_pool_wait(TaskPool *pool);
+void task_pool_destroy(TaskPool *pool);
+
+#endif
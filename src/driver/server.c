@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include "../ast/intern.h"
+#include "../codegen/codegen.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SERVER_MAGIC 0x31435a4cu /* "LZC1" */
+#define SERVER_MAX_REQUEST (1u << 20)
+#define SERVER_RECEIVE_TIMEOUT 5 /* seconds; the daemon reads requests itself */
+
+/*
+ * A request is this header, sent together with the client's stdout and
+ * stderr as SCM_RIGHTS, followed by `length` bytes of NUL-terminated
+ * strings: the working directory, then argv. The reply is the build's
+ * exit status as an int32_t.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t length;
+} ServerRequestHeader;
+
+typedef struct {
+    char *payload; /* the working directory; argv points into the rest */
+    int descriptors[2];
+    int argc;
+    char **argv;
+} ServerRequest;
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static void server_on_signal(int signal_number) {
+    (void)signal_number;
+    server_stopping = 1;
+}
+
+void server_default_socket(char *path, size_t size) {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && runtime_dir[0] == '/' &&
+        (size_t)snprintf(path, size, "%s/lazylangc.sock", runtime_dir) < size) {
+        return;
+    }
+    snprintf(path, size, "/tmp/lazylangc-%lu.sock", (unsigned long)getuid());
+}
+
+static bool server_address(const char *socket_path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "socket path '%s' is too long\n", socket_path);
+        return false;
+    }
+    strcpy(address->sun_path, socket_path);
+    return true;
+}
+
+static int server_connect(const char *socket_path) {
+    struct sockaddr_un address;
+    if (!server_address(socket_path, &address)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool server_write_all(int fd, const void *data, size_t length) {
+    const char *bytes = data;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        bytes += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+static bool server_read_all(int fd, void *data, size_t length) {
+    char *bytes = data;
+    while (length > 0) {
+        ssize_t got = read(fd, bytes, length);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        bytes += got;
+        length -= (size_t)got;
+    }
+    return true;
+}
+
+/* True when the process at the other end of `fd` runs as this user. */
+static bool server_peer_is_us(int fd) {
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 && length == sizeof(peer) &&
+           peer.uid == getuid();
+}
+
+bool server_forward(const char *socket_path, int argc, char **argv, int *exit_status) {
+    int fd = server_connect(socket_path);
+    if (fd < 0) {
+        return false;
+    }
+    /* Whoever answers gets our terminal and decides our exit status, so it must be us. */
+    if (!server_peer_is_us(fd)) {
+        fprintf(stderr, "ignoring compile server at '%s': it runs as another user\n", socket_path);
+        close(fd);
+        return false;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        close(fd);
+        return false;
+    }
+    size_t length = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        length += strlen(argv[i]) + 1;
+    }
+    if (length > SERVER_MAX_REQUEST) {
+        close(fd);
+        return false;
+    }
+    char *payload = malloc(length);
+    if (!payload) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t offset = 0;
+    size_t part = strlen(cwd) + 1;
+    memcpy(payload, cwd, part);
+    offset += part;
+    for (int i = 0; i < argc; i++) {
+        part = strlen(argv[i]) + 1;
+        memcpy(payload + offset, argv[i], part);
+        offset += part;
+    }
+
+    /* The daemon writes to our stdout/stderr directly; nothing of ours may be pending. */
+    fflush(stdout);
+    fflush(stderr);
+
+    ServerRequestHeader header = { .magic = SERVER_MAGIC, .length = (uint32_t)length };
+    int descriptors[2] = { STDOUT_FILENO, STDERR_FILENO };
+    union {
+        char buffer[CMSG_SPACE(sizeof(descriptors))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(descriptors));
+    memcpy(CMSG_DATA(cmsg), descriptors, sizeof(descriptors));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    bool ok = sent == (ssize_t)sizeof(header) && server_write_all(fd, payload, length);
+    free(payload);
+    if (!ok) {
+        close(fd);
+        return false;
+    }
+
+    /* From here on the build has started; a lost connection is a failed build, not a fallback. */
+    int32_t status = 0;
+    if (!server_read_all(fd, &status, sizeof(status))) {
+        fprintf(stderr, "compile server at '%s' closed the connection\n", socket_path);
+        status = EXIT_FAILURE;
+    }
+    close(fd);
+    *exit_status = status;
+    return true;
+}
+
+static void server_request_free(ServerRequest *request) {
+    for (int i = 0; i < 2; i++) {
+        if (request->descriptors[i] >= 0) {
+            close(request->descriptors[i]);
+        }
+    }
+    free(request->argv);
+    free(request->payload);
+}
+
+/* Reads one request; false (with nothing left to free) when it is malformed or incomplete. */
+static bool server_receive(int connection, ServerRequest *request) {
+    *request = (ServerRequest){ .descriptors = { -1, -1 } };
+    ServerRequestHeader header;
+    union {
+        char buffer[CMSG_SPACE(sizeof(request->descriptors))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer),
+    };
+    ssize_t got;
+    do {
+        got = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+    } while (got < 0 && errno == EINTR);
+    struct cmsghdr *cmsg = got > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        /* The daemon outlives the request: every descriptor received must be closed again. */
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int received;
+            memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (count == 2) {
+                request->descriptors[i] = received;
+            } else {
+                close(received);
+            }
+        }
+    }
+    if (got != (ssize_t)sizeof(header) || header.magic != SERVER_MAGIC ||
+        header.length == 0 || header.length > SERVER_MAX_REQUEST || request->descriptors[0] < 0) {
+        server_request_free(request);
+        return false;
+    }
+
+    request->payload = malloc(header.length);
+    if (!request->payload || !server_read_all(connection, request->payload, header.length) ||
+        request->payload[header.length - 1] != '\0') {
+        server_request_free(request);
+        return false;
+    }
+    int argc = -1; /* the working directory */
+    for (size_t i = 0; i < header.length; i++) {
+        argc += request->payload[i] == '\0';
+    }
+    request->argv = argc >= 1 ? calloc((size_t)argc + 1, sizeof(char *)) : NULL;
+    if (!request->argv) {
+        server_request_free(request);
+        return false;
+    }
+    char *cursor = request->payload + strlen(request->payload) + 1;
+    for (int i = 0; i < argc; i++) {
+        request->argv[i] = cursor;
+        cursor += strlen(cursor) + 1;
+    }
+    request->argc = argc;
+    return true;
+}
+
+/*
+ * Lets the warmer parse the request's modules in the daemon itself, from the
+ * client's working directory, so this session and every later one fork off
+ * the result (see module_cache_warm).
+ */
+static void server_warm_request(const ServerRequest *request, ServerWarmer warmer) {
+    int home = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (home < 0) {
+        return;
+    }
+    if (chdir(request->payload) == 0) {
+        warmer(request->argc, request->argv);
+        if (fchdir(home) != 0) {
+            /* Relative socket paths would no longer resolve. */
+            fprintf(stderr, "compile server cannot return to its directory: %s\n", strerror(errno));
+            server_stopping = 1;
+        }
+    }
+    close(home);
+}
+
+/* Runs one request in a child of the session, so the handler may exit() as it pleases. */
+static int server_run_request(const ServerRequest *request, ServerHandler handler) {
+    pid_t worker = fork();
+    if (worker < 0) {
+        return EXIT_FAILURE;
+    }
+    if (worker == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        int devnull = open("/dev/null", O_RDONLY);
+        if (devnull >= 0) {
+            dup2(devnull, STDIN_FILENO);
+            close(devnull);
+        }
+        dup2(request->descriptors[0], STDOUT_FILENO);
+        dup2(request->descriptors[1], STDERR_FILENO);
+        if (chdir(request->payload) != 0) {
+            fprintf(stderr, "compile server cannot enter '%s': %s\n", request->payload, strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+        exit(handler(request->argc, request->argv));
+    }
+
+    int status = 0;
+    while (waitpid(worker, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    return 128 + (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+}
+
+/* Work every build would otherwise repeat; forked children inherit the results. */
+static void server_warm_up(void) {
+    ast_symbols();
+    codegen_find_compiler();
+    char runtime_dir[PATH_MAX];
+    codegen_locate_runtime(runtime_dir, sizeof(runtime_dir));
+}
+
+int server_run(const char *socket_path, ServerHandler handler, ServerWarmer warmer) {
+    struct sockaddr_un address;
+    if (!server_address(socket_path, &address)) {
+        return EXIT_FAILURE;
+    }
+    int existing = server_connect(socket_path);
+    if (existing >= 0) {
+        close(existing);
+        fprintf(stderr, "a compile server is already listening on '%s'\n", socket_path);
+        return EXIT_FAILURE;
+    }
+    unlink(socket_path); /* left behind by a server that did not shut down cleanly */
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t previous_mask = umask(0077);
+    bool bound = listener >= 0 &&
+                 bind(listener, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+                 listen(listener, 64) == 0;
+    umask(previous_mask);
+    if (!bound) {
+        fprintf(stderr, "failed to listen on '%s': %s\n", socket_path, strerror(errno));
+        if (listener >= 0) close(listener);
+        return EXIT_FAILURE;
+    }
+
+    server_warm_up();
+
+    struct sigaction stop = { .sa_handler = server_on_signal };
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN); /* sessions are reaped automatically */
+
+    printf("lazylangc server listening on %s\n", socket_path);
+    fflush(stdout);
+    fflush(stderr);
+
+    while (!server_stopping) {
+        int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            break;
+        }
+        /* The socket is private to us, but only a same-user peer may hand over descriptors. */
+        struct timeval timeout = { .tv_sec = SERVER_RECEIVE_TIMEOUT };
+        ServerRequest request;
+        if (!server_peer_is_us(connection) ||
+            setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+            !server_receive(connection, &request)) {
+            close(connection);
+            continue;
+        }
+        server_warm_request(&request, warmer);
+
+        /* One session process per client, so slow builds never hold up the next request. */
+        pid_t session = fork();
+        if (session == 0) {
+            close(listener);
+            signal(SIGCHLD, SIG_DFL);
+            int32_t status = server_run_request(&request, handler);
+            server_write_all(connection, &status, sizeof(status));
+            _exit(EXIT_SUCCESS);
+        }
+        if (session < 0) {
+            fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        }
+        server_request_free(&request);
+        close(connection);
+    }
+
+    close(listener);
+    unlink(socket_path);
+    return server_stopping ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,38 @@
+#ifndef LZ_DRIVER_SERVER_H
+#define LZ_DRIVER_SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SERVER_SOCKET_CAPACITY 108 /* sizeof(sockaddr_un.sun_path) */
+
+/*
+ * Compile server behind --server and --connect. The daemon warms up once
+ * (interned symbols, toolchain discovery, runtime location), and before
+ * each request it lets the warmer parse the request's modules into its own
+ * memory, where they stay while the files are unchanged. Every request then
+ * runs in a child forked off that warm state, so errors that exit the front
+ * end only end that child. A client passes its working directory, its
+ * arguments and its stdout/stderr descriptors, and gets the build's exit
+ * status back; output goes straight to the client's terminal. Both ends
+ * check SO_PEERCRED and only talk to processes of the same user. The daemon
+ * uses its own environment (PATH, cache directory) for every build.
+ */
+typedef int (*ServerHandler)(int argc, char **argv);
+/* Runs in the daemon itself, from the client's directory; must not exit or print. */
+typedef void (*ServerWarmer)(int argc, char **argv);
+
+/* $XDG_RUNTIME_DIR/lazylangc.sock, else /tmp/lazylangc-<uid>.sock. */
+void server_default_socket(char *path, size_t size);
+
+/* Serves requests until SIGINT or SIGTERM; returns the process exit status. */
+int server_run(const char *socket_path, ServerHandler handler, ServerWarmer warmer);
+
+/*
+ * Sends one build to the daemon and waits for it. False when no daemon
+ * answers at `socket_path`, or one run by another user does; the caller
+ * then builds in-process.
+ */
+bool server_forward(const char *socket_path, int argc, char **argv, int *exit_status);
+
+#endif
@@ -0,0 +1,107 @@
+#define _DEFAULT_SOURCE
+
+#include "source.h"
+
+#include "../diag.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Pipes and other non-regular inputs cannot be mapped; read them instead. */
+static void source_file_read(SourceFile *file, int fd, const char *path) {
+    size_t capacity = 64 * 1024;
+    size_t length = 0;
+    char *buffer = malloc(capacity);
+    if (!buffer) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        if (capacity - length < 2) {
+            capacity *= 2;
+            char *grown = realloc(buffer, capacity);
+            if (!grown) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            buffer = grown;
+        }
+        ssize_t n = read(fd, buffer + length, capacity - length - 1);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            diag_error("failed to read '%s'\n", path);
+        }
+        length += (size_t)n;
+    }
+    buffer[length] = '\0';
+    file->data = buffer;
+    file->length = length;
+    file->mapping_size = 0;
+}
+
+/*
+ * The mapping is one page longer than the file needs, rounded up: an
+ * anonymous read-only reservation is made first and the file is mapped over
+ * its start with MAP_FIXED. Bytes past EOF in the file's last page read as
+ * zero, and when the file ends on a page boundary the following page is the
+ * zero-filled reservation, so data[length] is '\0' either way without
+ * copying anything.
+ */
+void source_file_open(SourceFile *file, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        diag_error("failed to open '%s'\n", path);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        diag_error("failed to measure '%s'\n", path);
+    }
+    if (!S_ISREG(info.st_mode) || info.st_size == 0) {
+        source_file_read(file, fd, path);
+        close(fd);
+        return;
+    }
+
+    size_t length = (size_t)info.st_size;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapping_size = (length / page + 1) * page;
+    void *base = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        diag_error("failed to map '%s': %s\n", path, strerror(error));
+    }
+    if (mmap(base, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        int error = errno;
+        munmap(base, mapping_size);
+        close(fd);
+        diag_error("failed to map '%s': %s\n", path, strerror(error));
+    }
+    close(fd);
+    madvise(base, length, MADV_SEQUENTIAL);
+    madvise(base, length, MADV_WILLNEED);
+
+    file->data = base;
+    file->length = length;
+    file->mapping_size = mapping_size;
+}
+
+void source_file_close(SourceFile *file) {
+    if (file->mapping_size > 0) {
+        munmap((void *)file->data, file->mapping_size);
+    } else {
+        free((void *)file->data);
+    }
+    file->data = NULL;
+    file->length = 0;
+    file->mapping_size = 0;
+}
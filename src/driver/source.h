@@ -0,0 +1,22 @@
+#ifndef LZ_DRIVER_SOURCE_H
+#define LZ_DRIVER_SOURCE_H
+
+#include <stddef.h>
+
+/*
+ * A source file loaded for compilation. Regular files are mapped read-only
+ * rather than copied; tokens and AST literals are slices of `data`, so the
+ * file must stay open until codegen has finished. data[length] is always
+ * '\0', which is the lexer's end-of-input sentinel.
+ */
+typedef struct {
+    const char *data;
+    size_t length;
+    size_t mapping_size; /* 0 when `data` is a heap buffer */
+} SourceFile;
+
+/* Reports the failure and exits, like the rest of the front end. */
+void source_file_open(SourceFile *file, const char *path);
+void source_file_close(SourceFile *file);
+
+#endif
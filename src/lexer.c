@@ -1,16 +1,28 @@
 #include "lexer.h"
+#include "diag.h"
+
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdio.h>
 
+#if defined(__GNUC__) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#define LEXER_SIMD 1
+/* AVX2 é compilado à parte (target) e escolhido em tempo de execução. */
+#if defined(__x86_64__) || defined(__i386__)
+#define LEXER_AVX2 1
+#define LEXER_AVX2_FN __attribute__((target("avx2")))
+#endif
+#endif
+
 #define INDENT_STACK_MAX 128
 
 struct Lexer {
     const char *src;
+    size_t length;
     size_t pos;
     int line;
-    int col;
+    size_t line_start; /* offset do primeiro byte da linha atual */
 
     int indent_stack[INDENT_STACK_MAX];
     int indent_top;
@@ -19,26 +31,206 @@ struct Lexer {
     bool at_line_start;
 };
 
+/* ---------- classes de caracteres ---------- */
+
+/*
+ * Tabela ASCII fixa (independente de locale). Bytes >= 0x80 não pertencem a
+ * nenhuma classe, como em isalpha/isdigit no locale "C".
+ */
+enum {
+    CH_ALPHA = 1, /* letras e '_' */
+    CH_DIGIT = 2,
+    CH_SPACE = 4, /* ' ' e '\t' */
+    CH_CR = 8,
+    CH_IDENT = CH_ALPHA | CH_DIGIT,
+    CH_BLANK = CH_SPACE | CH_CR,
+};
+
+static const unsigned char char_class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 0, 0, 0, 8, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+};
+
+static bool has_class(char c, unsigned char mask) {
+    return (char_class[(unsigned char)c] & mask) != 0;
+}
+
+/* ---------- varredura em blocos (SIMD) ---------- */
+
+/*
+ * Cada função avança `p` enquanto os bytes pertencem à classe e devolve o
+ * primeiro byte fora dela, sem passar de `end`. Os laços vetoriais só leem
+ * blocos inteiros antes de `end`; o resto é varrido pelo laço escalar.
+ */
+#ifdef LEXER_SIMD
+
+/* lo <= c <= hi, byte a byte (comparação sem sinal via deslocamento de 128). */
+static inline __m128i sse_in_range(__m128i v, char lo, char hi) {
+    __m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8((char)(lo + 128)));
+    return _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + (hi - lo) + 1)));
+}
+
+static inline unsigned sse_ident_mask(__m128i v) {
+    __m128i m = _mm_or_si128(sse_in_range(v, 'a', 'z'), sse_in_range(v, 'A', 'Z'));
+    m = _mm_or_si128(m, sse_in_range(v, '0', '9'));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    return (unsigned)_mm_movemask_epi8(m);
+}
+
+static inline unsigned sse_digit_mask(__m128i v) {
+    return (unsigned)_mm_movemask_epi8(sse_in_range(v, '0', '9'));
+}
+
+static inline unsigned sse_blank_mask(__m128i v, bool allow_cr) {
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    if (allow_cr) {
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    }
+    return (unsigned)_mm_movemask_epi8(m);
+}
+
+/* Corpo de string: tudo exceto '"', '\n' e '\0'. */
+static inline unsigned sse_string_mask(__m128i v) {
+    __m128i stop = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    return (unsigned)_mm_movemask_epi8(stop) ^ 0xFFFFu;
+}
+
+#ifdef LEXER_AVX2
+static inline LEXER_AVX2_FN __m256i avx_in_range(__m256i v, char lo, char hi) {
+    __m256i shifted = _mm256_sub_epi8(v, _mm256_set1_epi8((char)(lo + 128)));
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + (hi - lo) + 1)), shifted);
+}
+
+static inline LEXER_AVX2_FN unsigned avx_ident_mask(__m256i v) {
+    __m256i m = _mm256_or_si256(avx_in_range(v, 'a', 'z'), avx_in_range(v, 'A', 'Z'));
+    m = _mm256_or_si256(m, avx_in_range(v, '0', '9'));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    return (unsigned)_mm256_movemask_epi8(m);
+}
+
+static inline LEXER_AVX2_FN unsigned avx_string_mask(__m256i v) {
+    __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                   _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    return (unsigned)_mm256_movemask_epi8(stop) ^ 0xFFFFFFFFu;
+}
+#endif
+
+#endif /* LEXER_SIMD */
+
+static const char *skip_ident_sse(const char *p, const char *end) {
+#ifdef LEXER_SIMD
+    while (end - p >= 16) {
+        unsigned outside = sse_ident_mask(_mm_loadu_si128((const __m128i *)p)) ^ 0xFFFFu;
+        if (outside) return p + __builtin_ctz(outside);
+        p += 16;
+    }
+#endif
+    while (p < end && has_class(*p, CH_IDENT)) p++;
+    return p;
+}
+
+static const char *skip_string_body_sse(const char *p, const char *end) {
+#ifdef LEXER_SIMD
+    while (end - p >= 16) {
+        unsigned outside = sse_string_mask(_mm_loadu_si128((const __m128i *)p)) ^ 0xFFFFu;
+        if (outside) return p + __builtin_ctz(outside);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\n' && *p != '\0') p++;
+    return p;
+}
+
+#ifdef LEXER_AVX2
+static LEXER_AVX2_FN const char *skip_ident_avx2(const char *p, const char *end) {
+    while (end - p >= 32) {
+        unsigned outside = ~avx_ident_mask(_mm256_loadu_si256((const __m256i *)p));
+        if (outside) return p + __builtin_ctz(outside);
+        p += 32;
+    }
+    return skip_ident_sse(p, end);
+}
+
+static LEXER_AVX2_FN const char *skip_string_body_avx2(const char *p, const char *end) {
+    while (end - p >= 32) {
+        unsigned outside = ~avx_string_mask(_mm256_loadu_si256((const __m256i *)p));
+        if (outside) return p + __builtin_ctz(outside);
+        p += 32;
+    }
+    return skip_string_body_sse(p, end);
+}
+#endif
+
+/* __builtin_cpu_supports só lê uma flag já preenchida pela libgcc. */
+static const char *skip_ident(const char *p, const char *end) {
+#ifdef LEXER_AVX2
+    if (end - p >= 32 && __builtin_cpu_supports("avx2")) return skip_ident_avx2(p, end);
+#endif
+    return skip_ident_sse(p, end);
+}
+
+static const char *skip_digits(const char *p, const char *end) {
+#ifdef LEXER_SIMD
+    while (end - p >= 16) {
+        unsigned outside = sse_digit_mask(_mm_loadu_si128((const __m128i *)p)) ^ 0xFFFFu;
+        if (outside) return p + __builtin_ctz(outside);
+        p += 16;
+    }
+#endif
+    while (p < end && has_class(*p, CH_DIGIT)) p++;
+    return p;
+}
+
+/* Espaços e tabs; `allow_cr` também pula '\r' (fora da indentação). */
+static const char *skip_blanks(const char *p, const char *end, bool allow_cr) {
+    unsigned char mask = allow_cr ? CH_BLANK : CH_SPACE;
+#ifdef LEXER_SIMD
+    while (end - p >= 16) {
+        unsigned outside = sse_blank_mask(_mm_loadu_si128((const __m128i *)p), allow_cr) ^ 0xFFFFu;
+        if (outside) return p + __builtin_ctz(outside);
+        p += 16;
+    }
+#endif
+    while (p < end && has_class(*p, mask)) p++;
+    return p;
+}
+
+static const char *skip_string_body(const char *p, const char *end) {
+#ifdef LEXER_AVX2
+    if (end - p >= 32 && __builtin_cpu_supports("avx2")) return skip_string_body_avx2(p, end);
+#endif
+    return skip_string_body_sse(p, end);
+}
+
 /* ---------- utilidades básicas ---------- */
 
 static char peek(Lexer *l) {
     return l->src[l->pos];
 }
 
-static char advance(Lexer *l) {
-    char c = l->src[l->pos++];
-    if (c == '\n') {
-        l->line++;
-        l->col = 1;
-    } else {
-        l->col++;
-    }
-    return c;
+/* Colunas são calculadas sob demanda a partir do início da linha. */
+static int current_column(const Lexer *l) {
+    return (int)(l->pos - l->line_start) + 1;
+}
+
+static void new_line(Lexer *l) {
+    l->line++;
+    l->line_start = l->pos;
 }
 
 static bool match(Lexer *l, char expected) {
     if (peek(l) != expected) return false;
-    advance(l);
+    l->pos++;
     return true;
 }
 
@@ -48,18 +240,28 @@ static Token make_token(Lexer *l, TokenType type, const char *start, size_t len)
     t.lexeme = start;
     t.length = len;
     t.line = l->line;
-    t.column = l->col;
+    t.column = current_column(l);
     return t;
 }
 
+/* Símbolos e quebras de linha apontam para o próprio texto-fonte. */
+static Token symbol_token(Lexer *l, TokenType type, size_t len) {
+    return make_token(l, type, l->src + l->pos - len, len);
+}
+
 /* ---------- criação / destruição ---------- */
 
-Lexer *lexer_create(const char *source) {
+Lexer *lexer_create(const char *source, size_t length) {
     Lexer *l = malloc(sizeof(Lexer));
+    if (!l) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
     l->src = source;
+    l->length = length;
     l->pos = 0;
     l->line = 1;
-    l->col = 1;
+    l->line_start = 0;
 
     l->indent_stack[0] = 0;
     l->indent_top = 0;
@@ -76,46 +278,71 @@ void lexer_destroy(Lexer *l) {
 /* ---------- indentação ---------- */
 
 static int count_indent(Lexer *l) {
-    int count = 0;
-    while (peek(l) == ' ' || peek(l) == '\t') {
-        advance(l);
-        count++;
-    }
-    return count;
+    const char *start = l->src + l->pos;
+    const char *end = skip_blanks(start, l->src + l->length, false);
+    l->pos += (size_t)(end - start);
+    return (int)(end - start);
 }
 
 /* ---------- identificadores / keywords ---------- */
 
 static Token identifier(Lexer *l) {
     size_t start = l->pos - 1;
-    while (isalnum(peek(l)) || peek(l) == '_') {
-        advance(l);
-    }
+    const char *end = skip_ident(l->src + l->pos, l->src + l->length);
+    l->pos = (size_t)(end - l->src);
 
     size_t len = l->pos - start;
     const char *text = l->src + start;
+    return make_token(l, lexer_keyword_type(text, len), text, len);
+}
 
+/*
+ * Palavras-chave: o par (tamanho, primeira letra) já identifica no máximo um
+ * candidato, então basta um switch e uma única comparação de memória.
+ */
+TokenType lexer_keyword_type(const char *text, size_t len) {
 #define KW(name, tok) \
-    if (len == strlen(name) && strncmp(text, name, len) == 0) \
-        return make_token(l, tok, text, len);
-
-    KW("if", TOKEN_IF)
-    KW("else", TOKEN_ELSE)
-    KW("for", TOKEN_FOR)
-    KW("in", TOKEN_IN)
-    KW("struct", TOKEN_STRUCT)
-    KW("mut", TOKEN_MUT)
-    KW("pub", TOKEN_PUB)
-    KW("import", TOKEN_IMPORT)
-    KW("task", TOKEN_TASK)
-    KW("return", TOKEN_RETURN)
-    KW("true", TOKEN_TRUE)
-    KW("false", TOKEN_FALSE)
-    KW("null", TOKEN_NULL)
+    return memcmp(text, name, sizeof(name) - 1) == 0 ? tok : TOKEN_IDENT
+
+    switch (len) {
+        case 2:
+            switch (text[0]) {
+                case 'i':
+                    if (text[1] == 'f') return TOKEN_IF;
+                    if (text[1] == 'n') return TOKEN_IN;
+                    return TOKEN_IDENT;
+            }
+            break;
+        case 3:
+            switch (text[0]) {
+                case 'f': KW("for", TOKEN_FOR);
+                case 'm': KW("mut", TOKEN_MUT);
+                case 'p': KW("pub", TOKEN_PUB);
+            }
+            break;
+        case 4:
+            switch (text[0]) {
+                case 'e': KW("else", TOKEN_ELSE);
+                case 'n': KW("null", TOKEN_NULL);
+                case 't':
+                    if (text[1] == 'a') KW("task", TOKEN_TASK);
+                    KW("true", TOKEN_TRUE);
+            }
+            break;
+        case 5:
+            if (text[0] == 'f') KW("false", TOKEN_FALSE);
+            break;
+        case 6:
+            switch (text[0]) {
+                case 'i': KW("import", TOKEN_IMPORT);
+                case 'r': KW("return", TOKEN_RETURN);
+                case 's': KW("struct", TOKEN_STRUCT);
+            }
+            break;
+    }
+    return TOKEN_IDENT;
 
 #undef KW
-
-    return make_token(l, TOKEN_IDENT, text, len);
 }
 
 /* ---------- lexer principal ---------- */
@@ -148,10 +375,7 @@ Token lexer_next_token(Lexer *l) {
             }
 
             if (indent != l->indent_stack[l->indent_top]) {
-                fprintf(stderr,
-                        "Indentation error at line %d\n",
-                        l->line);
-                exit(1);
+                diag_error("Indentation error at line %d\n", l->line);
             }
 
             l->pending_dedents--;
@@ -161,9 +385,8 @@ Token lexer_next_token(Lexer *l) {
 
     /* consumo normal de caracteres */
     for (;;) {
-        char c = advance(l);
-
-        if (c == '\0') {
+        /* o terminador nunca é consumido: chamadas após o EOF continuam nele */
+        if (peek(l) == '\0') {
             if (l->indent_top > 0) {
                 l->indent_top--;
                 return make_token(l, TOKEN_DEDENT, "", 0);
@@ -171,26 +394,32 @@ Token lexer_next_token(Lexer *l) {
             return make_token(l, TOKEN_EOF, "", 0);
         }
 
-        if (c == ' ' || c == '\t' || c == '\r') {
+        char c = l->src[l->pos++];
+
+        if (has_class(c, CH_BLANK)) {
+            const char *end = skip_blanks(l->src + l->pos, l->src + l->length, true);
+            l->pos = (size_t)(end - l->src);
             continue;
         }
 
         if (c == '\n') {
+            new_line(l);
             l->at_line_start = true;
-            return make_token(l, TOKEN_NEWLINE, "\n", 1);
+            return symbol_token(l, TOKEN_NEWLINE, 1);
         }
 
-        if (isalpha(c) || c == '_') {
+        if (has_class(c, CH_ALPHA)) {
             return identifier(l);
         }
 
-        if (isdigit(c)) {
+        if (has_class(c, CH_DIGIT)) {
             size_t start = l->pos - 1;
-            while (isdigit(peek(l))) advance(l);
+            const char *end = l->src + l->length;
+            l->pos = (size_t)(skip_digits(l->src + l->pos, end) - l->src);
 
             if (peek(l) == '.') {
-                advance(l);
-                while (isdigit(peek(l))) advance(l);
+                l->pos++;
+                l->pos = (size_t)(skip_digits(l->src + l->pos, end) - l->src);
                 return make_token(l, TOKEN_FLOAT,
                                   l->src + start,
                                   l->pos - start);
@@ -203,69 +432,68 @@ Token lexer_next_token(Lexer *l) {
 
         if (c == '"') {
             size_t start = l->pos;
-            while (peek(l) != '"' && peek(l) != '\0') {
-                advance(l);
+            /* strings podem atravessar linhas; cada '\n' atualiza a posição */
+            for (;;) {
+                const char *end = skip_string_body(l->src + l->pos, l->src + l->length);
+                l->pos = (size_t)(end - l->src);
+                if (peek(l) != '\n') break;
+                l->pos++;
+                new_line(l);
             }
-            if (peek(l) == '"') advance(l);
+            if (peek(l) == '"') l->pos++;
             return make_token(l, TOKEN_STRING,
                               l->src + start,
                               l->pos - start - 1);
         }
 
         switch (c) {
-            case ':': return make_token(l, TOKEN_COLON, ":", 1);
-            case ',': return make_token(l, TOKEN_COMMA, ",", 1);
+            case ':': return symbol_token(l, TOKEN_COLON, 1);
+            case ',': return symbol_token(l, TOKEN_COMMA, 1);
             case '=':
                 if (match(l, '=')) {
-                    return make_token(l, TOKEN_EQEQ, "==", 2);
+                    return symbol_token(l, TOKEN_EQEQ, 2);
                 }
-                return make_token(l, TOKEN_EQUAL, "=", 1);
+                return symbol_token(l, TOKEN_EQUAL, 1);
             case '-':
                 if (match(l, '>')) {
-                    return make_token(l, TOKEN_ARROW, "->", 2);
+                    return symbol_token(l, TOKEN_ARROW, 2);
                 }
-                return make_token(l, TOKEN_MINUS, "-", 1);
+                return symbol_token(l, TOKEN_MINUS, 1);
             case '+':
-                return make_token(l, TOKEN_PLUS, "+", 1);
+                return symbol_token(l, TOKEN_PLUS, 1);
             case '*':
-                return make_token(l, TOKEN_STAR, "*", 1);
+                return symbol_token(l, TOKEN_STAR, 1);
             case '/':
-                return make_token(l, TOKEN_SLASH, "/", 1);
+                return symbol_token(l, TOKEN_SLASH, 1);
             case '!':
                 if (match(l, '=')) {
-                    return make_token(l, TOKEN_BANGEQ, "!=", 2);
+                    return symbol_token(l, TOKEN_BANGEQ, 2);
                 }
-                fprintf(stderr,
-                        "Unexpected '!' at line %d, column %d\n",
-                        l->line,
-                        l->col);
-                exit(1);
+                diag_error("Unexpected '!' at line %d, column %d\n", l->line, current_column(l));
             case '<':
                 if (match(l, '=')) {
-                    return make_token(l, TOKEN_LTE, "<=", 2);
+                    return symbol_token(l, TOKEN_LTE, 2);
                 }
-                return make_token(l, TOKEN_LT, "<", 1);
+                return symbol_token(l, TOKEN_LT, 1);
             case '>':
                 if (match(l, '=')) {
-                    return make_token(l, TOKEN_GTE, ">=", 2);
+                    return symbol_token(l, TOKEN_GTE, 2);
                 }
-                return make_token(l, TOKEN_GT, ">", 1);
+                return symbol_token(l, TOKEN_GT, 1);
             case '(':
-                return make_token(l, TOKEN_LPAREN, "(", 1);
+                return symbol_token(l, TOKEN_LPAREN, 1);
             case ')':
-                return make_token(l, TOKEN_RPAREN, ")", 1);
+                return symbol_token(l, TOKEN_RPAREN, 1);
             case '.':
-                return make_token(l, TOKEN_DOT, ".", 1);
+                return symbol_token(l, TOKEN_DOT, 1);
             case '[':
-                return make_token(l, TOKEN_LBRACKET, "[", 1);
+                return symbol_token(l, TOKEN_LBRACKET, 1);
             case ']':
-                return make_token(l, TOKEN_RBRACKET, "]", 1);
+                return symbol_token(l, TOKEN_RBRACKET, 1);
         }
     }
 }
 
-/* ---------- debug ---------- */
-
 const char *token_type_name(TokenType type) {
     switch (type) {
         case TOKEN_EOF:     return "EOF";
@@ -63,12 +63,16 @@ typedef struct {
 
 typedef struct Lexer Lexer;
 
-Lexer *lexer_create(const char *source);
+/* source[length] must be '\0'; the scanner never reads past it. */
+Lexer *lexer_create(const char *source, size_t length);
 
 void lexer_destroy(Lexer *lexer);
 
 Token lexer_next_token(Lexer *lexer);
 
+/* TOKEN_IDENT unless text[0..length) spells a keyword. */
+TokenType lexer_keyword_type(const char *text, size_t length);
+
 const char *token_type_name(TokenType type);
 
 #endif
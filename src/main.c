@@ -1,96 +1,287 @@
-#include "lexer.h"
-#include "parser/parser.h"
-#include "sema/sema.h"
 #include "codegen/codegen.h"
+#include "driver/builddb.h"
+#include "driver/cache.h"
+#include "driver/module.h"
+#include "driver/pool.h"
+#include "driver/server.h"
+#include "profile.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-static char *read_file(const char *path);
+static void print_usage(const char *program_name) {
+    fprintf(stderr,
+            "usage: %s [options] <source-file> [c-output [binary-output]]\n"
+            "options:\n"
+            "  --emit-c               write the generated C to c-output (default lazylang_out.c);\n"
+            "                         otherwise it is piped to the C compiler and never stored\n"
+            "  -O0 | -O1 | -O2 | -O3  optimization level for the generated binary (default -O0)\n"
+            "  -march=native          tune the binary for the host CPU\n"
+            "  -flto                  enable link-time optimization\n"
+            "  -fno-plt               call shared-library functions without the PLT\n"
+            "  -j N                   load, check and compile modules on N threads (default: all CPUs)\n"
+            "  --no-cache             always rebuild; neither read nor update the build cache\n"
+            "  --incremental          rebuild only changed functions, keeping per-function objects\n"
+            "                         in <c-output stem>.lzdb/ (implies --no-cache)\n"
+            "  --stats                print AST arena and interner statistics\n"
+            "  --time-passes          report wall and CPU time per compiler phase\n"
+            "  --mem-report           report peak RSS and allocation counts per phase\n"
+            "  --report-format=FMT    format for the reports above: text (default) or json\n"
+            "  --server[=SOCKET]      run as a compile server on a Unix socket\n"
+            "  --connect[=SOCKET]     send this build to a compile server, building locally if none\n"
+            "                         answers (default socket: $XDG_RUNTIME_DIR/lazylangc.sock)\n",
+            program_name);
+}
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "usage: %s <source-file> [c-output [binary-output]]\n", argv[0]);
+/* One build; runs in-process, or in a child of the compile server. */
+static int build_main(int argc, char **argv) {
+    const char *positional[3] = { NULL, NULL, NULL };
+    size_t positional_count = 0;
+    bool show_stats = false;
+    bool use_cache = true;
+    bool incremental = false;
+    bool emit_c = false;
+    bool time_passes = false;
+    bool mem_report = false;
+    ProfileFormat report_format = PROFILE_FORMAT_TEXT;
+    CodegenBuildFlags build_flags = {0};
+    size_t jobs = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--stats") == 0) {
+            show_stats = true;
+        } else if (strcmp(arg, "--no-cache") == 0) {
+            use_cache = false;
+        } else if (strcmp(arg, "--emit-c") == 0) {
+            emit_c = true;
+        } else if (strcmp(arg, "--incremental") == 0) {
+            incremental = true;
+        } else if (strcmp(arg, "--time-passes") == 0) {
+            time_passes = true;
+        } else if (strcmp(arg, "--mem-report") == 0) {
+            mem_report = true;
+        } else if (strcmp(arg, "--report-format=text") == 0) {
+            report_format = PROFILE_FORMAT_TEXT;
+        } else if (strcmp(arg, "--report-format=json") == 0) {
+            report_format = PROFILE_FORMAT_JSON;
+        } else if (arg[0] == '-' && arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '3' && arg[3] == '\0') {
+            build_flags.opt_level = arg[2] - '0';
+        } else if (strcmp(arg, "-march=native") == 0) {
+            build_flags.march_native = true;
+        } else if (strcmp(arg, "-flto") == 0) {
+            build_flags.lto = true;
+        } else if (strcmp(arg, "-fno-plt") == 0) {
+            build_flags.no_plt = true;
+        } else if (strncmp(arg, "-j", 2) == 0) {
+            const char *count = arg[2] ? arg + 2 : (i + 1 < argc ? argv[++i] : "");
+            char *end = NULL;
+            long parsed = strtol(count, &end, 10);
+            if (*count == '\0' || *end != '\0' || parsed < 1) {
+                fprintf(stderr, "invalid job count '%s'\n", count);
+                print_usage(argv[0]);
+                return 1;
+            }
+            jobs = (size_t)parsed;
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fprintf(stderr, "unknown option '%s'\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        } else if (positional_count < 3) {
+            positional[positional_count++] = arg;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (positional_count < 1) {
+        print_usage(argv[0]);
         return 1;
     }
 
-    const char *source_path = argv[1];
-    const char *c_output_path = (argc >= 3) ? argv[2] : "lazylang_out.c";
-    const char *binary_output_path = (argc >= 4) ? argv[3] : "lazylang_out";
+    profile_enable(time_passes, mem_report, report_format);
 
-    char *source = read_file(source_path);
-    Lexer *lexer = lexer_create(source);
-    ASTProgram *program = parse_program(lexer);
+    const char *source_path = positional[0];
+    const char *c_output_path = positional[1] ? positional[1] : "lazylang_out.c";
+    const char *binary_output_path = positional[2] ? positional[2] : "lazylang_out";
+
+    /* Imports are only known once parsed, so the cache is consulted after loading. */
+    ModuleGraph graph;
+    module_graph_load(&graph, source_path, jobs ? jobs : task_pool_default_threads());
+    ASTProgram *program = graph.modules[0]->program;
+
+    /* Incremental builds keep their own per-function state; the whole-program cache would only shadow it. */
+    BuildDb db;
+    if (incremental) {
+        if (!builddb_open(&db, c_output_path, &build_flags)) {
+            builddb_close(&db);
+            module_graph_destroy(&graph);
+            return 1;
+        }
+        module_graph_plan(&graph, &db, emit_c);
+    }
+
+    CompileCache cache = { .enabled = false };
+    if (use_cache && !incremental) {
+        profile_begin(PROFILE_PHASE_CACHE);
+        CacheSource *sources = malloc(graph.count * sizeof(CacheSource));
+        if (!sources) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        for (size_t i = 0; i < graph.count; i++) {
+            const Module *module = graph.modules[i];
+            sources[i] = (CacheSource){
+                .name = module->name,
+                .data = module->source.data,
+                .length = module->source.length,
+            };
+        }
+        cache_open(&cache, sources, graph.count, &build_flags);
+        free(sources);
+        bool hit = !show_stats &&
+                   cache_restore(&cache, emit_c ? c_output_path : NULL, binary_output_path);
+        profile_end(PROFILE_PHASE_CACHE);
+        if (hit) {
+            printf("Code generation completed (cached): %s%s%s\n",
+                   emit_c ? c_output_path : "",
+                   emit_c ? " -> " : "",
+                   binary_output_path);
+            module_graph_destroy(&graph);
+            profile_report(stderr);
+            return 0;
+        }
+    }
 
     printf("Parsed %zu import(s) and %zu declaration(s)\n",
            program->imports.count,
            program->declarations.count);
+    if (graph.count > 1) {
+        printf("Loaded %zu module(s)\n", graph.count);
+    }
+    if (show_stats) {
+        size_t bytes_used = 0;
+        size_t bytes_reserved = 0;
+        for (size_t i = 0; i < graph.count; i++) {
+            bytes_used += graph.modules[i]->program->arena.bytes_used;
+            bytes_reserved += graph.modules[i]->program->arena.bytes_reserved;
+        }
+        printf("AST arena: %zu bytes used (%zu bytes reserved)\n", bytes_used, bytes_reserved);
+        printf("Interned symbols: %zu\n", ast_intern_count());
+    }
 
-    sema_check_program(program);
+    module_graph_check(&graph);
     printf("Semantic analysis completed successfully\n");
+    size_t folded = module_graph_fold(&graph);
+    if (show_stats) {
+        printf("Constant folding: %zu node(s) folded\n", folded);
+    }
 
-    CodegenOptions options = {
-        .c_output_path = c_output_path,
-        .binary_output_path = binary_output_path,
-        .emit_binary = true,
-    };
-    if (!codegen_emit(program, &options)) {
+    bool built = incremental
+        ? module_graph_build_incremental(&graph, &db, binary_output_path, &build_flags)
+        : module_graph_build(&graph, c_output_path, binary_output_path, &build_flags, emit_c);
+    if (!built) {
         fprintf(stderr, "code generation failed\n");
-        ast_program_destroy(program);
-        lexer_destroy(lexer);
-        free(source);
+        if (incremental) {
+            builddb_close(&db);
+        }
+        module_graph_destroy(&graph);
+        profile_report(stderr);
         return 1;
     }
-    printf("Code generation completed: %s -> %s\n", c_output_path, binary_output_path);
+    if (incremental) {
+        printf("Code generation completed (incremental, %zu of %zu shard(s) rebuilt): %s -> %s\n",
+               graph.stale_count,
+               graph.unit_count,
+               db.dir,
+               binary_output_path);
+        builddb_close(&db);
+        module_graph_destroy(&graph);
+        profile_report(stderr);
+        return 0;
+    }
+    printf("Code generation completed: %s%s%s\n",
+           emit_c ? c_output_path : "",
+           emit_c ? " -> " : "",
+           binary_output_path);
+    profile_begin(PROFILE_PHASE_CACHE);
+    cache_store(&cache, emit_c ? c_output_path : NULL, binary_output_path);
+    profile_end(PROFILE_PHASE_CACHE);
 
-    ast_program_destroy(program);
-    lexer_destroy(lexer);
-    free(source);
+    module_graph_destroy(&graph);
+    profile_report(stderr);
     return 0;
 }
 
-static char *read_file(const char *path) {
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        fprintf(stderr, "failed to open '%s'\n", path);
-        exit(EXIT_FAILURE);
+/* Matches "--name" and "--name=value"; *value is NULL for the bare form. */
+static bool match_socket_option(const char *arg, const char *name, const char **value) {
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) != 0 || (arg[length] != '\0' && arg[length] != '=')) {
+        return false;
     }
+    *value = arg[length] == '=' ? arg + length + 1 : NULL;
+    return true;
+}
 
-    if (fseek(file, 0, SEEK_END) != 0) {
-        fprintf(stderr, "failed to seek '%s'\n", path);
-        fclose(file);
-        exit(EXIT_FAILURE);
+/* The compile server's warmer: caches the modules of build_main's source argument. */
+static void build_warm(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "-j") == 0) {
+            i++; /* the job count */
+        } else if (arg[0] != '-' || arg[1] == '\0') {
+            module_cache_warm(arg);
+            return;
+        }
     }
+}
 
-    long size = ftell(file);
-    if (size < 0) {
-        fprintf(stderr, "failed to measure '%s'\n", path);
-        fclose(file);
-        exit(EXIT_FAILURE);
+int main(int argc, char **argv) {
+    /* --server and --connect decide where the build runs; every other argument belongs to it. */
+    bool serve = false;
+    bool forward = false;
+    const char *socket_path = NULL;
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        const char *value = NULL;
+        if (match_socket_option(argv[i], "--server", &value)) {
+            serve = true;
+        } else if (match_socket_option(argv[i], "--connect", &value)) {
+            forward = true;
+        } else {
+            argv[kept++] = argv[i];
+            continue;
+        }
+        if (value) {
+            socket_path = value;
+        }
     }
+    argc = kept;
+    argv[argc] = NULL;
 
-    if (fseek(file, 0, SEEK_SET) != 0) {
-        fprintf(stderr, "failed to rewind '%s'\n", path);
-        fclose(file);
-        exit(EXIT_FAILURE);
+    char default_socket[SERVER_SOCKET_CAPACITY];
+    if (!socket_path) {
+        server_default_socket(default_socket, sizeof(default_socket));
+        socket_path = default_socket;
     }
 
-    char *buffer = malloc((size_t)size + 1);
-    if (!buffer) {
-        fprintf(stderr, "Out of memory\n");
-        fclose(file);
-        exit(EXIT_FAILURE);
+    if (serve) {
+        if (forward || argc > 1) {
+            fprintf(stderr, "--server takes no other arguments\n");
+            print_usage(argv[0]);
+            return 1;
+        }
+        return server_run(socket_path, build_main, build_warm);
     }
-
-    size_t read = fread(buffer, 1, (size_t)size, file);
-    if (read != (size_t)size) {
-        fprintf(stderr, "failed to read '%s'\n", path);
-        free(buffer);
-        fclose(file);
-        exit(EXIT_FAILURE);
+    if (forward) {
+        int status = 0;
+        if (server_forward(socket_path, argc, argv, &status)) {
+            return status;
+        }
+        fprintf(stderr, "no usable compile server at '%s'; building locally\n", socket_path);
     }
-
-    buffer[size] = '\0';
-    fclose(file);
-    return buffer;
+    return build_main(argc, argv);
 }
@@ -0,0 +1,291 @@
+#include "fold.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    ASTArena *arena;
+    size_t folded;
+} FoldContext;
+
+static void fold_block(FoldContext *ctx, ASTBlock *block);
+static ASTNode *fold_statement(FoldContext *ctx, ASTNode *node);
+static ASTNode *fold_expression(FoldContext *ctx, ASTNode *node);
+
+/* Literal text is a source slice and not NUL-terminated. */
+static bool fold_literal_text(const ASTLiteralExpr *literal, char *buffer, size_t size) {
+    if (!literal->text || literal->text_length == 0 || literal->text_length >= size) {
+        return false;
+    }
+    memcpy(buffer, literal->text, literal->text_length);
+    buffer[literal->text_length] = '\0';
+    return true;
+}
+
+static bool fold_int_value(const ASTLiteralExpr *literal, int64_t *value) {
+    char buffer[32];
+    if (!fold_literal_text(literal, buffer, sizeof(buffer))) {
+        return false;
+    }
+    errno = 0;
+    char *end = NULL;
+    long long parsed = strtoll(buffer, &end, 10);
+    if (errno != 0 || *end != '\0') {
+        return false;
+    }
+    *value = (int64_t)parsed;
+    return true;
+}
+
+static bool fold_float_value(const ASTLiteralExpr *literal, double *value) {
+    char buffer[64];
+    if (!fold_literal_text(literal, buffer, sizeof(buffer))) {
+        return false;
+    }
+    errno = 0;
+    char *end = NULL;
+    double parsed = strtod(buffer, &end);
+    if (errno != 0 || *end != '\0' || !isfinite(parsed)) {
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
+
+/* The folded literal keeps the operator's token, so diagnostics still point at the expression. */
+static ASTNode *fold_make_literal(FoldContext *ctx,
+                                  const ASTBinaryExpr *binary,
+                                  ASTLiteralKind kind,
+                                  const char *text) {
+    ASTLiteralExpr *literal = ast_literal_create(ctx->arena, &binary->base.token, kind);
+    if (text) {
+        size_t length = strlen(text);
+        ast_literal_set_text(literal, ast_copy_text(ctx->arena, text, length), length);
+    }
+    ctx->folded++;
+    return (ASTNode *)literal;
+}
+
+static ASTNode *fold_bool_result(FoldContext *ctx, const ASTBinaryExpr *binary, bool value) {
+    ASTLiteralExpr *literal = (ASTLiteralExpr *)fold_make_literal(ctx, binary, AST_LITERAL_BOOL, NULL);
+    ast_literal_set_bool(literal, value);
+    return (ASTNode *)literal;
+}
+
+static bool fold_compare(TokenType op, int order, bool *result) {
+    switch (op) {
+        case TOKEN_EQEQ: *result = order == 0; return true;
+        case TOKEN_BANGEQ: *result = order != 0; return true;
+        case TOKEN_LT: *result = order < 0; return true;
+        case TOKEN_LTE: *result = order <= 0; return true;
+        case TOKEN_GT: *result = order > 0; return true;
+        case TOKEN_GTE: *result = order >= 0; return true;
+        default: return false;
+    }
+}
+
+static ASTNode *fold_int_binary(FoldContext *ctx, ASTBinaryExpr *binary, int64_t left, int64_t right) {
+    int64_t value = 0;
+    bool ok = true;
+    switch (binary->op) {
+        case TOKEN_PLUS:
+            ok = !__builtin_add_overflow(left, right, &value);
+            break;
+        case TOKEN_MINUS:
+            ok = !__builtin_sub_overflow(left, right, &value);
+            break;
+        case TOKEN_STAR:
+            ok = !__builtin_mul_overflow(left, right, &value);
+            break;
+        case TOKEN_SLASH:
+            ok = right != 0 && !(left == INT64_MIN && right == -1);
+            if (ok) value = left / right;
+            break;
+        default: {
+            bool result;
+            if (!fold_compare(binary->op, (left > right) - (left < right), &result)) {
+                return (ASTNode *)binary;
+            }
+            return fold_bool_result(ctx, binary, result);
+        }
+    }
+    /* INT64_MIN has no literal spelling in C. */
+    if (!ok || value == INT64_MIN) {
+        return (ASTNode *)binary;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "%lld", (long long)value);
+    return fold_make_literal(ctx, binary, AST_LITERAL_INT, text);
+}
+
+static ASTNode *fold_float_binary(FoldContext *ctx, ASTBinaryExpr *binary, double left, double right) {
+    double value;
+    switch (binary->op) {
+        case TOKEN_PLUS: value = left + right; break;
+        case TOKEN_MINUS: value = left - right; break;
+        case TOKEN_STAR: value = left * right; break;
+        case TOKEN_SLASH:
+            if (right == 0.0) return (ASTNode *)binary;
+            value = left / right;
+            break;
+        default: {
+            bool result;
+            if (!fold_compare(binary->op, (left > right) - (left < right), &result)) {
+                return (ASTNode *)binary;
+            }
+            return fold_bool_result(ctx, binary, result);
+        }
+    }
+    if (!isfinite(value)) {
+        return (ASTNode *)binary;
+    }
+    /* %.17g round-trips every double; keep a '.' so C still reads a floating constant. */
+    char text[48];
+    int length = snprintf(text, sizeof(text), "%.17g", value);
+    if (!strpbrk(text, ".e")) {
+        snprintf(text + length, sizeof(text) - (size_t)length, ".0");
+    }
+    return fold_make_literal(ctx, binary, AST_LITERAL_FLOAT, text);
+}
+
+static ASTNode *fold_binary(FoldContext *ctx, ASTBinaryExpr *binary) {
+    binary->left = fold_expression(ctx, binary->left);
+    binary->right = fold_expression(ctx, binary->right);
+    if (!binary->left || !binary->right ||
+        binary->left->kind != AST_NODE_EXPR_LITERAL || binary->right->kind != AST_NODE_EXPR_LITERAL) {
+        return (ASTNode *)binary;
+    }
+    const ASTLiteralExpr *left = (const ASTLiteralExpr *)binary->left;
+    const ASTLiteralExpr *right = (const ASTLiteralExpr *)binary->right;
+    if (left->literal_kind != right->literal_kind) {
+        return (ASTNode *)binary;
+    }
+    switch (left->literal_kind) {
+        case AST_LITERAL_INT: {
+            int64_t a, b;
+            if (fold_int_value(left, &a) && fold_int_value(right, &b)) {
+                return fold_int_binary(ctx, binary, a, b);
+            }
+            break;
+        }
+        case AST_LITERAL_FLOAT: {
+            double a, b;
+            if (fold_float_value(left, &a) && fold_float_value(right, &b)) {
+                return fold_float_binary(ctx, binary, a, b);
+            }
+            break;
+        }
+        case AST_LITERAL_BOOL:
+            if (binary->op == TOKEN_EQEQ || binary->op == TOKEN_BANGEQ) {
+                bool equal = left->bool_value == right->bool_value;
+                return fold_bool_result(ctx, binary, binary->op == TOKEN_EQEQ ? equal : !equal);
+            }
+            break;
+        default:
+            break;
+    }
+    return (ASTNode *)binary;
+}
+
+static ASTNode *fold_expression(FoldContext *ctx, ASTNode *node) {
+    if (!node) return NULL;
+    switch (node->kind) {
+        case AST_NODE_EXPR_BINARY:
+            return fold_binary(ctx, (ASTBinaryExpr *)node);
+        case AST_NODE_EXPR_CALL: {
+            ASTCallExpr *call = (ASTCallExpr *)node;
+            for (size_t i = 0; i < call->arguments.count; i++) {
+                call->arguments.items[i] = fold_expression(ctx, call->arguments.items[i]);
+            }
+            return node;
+        }
+        case AST_NODE_EXPR_TASK:
+            fold_block(ctx, ((ASTTaskExpr *)node)->body);
+            return node;
+        default:
+            return node;
+    }
+}
+
+/*
+ * A taken branch replaces the whole `if` as a nested block, so its scope and
+ * its role as the enclosing block's tail value stay exactly as they were.
+ */
+static ASTNode *fold_if(FoldContext *ctx, ASTIfStmt *stmt) {
+    stmt->condition = fold_expression(ctx, stmt->condition);
+    fold_block(ctx, stmt->then_block);
+    fold_block(ctx, stmt->else_block);
+    const ASTLiteralExpr *condition = (const ASTLiteralExpr *)stmt->condition;
+    if (!condition || condition->base.kind != AST_NODE_EXPR_LITERAL ||
+        condition->literal_kind != AST_LITERAL_BOOL) {
+        return (ASTNode *)stmt;
+    }
+    ASTBlock *taken = condition->bool_value ? stmt->then_block : stmt->else_block;
+    if (!taken) {
+        taken = ast_block_create(ctx->arena, &stmt->base.token);
+    }
+    ctx->folded++;
+    return (ASTNode *)taken;
+}
+
+static ASTNode *fold_statement(FoldContext *ctx, ASTNode *node) {
+    if (!node) return NULL;
+    switch (node->kind) {
+        case AST_NODE_VAR_DECL: {
+            ASTVarDecl *decl = (ASTVarDecl *)node;
+            decl->initializer = fold_expression(ctx, decl->initializer);
+            return node;
+        }
+        case AST_NODE_ASSIGN: {
+            ASTAssignStmt *assign = (ASTAssignStmt *)node;
+            assign->value = fold_expression(ctx, assign->value);
+            return node;
+        }
+        case AST_NODE_IF:
+            return fold_if(ctx, (ASTIfStmt *)node);
+        case AST_NODE_FOR: {
+            ASTForStmt *stmt = (ASTForStmt *)node;
+            stmt->iterable = fold_expression(ctx, stmt->iterable);
+            fold_block(ctx, stmt->body);
+            return node;
+        }
+        case AST_NODE_RETURN: {
+            ASTReturnStmt *stmt = (ASTReturnStmt *)node;
+            stmt->value = fold_expression(ctx, stmt->value);
+            return node;
+        }
+        case AST_NODE_EXPR_STMT: {
+            ASTExprStmt *stmt = (ASTExprStmt *)node;
+            stmt->expr = fold_expression(ctx, stmt->expr);
+            return node;
+        }
+        case AST_NODE_BLOCK:
+            fold_block(ctx, (ASTBlock *)node);
+            return node;
+        default:
+            return node;
+    }
+}
+
+static void fold_block(FoldContext *ctx, ASTBlock *block) {
+    if (!block) return;
+    for (size_t i = 0; i < block->statements.count; i++) {
+        block->statements.items[i] = fold_statement(ctx, block->statements.items[i]);
+    }
+}
+
+size_t fold_program(ASTProgram *program, const bool *selected) {
+    FoldContext ctx = { .arena = &program->arena, .folded = 0 };
+    for (size_t i = 0; i < program->declarations.count; i++) {
+        ASTNode *decl = program->declarations.items[i];
+        if (decl->kind != AST_NODE_FUNCTION || (selected && !selected[i])) {
+            continue;
+        }
+        fold_block(&ctx, ((ASTFunctionDecl *)decl)->body);
+    }
+    return ctx.folded;
+}
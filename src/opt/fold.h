@@ -0,0 +1,24 @@
+#ifndef LZ_OPT_FOLD_H
+#define LZ_OPT_FOLD_H
+
+#include "../ast/ast.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Constant folding over a checked program, run between sema and codegen.
+ * A binary operator whose operands are both int, both float or both bool
+ * literals becomes the literal it evaluates to, and an `if` on a literal
+ * condition becomes the block it always takes (an empty one if none);
+ * task bodies are folded like any other block.
+ * Whatever C would evaluate differently is left alone: integer overflow,
+ * division by zero, non-finite floats and mixed int/float operands. New
+ * nodes and literal text come from the program's arena.
+ *
+ * Only the bodies of functions with selected[i] set are folded (all of them
+ * when `selected` is NULL). Returns the number of nodes folded.
+ */
+size_t fold_program(ASTProgram *program, const bool *selected);
+
+#endif
@@ -1,23 +1,30 @@
 #include "parser.h"
 
+#include "../diag.h"
+#include "../profile.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} TypeBuilder;
+
 typedef struct {
     Lexer *lexer;
+    bool time_lexing; /* charge each token fetch to the lex phase */
+    ASTArena *arena;
+    TypeBuilder type_builder; /* scratch space reused by every type */
     Token previous;
     Token current;
     Token next;
 } Parser;
 
-typedef struct {
-    char *data;
-    size_t length;
-    size_t capacity;
-} TypeBuilder;
-
-static void parser_init(Parser *parser, Lexer *lexer);
+static void parser_init(Parser *parser, Lexer *lexer, bool time_lexing, ASTArena *arena);
+static Token parser_fetch_token(Parser *parser);
 static void parser_advance(Parser *parser);
 static bool parser_check(Parser *parser, TokenType type);
 static bool parser_match(Parser *parser, TokenType type);
@@ -29,11 +36,10 @@ static TokenType parser_peek_next(Parser *parser);
 
 static void type_builder_init(TypeBuilder *builder);
 static void type_builder_append(TypeBuilder *builder, const char *text, size_t length);
-static char *type_builder_finish(TypeBuilder *builder);
 static bool token_is_terminator(TokenType type, const TokenType *terminators, size_t count);
-static char *parser_collect_type(Parser *parser,
-                                 const TokenType *terminators,
-                                 size_t terminator_count);
+static const char *parser_collect_type(Parser *parser,
+                                       const TokenType *terminators,
+                                       size_t terminator_count);
 
 static ASTImport *parse_import(Parser *parser);
 static ASTNode *parse_top_level_decl(Parser *parser);
@@ -58,11 +64,11 @@ static ASTNode *parse_call(Parser *parser);
 static ASTNode *finish_call(Parser *parser, ASTNode *callee);
 static ASTNode *parse_primary(Parser *parser);
 
-ASTProgram *parse_program(Lexer *lexer) {
+ASTProgram *parse_program(Lexer *lexer, bool time_lexing) {
+    ASTProgram *program = ast_program_create();
     Parser parser;
-    parser_init(&parser, lexer);
+    parser_init(&parser, lexer, time_lexing, &program->arena);
 
-    ASTProgram *program = ast_program_create();
     bool accepting_imports = true;
 
     parser_skip_newlines(&parser);
@@ -81,24 +87,39 @@ ASTProgram *parse_program(Lexer *lexer) {
         parser_skip_newlines(&parser);
     }
 
+    free(parser.type_builder.data);
     return program;
 }
 
-static void parser_init(Parser *parser, Lexer *lexer) {
+static void parser_init(Parser *parser, Lexer *lexer, bool time_lexing, ASTArena *arena) {
     parser->lexer = lexer;
+    parser->time_lexing = time_lexing;
+    parser->arena = arena;
+    type_builder_init(&parser->type_builder);
     parser->previous.type = TOKEN_EOF;
     parser->previous.lexeme = "";
     parser->previous.length = 0;
     parser->previous.line = 0;
     parser->previous.column = 0;
-    parser->current = lexer_next_token(lexer);
-    parser->next = lexer_next_token(lexer);
+    parser->current = parser_fetch_token(parser);
+    parser->next = parser_fetch_token(parser);
+}
+
+/* Tokens are lexed on demand, so lexing is timed here rather than up front. */
+static Token parser_fetch_token(Parser *parser) {
+    if (!parser->time_lexing) {
+        return lexer_next_token(parser->lexer);
+    }
+    profile_begin(PROFILE_PHASE_LEX);
+    Token token = lexer_next_token(parser->lexer);
+    profile_end(PROFILE_PHASE_LEX);
+    return token;
 }
 
 static void parser_advance(Parser *parser) {
     parser->previous = parser->current;
     parser->current = parser->next;
-    parser->next = lexer_next_token(parser->lexer);
+    parser->next = parser_fetch_token(parser);
 }
 
 static bool parser_check(Parser *parser, TokenType type) {
@@ -123,8 +144,7 @@ static Token parser_consume(Parser *parser, TokenType type, const char *message)
 }
 
 static void parser_error(Token token, const char *message) {
-    fprintf(stderr, "[line %d:%d] Parse error: %s\n", token.line, token.column, message);
-    exit(EXIT_FAILURE);
+    diag_error("[line %d:%d] Parse error: %s\n", token.line, token.column, message);
 }
 
 static void parser_skip_newlines(Parser *parser) {
@@ -134,6 +154,10 @@ static void parser_skip_newlines(Parser *parser) {
 }
 
 static void parser_require_line_break(Parser *parser, const char *message) {
+    /* A statement ending in a block (a task) has already consumed its line break. */
+    if (parser->previous.type == TOKEN_DEDENT) {
+        return;
+    }
     if (parser_match(parser, TOKEN_NEWLINE)) {
         parser_skip_newlines(parser);
         return;
@@ -174,19 +198,6 @@ static void type_builder_append(TypeBuilder *builder, const char *text, size_t l
     builder->length += length;
 }
 
-static char *type_builder_finish(TypeBuilder *builder) {
-    if (builder->capacity == 0) {
-        builder->data = malloc(1);
-        if (!builder->data) {
-            fprintf(stderr, "Out of memory\n");
-            exit(EXIT_FAILURE);
-        }
-        builder->capacity = 1;
-    }
-    builder->data[builder->length] = '\0';
-    return builder->data;
-}
-
 static bool token_is_terminator(TokenType type, const TokenType *terminators, size_t count) {
     for (size_t i = 0; i < count; i++) {
         if (type == terminators[i]) {
@@ -196,11 +207,11 @@ static bool token_is_terminator(TokenType type, const TokenType *terminators, si
     return false;
 }
 
-static char *parser_collect_type(Parser *parser,
-                                 const TokenType *terminators,
-                                 size_t terminator_count) {
-    TypeBuilder builder;
-    type_builder_init(&builder);
+static const char *parser_collect_type(Parser *parser,
+                                       const TokenType *terminators,
+                                       size_t terminator_count) {
+    TypeBuilder *builder = &parser->type_builder;
+    builder->length = 0;
     int bracket_depth = 0;
     bool collected = false;
 
@@ -242,7 +253,7 @@ static char *parser_collect_type(Parser *parser,
             }
         }
 
-        type_builder_append(&builder, parser->current.lexeme, parser->current.length);
+        type_builder_append(builder, parser->current.lexeme, parser->current.length);
         collected = true;
         parser_advance(parser);
     }
@@ -251,17 +262,17 @@ static char *parser_collect_type(Parser *parser,
         parser_error(parser->current, "expected type name");
     }
 
-    return type_builder_finish(&builder);
+    return ast_intern(builder->data, builder->length);
 }
 
 static ASTImport *parse_import(Parser *parser) {
     Token import_token = parser_consume(parser, TOKEN_IMPORT, "expected 'import'");
-    ASTImport *import_stmt = ast_import_create(&import_token);
+    ASTImport *import_stmt = ast_import_create(parser->arena, &import_token);
 
     bool expect_segment = true;
     while (expect_segment) {
         Token segment = parser_consume(parser, TOKEN_IDENT, "expected identifier in import path");
-        ast_import_add_segment(import_stmt, &segment);
+        ast_import_add_segment(parser->arena, import_stmt, &segment);
         if (!parser_match(parser, TOKEN_DOT)) {
             expect_segment = false;
         }
@@ -282,16 +293,8 @@ static ASTNode *parse_top_level_decl(Parser *parser) {
     return (ASTNode *)parse_function_decl(parser, is_public, name_token);
 }
 
-static void free_string_array(ASTArray *array) {
-    for (size_t i = 0; i < array->count; i++) {
-        free(array->items[i]);
-        array->items[i] = NULL;
-    }
-    ast_array_free(array);
-}
-
 static ASTFunctionDecl *parse_function_decl(Parser *parser, bool is_public, Token name_token) {
-    ASTFunctionDecl *fn = ast_function_decl_create(is_public, &name_token);
+    ASTFunctionDecl *fn = ast_function_decl_create(parser->arena, is_public, &name_token);
     parse_function_params(parser, fn);
     ASTBlock *body = parse_block(parser, &name_token);
     ast_function_decl_set_body(fn, body);
@@ -308,8 +311,8 @@ static void parse_function_params(Parser *parser, ASTFunctionDecl *fn) {
 
     if (!parser_check(parser, TOKEN_RPAREN)) {
         while (true) {
-            char *type_name = parser_collect_type(parser, type_terminators, 2);
-            ast_array_append(&type_strings, type_name);
+            const char *type_name = parser_collect_type(parser, type_terminators, 2);
+            ast_array_append(parser->arena, &type_strings, (void *)type_name);
             if (!parser_match(parser, TOKEN_COMMA)) {
                 break;
             }
@@ -319,9 +322,7 @@ static void parse_function_params(Parser *parser, ASTFunctionDecl *fn) {
 
     parser_consume(parser, TOKEN_ARROW, "expected '->' before return type");
     const TokenType return_terms[] = { TOKEN_EQUAL };
-    char *return_type = parser_collect_type(parser, return_terms, 1);
-    ast_function_decl_set_return_type(fn, return_type, strlen(return_type));
-    free(return_type);
+    ast_function_decl_set_return_type(fn, parser_collect_type(parser, return_terms, 1));
 
     parser_consume(parser, TOKEN_EQUAL, "expected '=' before parameter names");
     parser_consume(parser, TOKEN_LPAREN, "expected '(' before parameter names");
@@ -333,10 +334,7 @@ static void parse_function_params(Parser *parser, ASTFunctionDecl *fn) {
             if (index >= type_strings.count) {
                 parser_error(name_token, "missing parameter type");
             }
-            char *type_name = type_strings.items[index];
-            ast_function_decl_add_param(fn, type_name, strlen(type_name), &name_token);
-            free(type_name);
-            type_strings.items[index] = NULL;
+            ast_function_decl_add_param(parser->arena, fn, type_strings.items[index], &name_token);
             index++;
             if (!parser_match(parser, TOKEN_COMMA)) {
                 break;
@@ -348,14 +346,12 @@ static void parse_function_params(Parser *parser, ASTFunctionDecl *fn) {
     if (index != type_strings.count) {
         parser_error(parser->current, "mismatched parameter types and names");
     }
-
-    free_string_array(&type_strings);
 }
 
 static ASTStructDecl *parse_struct_decl(Parser *parser, bool is_public) {
     Token struct_token = parser_consume(parser, TOKEN_STRUCT, "expected 'struct'");
     Token name_token = parser_consume(parser, TOKEN_IDENT, "expected struct name");
-    ASTStructDecl *decl = ast_struct_decl_create(is_public, &name_token);
+    ASTStructDecl *decl = ast_struct_decl_create(parser->arena, is_public, &name_token);
 
     parser_consume(parser, TOKEN_NEWLINE, "expected newline after struct name");
     parser_consume(parser, TOKEN_INDENT, "expected indent before struct body");
@@ -365,9 +361,8 @@ static ASTStructDecl *parse_struct_decl(Parser *parser, bool is_public) {
     while (!parser_check(parser, TOKEN_DEDENT) && !parser_check(parser, TOKEN_EOF)) {
         Token field_name = parser_consume(parser, TOKEN_IDENT, "expected field name");
         parser_consume(parser, TOKEN_COLON, "expected ':' after field name");
-        char *type_name = parser_collect_type(parser, field_terms, 2);
-        ast_struct_decl_add_field(decl, &field_name, type_name, strlen(type_name));
-        free(type_name);
+        const char *type_name = parser_collect_type(parser, field_terms, 2);
+        ast_struct_decl_add_field(parser->arena, decl, &field_name, type_name);
         parser_require_line_break(parser, "expected newline after struct field");
         parser_skip_newlines(parser);
     }
@@ -381,12 +376,12 @@ static ASTBlock *parse_block(Parser *parser, const Token *start_token) {
     parser_consume(parser, TOKEN_NEWLINE, "expected newline before block");
     parser_consume(parser, TOKEN_INDENT, "expected indentation to start block");
 
-    ASTBlock *block = ast_block_create(start_token);
+    ASTBlock *block = ast_block_create(parser->arena, start_token);
     parser_skip_newlines(parser);
 
     while (!parser_check(parser, TOKEN_DEDENT) && !parser_check(parser, TOKEN_EOF)) {
         ASTNode *stmt = parse_statement(parser);
-        ast_block_add_statement(block, stmt);
+        ast_block_add_statement(parser->arena, block, stmt);
         parser_skip_newlines(parser);
     }
 
@@ -430,7 +425,7 @@ static ASTNode *parse_if_stmt(Parser *parser) {
         else_block = parse_block(parser, &parser->previous);
     }
 
-    return (ASTNode *)ast_if_create(&if_token, condition, then_block, else_block);
+    return (ASTNode *)ast_if_create(parser->arena, &if_token, condition, then_block, else_block);
 }
 
 static ASTNode *parse_for_stmt(Parser *parser) {
@@ -440,7 +435,7 @@ static ASTNode *parse_for_stmt(Parser *parser) {
     ASTNode *iterable = parse_expression(parser);
     ASTBlock *body = parse_block(parser, &for_token);
 
-    return (ASTNode *)ast_for_create(&for_token, &iterator, iterable, body);
+    return (ASTNode *)ast_for_create(parser->arena, &for_token, &iterator, iterable, body);
 }
 
 static ASTNode *parse_var_decl(Parser *parser, bool is_mutable) {
@@ -450,14 +445,13 @@ static ASTNode *parse_var_decl(Parser *parser, bool is_mutable) {
     parser_consume(parser, TOKEN_COLON, "expected ':' in variable declaration");
 
     const TokenType var_terms[] = { TOKEN_EQUAL };
-    char *type_name = parser_collect_type(parser, var_terms, 1);
+    const char *type_name = parser_collect_type(parser, var_terms, 1);
     parser_consume(parser, TOKEN_EQUAL, "expected '=' before initializer");
     ASTNode *initializer = parse_expression(parser);
     parser_require_line_break(parser, "expected newline after variable declaration");
 
-    ASTVarDecl *decl = ast_var_decl_create(&name_token, is_mutable);
-    ast_var_decl_set_type(decl, type_name, strlen(type_name));
-    free(type_name);
+    ASTVarDecl *decl = ast_var_decl_create(parser->arena, &name_token, is_mutable);
+    ast_var_decl_set_type(decl, type_name);
     ast_var_decl_set_initializer(decl, initializer);
     return (ASTNode *)decl;
 }
@@ -467,7 +461,7 @@ static ASTNode *parse_assignment(Parser *parser) {
     parser_consume(parser, TOKEN_EQUAL, "expected '=' in assignment");
     ASTNode *value = parse_expression(parser);
     parser_require_line_break(parser, "expected newline after assignment");
-    return (ASTNode *)ast_assign_create(&name_token, value);
+    return (ASTNode *)ast_assign_create(parser->arena, &name_token, value);
 }
 
 static ASTNode *parse_return(Parser *parser) {
@@ -479,13 +473,13 @@ static ASTNode *parse_return(Parser *parser) {
         value = parse_expression(parser);
     }
     parser_require_line_break(parser, "expected newline after return");
-    return (ASTNode *)ast_return_create(&return_token, value);
+    return (ASTNode *)ast_return_create(parser->arena, &return_token, value);
 }
 
 static ASTNode *parse_expr_stmt(Parser *parser) {
     ASTNode *expr = parse_expression(parser);
     parser_require_line_break(parser, "expected newline after expression");
-    return (ASTNode *)ast_expr_stmt_create(expr);
+    return (ASTNode *)ast_expr_stmt_create(parser->arena, expr);
 }
 
 static ASTNode *parse_expression(Parser *parser) {
@@ -498,7 +492,7 @@ static ASTNode *parse_equality(Parser *parser) {
         Token op_token = parser->current;
         parser_advance(parser);
         ASTNode *right = parse_comparison(parser);
-        expr = (ASTNode *)ast_binary_create(expr, op_token.type, right, &op_token);
+        expr = (ASTNode *)ast_binary_create(parser->arena, expr, op_token.type, right, &op_token);
     }
     return expr;
 }
@@ -510,7 +504,7 @@ static ASTNode *parse_comparison(Parser *parser) {
         Token op_token = parser->current;
         parser_advance(parser);
         ASTNode *right = parse_term(parser);
-        expr = (ASTNode *)ast_binary_create(expr, op_token.type, right, &op_token);
+        expr = (ASTNode *)ast_binary_create(parser->arena, expr, op_token.type, right, &op_token);
     }
     return expr;
 }
@@ -521,7 +515,7 @@ static ASTNode *parse_term(Parser *parser) {
         Token op_token = parser->current;
         parser_advance(parser);
         ASTNode *right = parse_factor(parser);
-        expr = (ASTNode *)ast_binary_create(expr, op_token.type, right, &op_token);
+        expr = (ASTNode *)ast_binary_create(parser->arena, expr, op_token.type, right, &op_token);
     }
     return expr;
 }
@@ -532,7 +526,7 @@ static ASTNode *parse_factor(Parser *parser) {
         Token op_token = parser->current;
         parser_advance(parser);
         ASTNode *right = parse_call(parser);
-        expr = (ASTNode *)ast_binary_create(expr, op_token.type, right, &op_token);
+        expr = (ASTNode *)ast_binary_create(parser->arena, expr, op_token.type, right, &op_token);
     }
     return expr;
 }
@@ -549,12 +543,12 @@ static ASTNode *parse_call(Parser *parser) {
 
 static ASTNode *finish_call(Parser *parser, ASTNode *callee) {
     Token lparen = parser->previous;
-    ASTCallExpr *call = ast_call_create(callee, &lparen);
+    ASTCallExpr *call = ast_call_create(parser->arena, callee, &lparen);
 
     if (!parser_check(parser, TOKEN_RPAREN)) {
         while (true) {
             ASTNode *argument = parse_expression(parser);
-            ast_call_add_argument(call, argument);
+            ast_call_add_argument(parser->arena, call, argument);
             if (!parser_match(parser, TOKEN_COMMA)) {
                 break;
             }
@@ -567,35 +561,42 @@ static ASTNode *finish_call(Parser *parser, ASTNode *callee) {
 
 static ASTNode *parse_primary(Parser *parser) {
     if (parser_match(parser, TOKEN_INT)) {
-        ASTLiteralExpr *expr = ast_literal_create(&parser->previous, AST_LITERAL_INT);
+        ASTLiteralExpr *expr = ast_literal_create(parser->arena, &parser->previous, AST_LITERAL_INT);
         ast_literal_set_text(expr, parser->previous.lexeme, parser->previous.length);
         return (ASTNode *)expr;
     }
     if (parser_match(parser, TOKEN_FLOAT)) {
-        ASTLiteralExpr *expr = ast_literal_create(&parser->previous, AST_LITERAL_FLOAT);
+        ASTLiteralExpr *expr = ast_literal_create(parser->arena, &parser->previous, AST_LITERAL_FLOAT);
         ast_literal_set_text(expr, parser->previous.lexeme, parser->previous.length);
         return (ASTNode *)expr;
     }
     if (parser_match(parser, TOKEN_STRING)) {
-        ASTLiteralExpr *expr = ast_literal_create(&parser->previous, AST_LITERAL_STRING);
+        ASTLiteralExpr *expr = ast_literal_create(parser->arena, &parser->previous, AST_LITERAL_STRING);
         ast_literal_set_text(expr, parser->previous.lexeme, parser->previous.length);
         return (ASTNode *)expr;
     }
     if (parser_match(parser, TOKEN_TRUE)) {
-        ASTLiteralExpr *expr = ast_literal_create(&parser->previous, AST_LITERAL_BOOL);
+        ASTLiteralExpr *expr = ast_literal_create(parser->arena, &parser->previous, AST_LITERAL_BOOL);
         ast_literal_set_bool(expr, true);
         return (ASTNode *)expr;
     }
     if (parser_match(parser, TOKEN_FALSE)) {
-        ASTLiteralExpr *expr = ast_literal_create(&parser->previous, AST_LITERAL_BOOL);
+        ASTLiteralExpr *expr = ast_literal_create(parser->arena, &parser->previous, AST_LITERAL_BOOL);
         ast_literal_set_bool(expr, false);
         return (ASTNode *)expr;
     }
     if (parser_match(parser, TOKEN_NULL)) {
-        return (ASTNode *)ast_literal_create(&parser->previous, AST_LITERAL_NULL);
+        return (ASTNode *)ast_literal_create(parser->arena, &parser->previous, AST_LITERAL_NULL);
     }
     if (parser_match(parser, TOKEN_IDENT)) {
-        return (ASTNode *)ast_identifier_create(&parser->previous);
+        return (ASTNode *)ast_identifier_create(parser->arena, &parser->previous);
+    }
+    if (parser_match(parser, TOKEN_TASK)) {
+        Token task_token = parser->previous;
+        parser_consume(parser, TOKEN_LPAREN, "expected '(' after 'task'");
+        parser_consume(parser, TOKEN_RPAREN, "expected ')' after 'task ('");
+        ASTBlock *body = parse_block(parser, &task_token);
+        return (ASTNode *)ast_task_create(parser->arena, &task_token, body);
     }
     if (parser_match(parser, TOKEN_LPAREN)) {
         ASTNode *expr = parse_expression(parser);
@@ -4,6 +4,11 @@
 #include "../lexer.h"
 #include "../ast/ast.h"
 
-ASTProgram *parse_program(Lexer *lexer);
+/*
+ * Pulls tokens from `lexer` as it parses. With `time_lexing`, each fetch is
+ * timed as the lex phase; only the main thread may ask for that (see
+ * profile.h). The AST points into the source text.
+ */
+ASTProgram *parse_program(Lexer *lexer, bool time_lexing);
 
 #endif
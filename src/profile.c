@@ -0,0 +1,390 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "profile.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define PROFILE_MAX_DEPTH 16
+
+/*
+ * Wall time is exclusive of nested phases. CPU time is only sampled when a
+ * top-level phase starts or ends (the CPU clock is a real syscall, too slow
+ * to read per token), so it covers nested phases too; the report hands each
+ * nested phase its wall-time share of the enclosing phase's CPU time.
+ */
+typedef struct {
+    double wall_seconds;
+    double nested_wall_seconds;
+    double cpu_seconds;
+    int parent; /* enclosing top-level phase, -1 when top-level */
+    long peak_rss_kb; /* 0 when the phase never ended at top level */
+} ProfileTiming;
+
+/* Written only by the owning thread (load + store, no RMW); summed at report time. */
+typedef struct {
+    atomic_size_t allocations;
+    atomic_size_t reallocations;
+    atomic_size_t frees;
+    atomic_size_t bytes;
+} ProfileAllocStats;
+
+typedef struct {
+    size_t allocations;
+    size_t reallocations;
+    size_t frees;
+    size_t bytes;
+} ProfileAllocTotals;
+
+/* One per thread that allocated while counting; kept after the thread exits. */
+typedef struct ProfileThreadAllocs {
+    ProfileAllocStats phases[PROFILE_PHASE_COUNT];
+    struct ProfileThreadAllocs *next;
+} ProfileThreadAllocs;
+
+static const char *const PROFILE_PHASE_NAMES[PROFILE_PHASE_COUNT] = {
+    [PROFILE_PHASE_OTHER] = "other",
+    [PROFILE_PHASE_CACHE] = "cache",
+    [PROFILE_PHASE_LEX] = "lex",
+    [PROFILE_PHASE_PARSE] = "parse",
+    [PROFILE_PHASE_SEMA] = "sema",
+    [PROFILE_PHASE_OPT] = "opt",
+    [PROFILE_PHASE_EMIT] = "emit",
+    [PROFILE_PHASE_CC] = "cc",
+};
+
+static struct {
+    bool enabled;
+    bool time_passes;
+    bool mem_report;
+    ProfileFormat format;
+    ProfilePhase stack[PROFILE_MAX_DEPTH];
+    size_t depth;
+    struct timespec wall_mark;
+    struct timespec cpu_mark;
+    double children_cpu_mark;
+    ProfileTiming timings[PROFILE_PHASE_COUNT];
+} profile;
+
+/*
+ * Read by the allocation wrappers on every thread. Without --mem-report the
+ * wrappers cost one relaxed load; with it, each thread counts into its own
+ * block under its own phase, so pool threads neither share cache lines nor
+ * borrow whatever phase the main thread has open.
+ */
+static atomic_bool profile_counting;
+static _Atomic(ProfileThreadAllocs *) profile_thread_allocs;
+static _Thread_local ProfileThreadAllocs *profile_local_allocs;
+static _Thread_local ProfilePhase profile_local_phase = PROFILE_PHASE_OTHER;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t count, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+void __wrap_free(void *ptr);
+
+/* NULL when counting is off, or when this thread's block cannot be allocated. */
+static ProfileAllocStats *profile_alloc_stats(void) {
+    if (!atomic_load_explicit(&profile_counting, memory_order_relaxed)) {
+        return NULL;
+    }
+    ProfileThreadAllocs *local = profile_local_allocs;
+    if (!local) {
+        local = __real_calloc(1, sizeof(ProfileThreadAllocs));
+        if (!local) {
+            return NULL;
+        }
+        local->next = atomic_load_explicit(&profile_thread_allocs, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&profile_thread_allocs,
+                                                      &local->next,
+                                                      local,
+                                                      memory_order_release,
+                                                      memory_order_relaxed)) {
+        }
+        profile_local_allocs = local;
+    }
+    return &local->phases[profile_local_phase];
+}
+
+static void profile_count(atomic_size_t *counter, size_t amount) {
+    atomic_store_explicit(counter,
+                          atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+void *__wrap_malloc(size_t size) {
+    ProfileAllocStats *stats = profile_alloc_stats();
+    if (stats) {
+        profile_count(&stats->allocations, 1);
+        profile_count(&stats->bytes, size);
+    }
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    ProfileAllocStats *stats = profile_alloc_stats();
+    if (stats) {
+        profile_count(&stats->allocations, 1);
+        profile_count(&stats->bytes, count * size);
+    }
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    ProfileAllocStats *stats = profile_alloc_stats();
+    if (stats) {
+        profile_count(ptr ? &stats->reallocations : &stats->allocations, 1);
+        profile_count(&stats->bytes, size);
+    }
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+    ProfileAllocStats *stats = ptr ? profile_alloc_stats() : NULL;
+    if (stats) {
+        profile_count(&stats->frees, 1);
+    }
+    __real_free(ptr);
+}
+
+/* Sums every thread's counters for `phase`. */
+static ProfileAllocTotals profile_alloc_totals(int phase) {
+    ProfileAllocTotals totals = {0};
+    for (ProfileThreadAllocs *block = atomic_load_explicit(&profile_thread_allocs, memory_order_acquire);
+         block;
+         block = block->next) {
+        const ProfileAllocStats *stats = &block->phases[phase];
+        totals.allocations += atomic_load_explicit(&stats->allocations, memory_order_relaxed);
+        totals.reallocations += atomic_load_explicit(&stats->reallocations, memory_order_relaxed);
+        totals.frees += atomic_load_explicit(&stats->frees, memory_order_relaxed);
+        totals.bytes += atomic_load_explicit(&stats->bytes, memory_order_relaxed);
+    }
+    return totals;
+}
+
+static double profile_seconds_between(const struct timespec *from, const struct timespec *to) {
+    return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static double profile_children_cpu(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_CHILDREN, &usage) != 0) {
+        return 0.0;
+    }
+    return (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6 +
+           (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+}
+
+static ProfilePhase profile_top(void) {
+    return profile.depth > 0 ? profile.stack[profile.depth - 1] : PROFILE_PHASE_OTHER;
+}
+
+/* Charges the time since the last mark to the innermost active phase. */
+static void profile_charge(bool sample_cpu) {
+    struct timespec wall;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    double elapsed = profile_seconds_between(&profile.wall_mark, &wall);
+    profile.wall_mark = wall;
+    profile.timings[profile_top()].wall_seconds += elapsed;
+    if (profile.depth > 1) {
+        profile.timings[profile.stack[0]].nested_wall_seconds += elapsed;
+    }
+
+    if (sample_cpu) {
+        struct timespec cpu;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+        ProfilePhase outer = profile.depth > 0 ? profile.stack[0] : PROFILE_PHASE_OTHER;
+        profile.timings[outer].cpu_seconds += profile_seconds_between(&profile.cpu_mark, &cpu);
+        profile.cpu_mark = cpu;
+    }
+}
+
+void profile_enable(bool time_passes, bool mem_report, ProfileFormat format) {
+    profile.enabled = time_passes || mem_report;
+    profile.time_passes = time_passes;
+    profile.mem_report = mem_report;
+    profile.format = format;
+    for (int i = 0; i < PROFILE_PHASE_COUNT; i++) {
+        profile.timings[i].parent = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &profile.wall_mark);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &profile.cpu_mark);
+    atomic_store_explicit(&profile_counting, mem_report, memory_order_relaxed);
+}
+
+bool profile_enabled(void) {
+    return profile.enabled;
+}
+
+void profile_set_thread_phase(ProfilePhase phase) {
+    profile_local_phase = phase;
+}
+
+ProfilePhase profile_thread_phase(void) {
+    return profile_local_phase;
+}
+
+void profile_begin(ProfilePhase phase) {
+    if (!profile.enabled || profile.depth == PROFILE_MAX_DEPTH) {
+        return;
+    }
+    profile_charge(profile.depth == 0);
+    if (profile.depth > 0) {
+        profile.timings[phase].parent = (int)profile.stack[0];
+    }
+    profile.stack[profile.depth++] = phase;
+    profile_local_phase = phase;
+    if (phase == PROFILE_PHASE_CC) {
+        profile.children_cpu_mark = profile_children_cpu();
+    }
+}
+
+void profile_end(ProfilePhase phase) {
+    if (!profile.enabled || profile_top() != phase || profile.depth == 0) {
+        return;
+    }
+    profile_charge(profile.depth == 1);
+    profile.depth--;
+    profile_local_phase = profile_top();
+
+    ProfileTiming *timing = &profile.timings[phase];
+    /* The C compiler runs as a child process; account for its CPU and RSS. */
+    if (phase == PROFILE_PHASE_CC) {
+        timing->cpu_seconds += profile_children_cpu() - profile.children_cpu_mark;
+    }
+    /* ru_maxrss is a process high-water mark, so nested phases have no sample. */
+    if (profile.mem_report && profile.depth == 0) {
+        struct rusage usage;
+        int who = phase == PROFILE_PHASE_CC ? RUSAGE_CHILDREN : RUSAGE_SELF;
+        if (getrusage(who, &usage) == 0) {
+            timing->peak_rss_kb = usage.ru_maxrss;
+        }
+    }
+}
+
+/* Exclusive CPU time: nested phases take their wall-time share of the parent. */
+static double profile_cpu_seconds(int phase) {
+    const ProfileTiming *timing = &profile.timings[phase];
+    if (timing->parent >= 0) {
+        const ProfileTiming *parent = &profile.timings[timing->parent];
+        double parent_wall = parent->wall_seconds + parent->nested_wall_seconds;
+        return parent_wall > 0.0
+            ? parent->cpu_seconds * timing->wall_seconds / parent_wall
+            : 0.0;
+    }
+    double total_wall = timing->wall_seconds + timing->nested_wall_seconds;
+    return total_wall > 0.0
+        ? timing->cpu_seconds * timing->wall_seconds / total_wall
+        : timing->cpu_seconds;
+}
+
+static long profile_peak_rss_kb(void) {
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+}
+
+static void profile_report_text(FILE *out) {
+    if (profile.time_passes) {
+        double total_wall = 0.0;
+        double total_cpu = 0.0;
+        fprintf(out, "===== Pass timing =====\n");
+        fprintf(out, "%-8s %12s %12s\n", "phase", "wall (ms)", "cpu (ms)");
+        for (int i = 0; i < PROFILE_PHASE_COUNT; i++) {
+            const ProfileTiming *timing = &profile.timings[i];
+            double cpu_seconds = profile_cpu_seconds(i);
+            fprintf(out,
+                    "%-8s %12.3f %12.3f\n",
+                    PROFILE_PHASE_NAMES[i],
+                    timing->wall_seconds * 1e3,
+                    cpu_seconds * 1e3);
+            total_wall += timing->wall_seconds;
+            total_cpu += cpu_seconds;
+        }
+        fprintf(out, "%-8s %12.3f %12.3f\n", "total", total_wall * 1e3, total_cpu * 1e3);
+    }
+    if (profile.mem_report) {
+        fprintf(out, "===== Memory =====\n");
+        fprintf(out, "peak RSS: %ld KiB\n", profile_peak_rss_kb());
+        fprintf(out,
+                "%-8s %14s %10s %10s %10s %14s\n",
+                "phase",
+                "peak RSS (KiB)",
+                "allocs",
+                "reallocs",
+                "frees",
+                "bytes");
+        for (int i = 0; i < PROFILE_PHASE_COUNT; i++) {
+            ProfileAllocTotals stats = profile_alloc_totals(i);
+            char rss[32] = "-";
+            if (profile.timings[i].peak_rss_kb > 0) {
+                snprintf(rss, sizeof(rss), "%ld", profile.timings[i].peak_rss_kb);
+            }
+            fprintf(out,
+                    "%-8s %14s %10zu %10zu %10zu %14zu\n",
+                    PROFILE_PHASE_NAMES[i],
+                    rss,
+                    stats.allocations,
+                    stats.reallocations,
+                    stats.frees,
+                    stats.bytes);
+        }
+    }
+}
+
+static void profile_report_json(FILE *out) {
+    fprintf(out, "{");
+    if (profile.time_passes) {
+        fprintf(out, "\"time_passes\":{");
+        for (int i = 0; i < PROFILE_PHASE_COUNT; i++) {
+            fprintf(out,
+                    "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}",
+                    i ? "," : "",
+                    PROFILE_PHASE_NAMES[i],
+                    profile.timings[i].wall_seconds * 1e3,
+                    profile_cpu_seconds(i) * 1e3);
+        }
+        fprintf(out, "}");
+    }
+    if (profile.mem_report) {
+        fprintf(out,
+                "%s\"mem_report\":{\"peak_rss_kb\":%ld,\"phases\":{",
+                profile.time_passes ? "," : "",
+                profile_peak_rss_kb());
+        for (int i = 0; i < PROFILE_PHASE_COUNT; i++) {
+            ProfileAllocTotals stats = profile_alloc_totals(i);
+            fprintf(out, "%s\"%s\":{\"peak_rss_kb\":", i ? "," : "", PROFILE_PHASE_NAMES[i]);
+            if (profile.timings[i].peak_rss_kb > 0) {
+                fprintf(out, "%ld", profile.timings[i].peak_rss_kb);
+            } else {
+                fprintf(out, "null");
+            }
+            fprintf(out,
+                    ",\"allocations\":%zu,\"reallocations\":%zu,\"frees\":%zu,\"bytes\":%zu}",
+                    stats.allocations,
+                    stats.reallocations,
+                    stats.frees,
+                    stats.bytes);
+        }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "}\n");
+}
+
+void profile_report(FILE *out) {
+    if (!profile.enabled) {
+        return;
+    }
+    profile_charge(profile.depth == 0);
+    if (profile.format == PROFILE_FORMAT_JSON) {
+        profile_report_json(out);
+    } else {
+        profile_report_text(out);
+    }
+}
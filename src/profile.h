@@ -0,0 +1,43 @@
+#ifndef LZ_PROFILE_H
+#define LZ_PROFILE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Compiler self-instrumentation behind --time-passes and --mem-report.
+ * Phases nest: time and allocations are charged to the innermost active
+ * phase only. Only the main thread opens phases: when modules are handled
+ * on worker threads, the whole parallel stage is timed as one phase
+ * (lexing of imported modules counts as parsing). Allocation counts come
+ * from the --wrap'ed malloc family (see Makefile) and are only kept with
+ * --mem-report; each thread counts under its own phase, which pool tasks
+ * set with profile_set_thread_phase.
+ */
+typedef enum {
+    PROFILE_PHASE_OTHER, /* driver work outside any named phase */
+    PROFILE_PHASE_CACHE,
+    PROFILE_PHASE_LEX,
+    PROFILE_PHASE_PARSE,
+    PROFILE_PHASE_SEMA,
+    PROFILE_PHASE_OPT,
+    PROFILE_PHASE_EMIT,
+    PROFILE_PHASE_CC,
+    PROFILE_PHASE_COUNT
+} ProfilePhase;
+
+typedef enum {
+    PROFILE_FORMAT_TEXT,
+    PROFILE_FORMAT_JSON,
+} ProfileFormat;
+
+void profile_enable(bool time_passes, bool mem_report, ProfileFormat format);
+bool profile_enabled(void);
+void profile_begin(ProfilePhase phase);
+void profile_end(ProfilePhase phase);
+/* Phase this thread's allocations are charged to; profile_begin/end set it too. */
+void profile_set_thread_phase(ProfilePhase phase);
+ProfilePhase profile_thread_phase(void);
+void profile_report(FILE *out);
+
+#endif
@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#define LZ_RUNTIME_DEFINE_STRUCTS
+#include "runtime.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Bounded MPMC channel behind `chan[T]`: Vyukov's array queue. Every cell
+ * carries a sequence number that says whose turn it is: a sender may fill
+ * cell i at position p once its sequence equals p, a receiver may drain it
+ * once it equals p + 1, and draining hands it to position p + capacity.
+ * Senders and receivers each claim positions with one CAS on their own
+ * counter, so neither side takes a lock while the channel has room or data.
+ * The two counters and the read-mostly fields live on separate cache lines.
+ *
+ * Only a side that has to wait touches the mutex. It announces itself in
+ * the waiter count of its direction and tries once more before parking; the
+ * other side checks that count after every transfer (both behind seq_cst
+ * fences), so a wakeup is never lost. Tasks park on a FIFO list and are
+ * resubmitted to the scheduler; threads sleep on a condition variable.
+ */
+
+#define LZ_CACHE_LINE 64
+
+typedef struct {
+    lz_future *head;
+    lz_future *tail;
+    atomic_int waiters; /* parked tasks plus sleeping threads */
+    pthread_cond_t cond;
+} lz_chan_waitq;
+
+struct lz_chan {
+    _Alignas(LZ_CACHE_LINE) atomic_size_t send_pos;
+    _Alignas(LZ_CACHE_LINE) atomic_size_t recv_pos;
+    _Alignas(LZ_CACHE_LINE) unsigned char *cells;
+    size_t mask;
+    size_t elem_size;
+    size_t stride;
+    void (*retain)(void *elem);
+    void (*release)(void *elem);
+    atomic_size_t refcount;
+    _Alignas(LZ_CACHE_LINE) pthread_mutex_t lock;
+    lz_chan_waitq senders;
+    lz_chan_waitq receivers;
+};
+
+/* A cell is its sequence number followed by the element bytes. */
+static atomic_size_t *lz_chan_seq(const lz_chan *chan, size_t pos) {
+    return (atomic_size_t *)(chan->cells + (pos & chan->mask) * chan->stride);
+}
+
+static void *lz_chan_slot(const lz_chan *chan, size_t pos) {
+    return chan->cells + (pos & chan->mask) * chan->stride + sizeof(atomic_size_t);
+}
+
+static void lz_chan_fatal(const char *message) {
+    fprintf(stderr, "lazylang runtime: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+lz_chan *lz_chan_new(size_t capacity,
+                     size_t elem_size,
+                     void (*retain)(void *elem),
+                     void (*release)(void *elem)) {
+    size_t rounded = 2;
+    while (rounded < capacity) {
+        rounded *= 2;
+    }
+    size_t stride = (sizeof(atomic_size_t) + elem_size + sizeof(atomic_size_t) - 1) &
+                    ~(sizeof(atomic_size_t) - 1);
+    lz_chan *chan = aligned_alloc(LZ_CACHE_LINE, sizeof(lz_chan));
+    unsigned char *cells = aligned_alloc(LZ_CACHE_LINE,
+                                         (rounded * stride + LZ_CACHE_LINE - 1) & ~(size_t)(LZ_CACHE_LINE - 1));
+    if (!chan || !cells) {
+        lz_chan_fatal("out of memory");
+    }
+    memset(chan, 0, sizeof(lz_chan));
+    chan->cells = cells;
+    chan->mask = rounded - 1;
+    chan->elem_size = elem_size;
+    chan->stride = stride;
+    chan->retain = retain;
+    chan->release = release;
+    atomic_init(&chan->send_pos, 0);
+    atomic_init(&chan->recv_pos, 0);
+    atomic_init(&chan->refcount, 1);
+    for (size_t i = 0; i < rounded; i++) {
+        atomic_init(lz_chan_seq(chan, i), i);
+    }
+    pthread_mutex_init(&chan->lock, NULL);
+    pthread_cond_init(&chan->senders.cond, NULL);
+    pthread_cond_init(&chan->receivers.cond, NULL);
+    atomic_init(&chan->senders.waiters, 0);
+    atomic_init(&chan->receivers.waiters, 0);
+    return chan;
+}
+
+lz_chan *lz_chan_retain(lz_chan *chan) {
+    if (chan) {
+        atomic_fetch_add_explicit(&chan->refcount, 1, memory_order_relaxed);
+    }
+    return chan;
+}
+
+/* Parked tasks hold a reference through their frames, so nobody waits on a dying channel. */
+void lz_chan_release(lz_chan *chan) {
+    if (!chan || atomic_fetch_sub_explicit(&chan->refcount, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    if (chan->release) {
+        size_t end = atomic_load_explicit(&chan->send_pos, memory_order_relaxed);
+        for (size_t pos = atomic_load_explicit(&chan->recv_pos, memory_order_relaxed); pos != end; pos++) {
+            chan->release(lz_chan_slot(chan, pos));
+        }
+    }
+    pthread_cond_destroy(&chan->senders.cond);
+    pthread_cond_destroy(&chan->receivers.cond);
+    pthread_mutex_destroy(&chan->lock);
+    free(chan->cells);
+    free(chan);
+}
+
+void lz_assign_chan(lz_chan **dst, lz_chan *value) {
+    if (dst) {
+        lz_chan *previous = *dst;
+        *dst = lz_chan_retain(value);
+        lz_chan_release(previous);
+    }
+}
+
+void lz_assign_chan_move(lz_chan **dst, lz_chan *value) {
+    if (dst) {
+        lz_chan *previous = *dst;
+        *dst = value;
+        lz_chan_release(previous);
+    } else {
+        lz_chan_release(value);
+    }
+}
+
+/*
+ * Claims up to `count` consecutive positions whose cells are at sequence
+ * `pos + i + ahead` (ahead is 0 for senders, 1 for receivers). Returns how
+ * many were claimed, 0 when the channel is full (or empty).
+ */
+static size_t lz_chan_claim(lz_chan *chan, atomic_size_t *counter, size_t ahead, size_t count, size_t *start) {
+    size_t pos = atomic_load_explicit(counter, memory_order_relaxed);
+    for (;;) {
+        size_t ready = 0;
+        while (ready < count) {
+            size_t seq = atomic_load_explicit(lz_chan_seq(chan, pos + ready), memory_order_acquire);
+            if (seq != pos + ready + ahead) {
+                break;
+            }
+            ready++;
+        }
+        if (ready == 0) {
+            size_t seq = atomic_load_explicit(lz_chan_seq(chan, pos), memory_order_acquire);
+            if ((intptr_t)(seq - (pos + ahead)) < 0) {
+                return 0;
+            }
+            /* Another thread already took `pos`; catch up. */
+            pos = atomic_load_explicit(counter, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(counter, &pos, pos + ready,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            *start = pos;
+            return ready;
+        }
+    }
+}
+
+static size_t lz_chan_push(lz_chan *chan, const void *elems, size_t count) {
+    size_t pos;
+    size_t claimed = lz_chan_claim(chan, &chan->send_pos, 0, count, &pos);
+    for (size_t i = 0; i < claimed; i++) {
+        void *slot = lz_chan_slot(chan, pos + i);
+        memcpy(slot, (const unsigned char *)elems + i * chan->elem_size, chan->elem_size);
+        if (chan->retain) {
+            chan->retain(slot);
+        }
+        atomic_store_explicit(lz_chan_seq(chan, pos + i), pos + i + 1, memory_order_release);
+    }
+    return claimed;
+}
+
+static size_t lz_chan_pop(lz_chan *chan, void *elems, size_t count) {
+    size_t pos;
+    size_t claimed = lz_chan_claim(chan, &chan->recv_pos, 1, count, &pos);
+    for (size_t i = 0; i < claimed; i++) {
+        memcpy((unsigned char *)elems + i * chan->elem_size, lz_chan_slot(chan, pos + i), chan->elem_size);
+        atomic_store_explicit(lz_chan_seq(chan, pos + i), pos + i + chan->mask + 1, memory_order_release);
+    }
+    return claimed;
+}
+
+/* After `count` transfers, lets up to that many waiters on the other side retry. */
+static void lz_chan_wake(lz_chan *chan, lz_chan_waitq *queue, size_t count) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->waiters, memory_order_relaxed) == 0) {
+        return;
+    }
+    lz_future *woken = NULL;
+    pthread_mutex_lock(&chan->lock);
+    while (count > 0 && queue->head) {
+        lz_future *task = queue->head;
+        queue->head = task->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+        task->next = woken;
+        woken = task;
+        atomic_fetch_sub_explicit(&queue->waiters, 1, memory_order_relaxed);
+        count--;
+    }
+    if (count > 0) {
+        pthread_cond_broadcast(&queue->cond);
+    }
+    pthread_mutex_unlock(&chan->lock);
+    while (woken) {
+        /* Submitting may reuse `next` as the injection queue link. */
+        lz_future *next = woken->next;
+        lz_sched_submit(woken);
+        woken = next;
+    }
+}
+
+static size_t lz_chan_try_transfer(lz_chan *chan, void *elems, size_t count, bool send) {
+    size_t done = send ? lz_chan_push(chan, elems, count) : lz_chan_pop(chan, elems, count);
+    if (done > 0) {
+        lz_chan_wake(chan, send ? &chan->receivers : &chan->senders, done);
+    }
+    return done;
+}
+
+static size_t lz_chan_transfer(lz_chan *chan, void *elems, size_t count, bool send) {
+    lz_chan_waitq *queue = send ? &chan->senders : &chan->receivers;
+    for (;;) {
+        size_t done = lz_chan_try_transfer(chan, elems, count, send);
+        if (done > 0) {
+            return done;
+        }
+        pthread_mutex_lock(&chan->lock);
+        atomic_fetch_add_explicit(&queue->waiters, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        done = send ? lz_chan_push(chan, elems, count) : lz_chan_pop(chan, elems, count);
+        if (done == 0) {
+            lz_sched_block();
+            pthread_cond_wait(&queue->cond, &chan->lock);
+        }
+        atomic_fetch_sub_explicit(&queue->waiters, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&chan->lock);
+        if (done > 0) {
+            lz_chan_wake(chan, send ? &chan->receivers : &chan->senders, done);
+            return done;
+        }
+    }
+}
+
+bool lz_chan_try_send(lz_chan *chan, const void *elem) {
+    return lz_chan_try_transfer(chan, (void *)elem, 1, true) == 1;
+}
+
+bool lz_chan_try_recv(lz_chan *chan, void *elem) {
+    return lz_chan_try_transfer(chan, elem, 1, false) == 1;
+}
+
+void lz_chan_send(lz_chan *chan, const void *elem) {
+    lz_chan_transfer(chan, (void *)elem, 1, true);
+}
+
+void *lz_chan_recv(lz_chan *chan, void *elem) {
+    lz_chan_transfer(chan, elem, 1, false);
+    return elem;
+}
+
+void lz_chan_send_many(lz_chan *chan, const void *elems, size_t count) {
+    const unsigned char *next = elems;
+    while (count > 0) {
+        size_t done = lz_chan_transfer(chan, (void *)next, count, true);
+        next += done * chan->elem_size;
+        count -= done;
+    }
+}
+
+size_t lz_chan_recv_many(lz_chan *chan, void *elems, size_t max) {
+    return max > 0 ? lz_chan_transfer(chan, elems, max, false) : 0;
+}
+
+/* The parked task is resubmitted and retries from the same resume point. */
+static bool lz_chan_task_transfer(lz_chan *chan, void *elem, lz_future *task, bool send) {
+    if (lz_chan_try_transfer(chan, elem, 1, send) == 1) {
+        return true;
+    }
+    lz_chan_waitq *queue = send ? &chan->senders : &chan->receivers;
+    pthread_mutex_lock(&chan->lock);
+    atomic_fetch_add_explicit(&queue->waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    bool done = (send ? lz_chan_push(chan, elem, 1) : lz_chan_pop(chan, elem, 1)) == 1;
+    if (done) {
+        atomic_fetch_sub_explicit(&queue->waiters, 1, memory_order_relaxed);
+    } else {
+        task->next = NULL;
+        if (queue->tail) {
+            queue->tail->next = task;
+        } else {
+            queue->head = task;
+        }
+        queue->tail = task;
+    }
+    pthread_mutex_unlock(&chan->lock);
+    if (done) {
+        lz_chan_wake(chan, send ? &chan->receivers : &chan->senders, 1);
+    }
+    return done;
+}
+
+bool lz_chan_task_send(lz_chan *chan, const void *elem, lz_future *task) {
+    return lz_chan_task_transfer(chan, (void *)elem, task, true);
+}
+
+bool lz_chan_task_recv(lz_chan *chan, void *elem, lz_future *task) {
+    return lz_chan_task_transfer(chan, elem, task, false);
+}
+
+void lz_chan_retain_string(void *elem) {
+    lz_string *value = *(lz_string **)elem;
+    lz_string_share(value);
+    lz_string_retain(value);
+}
+
+void lz_chan_release_string(void *elem) {
+    lz_string_release(*(lz_string **)elem);
+}
+
+void lz_chan_retain_frozen(void *elem) {
+    void *value = *(void **)elem;
+    lz_frozen_share(value);
+    lz_frozen_retain(value);
+}
+
+void lz_chan_release_frozen(void *elem) {
+    lz_frozen_release(*(void **)elem);
+}
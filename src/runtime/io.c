@@ -0,0 +1,588 @@
+#define _GNU_SOURCE
+#define LZ_RUNTIME_DEFINE_STRUCTS
+#include "runtime.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * Event loop behind lz_io. Every operation is a future-shaped frame from
+ * lz_task_alloc whose result slot receives the syscall's return value; one
+ * I/O thread reaps completions and finishes them with lz_future_complete,
+ * which puts suspended tasks back on the scheduler.
+ *
+ * io_uring is used through raw syscalls: the runtime maps the submission
+ * and completion rings itself, fills one SQE per operation under a lock and
+ * submits it right away, after dropping the lock; each io_uring_enter
+ * submits every entry published so far, and a submitter that finds every
+ * slot taken flushes before it retries. The I/O thread is the only CQ
+ * consumer. A multishot accept stays armed across completions while
+ * IORING_CQE_F_MORE is set and is re-armed if the kernel drops it after a
+ * successful accept.
+ *
+ * The epoll fallback tries an operation on the submitting thread first and
+ * only parks it when it would block (see lz_io_epoll_check). Each parked operation registers its own
+ * duplicate of the descriptor, so a read and a write can wait on one socket
+ * at the same time. The duplicate is deregistered explicitly before it is
+ * closed: epoll only drops an entry by itself once every descriptor for the
+ * file is gone, and a stale one would collide with the next duplicate.
+ */
+
+#define LZ_IO_ENTRIES 256
+#define LZ_IO_EVENTS 64
+
+typedef struct lz_io_op {
+    lz_future header;
+    int64_t result;
+    uint8_t opcode; /* IORING_OP_*, also used to pick the epoll syscall */
+    bool fixed;     /* `fd` and `buffer` index the registered tables */
+    bool multishot;
+    bool dontwait;  /* epoll: a socket, read and written with MSG_DONTWAIT */
+    int fd;
+    int wait_fd; /* epoll: the duplicate parked in the interest list */
+    unsigned buffer;
+    void *data;
+    size_t length;
+    void (*on_accept)(void *arg, int fd);
+    void *arg;
+    struct lz_io_op *next_deferred; /* io_uring: the I/O thread's queue for a full SQ */
+} lz_io_op;
+
+static struct {
+    bool uring;
+    pthread_mutex_t submit_lock;
+
+    int ring;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    int epoll;
+
+    /* Registered tables, kept for the epoll backend and for bounds checks. */
+    lz_io_buffer *buffers;
+    unsigned buffer_count;
+    int *files;
+    unsigned file_count;
+} lz_io = {
+    .submit_lock = PTHREAD_MUTEX_INITIALIZER,
+    .ring = -1,
+    .epoll = -1,
+};
+
+static pthread_once_t lz_io_once = PTHREAD_ONCE_INIT;
+
+static void lz_io_fatal(const char *message) {
+    fprintf(stderr, "lazylang runtime: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+static bool lz_io_uring_setup(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring = (int)syscall(__NR_io_uring_setup, LZ_IO_ENTRIES, &params);
+    if (ring < 0) {
+        return false;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    char *cq = single_mmap ? sq
+                           : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                                  IORING_OFF_CQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL,
+                                     params.sq_entries * sizeof(struct io_uring_sqe),
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE,
+                                     ring,
+                                     IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sq != MAP_FAILED) munmap(sq, sq_size);
+        if (cq != MAP_FAILED && !single_mmap) munmap(cq, cq_size);
+        if (sqes != MAP_FAILED) munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        close(ring);
+        return false;
+    }
+    lz_io.ring = ring;
+    lz_io.sq_head = (_Atomic unsigned *)(sq + params.sq_off.head);
+    lz_io.sq_tail = (_Atomic unsigned *)(sq + params.sq_off.tail);
+    lz_io.sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    lz_io.sq_entries = params.sq_entries;
+    lz_io.sq_array = (unsigned *)(sq + params.sq_off.array);
+    lz_io.sqes = sqes;
+    lz_io.cq_head = (_Atomic unsigned *)(cq + params.cq_off.head);
+    lz_io.cq_tail = (_Atomic unsigned *)(cq + params.cq_off.tail);
+    lz_io.cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    lz_io.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+/* Publishes the result and drops the loop's reference. */
+static void lz_io_finish(lz_io_op *op, int64_t result) {
+    op->result = result;
+    lz_future_complete(&op->header);
+    lz_future_release(&op->header);
+}
+
+/*
+ * Fills and publishes an SQE for `op`; lz_io_uring_flush hands it to the
+ * kernel. False when every slot still holds an entry the kernel has not
+ * read, which happens while submitters wait out EBUSY.
+ */
+static bool lz_io_uring_prepare(lz_io_op *op) {
+    pthread_mutex_lock(&lz_io.submit_lock);
+    unsigned tail = atomic_load_explicit(lz_io.sq_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(lz_io.sq_head, memory_order_acquire) >= lz_io.sq_entries) {
+        pthread_mutex_unlock(&lz_io.submit_lock);
+        return false;
+    }
+    unsigned index = tail & lz_io.sq_mask;
+    struct io_uring_sqe *sqe = &lz_io.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op->opcode;
+    sqe->fd = op->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    if (op->fixed) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->buf_index = (uint16_t)op->buffer;
+    }
+    switch (op->opcode) {
+        case IORING_OP_ACCEPT:
+            sqe->accept_flags = SOCK_CLOEXEC;
+            if (op->multishot) {
+                sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+            }
+            break;
+        case IORING_OP_READ:
+        case IORING_OP_WRITE:
+        case IORING_OP_READ_FIXED:
+        case IORING_OP_WRITE_FIXED:
+            sqe->addr = (uint64_t)(uintptr_t)op->data;
+            sqe->len = (uint32_t)op->length;
+            sqe->off = (uint64_t)-1; /* current position; ignored by sockets and pipes */
+            break;
+        default:
+            break;
+    }
+    lz_io.sq_array[index] = index;
+    atomic_store_explicit(lz_io.sq_tail, tail + 1, memory_order_release);
+    pthread_mutex_unlock(&lz_io.submit_lock);
+    return true;
+}
+
+/*
+ * Submits every published SQE, whoever published it. False on EBUSY: the CQ
+ * is backed up until the I/O thread drains it, and the entries stay queued.
+ */
+static bool lz_io_uring_flush(void) {
+    for (;;) {
+        unsigned head = atomic_load_explicit(lz_io.sq_head, memory_order_acquire);
+        unsigned pending = atomic_load_explicit(lz_io.sq_tail, memory_order_acquire) - head;
+        if (pending == 0 || syscall(__NR_io_uring_enter, lz_io.ring, pending, 0, 0, NULL, 0) >= 0) {
+            return true;
+        }
+        if (errno == EBUSY) {
+            return false;
+        }
+        if (errno != EINTR && errno != EAGAIN) {
+            lz_io_fatal("io_uring submission failed");
+        }
+        sched_yield();
+    }
+}
+
+/*
+ * Set on the I/O thread only: it must never wait for the CQ it drains, so
+ * what it submits (multishot re-arms, I/O started from accept callbacks)
+ * is handed to the kernel after the current drain, and queued on the
+ * thread until then if the SQ is full.
+ */
+static _Thread_local bool lz_io_on_loop;
+static _Thread_local bool lz_io_loop_unsubmitted;
+static _Thread_local lz_io_op *lz_io_loop_deferred;
+static _Thread_local lz_io_op *lz_io_loop_deferred_last;
+
+/* Never waits while holding submit_lock, so the I/O thread can always publish. */
+static void lz_io_uring_submit(lz_io_op *op) {
+    if (lz_io_on_loop) {
+        if (!lz_io_loop_deferred && lz_io_uring_prepare(op)) {
+            lz_io_loop_unsubmitted = true;
+        } else {
+            op->next_deferred = NULL;
+            if (lz_io_loop_deferred) {
+                lz_io_loop_deferred_last->next_deferred = op;
+            } else {
+                lz_io_loop_deferred = op;
+            }
+            lz_io_loop_deferred_last = op;
+        }
+        return;
+    }
+    while (!lz_io_uring_prepare(op)) {
+        if (!lz_io_uring_flush()) {
+            sched_yield();
+        }
+    }
+    while (!lz_io_uring_flush()) {
+        sched_yield();
+    }
+}
+
+/* The I/O thread's side of lz_io_uring_submit; what does not fit yet waits for the next drain. */
+static void lz_io_loop_flush(void) {
+    for (;;) {
+        if (lz_io_loop_unsubmitted) {
+            lz_io_loop_unsubmitted = !lz_io_uring_flush();
+        }
+        if (lz_io_loop_unsubmitted || !lz_io_loop_deferred || !lz_io_uring_prepare(lz_io_loop_deferred)) {
+            return;
+        }
+        lz_io_loop_unsubmitted = true;
+        lz_io_loop_deferred = lz_io_loop_deferred->next_deferred;
+    }
+}
+
+static void *lz_io_uring_main(void *arg) {
+    (void)arg;
+    lz_io_on_loop = true;
+    for (;;) {
+        unsigned head = atomic_load_explicit(lz_io.cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(lz_io.cq_tail, memory_order_acquire);
+        if (head == tail) {
+            /* On EBUSY the kernel holds overflowed completions, which the wait below moves into the CQ. */
+            if (lz_io_loop_unsubmitted || lz_io_loop_deferred) {
+                lz_io_loop_flush();
+            }
+            syscall(__NR_io_uring_enter, lz_io.ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &lz_io.cqes[head & lz_io.cq_mask];
+            lz_io_op *op = (lz_io_op *)(uintptr_t)cqe->user_data;
+            int32_t result = cqe->res;
+            bool more = cqe->flags & IORING_CQE_F_MORE;
+            /* The slot is copied out, so hand it back before running callbacks. */
+            atomic_store_explicit(lz_io.cq_head, head + 1, memory_order_release);
+            if (!op->multishot || result < 0) {
+                lz_io_finish(op, result);
+                continue;
+            }
+            op->on_accept(op->arg, result);
+            if (!more) {
+                lz_io_uring_submit(op);
+            }
+        }
+        if (lz_io_loop_unsubmitted || lz_io_loop_deferred) {
+            lz_io_loop_flush();
+        }
+    }
+    return NULL;
+}
+
+static int lz_io_resolve_fd(const lz_io_op *op) {
+    return op->fixed ? lz_io.files[op->fd] : op->fd;
+}
+
+/* Runs the operation now; false if it would block. */
+static bool lz_io_try(lz_io_op *op, int64_t *result) {
+    int fd = lz_io_resolve_fd(op);
+    ssize_t status;
+    switch (op->opcode) {
+        case IORING_OP_ACCEPT:
+            status = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+            break;
+        case IORING_OP_READ:
+        case IORING_OP_READ_FIXED:
+            status = op->dontwait ? recv(fd, op->data, op->length, MSG_DONTWAIT)
+                                  : read(fd, op->data, op->length);
+            break;
+        case IORING_OP_WRITE:
+        case IORING_OP_WRITE_FIXED:
+            status = op->dontwait ? send(fd, op->data, op->length, MSG_DONTWAIT)
+                                  : write(fd, op->data, op->length);
+            break;
+        default:
+            status = close(fd);
+            break;
+    }
+    if (status < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+    *result = status < 0 ? -errno : status;
+    return true;
+}
+
+static uint32_t lz_io_epoll_events(const lz_io_op *op) {
+    bool writes = op->opcode == IORING_OP_WRITE || op->opcode == IORING_OP_WRITE_FIXED;
+    return (writes ? EPOLLOUT : EPOLLIN) | (op->multishot ? 0 : EPOLLONESHOT);
+}
+
+/*
+ * 0 when `op` can be tried without blocking, else the errno it fails with.
+ * O_NONBLOCK belongs to the open file description, which other processes
+ * may share, so it is never set here: sockets get MSG_DONTWAIT instead,
+ * regular files never report EAGAIN, and everything else (pipes, ttys,
+ * listening sockets) must already be non-blocking.
+ */
+static int lz_io_epoll_check(lz_io_op *op, int fd) {
+    if (op->opcode == IORING_OP_CLOSE) {
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        return errno;
+    }
+    if (S_ISREG(info.st_mode) || S_ISBLK(info.st_mode)) {
+        return 0;
+    }
+    if (S_ISSOCK(info.st_mode) && op->opcode != IORING_OP_ACCEPT) {
+        op->dontwait = true;
+        return 0;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return errno;
+    }
+    return flags & O_NONBLOCK ? 0 : EINVAL;
+}
+
+static void lz_io_epoll_submit(lz_io_op *op) {
+    int fd = lz_io_resolve_fd(op);
+    int error = lz_io_epoll_check(op, fd);
+    if (error) {
+        lz_io_finish(op, -error);
+        return;
+    }
+    int64_t result;
+    if (!op->multishot && lz_io_try(op, &result)) {
+        lz_io_finish(op, result);
+        return;
+    }
+    struct epoll_event event = { .events = lz_io_epoll_events(op), .data.ptr = op };
+    op->wait_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (op->wait_fd < 0 || epoll_ctl(lz_io.epoll, EPOLL_CTL_ADD, op->wait_fd, &event) < 0) {
+        error = errno;
+        if (op->wait_fd >= 0) {
+            close(op->wait_fd);
+        }
+        lz_io_finish(op, -error);
+    }
+}
+
+static void lz_io_epoll_unpark(lz_io_op *op) {
+    epoll_ctl(lz_io.epoll, EPOLL_CTL_DEL, op->wait_fd, NULL);
+    close(op->wait_fd);
+}
+
+/* Level-triggered, so leaving a connection in the backlog only means another wakeup. */
+static void lz_io_epoll_accept_all(lz_io_op *op) {
+    int64_t result;
+    while (lz_io_try(op, &result)) {
+        if (result < 0) {
+            lz_io_epoll_unpark(op);
+            lz_io_finish(op, result);
+            return;
+        }
+        op->on_accept(op->arg, (int)result);
+    }
+}
+
+static void *lz_io_epoll_main(void *arg) {
+    (void)arg;
+    struct epoll_event events[LZ_IO_EVENTS];
+    for (;;) {
+        int count = epoll_wait(lz_io.epoll, events, LZ_IO_EVENTS, -1);
+        for (int i = 0; i < count; i++) {
+            lz_io_op *op = events[i].data.ptr;
+            if (op->multishot) {
+                lz_io_epoll_accept_all(op);
+                continue;
+            }
+            int64_t result;
+            if (!lz_io_try(op, &result)) {
+                struct epoll_event event = { .events = lz_io_epoll_events(op), .data.ptr = op };
+                epoll_ctl(lz_io.epoll, EPOLL_CTL_MOD, op->wait_fd, &event);
+                continue;
+            }
+            lz_io_epoll_unpark(op);
+            lz_io_finish(op, result);
+        }
+    }
+    return NULL;
+}
+
+static void lz_io_start(void) {
+    const char *env = getenv("LZ_IO");
+    bool epoll_only = env && strcmp(env, "epoll") == 0;
+    lz_io.uring = !epoll_only && lz_io_uring_setup();
+    if (!lz_io.uring) {
+        lz_io.epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (lz_io.epoll < 0) {
+            lz_io_fatal("failed to create the epoll instance");
+        }
+    }
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if (pthread_create(&thread, &attributes, lz_io.uring ? lz_io_uring_main : lz_io_epoll_main, NULL) != 0) {
+        lz_io_fatal("failed to start the I/O thread");
+    }
+    pthread_attr_destroy(&attributes);
+}
+
+static lz_io_op *lz_io_op_new(uint8_t opcode, int fd, void *data, size_t length) {
+    pthread_once(&lz_io_once, lz_io_start);
+    lz_io_op *op = (lz_io_op *)lz_task_alloc(sizeof(lz_io_op), offsetof(lz_io_op, result), NULL, NULL);
+    op->opcode = opcode;
+    op->fd = fd;
+    op->wait_fd = -1;
+    op->data = data;
+    op->length = length;
+    return op;
+}
+
+/* The caller keeps the reference from lz_task_alloc; the loop takes another until the operation completes. */
+static lz_future *lz_io_submit(lz_io_op *op) {
+    lz_future_retain(&op->header);
+    if (lz_io.uring) {
+        lz_io_uring_submit(op);
+    } else {
+        lz_io_epoll_submit(op);
+    }
+    return &op->header;
+}
+
+const char *lz_io_backend(void) {
+    pthread_once(&lz_io_once, lz_io_start);
+    return lz_io.uring ? "io_uring" : "epoll";
+}
+
+lz_future *lz_io_accept(int fd) {
+    return lz_io_submit(lz_io_op_new(IORING_OP_ACCEPT, fd, NULL, 0));
+}
+
+lz_future *lz_io_accept_multishot(int fd, void (*on_accept)(void *arg, int fd), void *arg) {
+    lz_io_op *op = lz_io_op_new(IORING_OP_ACCEPT, fd, NULL, 0);
+    op->multishot = true;
+    op->on_accept = on_accept;
+    op->arg = arg;
+    return lz_io_submit(op);
+}
+
+lz_future *lz_io_read(int fd, void *buf, size_t length) {
+    return lz_io_submit(lz_io_op_new(IORING_OP_READ, fd, buf, length));
+}
+
+lz_future *lz_io_write(int fd, const void *buf, size_t length) {
+    return lz_io_submit(lz_io_op_new(IORING_OP_WRITE, fd, (void *)buf, length));
+}
+
+lz_future *lz_io_close(int fd) {
+    return lz_io_submit(lz_io_op_new(IORING_OP_CLOSE, fd, NULL, 0));
+}
+
+bool lz_io_register_buffers(const lz_io_buffer *buffers, unsigned count) {
+    pthread_once(&lz_io_once, lz_io_start);
+    pthread_mutex_lock(&lz_io.submit_lock);
+    bool registered = false;
+    lz_io_buffer *table = NULL;
+    struct iovec *iov = NULL;
+    if (lz_io.buffers || count == 0) {
+        goto done;
+    }
+    table = malloc(count * sizeof(lz_io_buffer));
+    iov = malloc(count * sizeof(struct iovec));
+    if (!table || !iov) {
+        lz_io_fatal("out of memory");
+    }
+    for (unsigned i = 0; i < count; i++) {
+        table[i] = buffers[i];
+        iov[i] = (struct iovec){ .iov_base = buffers[i].base, .iov_len = buffers[i].length };
+    }
+    if (lz_io.uring && syscall(__NR_io_uring_register, lz_io.ring, IORING_REGISTER_BUFFERS, iov, count) < 0) {
+        goto done;
+    }
+    lz_io.buffers = table;
+    lz_io.buffer_count = count;
+    table = NULL;
+    registered = true;
+done:
+    pthread_mutex_unlock(&lz_io.submit_lock);
+    free(table);
+    free(iov);
+    return registered;
+}
+
+bool lz_io_register_files(const int *fds, unsigned count) {
+    pthread_once(&lz_io_once, lz_io_start);
+    pthread_mutex_lock(&lz_io.submit_lock);
+    bool registered = false;
+    int *table = NULL;
+    if (lz_io.files || count == 0) {
+        goto done;
+    }
+    table = malloc(count * sizeof(int));
+    if (!table) {
+        lz_io_fatal("out of memory");
+    }
+    memcpy(table, fds, count * sizeof(int));
+    if (lz_io.uring && syscall(__NR_io_uring_register, lz_io.ring, IORING_REGISTER_FILES, table, count) < 0) {
+        goto done;
+    }
+    lz_io.files = table;
+    lz_io.file_count = count;
+    table = NULL;
+    registered = true;
+done:
+    pthread_mutex_unlock(&lz_io.submit_lock);
+    free(table);
+    return registered;
+}
+
+static lz_future *lz_io_fixed(uint8_t opcode, unsigned file, unsigned buffer, size_t offset, size_t length) {
+    lz_io_op *op = lz_io_op_new(opcode, (int)file, NULL, length);
+    op->fixed = true;
+    op->buffer = buffer;
+    if (file >= lz_io.file_count || buffer >= lz_io.buffer_count ||
+        offset > lz_io.buffers[buffer].length || length > lz_io.buffers[buffer].length - offset) {
+        /* Completed before anyone can wait on it; the caller's reference is the only one. */
+        op->result = -EINVAL;
+        lz_future_complete(&op->header);
+        return &op->header;
+    }
+    op->data = (char *)lz_io.buffers[buffer].base + offset;
+    return lz_io_submit(op);
+}
+
+lz_future *lz_io_read_fixed(unsigned file, unsigned buffer, size_t offset, size_t length) {
+    return lz_io_fixed(IORING_OP_READ_FIXED, file, buffer, offset, length);
+}
+
+lz_future *lz_io_write_fixed(unsigned file, unsigned buffer, size_t offset, size_t length) {
+    return lz_io_fixed(IORING_OP_WRITE_FIXED, file, buffer, offset, length);
+}
@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L
 #define LZ_RUNTIME_DEFINE_STRUCTS
 #include "runtime.h"
 
@@ -28,6 +29,8 @@ lz_string *lz_string_from_literal(const char *literal) {
     lz_string *str = lz_runtime_alloc(sizeof(*str));
     str->length = strlen(literal);
     str->data = literal;
+    atomic_init(&str->refcount, 1);
+    str->flags = 0;
     return str;
 }
 
@@ -39,10 +42,122 @@ size_t lz_string_length(const lz_string *value) {
     return value ? value->length : 0;
 }
 
-/* Placeholder hook for future ARC/reference counting. */
+/*
+ * Task-local strings use relaxed loads/stores, which compile to plain moves;
+ * only strings marked LZ_STRING_SHARED pay for atomic read-modify-write.
+ */
+lz_string *lz_string_retain(lz_string *value) {
+    if (!value || (value->flags & LZ_STRING_STATIC)) {
+        return value;
+    }
+    if (value->flags & LZ_STRING_SHARED) {
+        atomic_fetch_add_explicit(&value->refcount, 1, memory_order_relaxed);
+    } else {
+        size_t count = atomic_load_explicit(&value->refcount, memory_order_relaxed);
+        atomic_store_explicit(&value->refcount, count + 1, memory_order_relaxed);
+    }
+    return value;
+}
+
 void lz_string_release(lz_string *value) {
-    (void)value;
-    /* ARC hook: no-op for now */
+    if (!value || (value->flags & LZ_STRING_STATIC)) {
+        return;
+    }
+    size_t previous;
+    if (value->flags & LZ_STRING_SHARED) {
+        previous = atomic_fetch_sub_explicit(&value->refcount, 1, memory_order_acq_rel);
+    } else {
+        previous = atomic_load_explicit(&value->refcount, memory_order_relaxed);
+        atomic_store_explicit(&value->refcount, previous - 1, memory_order_relaxed);
+    }
+    if (previous == 1) {
+        free(value);
+    }
+}
+
+/*
+ * Must run while the caller still holds the only thread-visible reference.
+ * Strings that are already shared are left untouched, since other threads
+ * may be reading their flags.
+ */
+void lz_string_share(lz_string *value) {
+    if (!value || (value->flags & (LZ_STRING_STATIC | LZ_STRING_SHARED))) {
+        return;
+    }
+    value->flags |= LZ_STRING_SHARED;
+}
+
+/* Sits in front of every frozen payload, padded so the payload stays max-aligned. */
+typedef struct {
+    atomic_size_t refcount;
+    bool shared;
+    void (*share)(void *payload);
+    void (*drop)(void *payload);
+} lz_frozen_header;
+
+#define LZ_FROZEN_HEADER_SIZE \
+    ((sizeof(lz_frozen_header) + _Alignof(max_align_t) - 1) / _Alignof(max_align_t) * _Alignof(max_align_t))
+
+static lz_frozen_header *lz_frozen_header_of(void *payload) {
+    return (lz_frozen_header *)((char *)payload - LZ_FROZEN_HEADER_SIZE);
+}
+
+void *lz_frozen_new(size_t size, void (*share)(void *payload), void (*drop)(void *payload)) {
+    lz_frozen_header *header = lz_runtime_alloc(LZ_FROZEN_HEADER_SIZE + size);
+    atomic_init(&header->refcount, 1);
+    header->shared = false;
+    header->share = share;
+    header->drop = drop;
+    return (char *)header + LZ_FROZEN_HEADER_SIZE;
+}
+
+void *lz_frozen_retain(void *payload) {
+    if (!payload) {
+        return NULL;
+    }
+    lz_frozen_header *header = lz_frozen_header_of(payload);
+    if (header->shared) {
+        atomic_fetch_add_explicit(&header->refcount, 1, memory_order_relaxed);
+    } else {
+        size_t count = atomic_load_explicit(&header->refcount, memory_order_relaxed);
+        atomic_store_explicit(&header->refcount, count + 1, memory_order_relaxed);
+    }
+    return payload;
+}
+
+void lz_frozen_release(void *payload) {
+    if (!payload) {
+        return;
+    }
+    lz_frozen_header *header = lz_frozen_header_of(payload);
+    size_t previous;
+    if (header->shared) {
+        previous = atomic_fetch_sub_explicit(&header->refcount, 1, memory_order_acq_rel);
+    } else {
+        previous = atomic_load_explicit(&header->refcount, memory_order_relaxed);
+        atomic_store_explicit(&header->refcount, previous - 1, memory_order_relaxed);
+    }
+    if (previous == 1) {
+        if (header->drop) {
+            header->drop(payload);
+        }
+        free(header);
+    }
+}
+
+/* Only the task that built the box can still see it unshared, so the flag needs no atomics. */
+void lz_frozen_share(void *payload) {
+    if (!payload) {
+        return;
+    }
+    lz_frozen_header *header = lz_frozen_header_of(payload);
+    if (header->shared) {
+        return;
+    }
+    header->shared = true;
+    if (header->share) {
+        header->share(payload);
+    }
 }
 
 void lz_assign_int64(int64_t *dst, int64_t value) {
@@ -65,13 +180,26 @@ void lz_assign_bool(bool *dst, bool value) {
 
 /*
  * The lz_assign_* functions are the only sanctioned mutation points for runtime
- * data. They appear trivial today, but ARC/ref-tracking logic will live here
- * later, so generated code must never bypass these helpers.
+ * data. ARC/ref-tracking logic lives here, so generated code must never
+ * bypass these helpers.
  */
-/* String-specific hook: mediates ownership transitions before ARC arrives. */
+/* String-specific hook: retain the incoming value before dropping the old one. */
 void lz_assign_string(lz_string **dst, lz_string *value) {
     if (dst) {
+        lz_string *previous = *dst;
+        *dst = lz_string_retain(value);
+        lz_string_release(previous);
+    }
+}
+
+/* Ownership of an already-retained value moves into *dst. */
+void lz_assign_string_move(lz_string **dst, lz_string *value) {
+    if (dst) {
+        lz_string *previous = *dst;
         *dst = value;
+        lz_string_release(previous);
+    } else {
+        lz_string_release(value);
     }
 }
 
@@ -100,6 +228,9 @@ void lz_runtime_log(lz_string *value) {
     if (!value) {
         return;
     }
+    /* Tasks log concurrently; the lock keeps each line whole. */
+    flockfile(stdout);
     fwrite(value->data, 1, value->length, stdout);
     fputc('\n', stdout);
+    funlockfile(stdout);
 }
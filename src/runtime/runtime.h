@@ -29,25 +29,44 @@
 typedef struct lz_string lz_string;
 typedef struct lz_result lz_result;
 typedef struct lz_maybe lz_maybe;
+typedef struct lz_future lz_future;
+typedef struct lz_chan lz_chan;
 
 /*
  * lz_string ownership model
  * -------------------------
  * - The runtime always owns the lz_string struct itself, regardless of where it
  *   was created.
+ * - Codegen hoists every string literal into a file-scope
+ *   `static const struct lz_string` (length computed at compile time, one
+ *   constant per distinct spelling), so evaluating a literal never allocates.
+ *   Those constants carry LZ_STRING_STATIC and are never counted or freed;
+ *   generated code casts away const when passing them around.
  * - When constructed via lz_string_from_literal, the underlying character data
  *   remains owned by the static literal; lz_string only references it and must
- *   never attempt to free it.
- * - Future heap-allocated strings will make lz_string responsible for both the
- *   struct and the backing buffer, paving the way for ARC/reference counting.
- * - lz_string_release is the single extension point for that future work, so it
- *   must be called (even today) whenever ownership transfer semantics require it.
+ *   never attempt to free it. The wrapper itself is heap allocated and
+ *   reference counted.
+ * - Heap strings start with a reference count of one. lz_string_retain and
+ *   lz_string_release adjust it; the string is freed when it drops to zero.
+ * - Counts are plain loads and stores while a string is confined to the task
+ *   that created it. lz_string_share switches a string to atomic counting and
+ *   must be called before the value is published to another task.
+ * - Ownership conventions used by codegen: locals and the hidden return slot
+ *   own one reference; parameters are borrowed; values returned from
+ *   functions are owned (+1) by the caller.
  */
 
+#define LZ_STRING_STATIC 0x1u
+#define LZ_STRING_SHARED 0x2u
+
 #ifdef LZ_RUNTIME_DEFINE_STRUCTS
+#include <stdatomic.h>
+
 struct lz_string {
     size_t length;
     const char *data;
+    atomic_size_t refcount;
+    uint32_t flags;
 };
 
 struct lz_result {
@@ -60,24 +79,64 @@ struct lz_maybe {
     bool has_value;
     union { void *ptr; int64_t i64; double f64; bool boolean; } data;
 };
+
+/* Header of every task frame; codegen appends captures, spilled locals and the result. */
+struct lz_future {
+    /* Injection queue link, or continuation list link while suspended. */
+    struct lz_future *next;
+    /* Returns false when the task suspended in an await. */
+    bool (*run)(lz_future *task);
+    void (*drop)(lz_future *task);
+    atomic_size_t refcount;
+    atomic_int state;
+    atomic_int waiters;
+    /* Tasks suspended on this future; a closed marker once it has completed. */
+    _Atomic(lz_future *) continuations;
+    /* Where `run` picks up again: 0 at the start, else the await it stopped in. */
+    uint32_t resume_point;
+    uint32_t result_offset;
+    uint32_t size_class;
+};
 #endif
 
 lz_string *lz_string_from_literal(const char *literal);
 const char *lz_string_data(const lz_string *value);
 size_t lz_string_length(const lz_string *value);
+lz_string *lz_string_retain(lz_string *value);
 void lz_string_release(lz_string *value);
+void lz_string_share(lz_string *value);
+
+/*
+ * Frozen structs
+ * --------------
+ * - Structs are deeply immutable, so codegen keeps every struct value in a
+ *   heap box and passes the pointer around: assigning one, sending it over a
+ *   channel or capturing it in a task moves a pointer, never the payload.
+ * - lz_frozen_new returns zeroed payload storage preceded by a hidden header
+ *   holding the count (starting at one) and the struct's hooks. The payload
+ *   is filled in once by its constructor and never written again.
+ * - Counts follow the string rules: plain while the box stays in the task
+ *   that built it, atomic after lz_frozen_share. `share` passes that on to
+ *   the struct's string fields and `drop` releases them before the box is
+ *   freed; either may be NULL for a struct without strings.
+ */
+void *lz_frozen_new(size_t size, void (*share)(void *payload), void (*drop)(void *payload));
+void *lz_frozen_retain(void *payload);
+void lz_frozen_release(void *payload);
+void lz_frozen_share(void *payload);
 
 /*
  * Assignment hooks (lz_assign_string/lz_assign_ptr/lz_assign_result/lz_assign_maybe)
- * centralize every observable mutation so that future ARC/reference counting can
- * intercept writes. They must never be bypassed, inlined, or removed, even
- * though they currently perform simple assignments.
+ * centralize every observable mutation so that ARC/reference counting can
+ * intercept writes. They must never be bypassed, inlined, or removed.
  */
 void lz_assign_int64(int64_t *dst, int64_t value);
 void lz_assign_double(double *dst, double value);
 void lz_assign_bool(bool *dst, bool value);
-/* Handles string ownership handoff; never bypass. */
+/* Retains the borrowed value and releases the previous one; never bypass. */
 void lz_assign_string(lz_string **dst, lz_string *value);
+/* Same as lz_assign_string but adopts an owned (+1) value without a retain. */
+void lz_assign_string_move(lz_string **dst, lz_string *value);
 /* Pointer assignment funnel for future ARC hooks. */
 void lz_assign_ptr(void **dst, void *value);
 /* Result assignment funnel for future ARC hooks. */
@@ -87,4 +146,140 @@ void lz_assign_maybe(lz_maybe *dst, lz_maybe value);
 
 void lz_runtime_log(lz_string *value);
 
+/*
+ * Tasks and futures
+ * -----------------
+ * - A `task` block is lowered to a frame: an lz_future header followed by the
+ *   values it captured and a slot for its result. lz_task_alloc hands out
+ *   zeroed frames from per-thread pools, so spawning a task never reaches
+ *   malloc in steady state.
+ * - lz_task_spawn queues the frame on the scheduler and returns it as the
+ *   future[T] value. The scheduler starts on first use with one worker per
+ *   online CPU (or $LZ_WORKERS). Each worker owns a deque: tasks spawned by
+ *   a worker go to the bottom of its own deque, idle workers steal from the
+ *   top of others', and tasks spawned outside the pool go through a shared
+ *   injection queue.
+ * - Futures are always shared across threads, so their counts are atomic.
+ *   The spawner owns the returned reference and the scheduler holds one more
+ *   until the task has run; `drop` releases the captures and the result once
+ *   the last reference goes away.
+ * - Task bodies are stackless coroutines. `run` is a state machine over the
+ *   frame: an await on an unfinished future calls lz_task_suspend, records
+ *   its resume point and returns false, and the task is queued again when
+ *   that future completes. A suspended task holds no thread and no stack,
+ *   only its frame.
+ * - lz_future_await blocks until the task has run and returns the address of
+ *   its result, which stays valid while the caller holds the future. Code
+ *   outside task bodies (main, and functions called from tasks) waits this
+ *   way; the waiting thread runs queued tasks in the meantime.
+ */
+lz_future *lz_task_alloc(size_t size,
+                         size_t result_offset,
+                         bool (*run)(lz_future *task),
+                         void (*drop)(lz_future *task));
+lz_future *lz_task_spawn(lz_future *task);
+/* True if `task` is now parked on `future` and must return from run; false once it has completed. */
+bool lz_task_suspend(lz_future *task, lz_future *future);
+void *lz_future_await(lz_future *future);
+lz_future *lz_future_retain(lz_future *future);
+void lz_future_release(lz_future *future);
+/* Same contract as lz_assign_string/lz_assign_string_move. */
+void lz_assign_future(lz_future **dst, lz_future *value);
+void lz_assign_future_move(lz_future **dst, lz_future *value);
+
+/*
+ * Channels
+ * --------
+ * - `chan[T]` is a bounded MPMC ring of fixed-size elements; the capacity
+ *   is rounded up to a power of two. Sends and receives are lock-free while
+ *   the channel has room (or data); send_many/recv_many claim a run of
+ *   cells with a single CAS.
+ * - A channel owns one reference to every element in it: `retain` runs on
+ *   each element as it is sent and `release` on whatever is left when the
+ *   channel is freed (both may be NULL). Received elements are owned (+1)
+ *   by the receiver. lz_chan_retain_string/lz_chan_release_string adapt
+ *   string elements and lz_chan_retain_frozen/lz_chan_release_frozen struct
+ *   boxes, sharing them on the way in.
+ * - lz_chan_send/lz_chan_recv block the calling thread. Waiting does not
+ *   run other tasks on the waiter's stack, which could bury the very task it
+ *   waits for; the scheduler starts a spare thread instead when no worker is
+ *   idle. lz_chan_recv returns `elem`, so generated code can
+ *   read the value in place. lz_chan_send_many sends all `count` elements;
+ *   lz_chan_recv_many waits for at least one and returns how many it got.
+ * - Inside task bodies codegen uses lz_chan_task_send/lz_chan_task_recv:
+ *   false means `task` is parked on the channel and must return from run;
+ *   it is resubmitted when the other side moves and retries the operation.
+ * - Channel counts are atomic; channels are always shared.
+ */
+lz_chan *lz_chan_new(size_t capacity,
+                     size_t elem_size,
+                     void (*retain)(void *elem),
+                     void (*release)(void *elem));
+lz_chan *lz_chan_retain(lz_chan *chan);
+void lz_chan_release(lz_chan *chan);
+bool lz_chan_try_send(lz_chan *chan, const void *elem);
+bool lz_chan_try_recv(lz_chan *chan, void *elem);
+void lz_chan_send(lz_chan *chan, const void *elem);
+void *lz_chan_recv(lz_chan *chan, void *elem);
+void lz_chan_send_many(lz_chan *chan, const void *elems, size_t count);
+size_t lz_chan_recv_many(lz_chan *chan, void *elems, size_t max);
+bool lz_chan_task_send(lz_chan *chan, const void *elem, lz_future *task);
+bool lz_chan_task_recv(lz_chan *chan, void *elem, lz_future *task);
+void lz_chan_retain_string(void *elem);
+void lz_chan_release_string(void *elem);
+void lz_chan_retain_frozen(void *elem);
+void lz_chan_release_frozen(void *elem);
+/* Same contract as lz_assign_string/lz_assign_string_move. */
+void lz_assign_chan(lz_chan **dst, lz_chan *value);
+void lz_assign_chan_move(lz_chan **dst, lz_chan *value);
+
+/*
+ * Async I/O
+ * ---------
+ * - lz_io hands socket and file operations to a dedicated I/O thread and
+ *   returns a future whose int64 result is what the syscall returned: bytes
+ *   moved, the accepted descriptor, 0, or -errno. That is the layout of a
+ *   future[int], so awaiting one in a task body suspends the task like any
+ *   other future instead of holding a worker in a syscall.
+ * - The backend is io_uring, driven through raw syscalls on rings the
+ *   runtime maps itself. When the kernel refuses it, or $LZ_IO is "epoll",
+ *   operations are tried right away and parked on epoll if they would
+ *   block. That backend never changes a descriptor's flags: it reads and
+ *   writes sockets with MSG_DONTWAIT, and fails operations on pipes, ttys
+ *   and listening sockets that are not already O_NONBLOCK with -EINVAL.
+ *   lz_io_backend names the one in use.
+ * - Buffers must stay valid until the future completes. The loop holds its
+ *   own reference to an in-flight future, so callers may release theirs.
+ * - lz_io_register_buffers/lz_io_register_files register one table of each
+ *   per process, before the first fixed operation; io_uring then skips the
+ *   per-operation file lookup and page pinning. The *_fixed operations name
+ *   a registered descriptor and a range of a registered buffer by index.
+ * - lz_io_accept_multishot keeps accepting on `fd` from a single submission
+ *   and calls `on_accept` on the I/O thread for every connection, so the
+ *   callback must not block. Its future completes (with -errno) only when
+ *   the listener fails.
+ */
+typedef struct {
+    void *base;
+    size_t length;
+} lz_io_buffer;
+
+const char *lz_io_backend(void);
+lz_future *lz_io_accept(int fd);
+lz_future *lz_io_accept_multishot(int fd, void (*on_accept)(void *arg, int fd), void *arg);
+lz_future *lz_io_read(int fd, void *buf, size_t length);
+lz_future *lz_io_write(int fd, const void *buf, size_t length);
+lz_future *lz_io_close(int fd);
+bool lz_io_register_buffers(const lz_io_buffer *buffers, unsigned count);
+bool lz_io_register_files(const int *fds, unsigned count);
+lz_future *lz_io_read_fixed(unsigned file, unsigned buffer, size_t offset, size_t length);
+lz_future *lz_io_write_fixed(unsigned file, unsigned buffer, size_t offset, size_t length);
+
+/* Scheduler hooks for the runtime's own blocking primitives; generated code never calls these. */
+void lz_sched_submit(lz_future *task);
+/* Called before a thread sleeps in a blocking operation; starts a spare thread if no worker is idle. */
+void lz_sched_block(void);
+/* Marks a future done, waking its awaiters and resubmitting the tasks suspended on it. */
+void lz_future_complete(lz_future *future);
+
 #endif
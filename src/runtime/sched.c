@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#define LZ_RUNTIME_DEFINE_STRUCTS
+#include "runtime.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Work-stealing scheduler behind `task`. Every worker owns a Chase-Lev deque
+ * (the C11 formulation of Lê et al., PPoPP 2013): the owner pushes and takes
+ * at the bottom without locking, thieves CAS the top. A full deque spills
+ * into the injection queue, which is also where threads outside the pool
+ * submit work. Idle workers park on an event count so a spawn only touches
+ * the mutex when somebody is actually asleep. A task that suspends in an
+ * await is pushed onto its future's continuation list (a Treiber stack) and
+ * resubmitted by whichever thread completes that future. A thread about to
+ * sleep in a blocking channel operation first makes sure some thread is
+ * free to run queued work, starting a spare one if every worker is busy.
+ */
+
+#define LZ_DEQUE_CAPACITY 4096
+#define LZ_MAX_WORKERS 256
+#define LZ_CACHE_LINE 64
+#define LZ_POOL_CLASSES 4
+#define LZ_POOL_LIMIT 64
+#define LZ_AWAIT_POLL_NS 1000000L
+#define LZ_HELP_DEPTH_LIMIT 128
+#define LZ_SPARE_IDLE_NS 50000000L
+
+enum {
+    LZ_FUTURE_PENDING,
+    LZ_FUTURE_DONE,
+};
+
+typedef struct {
+    _Alignas(LZ_CACHE_LINE) _Atomic int64_t top;
+    _Alignas(LZ_CACHE_LINE) _Atomic int64_t bottom;
+    _Alignas(LZ_CACHE_LINE) _Atomic(lz_future *) slots[LZ_DEQUE_CAPACITY];
+} lz_deque;
+
+typedef struct {
+    lz_deque deque;
+    size_t index;
+    uint64_t rng;
+} lz_worker;
+
+static struct {
+    lz_worker *workers;
+    size_t count;
+
+    pthread_mutex_t inject_lock;
+    lz_future *inject_head;
+    lz_future *inject_tail;
+    atomic_size_t inject_count;
+
+    /* Event count: a spawn bumps `epoch`; parked workers wait for it to move. */
+    pthread_mutex_t park_lock;
+    pthread_cond_t park_cond;
+    atomic_uint epoch;
+    atomic_int sleeping;
+    /* Threads started to stand in for blocked ones; they leave once idle. */
+    atomic_int spares;
+
+    /* Threads blocked in lz_future_await, woken by completing tasks. */
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+} lz_sched = {
+    .inject_lock = PTHREAD_MUTEX_INITIALIZER,
+    .park_lock = PTHREAD_MUTEX_INITIALIZER,
+    .park_cond = PTHREAD_COND_INITIALIZER,
+    .done_lock = PTHREAD_MUTEX_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t lz_sched_once = PTHREAD_ONCE_INIT;
+/* Continuation list of a completed future; never a real task. */
+static char lz_closed_marker;
+#define LZ_CONTINUATIONS_CLOSED ((lz_future *)&lz_closed_marker)
+static _Thread_local lz_worker *lz_current_worker;
+/* Tasks run from inside lz_future_await on this thread's stack right now. */
+static _Thread_local unsigned lz_help_depth;
+
+/* Frames freed on a thread are reused by the next spawn on that thread. */
+static const size_t lz_pool_sizes[LZ_POOL_CLASSES] = { 64, 128, 256, 512 };
+
+typedef struct {
+    lz_future *free[LZ_POOL_CLASSES];
+    size_t count[LZ_POOL_CLASSES];
+} lz_task_pool;
+
+static _Thread_local lz_task_pool lz_pool;
+
+static void lz_sched_fatal(const char *message) {
+    fprintf(stderr, "lazylang runtime: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+static bool lz_deque_push(lz_deque *deque, lz_future *task) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= LZ_DEQUE_CAPACITY) {
+        return false;
+    }
+    atomic_store_explicit(&deque->slots[bottom % LZ_DEQUE_CAPACITY], task, memory_order_relaxed);
+    /* Publishes the frame's contents to whichever thief reads the new bottom. */
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return true;
+}
+
+/* Owner only; races thieves for the last task through `top`. */
+static lz_future *lz_deque_take(lz_deque *deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    lz_future *task = atomic_load_explicit(&deque->slots[bottom % LZ_DEQUE_CAPACITY],
+                                           memory_order_relaxed);
+    if (top == bottom) {
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static lz_future *lz_deque_steal(lz_deque *deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    lz_future *task = atomic_load_explicit(&deque->slots[top % LZ_DEQUE_CAPACITY],
+                                           memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+static void lz_inject_push(lz_future *task) {
+    task->next = NULL;
+    pthread_mutex_lock(&lz_sched.inject_lock);
+    if (lz_sched.inject_tail) {
+        lz_sched.inject_tail->next = task;
+    } else {
+        lz_sched.inject_head = task;
+    }
+    lz_sched.inject_tail = task;
+    atomic_fetch_add_explicit(&lz_sched.inject_count, 1, memory_order_release);
+    pthread_mutex_unlock(&lz_sched.inject_lock);
+}
+
+static lz_future *lz_inject_pop(void) {
+    if (atomic_load_explicit(&lz_sched.inject_count, memory_order_acquire) == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&lz_sched.inject_lock);
+    lz_future *task = lz_sched.inject_head;
+    if (task) {
+        lz_sched.inject_head = task->next;
+        if (!lz_sched.inject_head) {
+            lz_sched.inject_tail = NULL;
+        }
+        atomic_fetch_sub_explicit(&lz_sched.inject_count, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&lz_sched.inject_lock);
+    return task;
+}
+
+static uint64_t lz_worker_random(lz_worker *worker) {
+    uint64_t x = worker->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    worker->rng = x;
+    return x;
+}
+
+/* Own deque first (newest task, still hot in cache), then shared work, then theft. */
+static lz_future *lz_sched_find(lz_worker *self) {
+    lz_future *task = NULL;
+    if (self && (task = lz_deque_take(&self->deque))) {
+        return task;
+    }
+    if ((task = lz_inject_pop())) {
+        return task;
+    }
+    size_t count = lz_sched.count;
+    size_t start = self ? (size_t)(lz_worker_random(self) % count) : 0;
+    for (size_t i = 0; i < count; i++) {
+        lz_worker *victim = &lz_sched.workers[(start + i) % count];
+        if (victim != self && (task = lz_deque_steal(&victim->deque))) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void lz_sched_notify(void) {
+    atomic_fetch_add_explicit(&lz_sched.epoch, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&lz_sched.sleeping, memory_order_seq_cst) > 0) {
+        pthread_mutex_lock(&lz_sched.park_lock);
+        pthread_cond_signal(&lz_sched.park_cond);
+        pthread_mutex_unlock(&lz_sched.park_lock);
+    }
+}
+
+void lz_sched_submit(lz_future *task) {
+    lz_worker *self = lz_current_worker;
+    if (!self || !lz_deque_push(&self->deque, task)) {
+        lz_inject_push(task);
+    }
+    lz_sched_notify();
+}
+
+void lz_future_complete(lz_future *future) {
+    atomic_store_explicit(&future->state, LZ_FUTURE_DONE, memory_order_seq_cst);
+    if (atomic_load_explicit(&future->waiters, memory_order_seq_cst) > 0) {
+        pthread_mutex_lock(&lz_sched.done_lock);
+        pthread_cond_broadcast(&lz_sched.done_cond);
+        pthread_mutex_unlock(&lz_sched.done_lock);
+    }
+    lz_future *waiting = atomic_exchange_explicit(&future->continuations,
+                                                  LZ_CONTINUATIONS_CLOSED,
+                                                  memory_order_acq_rel);
+    while (waiting) {
+        /* Submitting may reuse `next` as the injection queue link. */
+        lz_future *next = waiting->next;
+        lz_sched_submit(waiting);
+        waiting = next;
+    }
+}
+
+/* A task that suspended may already be running elsewhere once `run` returns, so it is left alone. */
+static void lz_task_run(lz_future *task) {
+    if (!task->run(task)) {
+        return;
+    }
+    lz_future_complete(task);
+    lz_future_release(task);
+}
+
+static void *lz_worker_main(void *arg) {
+    lz_worker *self = arg;
+    lz_current_worker = self;
+    for (;;) {
+        lz_future *task = lz_sched_find(self);
+        if (task) {
+            lz_task_run(task);
+            continue;
+        }
+        /* Announce the nap, then look once more so a concurrent spawn is not missed. */
+        unsigned epoch = atomic_load_explicit(&lz_sched.epoch, memory_order_seq_cst);
+        atomic_fetch_add_explicit(&lz_sched.sleeping, 1, memory_order_seq_cst);
+        task = lz_sched_find(self);
+        if (!task) {
+            pthread_mutex_lock(&lz_sched.park_lock);
+            while (atomic_load_explicit(&lz_sched.epoch, memory_order_seq_cst) == epoch) {
+                pthread_cond_wait(&lz_sched.park_cond, &lz_sched.park_lock);
+            }
+            pthread_mutex_unlock(&lz_sched.park_lock);
+        }
+        atomic_fetch_sub_explicit(&lz_sched.sleeping, 1, memory_order_seq_cst);
+        if (task) {
+            lz_task_run(task);
+        }
+    }
+    return NULL;
+}
+
+/* Like a worker without a deque; gives up after idling for LZ_SPARE_IDLE_NS. */
+static void *lz_spare_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        lz_future *task = lz_sched_find(NULL);
+        if (task) {
+            lz_task_run(task);
+            continue;
+        }
+        unsigned epoch = atomic_load_explicit(&lz_sched.epoch, memory_order_seq_cst);
+        atomic_fetch_add_explicit(&lz_sched.sleeping, 1, memory_order_seq_cst);
+        task = lz_sched_find(NULL);
+        if (!task) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LZ_SPARE_IDLE_NS;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            int status = 0;
+            pthread_mutex_lock(&lz_sched.park_lock);
+            while (status == 0 && atomic_load_explicit(&lz_sched.epoch, memory_order_seq_cst) == epoch) {
+                status = pthread_cond_timedwait(&lz_sched.park_cond, &lz_sched.park_lock, &deadline);
+            }
+            pthread_mutex_unlock(&lz_sched.park_lock);
+        }
+        atomic_fetch_sub_explicit(&lz_sched.sleeping, 1, memory_order_seq_cst);
+        if (task) {
+            lz_task_run(task);
+        } else if (atomic_load_explicit(&lz_sched.epoch, memory_order_seq_cst) == epoch) {
+            atomic_fetch_sub_explicit(&lz_sched.spares, 1, memory_order_relaxed);
+            return NULL;
+        }
+    }
+}
+
+void lz_sched_block(void) {
+    if (lz_sched.count == 0 || atomic_load_explicit(&lz_sched.sleeping, memory_order_seq_cst) > 0) {
+        return;
+    }
+    if (atomic_fetch_add_explicit(&lz_sched.spares, 1, memory_order_relaxed) >= LZ_MAX_WORKERS) {
+        atomic_fetch_sub_explicit(&lz_sched.spares, 1, memory_order_relaxed);
+        return;
+    }
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if (pthread_create(&thread, &attributes, lz_spare_main, NULL) != 0) {
+        atomic_fetch_sub_explicit(&lz_sched.spares, 1, memory_order_relaxed);
+    }
+    pthread_attr_destroy(&attributes);
+}
+
+static size_t lz_sched_worker_count(void) {
+    const char *env = getenv("LZ_WORKERS");
+    long count = env ? strtol(env, NULL, 10) : 0;
+    if (count <= 0) {
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (count < 1) count = 1;
+    if (count > LZ_MAX_WORKERS) count = LZ_MAX_WORKERS;
+    return (size_t)count;
+}
+
+static void lz_sched_start(void) {
+    size_t count = lz_sched_worker_count();
+    lz_worker *workers = aligned_alloc(LZ_CACHE_LINE, count * sizeof(lz_worker));
+    if (!workers) {
+        lz_sched_fatal("out of memory");
+    }
+    memset(workers, 0, count * sizeof(lz_worker));
+    lz_sched.workers = workers;
+    lz_sched.count = count;
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    for (size_t i = 0; i < count; i++) {
+        workers[i].index = i;
+        workers[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        pthread_t thread;
+        if (pthread_create(&thread, &attributes, lz_worker_main, &workers[i]) != 0) {
+            lz_sched_fatal("failed to start a worker thread");
+        }
+    }
+    pthread_attr_destroy(&attributes);
+}
+
+static size_t lz_pool_class_for(size_t size) {
+    size_t size_class = 0;
+    while (size_class < LZ_POOL_CLASSES && lz_pool_sizes[size_class] < size) {
+        size_class++;
+    }
+    return size_class;
+}
+
+lz_future *lz_task_alloc(size_t size,
+                         size_t result_offset,
+                         bool (*run)(lz_future *task),
+                         void (*drop)(lz_future *task)) {
+    size_t size_class = lz_pool_class_for(size);
+    lz_future *task = NULL;
+    if (size_class < LZ_POOL_CLASSES && lz_pool.free[size_class]) {
+        task = lz_pool.free[size_class];
+        lz_pool.free[size_class] = task->next;
+        lz_pool.count[size_class]--;
+        memset(task, 0, lz_pool_sizes[size_class]);
+    } else {
+        size_t bytes = size_class < LZ_POOL_CLASSES ? lz_pool_sizes[size_class] : size;
+        task = calloc(1, bytes);
+        if (!task) {
+            lz_sched_fatal("out of memory");
+        }
+    }
+    task->run = run;
+    task->drop = drop;
+    atomic_init(&task->refcount, 1);
+    atomic_init(&task->state, LZ_FUTURE_PENDING);
+    atomic_init(&task->waiters, 0);
+    atomic_init(&task->continuations, NULL);
+    task->result_offset = (uint32_t)result_offset;
+    task->size_class = (uint32_t)size_class;
+    return task;
+}
+
+static void lz_task_free(lz_future *task) {
+    size_t size_class = task->size_class;
+    if (size_class < LZ_POOL_CLASSES && lz_pool.count[size_class] < LZ_POOL_LIMIT) {
+        task->next = lz_pool.free[size_class];
+        lz_pool.free[size_class] = task;
+        lz_pool.count[size_class]++;
+        return;
+    }
+    free(task);
+}
+
+/* The caller keeps the reference it got from lz_task_alloc; the queue takes another. */
+lz_future *lz_task_spawn(lz_future *task) {
+    pthread_once(&lz_sched_once, lz_sched_start);
+    lz_future_retain(task);
+    lz_sched_submit(task);
+    return task;
+}
+
+/* The scheduler's reference keeps `task` alive while it sits on the list. */
+bool lz_task_suspend(lz_future *task, lz_future *future) {
+    if (atomic_load_explicit(&future->state, memory_order_acquire) == LZ_FUTURE_DONE) {
+        return false;
+    }
+    lz_future *head = atomic_load_explicit(&future->continuations, memory_order_acquire);
+    do {
+        if (head == LZ_CONTINUATIONS_CLOSED) {
+            return false;
+        }
+        task->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&future->continuations, &head, task,
+                                                    memory_order_release,
+                                                    memory_order_acquire));
+    return true;
+}
+
+/*
+ * Waiting threads help: they run whatever task they can find, which also
+ * keeps a single worker from deadlocking on a task it spawned itself. Each
+ * helped task nests on the waiter's stack, so helping stops at a fixed depth.
+ * With nothing to run they sleep on the completion condition, polling so
+ * that tasks spawned meanwhile are still picked up.
+ */
+void *lz_future_await(lz_future *future) {
+    lz_worker *self = lz_current_worker;
+    while (atomic_load_explicit(&future->state, memory_order_acquire) != LZ_FUTURE_DONE) {
+        lz_future *task = lz_help_depth < LZ_HELP_DEPTH_LIMIT ? lz_sched_find(self) : NULL;
+        if (task) {
+            lz_help_depth++;
+            lz_task_run(task);
+            lz_help_depth--;
+            continue;
+        }
+        atomic_fetch_add_explicit(&future->waiters, 1, memory_order_seq_cst);
+        pthread_mutex_lock(&lz_sched.done_lock);
+        if (atomic_load_explicit(&future->state, memory_order_seq_cst) != LZ_FUTURE_DONE) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LZ_AWAIT_POLL_NS;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&lz_sched.done_cond, &lz_sched.done_lock, &deadline);
+        }
+        pthread_mutex_unlock(&lz_sched.done_lock);
+        atomic_fetch_sub_explicit(&future->waiters, 1, memory_order_seq_cst);
+    }
+    return (char *)future + future->result_offset;
+}
+
+lz_future *lz_future_retain(lz_future *future) {
+    if (future) {
+        atomic_fetch_add_explicit(&future->refcount, 1, memory_order_relaxed);
+    }
+    return future;
+}
+
+void lz_future_release(lz_future *future) {
+    if (!future) {
+        return;
+    }
+    if (atomic_fetch_sub_explicit(&future->refcount, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    if (future->drop) {
+        future->drop(future);
+    }
+    lz_task_free(future);
+}
+
+void lz_assign_future(lz_future **dst, lz_future *value) {
+    if (dst) {
+        lz_future *previous = *dst;
+        *dst = lz_future_retain(value);
+        lz_future_release(previous);
+    }
+}
+
+void lz_assign_future_move(lz_future **dst, lz_future *value) {
+    if (dst) {
+        lz_future *previous = *dst;
+        *dst = value;
+        lz_future_release(previous);
+    } else {
+        lz_future_release(value);
+    }
+}
@@ -1,5 +1,8 @@
 #include "sema.h"
 
+#include "../ast/symtab.h"
+#include "../diag.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,12 +20,6 @@ typedef struct {
     Token token;
 } VarSymbol;
 
-typedef struct {
-    VarSymbol *items;
-    size_t count;
-    size_t capacity;
-} VarScope;
-
 typedef struct {
     const char *name;
     const char *return_type;
@@ -32,21 +29,38 @@ typedef struct {
 
 static const char *SUPPORTED_BUILTINS[] = {
     "log",
+    "await",
+    "chan",
+    "send",
+    "recv",
 };
 static const size_t SUPPORTED_BUILTIN_COUNT = sizeof(SUPPORTED_BUILTINS) /
                                              sizeof(SUPPORTED_BUILTINS[0]);
 
+/*
+ * Every name reaching sema is interned, so symbol comparisons below are
+ * pointer comparisons against the canonical spellings in ast_symbols().
+ */
 typedef struct {
-    VarScope *scopes;
-    size_t scope_count;
-    size_t scope_capacity;
+    ASTScopeStack vars; /* of VarSymbol */
 
     FunctionSymbol *functions;
     size_t function_count;
     size_t function_capacity;
+    ASTSymbolMap function_index; /* name -> function position + 1 */
+
+    const ASTStructDecl **structs;
+    size_t struct_count;
+    size_t struct_capacity;
+    ASTSymbolMap struct_index; /* name -> struct position + 1 */
 
     const ASTFunctionDecl *current_function;
     FlowMode current_flow_mode;
+    /* Inside a task body, variables below this position are captured from outside it. */
+    bool in_task;
+    size_t task_scope_start;
+    /* Expression of the statement being checked: the one place `send` may appear. */
+    const ASTNode *statement_expr;
 } SemaContext;
 
 static void sema_context_init(SemaContext *ctx);
@@ -65,7 +79,10 @@ static void sema_add_function_symbol(SemaContext *ctx,
                                      const char *return_type,
                                      const ASTFunctionDecl *decl,
                                      Token token);
+static void sema_register_struct(SemaContext *ctx, const ASTStructDecl *decl);
+static const ASTStructDecl *sema_lookup_struct(SemaContext *ctx, const char *name);
 static void sema_register_builtins(SemaContext *ctx);
+static void sema_register_imports(SemaContext *ctx, const ASTProgram *program);
 static const FunctionSymbol *sema_lookup_function(SemaContext *ctx, const char *name);
 static void sema_note_flow_usage(SemaContext *ctx, FlowMode mode, Token token);
 static FlowMode flow_mode_from_type(const char *type_name);
@@ -83,16 +100,31 @@ static void sema_check_unused_result(SemaContext *ctx, ASTExprStmt *stmt);
 static bool type_is_maybe(const char *type_name);
 static bool type_is_result(const char *type_name);
 static bool type_is_primitive(const char *type_name);
-static bool type_is_concurrency(const char *type_name);
-static void sema_require_supported_type(const char *type_name,
+static bool type_is_future(const char *type_name);
+static bool type_is_chan(const char *type_name);
+static const char *type_future_result(const char *type_name);
+static const char *type_chan_element(const char *type_name);
+static void sema_require_supported_type(SemaContext *ctx,
+                                       const char *type_name,
                                        Token token,
                                        bool allow_complex);
-static void sema_validate_struct_field(const ASTStructDecl *decl,
+static void sema_validate_struct_field(SemaContext *ctx,
+                                       const ASTStructDecl *decl,
                                        ASTStructField *field);
 static bool sema_is_concurrency_keyword(const char *name);
 static void sema_check_builtin_call(SemaContext *ctx, ASTCallExpr *call);
+static void sema_check_task(SemaContext *ctx, ASTTaskExpr *task, const char *target_type);
+static bool sema_is_chan_new(const ASTNode *node);
+static void sema_check_chan_new(SemaContext *ctx, ASTCallExpr *call, const char *target_type);
+static void sema_check_struct_new(SemaContext *ctx, ASTCallExpr *call);
+static VarSymbol *sema_lookup_captured_var(SemaContext *ctx, const char *name, Token token);
+static const char *sema_expression_type(SemaContext *ctx, const ASTNode *node);
 
 void sema_check_program(ASTProgram *program) {
+    sema_check_program_partial(program, NULL);
+}
+
+void sema_check_program_partial(ASTProgram *program, const bool *selected) {
     SemaContext ctx;
     sema_context_init(&ctx);
     sema_register_builtins(&ctx);
@@ -101,59 +133,52 @@ void sema_check_program(ASTProgram *program) {
         ASTNode *node = program->declarations.items[i];
         if (node->kind == AST_NODE_FUNCTION) {
             sema_register_function(&ctx, (ASTFunctionDecl *)node);
+        } else if (node->kind == AST_NODE_STRUCT) {
+            sema_register_struct(&ctx, (const ASTStructDecl *)node);
         }
     }
+    sema_register_imports(&ctx, program);
 
     for (size_t i = 0; i < program->declarations.count; i++) {
-        sema_check_declaration(&ctx, program->declarations.items[i]);
+        if (!selected || selected[i]) {
+            sema_check_declaration(&ctx, program->declarations.items[i]);
+        }
     }
 
     sema_context_destroy(&ctx);
 }
 
 static void sema_context_init(SemaContext *ctx) {
-    ctx->scopes = NULL;
-    ctx->scope_count = 0;
-    ctx->scope_capacity = 0;
+    ast_scope_stack_init(&ctx->vars, sizeof(VarSymbol));
     ctx->functions = NULL;
     ctx->function_count = 0;
     ctx->function_capacity = 0;
+    ast_symbol_map_init(&ctx->function_index);
+    ctx->structs = NULL;
+    ctx->struct_count = 0;
+    ctx->struct_capacity = 0;
+    ast_symbol_map_init(&ctx->struct_index);
     ctx->current_function = NULL;
     ctx->current_flow_mode = FLOW_MODE_NONE;
+    ctx->in_task = false;
+    ctx->task_scope_start = 0;
+    ctx->statement_expr = NULL;
 }
 
 static void sema_context_destroy(SemaContext *ctx) {
-    for (size_t i = 0; i < ctx->scope_count; i++) {
-        free(ctx->scopes[i].items);
-    }
-    free(ctx->scopes);
+    ast_scope_stack_destroy(&ctx->vars);
     free(ctx->functions);
+    ast_symbol_map_destroy(&ctx->function_index);
+    free(ctx->structs);
+    ast_symbol_map_destroy(&ctx->struct_index);
 }
 
 static void sema_push_scope(SemaContext *ctx) {
-    if (ctx->scope_count == ctx->scope_capacity) {
-        size_t new_capacity = ctx->scope_capacity ? ctx->scope_capacity * 2 : 4;
-        VarScope *new_scopes = realloc(ctx->scopes, new_capacity * sizeof(VarScope));
-        if (!new_scopes) {
-            fprintf(stderr, "Out of memory\n");
-            exit(EXIT_FAILURE);
-        }
-        ctx->scopes = new_scopes;
-        ctx->scope_capacity = new_capacity;
-    }
-    VarScope *scope = &ctx->scopes[ctx->scope_count++];
-    scope->items = NULL;
-    scope->count = 0;
-    scope->capacity = 0;
+    ast_scope_stack_push(&ctx->vars);
 }
 
 static void sema_pop_scope(SemaContext *ctx) {
-    if (ctx->scope_count == 0) return;
-    VarScope *scope = &ctx->scopes[--ctx->scope_count];
-    free(scope->items);
-    scope->items = NULL;
-    scope->count = 0;
-    scope->capacity = 0;
+    ast_scope_stack_pop(&ctx->vars);
 }
 
 static void sema_add_var(SemaContext *ctx,
@@ -161,26 +186,11 @@ static void sema_add_var(SemaContext *ctx,
                          bool is_mutable,
                          const char *type_name,
                          Token token) {
-    if (ctx->scope_count == 0) {
-        sema_push_scope(ctx);
-    }
-    VarScope *scope = &ctx->scopes[ctx->scope_count - 1];
-    for (size_t i = 0; i < scope->count; i++) {
-        if (strcmp(scope->items[i].name, name) == 0) {
-            sema_error(token, "symbol already declared in this scope");
-        }
+    if (ast_scope_stack_lookup_current(&ctx->vars, name)) {
+        sema_error(token, "symbol already declared in this scope");
     }
-    if (scope->count == scope->capacity) {
-        size_t new_capacity = scope->capacity ? scope->capacity * 2 : 4;
-        VarSymbol *new_items = realloc(scope->items, new_capacity * sizeof(VarSymbol));
-        if (!new_items) {
-            fprintf(stderr, "Out of memory\n");
-            exit(EXIT_FAILURE);
-        }
-        scope->items = new_items;
-        scope->capacity = new_capacity;
-    }
-    scope->items[scope->count++] = (VarSymbol){
+    VarSymbol *symbol = ast_scope_stack_add(&ctx->vars, name);
+    *symbol = (VarSymbol){
         .name = name,
         .is_mutable = is_mutable,
         .type_name = type_name,
@@ -189,15 +199,7 @@ static void sema_add_var(SemaContext *ctx,
 }
 
 static VarSymbol *sema_lookup_var(SemaContext *ctx, const char *name) {
-    for (size_t s = ctx->scope_count; s > 0; s--) {
-        VarScope *scope = &ctx->scopes[s - 1];
-        for (size_t i = 0; i < scope->count; i++) {
-            if (strcmp(scope->items[i].name, name) == 0) {
-                return &scope->items[i];
-            }
-        }
-    }
-    return NULL;
+    return ast_scope_stack_lookup(&ctx->vars, name);
 }
 
 static void sema_register_function(SemaContext *ctx, ASTFunctionDecl *fn) {
@@ -209,10 +211,8 @@ static void sema_add_function_symbol(SemaContext *ctx,
                                      const char *return_type,
                                      const ASTFunctionDecl *decl,
                                      Token token) {
-    for (size_t i = 0; i < ctx->function_count; i++) {
-        if (strcmp(ctx->functions[i].name, name) == 0) {
-            sema_error(token, "function already declared");
-        }
+    if (ast_symbol_map_get(&ctx->function_index, name)) {
+        sema_error(token, "function already declared");
     }
     if (ctx->function_count == ctx->function_capacity) {
         size_t new_capacity = ctx->function_capacity ? ctx->function_capacity * 2 : 4;
@@ -230,6 +230,7 @@ static void sema_add_function_symbol(SemaContext *ctx,
         .decl = decl,
         .token = token,
     };
+    ast_symbol_map_set(&ctx->function_index, name, ctx->function_count);
 }
 
 static void sema_register_builtins(SemaContext *ctx) {
@@ -243,20 +244,80 @@ static void sema_register_builtins(SemaContext *ctx) {
 
     for (size_t i = 0; i < SUPPORTED_BUILTIN_COUNT; i++) {
         sema_add_function_symbol(ctx,
-                                 SUPPORTED_BUILTINS[i],
-                                 "null",
+                                 ast_intern_cstr(SUPPORTED_BUILTINS[i]),
+                                 ast_symbols()->null_type,
                                  NULL,
                                  token);
     }
 }
 
+/*
+ * `pub` functions of directly imported modules are callable by their bare
+ * name. Dependencies are only read, so modules can be checked concurrently.
+ */
+static void sema_register_imports(SemaContext *ctx, const ASTProgram *program) {
+    for (size_t d = 0; d < program->dependencies.count; d++) {
+        const ASTProgram *dependency = program->dependencies.items[d];
+        for (size_t i = 0; i < dependency->declarations.count; i++) {
+            ASTNode *node = dependency->declarations.items[i];
+            if (node->kind == AST_NODE_STRUCT && ((const ASTStructDecl *)node)->is_public) {
+                sema_register_struct(ctx, (const ASTStructDecl *)node);
+                continue;
+            }
+            if (node->kind != AST_NODE_FUNCTION) {
+                continue;
+            }
+            const ASTFunctionDecl *fn = (const ASTFunctionDecl *)node;
+            if (!fn->is_public) {
+                continue;
+            }
+            const FunctionSymbol *existing = sema_lookup_function(ctx, fn->name);
+            if (existing && existing->decl == fn) {
+                continue;
+            }
+            if (existing) {
+                sema_error(existing->token, "function clashes with a pub function of an imported module");
+            }
+            sema_add_function_symbol(ctx, fn->name, fn->return_type, fn, fn->base.token);
+        }
+    }
+}
+
 static const FunctionSymbol *sema_lookup_function(SemaContext *ctx, const char *name) {
-    for (size_t i = 0; i < ctx->function_count; i++) {
-        if (strcmp(ctx->functions[i].name, name) == 0) {
-            return &ctx->functions[i];
+    size_t entry = ast_symbol_map_get(&ctx->function_index, name);
+    return entry ? &ctx->functions[entry - 1] : NULL;
+}
+
+/*
+ * Struct fields are limited to primitives (see sema_validate_struct_field),
+ * so every struct is deeply immutable and may be sent over channels and
+ * captured by tasks as it is. Revisit both once fields can hold mutable types.
+ */
+static void sema_register_struct(SemaContext *ctx, const ASTStructDecl *decl) {
+    const ASTStructDecl *existing = sema_lookup_struct(ctx, decl->name);
+    if (existing == decl) {
+        return;
+    }
+    if (existing) {
+        sema_error(decl->base.token, "duplicate struct name");
+    }
+    if (ctx->struct_count == ctx->struct_capacity) {
+        size_t new_capacity = ctx->struct_capacity ? ctx->struct_capacity * 2 : 4;
+        const ASTStructDecl **new_items = realloc(ctx->structs, new_capacity * sizeof(*new_items));
+        if (!new_items) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
         }
+        ctx->structs = new_items;
+        ctx->struct_capacity = new_capacity;
     }
-    return NULL;
+    ctx->structs[ctx->struct_count++] = decl;
+    ast_symbol_map_set(&ctx->struct_index, decl->name, ctx->struct_count);
+}
+
+static const ASTStructDecl *sema_lookup_struct(SemaContext *ctx, const char *name) {
+    size_t entry = ast_symbol_map_get(&ctx->struct_index, name);
+    return entry ? ctx->structs[entry - 1] : NULL;
 }
 
 static void sema_note_flow_usage(SemaContext *ctx, FlowMode mode, Token token) {
@@ -300,26 +361,69 @@ static bool type_is_result(const char *type_name) {
 
 static bool type_is_primitive(const char *type_name) {
     if (!type_name) return false;
-    return strcmp(type_name, "int") == 0 ||
-           strcmp(type_name, "float") == 0 ||
-           strcmp(type_name, "bool") == 0 ||
-           strcmp(type_name, "string") == 0 ||
-           strcmp(type_name, "null") == 0;
+    const ASTSymbols *symbols = ast_symbols();
+    return type_name == symbols->int_type ||
+           type_name == symbols->float_type ||
+           type_name == symbols->bool_type ||
+           type_name == symbols->string_type ||
+           type_name == symbols->null_type;
 }
 
-static bool type_is_concurrency(const char *type_name) {
-    return type_starts_with(type_name, "future") ||
-           type_starts_with(type_name, "chan");
+static bool type_is_future(const char *type_name) {
+    return type_starts_with(type_name, "future");
 }
 
-static void sema_require_supported_type(const char *type_name,
+static bool type_is_chan(const char *type_name) {
+    return type_starts_with(type_name, "chan");
+}
+
+/* Interned T of "future[T]"; NULL when the brackets are missing or empty. */
+static const char *type_future_result(const char *type_name) {
+    size_t prefix = strlen("future[");
+    size_t length = strlen(type_name);
+    if (length <= prefix + 1 || type_name[length - 1] != ']') {
+        return NULL;
+    }
+    return ast_intern(type_name + prefix, length - prefix - 1);
+}
+
+/* Interned T of "chan[T]"; NULL when the brackets are missing or empty. */
+static const char *type_chan_element(const char *type_name) {
+    size_t prefix = strlen("chan[");
+    size_t length = strlen(type_name);
+    if (length <= prefix + 1 || type_name[length - 1] != ']') {
+        return NULL;
+    }
+    return ast_intern(type_name + prefix, length - prefix - 1);
+}
+
+static void sema_require_supported_type(SemaContext *ctx,
+                                       const char *type_name,
                                        Token token,
                                        bool allow_complex) {
     if (!type_name) {
         return;
     }
-    if (type_is_concurrency(type_name)) {
-        sema_error(token, "concurrency is not supported by the current backend");
+    if (type_is_chan(type_name)) {
+        const char *element_type = type_chan_element(type_name);
+        if (!element_type) {
+            sema_error(token, "chan needs an element type, e.g. chan[int]");
+        }
+        const ASTStructDecl *element_struct = sema_lookup_struct(ctx, element_type);
+        if (!element_struct &&
+            (!type_is_primitive(element_type) || element_type == ast_symbols()->null_type)) {
+            sema_error(token, "unsupported channel element type for current backend");
+        }
+    }
+    if (type_is_future(type_name)) {
+        const char *result_type = type_future_result(type_name);
+        if (!result_type) {
+            sema_error(token, "future needs a result type, e.g. future[int]");
+        }
+        if (type_is_future(result_type) || type_is_chan(result_type) ||
+            type_is_result(result_type) || type_is_maybe(result_type)) {
+            sema_error(token, "unsupported future result type for current backend");
+        }
     }
     if (!allow_complex) {
         if (type_is_result(type_name) || type_is_maybe(type_name)) {
@@ -331,37 +435,192 @@ static void sema_require_supported_type(const char *type_name,
     }
 }
 
-static void sema_validate_struct_field(const ASTStructDecl *decl,
+static void sema_validate_struct_field(SemaContext *ctx,
+                                       const ASTStructDecl *decl,
                                        ASTStructField *field) {
-    sema_require_supported_type(field->type_name, field->token, false);
-    if (field->type_name && strcmp(field->type_name, decl->name) == 0) {
+    sema_require_supported_type(ctx, field->type_name, field->token, false);
+    if (field->type_name && field->type_name == decl->name) {
         sema_error(field->token, "struct contains unsupported field type for current backend");
     }
 }
 
 static bool sema_is_concurrency_keyword(const char *name) {
     if (!name) return false;
-    return strcmp(name, "task") == 0 ||
-           strcmp(name, "future") == 0 ||
-           strcmp(name, "chan") == 0;
+    const ASTSymbols *symbols = ast_symbols();
+    return name == symbols->task ||
+           name == symbols->future;
 }
 
 static void sema_check_builtin_call(SemaContext *ctx, ASTCallExpr *call) {
-    (void)ctx;
     if (!call || call->callee->kind != AST_NODE_EXPR_IDENTIFIER) {
         return;
     }
     ASTIdentifierExpr *ident = (ASTIdentifierExpr *)call->callee;
-    if (strcmp(ident->name, "log") == 0) {
+    if (ident->name == ast_symbols()->log) {
         if (call->arguments.count != 1) {
             sema_error(call->base.token, "log expects exactly one argument");
         }
     }
+    if (ident->name == ast_symbols()->await) {
+        if (call->arguments.count != 1) {
+            sema_error(call->base.token, "await expects exactly one argument");
+        }
+        if (!type_is_future(sema_expression_type(ctx, call->arguments.items[0]))) {
+            sema_error(call->base.token, "await expects a future variable or a call returning one");
+        }
+    }
+    if (ident->name == ast_symbols()->chan) {
+        sema_error(call->base.token, "chan must initialize a channel variable");
+    }
+    if (ident->name == ast_symbols()->send) {
+        if (call->arguments.count != 2) {
+            sema_error(call->base.token, "send expects a channel and a value");
+        }
+        const char *chan_type = sema_expression_type(ctx, call->arguments.items[0]);
+        if (!type_is_chan(chan_type)) {
+            sema_error(call->base.token, "send expects a channel variable or a call returning one");
+        }
+        const char *value_type = sema_expression_type(ctx, call->arguments.items[1]);
+        if (value_type && value_type != type_chan_element(chan_type)) {
+            sema_error(call->base.token, "sent value does not match the channel's element type");
+        }
+        if ((const ASTNode *)call != ctx->statement_expr) {
+            sema_error(call->base.token, "send is a statement; it has no value to use");
+        }
+    }
+    if (ident->name == ast_symbols()->recv) {
+        if (call->arguments.count != 1) {
+            sema_error(call->base.token, "recv expects exactly one argument");
+        }
+        if (!type_is_chan(sema_expression_type(ctx, call->arguments.items[0]))) {
+            sema_error(call->base.token, "recv expects a channel variable or a call returning one");
+        }
+    }
+}
+
+static bool sema_is_chan_new(const ASTNode *node) {
+    if (!node || node->kind != AST_NODE_EXPR_CALL) {
+        return false;
+    }
+    const ASTNode *callee = ((const ASTCallExpr *)node)->callee;
+    return callee->kind == AST_NODE_EXPR_IDENTIFIER &&
+           ((const ASTIdentifierExpr *)callee)->name == ast_symbols()->chan;
+}
+
+/* Like a task, `chan(capacity)` takes its element type from the variable it initializes. */
+static void sema_check_chan_new(SemaContext *ctx, ASTCallExpr *call, const char *target_type) {
+    if (!type_is_chan(target_type)) {
+        sema_error(call->base.token, "chan must initialize a channel variable");
+    }
+    if (call->arguments.count != 1) {
+        sema_error(call->base.token, "chan expects exactly one argument, its capacity");
+    }
+    ASTNode *capacity = call->arguments.items[0];
+    sema_check_expression(ctx, capacity);
+    const char *capacity_type = sema_expression_type(ctx, capacity);
+    if (capacity_type && capacity_type != ast_symbols()->int_type) {
+        sema_error(call->base.token, "channel capacity must be an int");
+    }
+}
+
+/* `Name(a, b)` builds a struct from one argument per field, in declaration order. */
+static void sema_check_struct_new(SemaContext *ctx, ASTCallExpr *call) {
+    if (call->callee->kind != AST_NODE_EXPR_IDENTIFIER) {
+        return;
+    }
+    const char *name = ((const ASTIdentifierExpr *)call->callee)->name;
+    const ASTStructDecl *decl = sema_lookup_struct(ctx, name);
+    if (!decl || sema_lookup_function(ctx, name)) {
+        return;
+    }
+    if (call->arguments.count != decl->fields.count) {
+        sema_error(call->base.token, "struct constructor expects one argument per field");
+    }
+    for (size_t i = 0; i < call->arguments.count; i++) {
+        const ASTStructField *field = decl->fields.items[i];
+        const char *argument_type = sema_expression_type(ctx, call->arguments.items[i]);
+        if (argument_type && argument_type != field->type_name) {
+            sema_error(call->base.token, "argument does not match the struct field's type");
+        }
+    }
+}
+
+/*
+ * A task runs its block on the scheduler and yields the block's tail value,
+ * so its type comes from the future it initializes. Immutable variables of
+ * the enclosing function are captured by value; mutable ones never are.
+ */
+static void sema_check_task(SemaContext *ctx, ASTTaskExpr *task, const char *target_type) {
+    if (!type_is_future(target_type)) {
+        sema_error(task->base.token, "task must initialize a future variable");
+    }
+    task->result_type = type_future_result(target_type);
+
+    bool previous_in_task = ctx->in_task;
+    size_t previous_start = ctx->task_scope_start;
+    FlowMode previous_flow = ctx->current_flow_mode;
+    ctx->in_task = true;
+    ctx->task_scope_start = ctx->vars.count;
+    ctx->current_flow_mode = FLOW_MODE_NONE;
+    sema_check_block(ctx, task->body, true);
+    ctx->in_task = previous_in_task;
+    ctx->task_scope_start = previous_start;
+    ctx->current_flow_mode = previous_flow;
+}
+
+static VarSymbol *sema_lookup_captured_var(SemaContext *ctx, const char *name, Token token) {
+    VarSymbol *symbol = sema_lookup_var(ctx, name);
+    if (!symbol || !ctx->in_task ||
+        ast_scope_stack_position(&ctx->vars, symbol) >= ctx->task_scope_start) {
+        return symbol;
+    }
+    if (symbol->is_mutable) {
+        sema_error(token, "tasks cannot capture mutable variables");
+    }
+    return symbol;
+}
+
+/* Declared type of a variable or a call's return type; NULL for anything else. */
+static const char *sema_expression_type(SemaContext *ctx, const ASTNode *node) {
+    if (!node) {
+        return NULL;
+    }
+    if (node->kind == AST_NODE_EXPR_LITERAL) {
+        const ASTSymbols *symbols = ast_symbols();
+        switch (((const ASTLiteralExpr *)node)->literal_kind) {
+            case AST_LITERAL_INT: return symbols->int_type;
+            case AST_LITERAL_FLOAT: return symbols->float_type;
+            case AST_LITERAL_BOOL: return symbols->bool_type;
+            case AST_LITERAL_STRING: return symbols->string_type;
+            case AST_LITERAL_NULL: return symbols->null_type;
+        }
+    }
+    if (node->kind == AST_NODE_EXPR_IDENTIFIER) {
+        const VarSymbol *symbol = sema_lookup_var(ctx, ((const ASTIdentifierExpr *)node)->name);
+        return symbol ? symbol->type_name : NULL;
+    }
+    if (node->kind == AST_NODE_EXPR_CALL) {
+        const ASTCallExpr *call = (const ASTCallExpr *)node;
+        if (call->callee->kind == AST_NODE_EXPR_IDENTIFIER) {
+            const char *callee = ((const ASTIdentifierExpr *)call->callee)->name;
+            if (callee == ast_symbols()->recv && call->arguments.count == 1) {
+                const char *chan_type = sema_expression_type(ctx, call->arguments.items[0]);
+                return type_is_chan(chan_type) ? type_chan_element(chan_type) : NULL;
+            }
+            const FunctionSymbol *fn =
+                sema_lookup_function(ctx, ((const ASTIdentifierExpr *)call->callee)->name);
+            if (!fn) {
+                const ASTStructDecl *decl = sema_lookup_struct(ctx, callee);
+                return decl ? decl->name : NULL;
+            }
+            return fn->decl ? fn->return_type : NULL;
+        }
+    }
+    return NULL;
 }
 
 static void sema_error(Token token, const char *message) {
-    fprintf(stderr, "[line %d:%d] Semantic error: %s\n", token.line, token.column, message);
-    exit(EXIT_FAILURE);
+    diag_error("[line %d:%d] Semantic error: %s\n", token.line, token.column, message);
 }
 
 static void sema_check_declaration(SemaContext *ctx, ASTNode *node) {
@@ -384,15 +643,15 @@ static void sema_check_function(SemaContext *ctx, ASTFunctionDecl *fn) {
     ctx->current_function = fn;
     ctx->current_flow_mode = flow_mode_from_type(fn->return_type);
 
-    sema_require_supported_type(fn->return_type, fn->base.token, true);
-    if (fn->name && strcmp(fn->name, "main") == 0 && type_is_result(fn->return_type)) {
+    sema_require_supported_type(ctx, fn->return_type, fn->base.token, true);
+    if (fn->name == ast_symbols()->main && type_is_result(fn->return_type)) {
         sema_error(fn->base.token, "main cannot return result type");
     }
 
     sema_push_scope(ctx);
     for (size_t i = 0; i < fn->params.count; i++) {
         ASTFunctionParam *param = fn->params.items[i];
-        sema_require_supported_type(param->type_name, param->token, true);
+        sema_require_supported_type(ctx, param->type_name, param->token, true);
         sema_note_flow_usage(ctx, flow_mode_from_type(param->type_name), param->token);
         sema_add_var(ctx, param->name, false, param->type_name, param->token);
     }
@@ -404,16 +663,18 @@ static void sema_check_function(SemaContext *ctx, ASTFunctionDecl *fn) {
 }
 
 static void sema_check_struct(SemaContext *ctx, ASTStructDecl *decl) {
-    (void)ctx;
+    if (sema_lookup_function(ctx, decl->name)) {
+        sema_error(decl->base.token, "struct name clashes with a function");
+    }
     for (size_t i = 0; i < decl->fields.count; i++) {
         ASTStructField *field_i = decl->fields.items[i];
         for (size_t j = i + 1; j < decl->fields.count; j++) {
             ASTStructField *field_j = decl->fields.items[j];
-            if (strcmp(field_i->name, field_j->name) == 0) {
+            if (field_i->name == field_j->name) {
                 sema_error(field_j->token, "duplicate field name in struct");
             }
         }
-        sema_validate_struct_field(decl, field_i);
+        sema_validate_struct_field(ctx, decl, field_i);
     }
 }
 
@@ -434,8 +695,19 @@ static void sema_check_statement(SemaContext *ctx, ASTNode *node) {
     switch (node->kind) {
         case AST_NODE_VAR_DECL: {
             ASTVarDecl *decl = (ASTVarDecl *)node;
-            sema_require_supported_type(decl->type_name, decl->base.token, true);
+            sema_require_supported_type(ctx, decl->type_name, decl->base.token, true);
             sema_note_flow_usage(ctx, flow_mode_from_type(decl->type_name), decl->base.token);
+            if (decl->initializer && decl->initializer->kind == AST_NODE_EXPR_TASK) {
+                /* Checked before the name is bound, so the task cannot capture itself. */
+                sema_check_task(ctx, (ASTTaskExpr *)decl->initializer, decl->type_name);
+                sema_add_var(ctx, decl->name, decl->is_mutable, decl->type_name, decl->base.token);
+                break;
+            }
+            if (sema_is_chan_new(decl->initializer)) {
+                sema_check_chan_new(ctx, (ASTCallExpr *)decl->initializer, decl->type_name);
+                sema_add_var(ctx, decl->name, decl->is_mutable, decl->type_name, decl->base.token);
+                break;
+            }
             sema_add_var(ctx, decl->name, decl->is_mutable, decl->type_name, decl->base.token);
             sema_check_expression(ctx, decl->initializer);
             break;
@@ -449,7 +721,16 @@ static void sema_check_statement(SemaContext *ctx, ASTNode *node) {
             if (!symbol->is_mutable) {
                 sema_error(assign->base.token, "cannot assign to immutable variable");
             }
-            sema_check_expression(ctx, assign->value);
+            if (ctx->in_task && ast_scope_stack_position(&ctx->vars, symbol) < ctx->task_scope_start) {
+                sema_error(assign->base.token, "tasks cannot capture mutable variables");
+            }
+            if (assign->value && assign->value->kind == AST_NODE_EXPR_TASK) {
+                sema_check_task(ctx, (ASTTaskExpr *)assign->value, symbol->type_name);
+            } else if (sema_is_chan_new(assign->value)) {
+                sema_check_chan_new(ctx, (ASTCallExpr *)assign->value, symbol->type_name);
+            } else {
+                sema_check_expression(ctx, assign->value);
+            }
             break;
         }
         case AST_NODE_IF: {
@@ -467,13 +748,18 @@ static void sema_check_statement(SemaContext *ctx, ASTNode *node) {
             if (!ctx->current_function) {
                 sema_error(node->token, "return outside of function");
             }
+            if (ctx->in_task) {
+                sema_error(node->token, "return inside a task; its last expression is its result");
+            }
             ASTReturnStmt *stmt = (ASTReturnStmt *)node;
             sema_check_expression(ctx, stmt->value);
             break;
         }
         case AST_NODE_EXPR_STMT: {
             ASTExprStmt *stmt = (ASTExprStmt *)node;
+            ctx->statement_expr = stmt->expr;
             sema_check_expression(ctx, stmt->expr);
+            ctx->statement_expr = NULL;
             sema_check_unused_result(ctx, stmt);
             break;
         }
@@ -492,7 +778,7 @@ static void sema_check_expression(SemaContext *ctx, ASTNode *node) {
             if (sema_is_concurrency_keyword(ident->name)) {
                 sema_error(node->token, "concurrency is not supported by the current backend");
             }
-            if (sema_lookup_var(ctx, ident->name)) {
+            if (sema_lookup_captured_var(ctx, ident->name, node->token)) {
                 break;
             }
             if (!sema_lookup_function(ctx, ident->name)) {
@@ -507,8 +793,8 @@ static void sema_check_expression(SemaContext *ctx, ASTNode *node) {
                 if (sema_is_concurrency_keyword(ident->name)) {
                     sema_error(call->base.token, "concurrency is not supported by the current backend");
                 }
-                if (!sema_lookup_function(ctx, ident->name)) {
-                    VarSymbol *symbol = sema_lookup_var(ctx, ident->name);
+                if (!sema_lookup_function(ctx, ident->name) && !sema_lookup_struct(ctx, ident->name)) {
+                    VarSymbol *symbol = sema_lookup_captured_var(ctx, ident->name, call->callee->token);
                     if (!symbol) {
                         sema_error(call->callee->token, "call to undefined function");
                     }
@@ -520,6 +806,7 @@ static void sema_check_expression(SemaContext *ctx, ASTNode *node) {
                 sema_check_expression(ctx, call->arguments.items[i]);
             }
             sema_check_builtin_call(ctx, call);
+            sema_check_struct_new(ctx, call);
             break;
         }
         case AST_NODE_EXPR_BINARY: {
@@ -528,6 +815,9 @@ static void sema_check_expression(SemaContext *ctx, ASTNode *node) {
             sema_check_expression(ctx, binary->right);
             break;
         }
+        case AST_NODE_EXPR_TASK:
+            sema_error(node->token, "task must initialize a future variable");
+            break;
         default:
             break;
     }
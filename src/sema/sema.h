@@ -5,4 +5,11 @@
 
 void sema_check_program(ASTProgram *program);
 
+/*
+ * Registers every declaration as usual but only checks the bodies of those
+ * with selected[i] set (all of them when `selected` is NULL). Used by
+ * incremental builds to skip functions the build database says are unchanged.
+ */
+void sema_check_program_partial(ASTProgram *program, const bool *selected);
+
 #endif